@@ -0,0 +1,557 @@
+//
+// Created by William Kamp on 8/2/16.
+//
+// Evaluates fences against gps logs offline, without Mongo or the http api. Every fence is checked against every log
+// of the same device_id whose time window covers its entry_time, the same way GET /fence_entry checks it against the
+// one log it finds.
+//
+// Inputs are either mongodump .bson files (concatenated bson documents, the compact form) or newline delimited json
+// in the shape POST /fence_entry and POST /gps_log accept, which is validated the same way. Both are memory mapped.
+// The fences are decoded up front; the logs are streamed in chunks across the worker pool so memory stays bounded by
+// the fences plus one decoded log per worker however many points the dump holds.
+//
+// Results are written as one json line per fence and covering log:
+// { identifier, device_id, corresponding_log: { _id, start_time, end_time } or null, actual_entry: { ... } or null }
+// with device_id only present for fences that have one
+//
+// usage: geofence_batch -f fences.(bson|ndjson) -l gps_logs.(bson|ndjson) [-o results.ndjson] [-t threads]
+//
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "database.h"
+#include "entry.h"
+#include "threadpool.h"
+
+/*
+ * Bytes of logs handed to a worker at a time, a single larger record is handed over whole
+ */
+#define CHUNK_BYTES (8 * 1024 * 1024)
+
+/*
+ * Output a worker buffers before taking the output lock
+ */
+#define OUTPUT_FLUSH_BYTES (1024 * 1024)
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A memory mapped input file, chunks are handed out under the lock
+ */
+struct BAT_Input {
+    char const *path;
+    char const *data;
+    size_t size;
+    bool bson;
+    pthread_mutex_t lock;
+    size_t offset;
+    bool corrupt;
+};
+
+/*
+ * Shared state of a run
+ */
+struct BAT_Run {
+    struct BAT_Input logs;
+    struct DB_Fence **fences; // sorted by entry time
+    size_t fenceCount;
+    atomic_bool *covered;
+    struct TP_Pool *workers;
+    FILE *output;
+    pthread_mutex_t outputLock;
+    _Atomic uint64_t logCount;
+    _Atomic uint64_t pointCount;
+    _Atomic uint64_t pairCount;
+    _Atomic uint64_t entryCount;
+    _Atomic uint64_t invalidCount;
+};
+
+/*
+ * One worker's buffers
+ */
+struct BAT_Worker {
+    struct BAT_Run *run;
+    bson_string_t *output;
+    char *line;
+    size_t lineCapacity;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Map pPath read only, .bson files are read as bson documents and anything else as json lines
+ *
+ * returns false when the file could not be mapped
+ */
+bool _openInput(struct BAT_Input *pInput, char const *pPath);
+
+void _closeInput(struct BAT_Input *pInput);
+
+/**
+ * Take the next chunk of whole records
+ *
+ * returns false when the input is exhausted (or corrupt)
+ */
+bool _nextChunk(struct BAT_Input *pInput, size_t *pStart, size_t *pEnd);
+
+/**
+ * The next record of a chunk as bson, validating json lines the way the http api does
+ *
+ * param pPosition - advanced past the record
+ * param pDocument - initialized to the record, pass pOwned to bson_destroy() when it is set
+ * param fValidate - DB_validateFence or DB_validateGpsLog
+ *
+ * returns false at the end of the chunk, records that fail validation are counted and skipped
+ */
+bool _nextRecord(struct BAT_Worker *pWorker, struct BAT_Input const *pInput, size_t *pPosition, size_t pEnd,
+                 bson_t *pDocument, bson_t **pOwned, bson_t *(*fValidate)(char const *));
+
+/**
+ * Decode every fence and sort them by entry time
+ */
+bool _loadFences(struct BAT_Run *pRun, char const *pPath);
+
+/**
+ * Evaluate one log against every fence whose entry time it covers
+ */
+void _evaluateLog(struct BAT_Worker *pWorker, struct DB_GpsLog const *pLog);
+
+/**
+ * Append a result line to the worker's output, flushing it when large
+ */
+void _writeResult(struct BAT_Worker *pWorker, struct DB_Fence const *pFence, struct DB_GpsLog const *pLog,
+                  bson_t const *pActualEntry);
+
+void _flushOutput(struct BAT_Worker *pWorker);
+
+/**
+ * Worker pool task, evaluates log chunks until the input is exhausted
+ */
+void _evaluateLogs(void *pArg);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static double __seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int __compareFenceEntryTime(void const *pA, void const *pB) {
+    int32_t a = (*(struct DB_Fence *const *) pA)->entryTime;
+    int32_t b = (*(struct DB_Fence *const *) pB)->entryTime;
+    return (a > b) - (a < b);
+}
+
+/**
+ * Index of the first fence entering at or after pTime
+ */
+static size_t __firstFenceFrom(struct BAT_Run const *pRun, int64_t pTime) {
+    size_t low = 0;
+    size_t high = pRun->fenceCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (pRun->fences[middle]->entryTime < pTime) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*
+ * Whether two device ids name the same partition, NULL being the records without a device_id
+ */
+static bool __sameDevice(char const *pA, char const *pB) {
+    return NULL == pA || NULL == pB ? pA == pB : 0 == strcmp(pA, pB);
+}
+
+static bool __hasSuffix(char const *pString, char const *pSuffix) {
+    size_t length = strlen(pString);
+    size_t suffixLength = strlen(pSuffix);
+    return length >= suffixLength && 0 == strcmp(pString + length - suffixLength, pSuffix);
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool _openInput(struct BAT_Input *pInput, char const *pPath) {
+    memset(pInput, 0, sizeof(struct BAT_Input));
+    pthread_mutex_init(&pInput->lock, NULL);
+    pInput->path = pPath;
+    pInput->bson = __hasSuffix(pPath, ".bson");
+
+    int fd = open(pPath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || 0 != fstat(fd, &st)) {
+        fprintf(stderr, "could not open %s\n", pPath);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    pInput->size = (size_t) st.st_size;
+    if (pInput->size > 0) {
+        void *data = mmap(NULL, pInput->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "could not map %s\n", pPath);
+            close(fd);
+            return false;
+        }
+        madvise(data, pInput->size, MADV_SEQUENTIAL);
+        pInput->data = data;
+    }
+    close(fd);
+    return true;
+}
+
+void _closeInput(struct BAT_Input *pInput) {
+    if (NULL != pInput->data) {
+        munmap((void *) pInput->data, pInput->size);
+    }
+    pthread_mutex_destroy(&pInput->lock);
+}
+
+bool _nextChunk(struct BAT_Input *pInput, size_t *pStart, size_t *pEnd) {
+    pthread_mutex_lock(&pInput->lock);
+    size_t start = pInput->offset;
+    size_t end = start;
+    if (pInput->bson) {
+        /*
+         * bson documents can only be walked from the front, each starts with its little endian length
+         */
+        while (end < pInput->size && end - start < CHUNK_BYTES) {
+            int32_t length;
+            if (pInput->size - end < 5) {
+                pInput->corrupt = true;
+                break;
+            }
+            memcpy(&length, pInput->data + end, sizeof length);
+            length = BSON_UINT32_FROM_LE(length);
+            if (length < 5 || (size_t) length > pInput->size - end) {
+                pInput->corrupt = true;
+                break;
+            }
+            end += (size_t) length;
+        }
+        if (pInput->corrupt) {
+            fprintf(stderr, "%s is corrupt at byte %zu\n", pInput->path, end);
+            pInput->offset = pInput->size;
+        } else {
+            pInput->offset = end;
+        }
+    } else {
+        end = MIN(start + CHUNK_BYTES, pInput->size);
+        char const *newline = end < pInput->size ? memchr(pInput->data + end, '\n', pInput->size - end) : NULL;
+        end = NULL != newline ? (size_t) (newline - pInput->data) + 1 : pInput->size;
+        pInput->offset = end;
+    }
+    pthread_mutex_unlock(&pInput->lock);
+
+    *pStart = start;
+    *pEnd = end;
+    return end > start;
+}
+
+bool _nextRecord(struct BAT_Worker *pWorker, struct BAT_Input const *pInput, size_t *pPosition, size_t pEnd,
+                 bson_t *pDocument, bson_t **pOwned, bson_t *(*fValidate)(char const *)) {
+    *pOwned = NULL;
+    while (*pPosition < pEnd) {
+        char const *record = pInput->data + *pPosition;
+        if (pInput->bson) {
+            int32_t length;
+            memcpy(&length, record, sizeof length);
+            length = BSON_UINT32_FROM_LE(length);
+            *pPosition += (size_t) length;
+            if (bson_init_static(pDocument, (uint8_t const *) record, (size_t) length)) {
+                return true;
+            }
+        } else {
+            char const *newline = memchr(record, '\n', pEnd - *pPosition);
+            size_t length = NULL != newline ? (size_t) (newline - record) : pEnd - *pPosition;
+            *pPosition += length + 1;
+            if (length == 0 || (length == 1 && record[0] == '\r')) {
+                continue;
+            }
+
+            /*
+             * The validators take a NUL terminated string, the mapping is not
+             */
+            if (length + 1 > pWorker->lineCapacity) {
+                pWorker->lineCapacity = MAX(length + 1, pWorker->lineCapacity * 2);
+                pWorker->line = realloc(pWorker->line, pWorker->lineCapacity);
+            }
+            memcpy(pWorker->line, record, length);
+            pWorker->line[length] = '\0';
+            *pOwned = fValidate(pWorker->line);
+            if (NULL != *pOwned) {
+                return true;
+            }
+        }
+        atomic_fetch_add(&pWorker->run->invalidCount, 1);
+    }
+    return false;
+}
+
+bool _loadFences(struct BAT_Run *pRun, char const *pPath) {
+    struct BAT_Input input;
+    if (!_openInput(&input, pPath)) {
+        return false;
+    }
+
+    struct BAT_Worker worker = {pRun, NULL, NULL, 0};
+    size_t capacity = 1024;
+    pRun->fences = malloc(capacity * sizeof(struct DB_Fence *));
+    pRun->fenceCount = 0;
+    size_t start;
+    size_t end;
+    while (_nextChunk(&input, &start, &end)) {
+        bson_t document;
+        bson_t *owned;
+        while (_nextRecord(&worker, &input, &start, end, &document, &owned, &DB_validateFence)) {
+            struct DB_Fence *fence = DB_decodeFence(NULL != owned ? owned : &document);
+            if (NULL != owned) {
+                bson_destroy(owned);
+            }
+            if (NULL == fence) {
+                atomic_fetch_add(&pRun->invalidCount, 1);
+                continue;
+            }
+            if (pRun->fenceCount == capacity) {
+                capacity *= 2;
+                pRun->fences = realloc(pRun->fences, capacity * sizeof(struct DB_Fence *));
+            }
+            pRun->fences[pRun->fenceCount++] = fence;
+        }
+    }
+    free(worker.line);
+    bool corrupt = input.corrupt;
+    _closeInput(&input);
+
+    qsort(pRun->fences, pRun->fenceCount, sizeof(struct DB_Fence *), &__compareFenceEntryTime);
+    pRun->covered = calloc(MAX(pRun->fenceCount, 1), sizeof(atomic_bool));
+    return !corrupt;
+}
+
+void _evaluateLog(struct BAT_Worker *pWorker, struct DB_GpsLog const *pLog) {
+    struct BAT_Run *run = pWorker->run;
+    for (size_t f = __firstFenceFrom(run, pLog->startTime);
+         f < run->fenceCount && run->fences[f]->entryTime <= pLog->endTime; ++f) {
+        struct DB_Fence const *fence = run->fences[f];
+        if (!__sameDevice(fence->deviceId, pLog->deviceId)) {
+            continue;
+        }
+        atomic_store_explicit(&run->covered[f], true, memory_order_relaxed);
+
+        /*
+         * Very long logs are split across the pool too, the waiting worker runs queued chunks meanwhile
+         */
+        bson_t *actualEntry = ENT_findEntryPoint(fence, pLog, run->workers);
+        _writeResult(pWorker, fence, pLog, actualEntry);
+        atomic_fetch_add_explicit(&run->pairCount, 1, memory_order_relaxed);
+        if (NULL != actualEntry) {
+            atomic_fetch_add_explicit(&run->entryCount, 1, memory_order_relaxed);
+            bson_destroy(actualEntry);
+        }
+    }
+}
+
+void _writeResult(struct BAT_Worker *pWorker, struct DB_Fence const *pFence, struct DB_GpsLog const *pLog,
+                  bson_t const *pActualEntry) {
+    bson_t result;
+    bson_t log;
+    bson_init(&result);
+    BSON_APPEND_UTF8(&result, "identifier", NULL != pFence->identifier ? pFence->identifier : "");
+    if (NULL != pFence->deviceId) {
+        BSON_APPEND_UTF8(&result, "device_id", pFence->deviceId);
+    }
+    if (NULL != pLog) {
+        BSON_APPEND_DOCUMENT_BEGIN(&result, "corresponding_log", &log);
+        if (pLog->hasId) {
+            BSON_APPEND_OID(&log, "_id", &pLog->id);
+        }
+        BSON_APPEND_INT64(&log, "start_time", pLog->startTime);
+        BSON_APPEND_INT64(&log, "end_time", pLog->endTime);
+        bson_append_document_end(&result, &log);
+    } else {
+        BSON_APPEND_NULL(&result, "corresponding_log");
+    }
+    if (NULL != pActualEntry) {
+        BSON_APPEND_DOCUMENT(&result, "actual_entry", pActualEntry);
+    } else {
+        BSON_APPEND_NULL(&result, "actual_entry");
+    }
+
+    size_t length;
+    char *json = bson_as_json(&result, &length);
+    bson_string_append(pWorker->output, json);
+    bson_string_append_c(pWorker->output, '\n');
+    bson_free(json);
+    bson_destroy(&result);
+
+    if (pWorker->output->len >= OUTPUT_FLUSH_BYTES) {
+        _flushOutput(pWorker);
+    }
+}
+
+void _flushOutput(struct BAT_Worker *pWorker) {
+    if (pWorker->output->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pWorker->run->outputLock);
+    fwrite(pWorker->output->str, 1, pWorker->output->len, pWorker->run->output);
+    pthread_mutex_unlock(&pWorker->run->outputLock);
+    bson_string_truncate(pWorker->output, 0);
+}
+
+void _evaluateLogs(void *pArg) {
+    struct BAT_Run *run = pArg;
+    struct BAT_Worker worker = {run, bson_string_new(NULL), NULL, 0};
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t start;
+    size_t end;
+    while (_nextChunk(&run->logs, &start, &end)) {
+        size_t chunkStart = start;
+        bson_t document;
+        bson_t *owned;
+        while (_nextRecord(&worker, &run->logs, &start, end, &document, &owned, &DB_validateGpsLog)) {
+            struct DB_GpsLog *log = DB_decodeGpsLog(NULL != owned ? owned : &document);
+            if (NULL != owned) {
+                bson_destroy(owned);
+            }
+            if (NULL == log) {
+                atomic_fetch_add(&run->invalidCount, 1);
+                continue;
+            }
+            atomic_fetch_add_explicit(&run->logCount, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&run->pointCount, log->count, memory_order_relaxed);
+            _evaluateLog(&worker, log);
+            DB_freeGpsLog(log);
+        }
+
+        /*
+         * The chunk is done with, let the kernel drop its pages rather than grow our resident set to the whole dump
+         */
+        size_t first = (chunkStart + pageSize - 1) / pageSize * pageSize;
+        size_t last = end / pageSize * pageSize;
+        if (last > first) {
+            madvise((void *) (run->logs.data + first), last - first, MADV_DONTNEED);
+        }
+    }
+    _flushOutput(&worker);
+    bson_string_free(worker.output, true);
+    free(worker.line);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int main(int argc, char **argv) {
+    char const *fencePath = NULL;
+    char const *logPath = NULL;
+    char const *outputPath = NULL;
+    unsigned int threads = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "f:l:o:t:")) != -1) {
+        switch (option) {
+            case 'f':
+                fencePath = optarg;
+                break;
+            case 'l':
+                logPath = optarg;
+                break;
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 't':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fencePath = NULL;
+                break;
+        }
+    }
+    if (NULL == fencePath || NULL == logPath) {
+        fprintf(stderr, "usage: %s -f fences.(bson|ndjson) -l gps_logs.(bson|ndjson) [-o results.ndjson] "
+                        "[-t threads]\n", argv[0]);
+        return 2;
+    }
+
+    struct BAT_Run run;
+    memset(&run, 0, sizeof run);
+    pthread_mutex_init(&run.outputLock, NULL);
+    run.output = NULL != outputPath ? fopen(outputPath, "w") : stdout;
+    if (NULL == run.output) {
+        fprintf(stderr, "could not open %s\n", outputPath);
+        return 1;
+    }
+
+    double startTime = __seconds();
+    bool ok = _loadFences(&run, fencePath);
+    double fenceSeconds = __seconds() - startTime;
+
+    if (ok && _openInput(&run.logs, logPath)) {
+        /*
+         * One task per worker, each pulls chunks until the logs run out
+         */
+        run.workers = TP_createPool(threads);
+        struct TP_Group group;
+        TP_initGroup(&group);
+        for (unsigned int i = 0; i < TP_threadCount(run.workers); ++i) {
+            TP_submit(run.workers, &group, &_evaluateLogs, &run);
+        }
+        TP_wait(run.workers, &group);
+        TP_destroyGroup(&group);
+        TP_destroyPool(run.workers);
+        ok = !run.logs.corrupt;
+        _closeInput(&run.logs);
+    } else {
+        ok = false;
+    }
+
+    /*
+     * Fences no log covers are reported too, as GET /fence_entry does
+     */
+    struct BAT_Worker worker = {&run, bson_string_new(NULL), NULL, 0};
+    for (size_t f = 0; f < run.fenceCount; ++f) {
+        if (!atomic_load(&run.covered[f])) {
+            _writeResult(&worker, run.fences[f], NULL, NULL);
+        }
+        DB_freeFence(run.fences[f]);
+    }
+    _flushOutput(&worker);
+    bson_string_free(worker.output, true);
+    free(run.fences);
+    free(run.covered);
+    if (run.output != stdout) {
+        ok = 0 == fclose(run.output) && ok;
+    } else {
+        fflush(stdout);
+    }
+
+    double seconds = __seconds() - startTime;
+    fprintf(stderr, "fences %zu (%.2fs), logs %llu, points %llu, evaluated %llu, entries %llu, invalid records %llu\n",
+            run.fenceCount, fenceSeconds, (unsigned long long) atomic_load(&run.logCount),
+            (unsigned long long) atomic_load(&run.pointCount), (unsigned long long) atomic_load(&run.pairCount),
+            (unsigned long long) atomic_load(&run.entryCount), (unsigned long long) atomic_load(&run.invalidCount));
+    fprintf(stderr, "%.2fs, %.0f points/s\n", seconds, atomic_load(&run.pointCount) / MAX(seconds, 1e-9));
+    pthread_mutex_destroy(&run.outputLock);
+    return ok ? 0 : 1;
+}
+
+//endregion
@@ -0,0 +1,1006 @@
+//
+// Created by William Kamp on 7/28/16.
+//
+// Drives a running GeoFenceBeC with a weighted mix of its endpoints and reports throughput and latency percentiles.
+// Seeds its own fences and gps logs through the http api first and deletes everything it created when done.
+//
+// Closed loop (default): each connection sends its next request as soon as the previous one is answered.
+// Open loop (-r): requests are scheduled at a fixed total rate and latency is measured from the scheduled time, so a
+// stalled server is charged for the requests that queued up behind the stall.
+//
+// With -s, that many GET /fence_entry/events streams are opened before the run and held through it, then counted
+// again at the end, to check the server keeps thousands of idle subscribers without starving the other requests.
+//
+// usage: geofence_loadgen [-h host] [-p port] [-c connections] [-r requests/s] [-d seconds] [-w warmup seconds]
+//                         [-f fences] [-l logs] [-n points per log] [-m mix] [-s subscribers] [-k]
+//
+// mix is a comma separated list of op=weight, ops are fence_entry, gps_log, fence_entry_list, gps_log_list,
+// evaluate, post_fence_entry and post_gps_log
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "8181"
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION 10
+#define DEFAULT_WARMUP 2
+#define DEFAULT_FENCES 200
+#define DEFAULT_LOGS 20
+#define DEFAULT_LOG_POINTS 1000
+#define DEFAULT_MIX "fence_entry=60,gps_log=15,evaluate=5,fence_entry_list=2,gps_log_list=2,post_fence_entry=15," \
+                    "post_gps_log=1"
+#define POSTED_LOG_POINTS 100
+#define EVALUATE_IDENTIFIERS 8
+#define FENCE_RADIUS 50.0
+#define READ_SIZE 16384
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+enum LG_Op {
+    LG_OP_FENCE_ENTRY,
+    LG_OP_GPS_LOG,
+    LG_OP_FENCE_ENTRY_LIST,
+    LG_OP_GPS_LOG_LIST,
+    LG_OP_EVALUATE,
+    LG_OP_POST_FENCE_ENTRY,
+    LG_OP_POST_GPS_LOG,
+    LG_OP_COUNT
+};
+
+struct LG_Config {
+    char const *host;
+    char const *port;
+    int connections;
+    double rate;
+    int duration;
+    int warmup;
+    int fences;
+    int logs;
+    int logPoints;
+    int weights[LG_OP_COUNT];
+    int totalWeight;
+    int subscribers;
+    bool keep;
+};
+
+/*
+ * A keep-alive connection and the bytes read from it that have not been consumed yet
+ */
+struct LG_Connection {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+struct LG_Response {
+    int status;
+    char *body;
+    size_t bodyLen;
+};
+
+/*
+ * Latency samples of one op, in microseconds
+ */
+struct LG_Samples {
+    int64_t *values;
+    size_t count;
+    size_t cap;
+    uint64_t errors;
+};
+
+struct LG_Worker {
+    pthread_t thread;
+    int index;
+    uint32_t random;
+    struct LG_Samples samples[LG_OP_COUNT];
+};
+
+/*
+ * Record ids created by the run, deleted at the end
+ */
+struct LG_Created {
+    pthread_mutex_t lock;
+    char (*fenceIds)[25];
+    size_t fenceCount;
+    size_t fenceCap;
+    char (*logIds)[25];
+    size_t logCount;
+    size_t logCap;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Parse the command line into pConfig
+ *
+ * returns false when the arguments are invalid
+ */
+bool _parseArguments(int argc, char **argv, struct LG_Config *pConfig);
+
+/**
+ * Parse an op=weight,... mix into pConfig->weights
+ */
+bool _parseMix(char const *pMix, struct LG_Config *pConfig);
+
+/**
+ * Open a connection to the server
+ *
+ * returns false when the server could not be reached
+ */
+bool _connect(struct LG_Connection *pConn);
+
+void _disconnect(struct LG_Connection *pConn);
+
+/**
+ * Send one request and read its response, reconnecting once when a kept alive connection was closed by the server
+ *
+ * returns false on a transport error
+ */
+bool _request(struct LG_Connection *pConn, char const *pMethod, char const *pPath, char const *pBody,
+              struct LG_Response *pResponse);
+
+/**
+ * Read one response, Content-Length or chunked, into pResponse
+ */
+bool _readResponse(struct LG_Connection *pConn, struct LG_Response *pResponse);
+
+/**
+ * Open an event stream on a new connection and read its response headers, the body is left unread
+ *
+ * returns true when the stream was answered 200
+ */
+bool _subscribe(struct LG_Connection *pConn);
+
+/**
+ * Whether the server still holds an event stream open, reading off whatever it sent meanwhile
+ */
+bool _isStreamOpen(struct LG_Connection *pConn);
+
+/**
+ * Insert the fences and gps logs the run reads
+ */
+bool _seed(struct LG_Connection *pConn);
+
+/**
+ * Delete every record the run created
+ */
+void _cleanup(struct LG_Connection *pConn);
+
+/**
+ * Send one request of pOp
+ *
+ * returns true when it was answered with a 2xx status
+ */
+bool _runOp(struct LG_Worker *pWorker, struct LG_Connection *pConn, enum LG_Op pOp);
+
+/**
+ * Worker thread sending requests until the run ends
+ */
+void *_work(void *pArg);
+
+/**
+ * Print the throughput, errors and latency percentiles of one op, sorting its samples in place
+ */
+void _report(char const *pName, struct LG_Samples *pSamples, double pSeconds);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static char const *const __opNames[LG_OP_COUNT] = {
+        [LG_OP_FENCE_ENTRY] = "fence_entry",
+        [LG_OP_GPS_LOG] = "gps_log",
+        [LG_OP_FENCE_ENTRY_LIST] = "fence_entry_list",
+        [LG_OP_GPS_LOG_LIST] = "gps_log_list",
+        [LG_OP_EVALUATE] = "evaluate",
+        [LG_OP_POST_FENCE_ENTRY] = "post_fence_entry",
+        [LG_OP_POST_GPS_LOG] = "post_gps_log",
+};
+
+static struct LG_Config __config;
+static struct LG_Created __created = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static int32_t __baseTime;
+static int32_t __postedLogTime;
+static int __nextPosted = 0;
+static int64_t __runStart;
+static int64_t __measureStart;
+static int64_t __runEnd;
+
+static int64_t __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void __sleepUntil(int64_t pMicros) {
+    int64_t remaining;
+    while ((remaining = pMicros - __now()) > 0) {
+        struct timespec ts;
+        ts.tv_sec = remaining / 1000000;
+        ts.tv_nsec = (remaining % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static uint32_t __nextRandom(struct LG_Worker *pWorker) {
+    pWorker->random ^= pWorker->random << 13;
+    pWorker->random ^= pWorker->random >> 17;
+    pWorker->random ^= pWorker->random << 5;
+    return pWorker->random;
+}
+
+static int __compareInt64(void const *pA, void const *pB) {
+    int64_t a = *(int64_t const *) pA;
+    int64_t b = *(int64_t const *) pB;
+    return (a > b) - (a < b);
+}
+
+static int64_t __percentile(int64_t const *pSorted, size_t pCount, double pPercentile) {
+    size_t index = (size_t) (pPercentile / 100.0 * (pCount - 1) + 0.5);
+    return pSorted[index];
+}
+
+static void __addSample(struct LG_Samples *pSamples, int64_t pMicros) {
+    if (pSamples->count == pSamples->cap) {
+        pSamples->cap = pSamples->cap > 0 ? pSamples->cap * 2 : 4096;
+        pSamples->values = realloc(pSamples->values, pSamples->cap * sizeof(int64_t));
+    }
+    pSamples->values[pSamples->count++] = pMicros;
+}
+
+/**
+ * Append a printf formatted string to a growing buffer
+ */
+static void __appendf(char **pBuf, size_t *pLen, size_t *pCap, char const *pFormat, ...) {
+    va_list args;
+    for (;;) {
+        va_start(args, pFormat);
+        int written = vsnprintf(*pBuf + *pLen, *pCap - *pLen, pFormat, args);
+        va_end(args);
+        if (written >= 0 && (size_t) written < *pCap - *pLen) {
+            *pLen += (size_t) written;
+            return;
+        }
+        *pCap = *pCap * 2 + (written > 0 ? (size_t) written : 0);
+        *pBuf = realloc(*pBuf, *pCap);
+    }
+}
+
+/**
+ * A gps log json body of pCount points, one second apart from pStartTime, walking north east from pLatitude,
+ * pLongitude
+ *
+ * returns a string which you must later free()
+ */
+static char *__gpsLogJson(int32_t pStartTime, int pCount, double pLatitude, double pLongitude) {
+    size_t cap = (size_t) pCount * 80 + 32;
+    size_t len = 0;
+    char *json = malloc(cap);
+    json[0] = '\0';
+    __appendf(&json, &len, &cap, "{\"log\": [");
+    for (int i = 0; i < pCount; ++i) {
+        __appendf(&json, &len, &cap, "%s{\"latitude\": %.6f, \"longitude\": %.6f, \"time\": %d}", i > 0 ? "," : "",
+                  pLatitude + i * 0.0001, pLongitude + i * 0.0001, pStartTime + i);
+    }
+    __appendf(&json, &len, &cap, "]}");
+    return json;
+}
+
+/**
+ * The start time and origin of seeded log pLog
+ */
+static void __seededLog(int pLog, int32_t *pStartTime, double *pLatitude, double *pLongitude) {
+    *pStartTime = __baseTime + pLog * (__config.logPoints + 100);
+    *pLatitude = 40.0 + (pLog % 50) * 0.1;
+    *pLongitude = -120.0 + (pLog / 50) * 0.1;
+}
+
+/**
+ * A fence json body entered half way along seeded log pFence % logs
+ *
+ * returns a string which you must later free()
+ */
+static char *__fenceJson(char const *pIdentifier, int pFence) {
+    int32_t startTime;
+    double latitude;
+    double longitude;
+    __seededLog(pFence % __config.logs, &startTime, &latitude, &longitude);
+    int point = __config.logPoints / 2;
+    size_t cap = 256;
+    size_t len = 0;
+    char *json = malloc(cap);
+    __appendf(&json, &len, &cap, "{\"identifier\": \"%s\", \"latitude\": %.6f, \"longitude\": %.6f, "
+                      "\"radius\": %.1f, \"entry_time\": %d}", pIdentifier, latitude + point * 0.0001,
+              longitude + point * 0.0001, FENCE_RADIUS, startTime + point);
+    return json;
+}
+
+/**
+ * Remember the _id of a record created by a POST, found in its { "record": { "_id": { "$oid": "..." } } } response
+ */
+static void __rememberCreated(struct LG_Response const *pResponse, bool pIsFence) {
+    char const *oid = NULL;
+    if (pResponse->body != NULL) {
+        oid = strstr(pResponse->body, "\"$oid\"");
+    }
+    if (NULL == oid || NULL == (oid = strchr(oid + 6, '"')) || strlen(oid + 1) < 24) {
+        return;
+    }
+
+    pthread_mutex_lock(&__created.lock);
+    char (**ids)[25] = pIsFence ? &__created.fenceIds : &__created.logIds;
+    size_t *count = pIsFence ? &__created.fenceCount : &__created.logCount;
+    size_t *cap = pIsFence ? &__created.fenceCap : &__created.logCap;
+    if (*count == *cap) {
+        *cap = *cap > 0 ? *cap * 2 : 256;
+        *ids = realloc(*ids, *cap * sizeof(char[25]));
+    }
+    memcpy((*ids)[*count], oid + 1, 24);
+    (*ids)[*count][24] = '\0';
+    ++*count;
+    pthread_mutex_unlock(&__created.lock);
+}
+
+/**
+ * Make sure pConn->buf holds at least pWanted unconsumed bytes
+ */
+static bool __fill(struct LG_Connection *pConn, size_t pWanted) {
+    while (pConn->len < pWanted) {
+        if (pConn->cap - pConn->len < READ_SIZE) {
+            pConn->cap = MAX(pConn->cap * 2, pConn->len + READ_SIZE);
+            pConn->buf = realloc(pConn->buf, pConn->cap + 1);
+        }
+        ssize_t received = recv(pConn->fd, pConn->buf + pConn->len, pConn->cap - pConn->len, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pConn->len += (size_t) received;
+    }
+    pConn->buf[pConn->len] = '\0';
+    return true;
+}
+
+/**
+ * Find a CRLF terminated line at pOffset, filling as needed
+ *
+ * returns the offset just past the CRLF or 0 when the connection closed first
+ */
+static size_t __line(struct LG_Connection *pConn, size_t pOffset) {
+    for (;;) {
+        if (pConn->len > pOffset) {
+            char *end = memmem(pConn->buf + pOffset, pConn->len - pOffset, "\r\n", 2);
+            if (NULL != end) {
+                return (size_t) (end - pConn->buf) + 2;
+            }
+        }
+        if (!__fill(pConn, pConn->len + 1)) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Drop the first pCount bytes of the read buffer
+ */
+static void __consume(struct LG_Connection *pConn, size_t pCount) {
+    memmove(pConn->buf, pConn->buf + pCount, pConn->len - pCount);
+    pConn->len -= pCount;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool _parseMix(char const *pMix, struct LG_Config *pConfig) {
+    memset(pConfig->weights, 0, sizeof pConfig->weights);
+    pConfig->totalWeight = 0;
+
+    char *mix = strdup(pMix);
+    char *save = NULL;
+    bool result = true;
+    for (char *item = strtok_r(mix, ",", &save); NULL != item && result; item = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(item, '=');
+        result = false;
+        if (NULL == equals) {
+            break;
+        }
+        *equals = '\0';
+        for (int op = 0; op < LG_OP_COUNT; ++op) {
+            if (0 == strcmp(item, __opNames[op])) {
+                pConfig->weights[op] = atoi(equals + 1);
+                result = pConfig->weights[op] >= 0;
+            }
+        }
+    }
+    free(mix);
+
+    for (int op = 0; op < LG_OP_COUNT; ++op) {
+        pConfig->totalWeight += pConfig->weights[op];
+    }
+    return result && pConfig->totalWeight > 0;
+}
+
+bool _parseArguments(int argc, char **argv, struct LG_Config *pConfig) {
+    pConfig->host = DEFAULT_HOST;
+    pConfig->port = DEFAULT_PORT;
+    pConfig->connections = DEFAULT_CONNECTIONS;
+    pConfig->rate = 0;
+    pConfig->duration = DEFAULT_DURATION;
+    pConfig->warmup = DEFAULT_WARMUP;
+    pConfig->fences = DEFAULT_FENCES;
+    pConfig->logs = DEFAULT_LOGS;
+    pConfig->logPoints = DEFAULT_LOG_POINTS;
+    pConfig->subscribers = 0;
+    pConfig->keep = false;
+    char const *mix = DEFAULT_MIX;
+
+    int option;
+    while ((option = getopt(argc, argv, "h:p:c:r:d:w:f:l:n:m:s:k")) != -1) {
+        switch (option) {
+            case 'h':
+                pConfig->host = optarg;
+                break;
+            case 'p':
+                pConfig->port = optarg;
+                break;
+            case 'c':
+                pConfig->connections = atoi(optarg);
+                break;
+            case 'r':
+                pConfig->rate = strtod(optarg, NULL);
+                break;
+            case 'd':
+                pConfig->duration = atoi(optarg);
+                break;
+            case 'w':
+                pConfig->warmup = atoi(optarg);
+                break;
+            case 'f':
+                pConfig->fences = atoi(optarg);
+                break;
+            case 'l':
+                pConfig->logs = atoi(optarg);
+                break;
+            case 'n':
+                pConfig->logPoints = atoi(optarg);
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            case 's':
+                pConfig->subscribers = atoi(optarg);
+                break;
+            case 'k':
+                pConfig->keep = true;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return _parseMix(mix, pConfig) && pConfig->connections > 0 && pConfig->rate >= 0 && pConfig->duration > 0 &&
+           pConfig->warmup >= 0 && pConfig->fences > 0 && pConfig->logs > 0 && pConfig->logPoints > 1 &&
+           pConfig->subscribers >= 0;
+}
+
+bool _connect(struct LG_Connection *pConn) {
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(__config.host, __config.port, &hints, &addresses)) {
+        return false;
+    }
+
+    pConn->fd = -1;
+    for (struct addrinfo *address = addresses; NULL != address && pConn->fd < 0; address = address->ai_next) {
+        pConn->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (pConn->fd >= 0 && 0 != connect(pConn->fd, address->ai_addr, address->ai_addrlen)) {
+            close(pConn->fd);
+            pConn->fd = -1;
+        }
+    }
+    if (pConn->fd >= 0) {
+        int noDelay = 1;
+        setsockopt(pConn->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+    }
+    freeaddrinfo(addresses);
+    pConn->len = 0;
+    return pConn->fd >= 0;
+}
+
+void _disconnect(struct LG_Connection *pConn) {
+    if (pConn->fd >= 0) {
+        close(pConn->fd);
+        pConn->fd = -1;
+    }
+    pConn->len = 0;
+}
+
+bool _readResponse(struct LG_Connection *pConn, struct LG_Response *pResponse) {
+    /*
+     * Status line and headers
+     */
+    size_t headerEnd = 0;
+    while (NULL == pConn->buf || NULL == memmem(pConn->buf, pConn->len, "\r\n\r\n", 4)) {
+        if (!__fill(pConn, pConn->len + 1)) {
+            return false;
+        }
+    }
+    headerEnd = (size_t) ((char *) memmem(pConn->buf, pConn->len, "\r\n\r\n", 4) - pConn->buf) + 4;
+    if (1 != sscanf(pConn->buf, "HTTP/%*s %d", &pResponse->status)) {
+        return false;
+    }
+
+    long contentLength = -1;
+    bool chunked = false;
+    for (char *line = strstr(pConn->buf, "\r\n") + 2; line < pConn->buf + headerEnd - 2;
+         line = strstr(line, "\r\n") + 2) {
+        if (0 == strncasecmp(line, "Content-Length:", 15)) {
+            contentLength = strtol(line + 15, NULL, 10);
+        } else if (0 == strncasecmp(line, "Transfer-Encoding:", 18) && NULL != strstr(line, "chunked")) {
+            chunked = true;
+        }
+    }
+    __consume(pConn, headerEnd);
+
+    /*
+     * Body
+     */
+    pResponse->bodyLen = 0;
+    if (!chunked) {
+        size_t length = contentLength > 0 ? (size_t) contentLength : 0;
+        if (!__fill(pConn, length)) {
+            return false;
+        }
+        pResponse->body = malloc(length + 1);
+        memcpy(pResponse->body, pConn->buf, length);
+        pResponse->body[length] = '\0';
+        pResponse->bodyLen = length;
+        __consume(pConn, length);
+        return true;
+    }
+
+    size_t cap = READ_SIZE;
+    pResponse->body = malloc(cap + 1);
+    for (;;) {
+        size_t sizeEnd = __line(pConn, 0);
+        if (0 == sizeEnd) {
+            return false;
+        }
+        size_t size = strtoul(pConn->buf, NULL, 16);
+        __consume(pConn, sizeEnd);
+        if (size == 0) {
+            // trailers end with an empty line
+            size_t trailerEnd;
+            while ((trailerEnd = __line(pConn, 0)) > 2) {
+                __consume(pConn, trailerEnd);
+            }
+            if (0 == trailerEnd) {
+                return false;
+            }
+            __consume(pConn, trailerEnd);
+            break;
+        }
+        if (!__fill(pConn, size + 2)) {
+            return false;
+        }
+        if (pResponse->bodyLen + size > cap) {
+            cap = MAX(cap * 2, pResponse->bodyLen + size);
+            pResponse->body = realloc(pResponse->body, cap + 1);
+        }
+        memcpy(pResponse->body + pResponse->bodyLen, pConn->buf, size);
+        pResponse->bodyLen += size;
+        __consume(pConn, size + 2);
+    }
+    pResponse->body[pResponse->bodyLen] = '\0';
+    return true;
+}
+
+bool _request(struct LG_Connection *pConn, char const *pMethod, char const *pPath, char const *pBody,
+              struct LG_Response *pResponse) {
+    size_t bodyLen = NULL != pBody ? strlen(pBody) : 0;
+    size_t cap = bodyLen + 256;
+    size_t len = 0;
+    char *request = malloc(cap);
+    __appendf(&request, &len, &cap, "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\n%s\r\n", pMethod, pPath,
+              __config.host, bodyLen, bodyLen > 0 ? "Content-Type: application/json\r\n" : "");
+    if (bodyLen > 0) {
+        __appendf(&request, &len, &cap, "%s", pBody);
+    }
+
+    /*
+     * Only a kept alive connection is retried, the server may have timed it out before our request arrived
+     */
+    pResponse->body = NULL;
+    bool result = false;
+    int attempts = pConn->fd >= 0 ? 2 : 1;
+    for (int attempt = 0; attempt < attempts && !result; ++attempt) {
+        if (pConn->fd < 0 && !_connect(pConn)) {
+            break;
+        }
+
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t written = send(pConn->fd, request + sent, len - sent, 0);
+            if (written <= 0) {
+                break;
+            }
+            sent += (size_t) written;
+        }
+        free(pResponse->body);
+        pResponse->body = NULL;
+        result = sent == len && _readResponse(pConn, pResponse);
+        if (!result) {
+            _disconnect(pConn);
+        }
+    }
+    free(request);
+    return result;
+}
+
+bool _seed(struct LG_Connection *pConn) {
+    struct LG_Response response;
+    bool result = true;
+
+    for (int i = 0; i < __config.logs && result; ++i) {
+        int32_t startTime;
+        double latitude;
+        double longitude;
+        __seededLog(i, &startTime, &latitude, &longitude);
+        char *json = __gpsLogJson(startTime, __config.logPoints, latitude, longitude);
+        result = _request(pConn, "POST", "/gps_log", json, &response) && response.status == 200;
+        if (result) {
+            __rememberCreated(&response, false);
+        }
+        free(json);
+        free(response.body);
+    }
+
+    for (int i = 0; i < __config.fences && result; ++i) {
+        char identifier[64];
+        snprintf(identifier, sizeof identifier, "loadgen_%d_%d", (int) getpid(), i);
+        char *json = __fenceJson(identifier, i);
+        result = _request(pConn, "POST", "/fence_entry", json, &response) && response.status == 200;
+        if (result) {
+            __rememberCreated(&response, true);
+        }
+        free(json);
+        free(response.body);
+    }
+    return result;
+}
+
+bool _subscribe(struct LG_Connection *pConn) {
+    if (!_connect(pConn)) {
+        return false;
+    }
+    char request[512];
+    int len = snprintf(request, sizeof request, "GET /fence_entry/events HTTP/1.1\r\nHost: %s\r\n\r\n",
+                       __config.host);
+    if (send(pConn->fd, request, (size_t) len, MSG_NOSIGNAL) != len) {
+        _disconnect(pConn);
+        return false;
+    }
+    while (NULL == pConn->buf || NULL == memmem(pConn->buf, pConn->len, "\r\n\r\n", 4)) {
+        if (!__fill(pConn, pConn->len + 1)) {
+            _disconnect(pConn);
+            return false;
+        }
+    }
+    bool ok = 0 == strncmp(pConn->buf, "HTTP/1.1 200", 12);
+    pConn->len = 0;
+    if (!ok) {
+        _disconnect(pConn);
+    }
+    return ok;
+}
+
+bool _isStreamOpen(struct LG_Connection *pConn) {
+    char discard[READ_SIZE];
+    while (pConn->fd >= 0) {
+        ssize_t received = recv(pConn->fd, discard, sizeof discard, MSG_DONTWAIT);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (received <= 0 && !(received < 0 && errno == EINTR)) {
+            _disconnect(pConn);
+        }
+    }
+    return false;
+}
+
+void _cleanup(struct LG_Connection *pConn) {
+    struct LG_Response response;
+    char path[64];
+    size_t failed = 0;
+    for (size_t i = 0; i < __created.fenceCount; ++i) {
+        snprintf(path, sizeof path, "/fence_entry?id=%s", __created.fenceIds[i]);
+        failed += !_request(pConn, "DELETE", path, NULL, &response) || response.status != 200;
+        free(response.body);
+    }
+    for (size_t i = 0; i < __created.logCount; ++i) {
+        snprintf(path, sizeof path, "/gps_log?id=%s", __created.logIds[i]);
+        failed += !_request(pConn, "DELETE", path, NULL, &response) || response.status != 200;
+        free(response.body);
+    }
+    if (failed > 0) {
+        fprintf(stderr, "could not delete %zu of the created records\n", failed);
+    }
+}
+
+bool _runOp(struct LG_Worker *pWorker, struct LG_Connection *pConn, enum LG_Op pOp) {
+    struct LG_Response response;
+    char path[128];
+    char *body = NULL;
+    char const *method = "GET";
+    int fence = (int) (__nextRandom(pWorker) % (uint32_t) __config.fences);
+    int log = (int) (__nextRandom(pWorker) % (uint32_t) __config.logs);
+
+    switch (pOp) {
+        case LG_OP_FENCE_ENTRY:
+            snprintf(path, sizeof path, "/fence_entry?i=loadgen_%d_%d", (int) getpid(), fence);
+            break;
+        case LG_OP_GPS_LOG: {
+            int32_t startTime;
+            double latitude;
+            double longitude;
+            __seededLog(log, &startTime, &latitude, &longitude);
+            snprintf(path, sizeof path, "/gps_log?t=%d",
+                     startTime + (int32_t) (__nextRandom(pWorker) % (uint32_t) __config.logPoints));
+            break;
+        }
+        case LG_OP_FENCE_ENTRY_LIST:
+            snprintf(path, sizeof path, "/fence_entry_list");
+            break;
+        case LG_OP_GPS_LOG_LIST:
+            snprintf(path, sizeof path, "/gps_log_list");
+            break;
+        case LG_OP_EVALUATE: {
+            size_t cap = 64 + EVALUATE_IDENTIFIERS * 40;
+            size_t len = 0;
+            body = malloc(cap);
+            __appendf(&body, &len, &cap, "{\"identifiers\": [");
+            for (int i = 0; i < EVALUATE_IDENTIFIERS; ++i) {
+                __appendf(&body, &len, &cap, "%s\"loadgen_%d_%u\"", i > 0 ? "," : "", (int) getpid(),
+                          __nextRandom(pWorker) % (uint32_t) __config.fences);
+            }
+            __appendf(&body, &len, &cap, "]}");
+            method = "POST";
+            snprintf(path, sizeof path, "/fence_entry/evaluate");
+            break;
+        }
+        case LG_OP_POST_FENCE_ENTRY: {
+            char identifier[64];
+            snprintf(identifier, sizeof identifier, "loadgen_%d_p%d", (int) getpid(),
+                     __atomic_fetch_add(&__nextPosted, 1, __ATOMIC_RELAXED));
+            body = __fenceJson(identifier, fence);
+            method = "POST";
+            snprintf(path, sizeof path, "/fence_entry");
+            break;
+        }
+        case LG_OP_POST_GPS_LOG: {
+            // posted logs get their own time windows after the seeded ones
+            int posted = __atomic_fetch_add(&__nextPosted, 1, __ATOMIC_RELAXED);
+            body = __gpsLogJson(__postedLogTime + posted * (POSTED_LOG_POINTS + 10), POSTED_LOG_POINTS, 10.0, 10.0);
+            method = "POST";
+            snprintf(path, sizeof path, "/gps_log");
+            break;
+        }
+        default:
+            return false;
+    }
+
+    bool result = _request(pConn, method, path, body, &response) && response.status >= 200 && response.status < 300;
+    if (result && (pOp == LG_OP_POST_FENCE_ENTRY || pOp == LG_OP_POST_GPS_LOG)) {
+        __rememberCreated(&response, pOp == LG_OP_POST_FENCE_ENTRY);
+    }
+    free(response.body);
+    free(body);
+    return result;
+}
+
+void *_work(void *pArg) {
+    struct LG_Worker *worker = pArg;
+    struct LG_Connection conn = {-1, NULL, 0, 0};
+
+    /*
+     * Open loop workers share the rate and are staggered so their sends interleave
+     */
+    int64_t interval = __config.rate > 0 ? (int64_t) (1e6 * __config.connections / __config.rate) : 0;
+    int64_t scheduled = __runStart + interval * worker->index / __config.connections;
+
+    for (;;) {
+        int64_t start = __now();
+        if (interval > 0) {
+            if (scheduled > start) {
+                __sleepUntil(scheduled);
+            }
+            start = scheduled;
+            scheduled += interval;
+        }
+        if (start >= __runEnd) {
+            break;
+        }
+
+        uint32_t pick = __nextRandom(worker) % (uint32_t) __config.totalWeight;
+        enum LG_Op op = 0;
+        while (pick >= (uint32_t) __config.weights[op]) {
+            pick -= (uint32_t) __config.weights[op];
+            ++op;
+        }
+
+        bool ok = _runOp(worker, &conn, op);
+        if (start >= __measureStart) {
+            __addSample(&worker->samples[op], __now() - start);
+            worker->samples[op].errors += !ok;
+        }
+    }
+
+    _disconnect(&conn);
+    free(conn.buf);
+    return NULL;
+}
+
+void _report(char const *pName, struct LG_Samples *pSamples, double pSeconds) {
+    if (pSamples->count == 0) {
+        return;
+    }
+    qsort(pSamples->values, pSamples->count, sizeof(int64_t), &__compareInt64);
+    printf("%-18s %9zu %10.1f %8llu %9.2f %9.2f %9.2f %9.2f\n", pName, pSamples->count,
+           (double) pSamples->count / pSeconds, (unsigned long long) pSamples->errors,
+           __percentile(pSamples->values, pSamples->count, 50.0) / 1000.0,
+           __percentile(pSamples->values, pSamples->count, 99.0) / 1000.0,
+           __percentile(pSamples->values, pSamples->count, 99.9) / 1000.0,
+           pSamples->values[pSamples->count - 1] / 1000.0);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int main(int argc, char **argv) {
+    if (!_parseArguments(argc, argv, &__config)) {
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-r requests/s] [-d seconds] "
+                        "[-w warmup seconds] [-f fences] [-l logs] [-n points per log] [-m op=weight,...] "
+                        "[-s subscribers] [-k]\n"
+                        "ops: fence_entry gps_log fence_entry_list gps_log_list evaluate post_fence_entry "
+                        "post_gps_log\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+     * Seed far in the future so the run does not collide with real data or another loadgen
+     */
+    __baseTime = 2000000000 + (int32_t) (getpid() % 1000) * 100000;
+    __postedLogTime = __baseTime + __config.logs * (__config.logPoints + 100);
+
+    struct LG_Connection conn = {-1, NULL, 0, 0};
+    printf("seeding %d gps logs of %d points and %d fences\n", __config.logs, __config.logPoints, __config.fences);
+    if (!_seed(&conn)) {
+        fprintf(stderr, "could not seed http://%s:%s\n", __config.host, __config.port);
+        _cleanup(&conn);
+        return 1;
+    }
+
+    /*
+     * Hold the event streams through the whole run, each takes a descriptor here as well as on the server
+     */
+    struct rlimit files;
+    if (0 == getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    struct LG_Connection *subscribers = calloc((size_t) MAX(__config.subscribers, 1), sizeof(struct LG_Connection));
+    int subscribed = 0;
+    for (int i = 0; i < __config.subscribers; ++i) {
+        subscribers[i].fd = -1;
+        subscribed += _subscribe(&subscribers[i]);
+    }
+    if (__config.subscribers > 0) {
+        printf("opened %d of %d event streams\n", subscribed, __config.subscribers);
+    }
+
+    /*
+     * Run, discarding the warmup samples
+     */
+    struct LG_Worker *workers = calloc((size_t) __config.connections, sizeof(struct LG_Worker));
+    __runStart = __now();
+    __measureStart = __runStart + (int64_t) __config.warmup * 1000000;
+    __runEnd = __measureStart + (int64_t) __config.duration * 1000000;
+    for (int i = 0; i < __config.connections; ++i) {
+        workers[i].index = i;
+        workers[i].random = 0x9e3779b9u * (uint32_t) (i + 1) ^ (uint32_t) getpid();
+        pthread_create(&workers[i].thread, NULL, &_work, &workers[i]);
+    }
+    for (int i = 0; i < __config.connections; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    /*
+     * Merge the per worker samples
+     */
+    struct LG_Samples total = {NULL, 0, 0, 0};
+    struct LG_Samples byOp[LG_OP_COUNT];
+    memset(byOp, 0, sizeof byOp);
+    for (int i = 0; i < __config.connections; ++i) {
+        for (int op = 0; op < LG_OP_COUNT; ++op) {
+            struct LG_Samples *samples = &workers[i].samples[op];
+            for (size_t s = 0; s < samples->count; ++s) {
+                __addSample(&byOp[op], samples->values[s]);
+                __addSample(&total, samples->values[s]);
+            }
+            byOp[op].errors += samples->errors;
+            total.errors += samples->errors;
+            free(samples->values);
+        }
+    }
+
+    double seconds = __config.duration;
+    if (__config.rate > 0) {
+        printf("open loop at %.1f requests/s over %d connections for %ds\n", __config.rate, __config.connections,
+               __config.duration);
+    } else {
+        printf("closed loop over %d connections for %ds\n", __config.connections, __config.duration);
+    }
+    printf("%-18s %9s %10s %8s %9s %9s %9s %9s\n", "op", "requests", "req/s", "errors", "p50 ms", "p99 ms",
+           "p999 ms", "max ms");
+    for (int op = 0; op < LG_OP_COUNT; ++op) {
+        _report(__opNames[op], &byOp[op], seconds);
+        free(byOp[op].values);
+    }
+    _report("total", &total, seconds);
+    free(total.values);
+    free(workers);
+
+    int open = 0;
+    for (int i = 0; i < __config.subscribers; ++i) {
+        open += _isStreamOpen(&subscribers[i]);
+        _disconnect(&subscribers[i]);
+        free(subscribers[i].buf);
+    }
+    free(subscribers);
+    if (__config.subscribers > 0) {
+        printf("%d of %d event streams still open\n", open, __config.subscribers);
+    }
+
+    if (!__config.keep) {
+        _cleanup(&conn);
+    }
+    _disconnect(&conn);
+    free(conn.buf);
+    free(__created.fenceIds);
+    free(__created.logIds);
+    return total.errors > 0 || open < __config.subscribers ? 2 : 0;
+}
+
+//endregion
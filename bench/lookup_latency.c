@@ -0,0 +1,206 @@
+//
+// Created by William Kamp on 7/19/16.
+//
+// Compares the latency of fetching a fence and its covering gps log with two dependent queries
+// (DB_getFenceRecord then DB_getGpsLogRecord) against the single $lookup aggregation (DB_getFenceWithLog).
+//
+// usage: geofence_bench_lookup [iterations] [log points] [mongodb uri]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "database.h"
+
+#define DEFAULT_ITERATIONS 1000
+#define DEFAULT_LOG_POINTS 1000
+#define WARMUP_ITERATIONS 20
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Insert a fence and a gps log of pLogPoints points that covers its entry time
+ *
+ * returns false when either insert failed
+ */
+bool _seed(mongoc_client_t *pClient, char const *pIdentifier, int32_t pEntryTime, int pLogPoints);
+
+/**
+ * Remove the seeded fence and gps log
+ */
+void _cleanup(mongoc_client_t *pClient, char const *pIdentifier, int32_t pEntryTime);
+
+/**
+ * Time one fetch of the fence and its log through the two query path in microseconds
+ */
+int64_t _timeTwoQueries(mongoc_client_t *pClient, char const *pIdentifier);
+
+/**
+ * Time one fetch of the fence and its log through the $lookup path in microseconds
+ */
+int64_t _timeLookup(mongoc_client_t *pClient, char const *pIdentifier);
+
+/**
+ * Print percentiles of pCount latency samples, sorting them in place
+ */
+void _report(char const *pName, int64_t *pSamples, int pCount);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static int __compareInt64(void const *pA, void const *pB) {
+    int64_t a = *(int64_t const *) pA;
+    int64_t b = *(int64_t const *) pB;
+    return (a > b) - (a < b);
+}
+
+static int64_t __percentile(int64_t const *pSorted, int pCount, double pPercentile) {
+    int index = (int) (pPercentile / 100.0 * (pCount - 1) + 0.5);
+    return pSorted[index];
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool _seed(mongoc_client_t *pClient, char const *pIdentifier, int32_t pEntryTime, int pLogPoints) {
+    bson_string_t *json = bson_string_new("{\"log\": [");
+    for (int i = 0; i < pLogPoints; ++i) {
+        bson_string_append_printf(json, "%s{\"latitude\": %.6f, \"longitude\": %.6f, \"time\": %d}",
+                                  i > 0 ? "," : "", 47.0 + i * 0.0001, -122.0 + i * 0.0001,
+                                  pEntryTime - pLogPoints / 2 + i);
+    }
+    bson_string_append(json, "]}");
+    struct DB_Record *log = DB_insertGpsLogRecord(json->str, pClient);
+    bson_string_free(json, true);
+
+    char *fenceJson = bson_strdup_printf("{\"identifier\": \"%s\", \"latitude\": 47.1, \"longitude\": -121.9, "
+                                                 "\"radius\": 100.0, \"entry_time\": %d}", pIdentifier, pEntryTime);
+    struct DB_Record *fence = DB_insertFenceRecord(fenceJson, pClient);
+    bson_free(fenceJson);
+
+    bool result = log->record != NULL && fence->record != NULL;
+    DB_freeRecord(log);
+    DB_freeRecord(fence);
+    return result;
+}
+
+void _cleanup(mongoc_client_t *pClient, char const *pIdentifier, int32_t pEntryTime) {
+    bson_iter_t iter;
+    char oid[25];
+
+    struct DB_Record *fence = DB_getFenceRecord(pIdentifier, NULL, pClient);
+    if (fence->record && bson_iter_init_find(&iter, fence->record, "_id") && BSON_ITER_HOLDS_OID(&iter)) {
+        bson_oid_to_string(bson_iter_oid(&iter), oid);
+        DB_deleteFenceRecord(oid, NULL, pClient);
+    }
+    DB_freeRecord(fence);
+
+    struct DB_GpsLog *log = DB_getGpsLog(pEntryTime, NULL, false, pClient);
+    if (log != NULL && log->hasId) {
+        bson_oid_to_string(&log->id, oid);
+        DB_deleteGpsLogRecord(oid, NULL, pClient);
+    }
+    DB_freeGpsLog(log);
+}
+
+int64_t _timeTwoQueries(mongoc_client_t *pClient, char const *pIdentifier) {
+    int64_t start = bson_get_monotonic_time();
+
+    struct DB_Record *record = DB_getFenceRecord(pIdentifier, NULL, pClient);
+    struct DB_Record *logRecord = NULL;
+    bson_iter_t iter;
+    if (record->record && bson_iter_init_find(&iter, record->record, "entry_time")) {
+        logRecord = DB_getGpsLogRecord(DB_bsonValueInt32(bson_iter_value(&iter)), NULL, NULL, pClient);
+    }
+
+    int64_t elapsed = bson_get_monotonic_time() - start;
+    DB_freeRecord(record);
+    DB_freeRecord(logRecord);
+    return elapsed;
+}
+
+int64_t _timeLookup(mongoc_client_t *pClient, char const *pIdentifier) {
+    int64_t start = bson_get_monotonic_time();
+
+    struct DB_GpsLog *log = NULL;
+    struct DB_Fence *fence = DB_getFenceWithLog(pIdentifier, NULL, NULL, pClient, &log);
+
+    int64_t elapsed = bson_get_monotonic_time() - start;
+    DB_freeFence(fence);
+    DB_freeGpsLog(log);
+    return elapsed;
+}
+
+void _report(char const *pName, int64_t *pSamples, int pCount) {
+    qsort(pSamples, (size_t) pCount, sizeof(int64_t), &__compareInt64);
+    int64_t sum = 0;
+    for (int i = 0; i < pCount; ++i) {
+        sum += pSamples[i];
+    }
+    printf("%-12s mean %8.1fus  p50 %8lldus  p90 %8lldus  p99 %8lldus  max %8lldus\n", pName,
+           (double) sum / pCount,
+           (long long) __percentile(pSamples, pCount, 50.0),
+           (long long) __percentile(pSamples, pCount, 90.0),
+           (long long) __percentile(pSamples, pCount, 99.0),
+           (long long) pSamples[pCount - 1]);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    int logPoints = argc > 2 ? atoi(argv[2]) : DEFAULT_LOG_POINTS;
+    char const *uri = argc > 3 ? argv[3] : DB_URL;
+    if (iterations <= 0 || logPoints <= 0) {
+        fprintf(stderr, "usage: %s [iterations] [log points] [mongodb uri]\n", argv[0]);
+        return 1;
+    }
+
+    mongoc_init();
+    mongoc_client_t *client = mongoc_client_new(uri);
+
+    /*
+     * Seed a fence and log far in the future so they do not collide with real data
+     */
+    char identifier[64];
+    snprintf(identifier, sizeof identifier, "bench_lookup_%d", (int) getpid());
+    int32_t entryTime = 2000000000 + (int32_t) getpid() % 100000 * 1000;
+    if (!_seed(client, identifier, entryTime, logPoints)) {
+        fprintf(stderr, "could not seed the benchmark records at %s\n", uri);
+        mongoc_client_destroy(client);
+        mongoc_cleanup();
+        return 1;
+    }
+
+    for (int i = 0; i < WARMUP_ITERATIONS; ++i) {
+        _timeTwoQueries(client, identifier);
+        _timeLookup(client, identifier);
+    }
+
+    /*
+     * Interleave the two paths so drift in server load affects both equally
+     */
+    int64_t *twoQueries = malloc((size_t) iterations * sizeof(int64_t));
+    int64_t *lookup = malloc((size_t) iterations * sizeof(int64_t));
+    for (int i = 0; i < iterations; ++i) {
+        twoQueries[i] = _timeTwoQueries(client, identifier);
+        lookup[i] = _timeLookup(client, identifier);
+    }
+
+    printf("fence + covering log (%d points), %d iterations\n", logPoints, iterations);
+    _report("two queries", twoQueries, iterations);
+    _report("$lookup", lookup, iterations);
+
+    _cleanup(client, identifier, entryTime);
+    free(twoQueries);
+    free(lookup);
+    mongoc_client_destroy(client);
+    mongoc_cleanup();
+    return 0;
+}
+
+//endregion
@@ -0,0 +1,443 @@
+//
+// Created by William Kamp on 7/29/16.
+//
+// Times the cpu hot paths on their own with synthetic inputs: record validation, the Vincenty inverse, the fence
+// entry scan and bson_as_json. Needs no database.
+//
+// Results are written as json, which can be saved and passed back with -b to compare a later run against it. Any
+// benchmark slower than its baseline by more than the threshold is reported and makes the run exit with status 1.
+//
+// usage: geofence_microbench [-o results.json] [-b baseline.json] [-t threshold percent] [-s max size]
+//                            [-f name filter]
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "database.h"
+#include "entry.h"
+#include "location.h"
+#include "threadpool.h"
+
+#define DEFAULT_THRESHOLD 10.0
+#define DEFAULT_MAX_SIZE 1000000
+#define BATCH_MICROS 20000
+#define BATCHES 5
+#define MAX_RESULTS 128
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+typedef void (*MB_runFunction)(void *pState);
+
+struct MB_Result {
+    char const *name;
+    size_t size;
+    uint64_t iterations;
+    double nsPerOp;
+};
+
+/*
+ * Inputs of a Vincenty case
+ */
+struct MB_LocationCase {
+    char const *name;
+    double startLat;
+    double startLng;
+    double endLat;
+    double endLng;
+};
+
+struct MB_ScanState {
+    struct DB_Fence *fence;
+    struct DB_GpsLog *log;
+    struct TP_Pool *workers;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * Private to database.c, declared here to time them without a database
+ */
+bson_t *_validateGpsLogRecord(char const *pJson);
+
+bson_t *_validateFenceRecord(char const *pJson);
+
+/**
+ * Time fRun, growing the iterations until a batch takes BATCH_MICROS, and keep the median of BATCHES batches
+ */
+void _measure(char const *pName, size_t pSize, MB_runFunction fRun, void *pState);
+
+/**
+ * Write the results as { "benchmarks": [ { name, size, iterations, ns_per_op, ns_per_point } ] }
+ */
+void _writeResults(FILE *pFile);
+
+/**
+ * Compare the results against a file written by _writeResults()
+ *
+ * returns the number of benchmarks slower than their baseline by more than pThreshold percent, or -1 when the
+ * baseline could not be read
+ */
+int _compareBaseline(char const *pPath, double pThreshold);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static struct MB_Result __results[MAX_RESULTS];
+static size_t __resultCount = 0;
+static char const *__filter = NULL;
+static volatile float __sink;
+
+static size_t const __sizes[] = {10, 1000, 100000, 1000000};
+
+/*
+ * Near and far are well behaved, the antipodal and equatorial near-antipodal cases sit at the edge of where the
+ * Vincenty iteration converges and run to its iteration limit
+ */
+static struct MB_LocationCase const __locationCases[] = {
+        {"loc_near", 47.6062, -122.3321, 47.6072, -122.3301},
+        {"loc_far", 47.6062, -122.3321, -33.8688, 151.2093},
+        {"loc_antipodal", 10.0, 20.0, -10.0, -160.0},
+        {"loc_convergence_edge", 0.0, 0.0, 0.5, 179.7},
+};
+
+static int64_t __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int __compareDouble(void const *pA, void const *pB) {
+    double a = *(double const *) pA;
+    double b = *(double const *) pB;
+    return (a > b) - (a < b);
+}
+
+/**
+ * A gps log json body of pCount points walking north east, one second apart
+ *
+ * returns a string which you must later bson_free()
+ */
+static char *__gpsLogJson(size_t pCount) {
+    bson_string_t *json = bson_string_new("{\"log\": [");
+    for (size_t i = 0; i < pCount; ++i) {
+        bson_string_append_printf(json, "%s{\"latitude\": %.6f, \"longitude\": %.6f, \"time\": %d}",
+                                  i > 0 ? "," : "", 47.0 + (i % 100000) * 0.00001, -122.0 + (i % 100000) * 0.00001,
+                                  1500000000 + (int) i);
+    }
+    bson_string_append(json, "]}");
+    return bson_string_free(json, false);
+}
+
+/**
+ * A fence json body with a polygon of pVertices vertices on a small circle, a plain circular fence when pVertices is 0
+ *
+ * returns a string which you must later bson_free()
+ */
+static char *__fenceJson(size_t pVertices, double pLatitude, double pLongitude) {
+    bson_string_t *json = bson_string_new(NULL);
+    bson_string_append_printf(json, "{\"identifier\": \"microbench\", \"latitude\": %.6f, \"longitude\": %.6f, "
+                                      "\"radius\": 100.0, \"entry_time\": 1500000000", pLatitude, pLongitude);
+    if (pVertices > 0) {
+        bson_string_append(json, ", \"polygon\": [");
+        for (size_t i = 0; i < pVertices; ++i) {
+            double angle = 2 * M_PI * (double) i / (double) pVertices;
+            bson_string_append_printf(json, "%s{\"latitude\": %.8f, \"longitude\": %.8f}", i > 0 ? "," : "",
+                                      pLatitude + 0.01 * sin(angle), pLongitude + 0.01 * cos(angle));
+        }
+        bson_string_append(json, "]");
+    }
+    bson_string_append(json, "}");
+    return bson_string_free(json, false);
+}
+
+static bool __selected(char const *pName) {
+    return NULL == __filter || NULL != strstr(pName, __filter);
+}
+
+static void __runValidateGpsLog(void *pState) {
+    bson_t *record = _validateGpsLogRecord(pState);
+    bson_destroy(record);
+}
+
+static void __runValidateFence(void *pState) {
+    bson_t *record = _validateFenceRecord(pState);
+    bson_destroy(record);
+}
+
+static void __runLocation(void *pState) {
+    struct MB_LocationCase const *locationCase = pState;
+    struct LocationInfo info;
+    LOC_calculateLocationInfo(&info, locationCase->startLat, locationCase->startLng, locationCase->endLat,
+                              locationCase->endLng);
+    __sink = info.distanceMeters;
+}
+
+static void __runScan(void *pState) {
+    struct MB_ScanState *scan = pState;
+    bson_t *entry = ENT_findEntryPoint(scan->fence, scan->log, scan->workers);
+    if (NULL != entry) {
+        bson_destroy(entry);
+    }
+}
+
+static void __runAsJson(void *pState) {
+    char *json = bson_as_json(pState, NULL);
+    bson_free(json);
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void _measure(char const *pName, size_t pSize, MB_runFunction fRun, void *pState) {
+    if (__resultCount == MAX_RESULTS) {
+        return;
+    }
+
+    /*
+     * Warm up and size the batch
+     */
+    uint64_t iterations = 1;
+    for (;;) {
+        int64_t start = __now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            fRun(pState);
+        }
+        int64_t elapsed = __now() - start;
+        if (elapsed >= BATCH_MICROS * 1000 || iterations >= (1ull << 30)) {
+            break;
+        }
+        iterations = elapsed > 0 ? MAX(iterations * 2, iterations * BATCH_MICROS * 1000 / (uint64_t) elapsed) :
+                     iterations * 10;
+    }
+
+    double perOp[BATCHES];
+    for (int b = 0; b < BATCHES; ++b) {
+        int64_t start = __now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            fRun(pState);
+        }
+        perOp[b] = (double) (__now() - start) / (double) iterations;
+    }
+    qsort(perOp, BATCHES, sizeof(double), &__compareDouble);
+
+    struct MB_Result *result = &__results[__resultCount++];
+    result->name = pName;
+    result->size = pSize;
+    result->iterations = iterations * BATCHES;
+    result->nsPerOp = perOp[BATCHES / 2];
+    fprintf(stderr, "%-24s %8zu %14.1f ns/op %10.2f ns/point\n", pName, pSize, result->nsPerOp,
+            result->nsPerOp / (double) pSize);
+}
+
+void _writeResults(FILE *pFile) {
+    fprintf(pFile, "{\"benchmarks\": [\n");
+    for (size_t i = 0; i < __resultCount; ++i) {
+        struct MB_Result const *result = &__results[i];
+        fprintf(pFile, "  {\"name\": \"%s\", \"size\": %zu, \"iterations\": %llu, \"ns_per_op\": %.3f, "
+                        "\"ns_per_point\": %.3f}%s\n", result->name, result->size,
+                (unsigned long long) result->iterations, result->nsPerOp, result->nsPerOp / (double) result->size,
+                i + 1 < __resultCount ? "," : "");
+    }
+    fprintf(pFile, "]}\n");
+}
+
+int _compareBaseline(char const *pPath, double pThreshold) {
+    FILE *file = fopen(pPath, "r");
+    if (NULL == file) {
+        fprintf(stderr, "could not read baseline %s\n", pPath);
+        return -1;
+    }
+    bson_string_t *json = bson_string_new(NULL);
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof buf - 1, file)) > 0) {
+        buf[len] = '\0';
+        bson_string_append(json, buf);
+    }
+    fclose(file);
+
+    bson_error_t error;
+    bson_t *baseline = bson_new_from_json((uint8_t const *) json->str, json->len, &error);
+    bson_string_free(json, true);
+    bson_iter_t iter;
+    bson_iter_t benchmarkItr;
+    if (NULL == baseline || !bson_iter_init_find(&iter, baseline, "benchmarks") || !BSON_ITER_HOLDS_ARRAY(&iter)) {
+        fprintf(stderr, "could not parse baseline %s\n", pPath);
+        if (NULL != baseline) {
+            bson_destroy(baseline);
+        }
+        return -1;
+    }
+
+    fprintf(stderr, "\n%-24s %8s %14s %14s %8s\n", "compared to baseline", "size", "baseline ns", "now ns", "change");
+    int regressions = 0;
+    bson_iter_recurse(&iter, &benchmarkItr);
+    while (bson_iter_next(&benchmarkItr)) {
+        bson_iter_t fieldItr;
+        char const *name = NULL;
+        size_t size = 0;
+        double nsPerOp = 0;
+        if (!BSON_ITER_HOLDS_DOCUMENT(&benchmarkItr) || !bson_iter_recurse(&benchmarkItr, &fieldItr)) {
+            continue;
+        }
+        while (bson_iter_next(&fieldItr)) {
+            char const *key = bson_iter_key(&fieldItr);
+            if (0 == strcmp(key, "name") && BSON_ITER_HOLDS_UTF8(&fieldItr)) {
+                name = bson_iter_utf8(&fieldItr, NULL);
+            } else if (0 == strcmp(key, "size")) {
+                size = (size_t) DB_bsonValueDouble(bson_iter_value(&fieldItr));
+            } else if (0 == strcmp(key, "ns_per_op")) {
+                nsPerOp = DB_bsonValueDouble(bson_iter_value(&fieldItr));
+            }
+        }
+
+        for (size_t i = 0; NULL != name && nsPerOp > 0 && i < __resultCount; ++i) {
+            struct MB_Result const *result = &__results[i];
+            if (result->size == size && 0 == strcmp(result->name, name)) {
+                double change = (result->nsPerOp / nsPerOp - 1.0) * 100.0;
+                bool regressed = change > pThreshold;
+                regressions += regressed;
+                fprintf(stderr, "%-24s %8zu %14.1f %14.1f %+7.1f%%%s\n", name, size, nsPerOp, result->nsPerOp,
+                        change, regressed ? "  REGRESSION" : "");
+            }
+        }
+    }
+    bson_destroy(baseline);
+    return regressions;
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int main(int argc, char **argv) {
+    char const *output = NULL;
+    char const *baseline = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    size_t maxSize = DEFAULT_MAX_SIZE;
+    int option;
+    while ((option = getopt(argc, argv, "o:b:t:s:f:")) != -1) {
+        switch (option) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 't':
+                threshold = strtod(optarg, NULL);
+                break;
+            case 's':
+                maxSize = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                __filter = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-o results.json] [-b baseline.json] [-t threshold percent] "
+                                "[-s max size] [-f name filter]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    /*
+     * Vincenty, one call per op
+     */
+    for (size_t c = 0; c < sizeof __locationCases / sizeof __locationCases[0]; ++c) {
+        if (__selected(__locationCases[c].name)) {
+            _measure(__locationCases[c].name, 1, &__runLocation, (void *) &__locationCases[c]);
+        }
+    }
+
+    if (__selected("validate_fence")) {
+        char *json = __fenceJson(0, 47.0, -122.0);
+        _measure("validate_fence", 1, &__runValidateFence, json);
+        bson_free(json);
+    }
+
+    struct TP_Pool *workers = TP_createPool(0);
+    for (size_t s = 0; s < sizeof __sizes / sizeof __sizes[0] && __sizes[s] <= maxSize; ++s) {
+        size_t size = __sizes[s];
+
+        if (__selected("validate_fence_polygon")) {
+            char *json = __fenceJson(size, 47.0, -122.0);
+            _measure("validate_fence_polygon", size, &__runValidateFence, json);
+            bson_free(json);
+        }
+
+        char *logJson = __gpsLogJson(size);
+        if (__selected("validate_gps_log")) {
+            _measure("validate_gps_log", size, &__runValidateGpsLog, logJson);
+        }
+
+        /*
+         * The fences are never entered so every scan reads the whole log
+         */
+        bson_t *logRecord = _validateGpsLogRecord(logJson);
+        struct MB_ScanState scan;
+        scan.log = DB_decodeGpsLog(logRecord);
+        char *fenceJson = __fenceJson(0, 10.0, 10.0);
+        bson_t *fenceRecord = bson_new_from_json((uint8_t const *) fenceJson, -1, NULL);
+        scan.fence = DB_decodeFence(fenceRecord);
+        scan.workers = NULL;
+        if (__selected("entry_scan")) {
+            _measure("entry_scan", size, &__runScan, &scan);
+        }
+        if (__selected("entry_scan_parallel") && size >= ENT_PARALLEL_THRESHOLD) {
+            scan.workers = workers;
+            _measure("entry_scan_parallel", size, &__runScan, &scan);
+            scan.workers = NULL;
+        }
+        DB_freeFence(scan.fence);
+        bson_destroy(fenceRecord);
+        bson_free(fenceJson);
+
+        fenceJson = __fenceJson(8, 10.0, 10.0);
+        fenceRecord = bson_new_from_json((uint8_t const *) fenceJson, -1, NULL);
+        scan.fence = DB_decodeFence(fenceRecord);
+        if (__selected("entry_scan_polygon")) {
+            _measure("entry_scan_polygon", size, &__runScan, &scan);
+        }
+        DB_freeFence(scan.fence);
+        bson_destroy(fenceRecord);
+        bson_free(fenceJson);
+        DB_freeGpsLog(scan.log);
+
+        if (__selected("bson_as_json")) {
+            _measure("bson_as_json", size, &__runAsJson, logRecord);
+        }
+        bson_destroy(logRecord);
+        bson_free(logJson);
+    }
+    TP_destroyPool(workers);
+
+    if (NULL != output) {
+        FILE *file = fopen(output, "w");
+        if (NULL == file) {
+            fprintf(stderr, "could not write %s\n", output);
+            return 2;
+        }
+        _writeResults(file);
+        fclose(file);
+    } else {
+        _writeResults(stdout);
+    }
+
+    if (NULL != baseline) {
+        int regressions = _compareBaseline(baseline, threshold);
+        if (regressions != 0) {
+            return regressions < 0 ? 2 : 1;
+        }
+    }
+    return 0;
+}
+
+//endregion
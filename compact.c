@@ -0,0 +1,351 @@
+//
+// Created by William Kamp on 8/29/16.
+//
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "compact.h"
+#include "location.h"
+#include "log.h"
+#include "polygon.h"
+#include "simplify.h"
+
+#define OWNER_SIZE 320
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * What one pass did, for its log record
+ */
+struct CMP_Totals {
+    size_t compacted;
+    size_t pointsBefore;
+    size_t pointsAfter;
+    int64_t expired;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Mark the points of pLog near the boundary of pFence or on either side of a step across it
+ */
+void _markBoundary(struct DB_GpsLog const *pLog, struct DB_Fence const *pFence, double pBoundaryMeters,
+                   uint8_t *pKeep);
+
+/**
+ * Wait pMillis, returns false when the compactor is being stopped
+ */
+bool _pause(int64_t pMillis);
+
+/**
+ * Wait until foreground requests leave the database alone or maxDeferMillis went by, returns false when the compactor
+ * is being stopped
+ */
+bool _waitForIdle(void);
+
+/**
+ * Delete the logs of a partition past the retention horizon, a batch at a time
+ */
+void _expirePartition(char const *pPartition, int64_t pEndedBefore, mongoc_client_t *pClient,
+                      struct CMP_Totals *pTotals);
+
+/**
+ * Downsample the logs of a partition past the compaction age, a batch at a time in _id order. Each batch resumes
+ * after the last log read so logs that are left alone are not read over and over.
+ */
+void _compactPartition(char const *pPartition, int64_t pEndedBefore, mongoc_client_t *pClient,
+                       struct CMP_Totals *pTotals);
+
+/**
+ * One pass over every partition, when this process holds the lease
+ */
+void _runPass(mongoc_client_t *pClient);
+
+/**
+ * The compactor thread
+ */
+void *_compactor(void *pArg);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static pthread_mutex_t __lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __wake = PTHREAD_COND_INITIALIZER;
+static pthread_t __compactorThread;
+static bool __running = false;
+static bool __stopping = false;
+static struct CMP_Config __config;
+static char *__uri = NULL;
+static CMP_busyFunction __busy = NULL;
+static void *__busyContext = NULL;
+static char __owner[OWNER_SIZE];
+
+/*
+ * Distance in meters from a point to the segment a-b, on a plane scaled around the point
+ */
+static double __segmentDistance(double pLatitude, double pLongitude, double pLatA, double pLngA, double pLatB,
+                                double pLngB, double pLatitudeMeters, double pLongitudeMeters) {
+    double ax = (pLngA - pLongitude) * pLongitudeMeters;
+    double ay = (pLatA - pLatitude) * pLatitudeMeters;
+    double bx = (pLngB - pLongitude) * pLongitudeMeters;
+    double by = (pLatB - pLatitude) * pLatitudeMeters;
+    double dx = bx - ax;
+    double dy = by - ay;
+    double lengthSq = dx * dx + dy * dy;
+    double t = lengthSq > 0.0 ? -(ax * dx + ay * dy) / lengthSq : 0.0;
+    t = MAX(0.0, MIN(1.0, t));
+    double x = ax + t * dx;
+    double y = ay + t * dy;
+    return sqrt(x * x + y * y);
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void _markBoundary(struct DB_GpsLog const *pLog, struct DB_Fence const *pFence, double pBoundaryMeters,
+                   uint8_t *pKeep) {
+    uint8_t *inside = malloc(pLog->count * sizeof(uint8_t));
+    if (pFence->polygonCount > 0) {
+        struct PLY_Polygon *polygon = PLY_createPolygon(pFence->polygonLatitudes, pFence->polygonLongitudes,
+                                                        pFence->polygonCount);
+        if (NULL == polygon) {
+            free(inside);
+            return;
+        }
+        PLY_containsPoints(polygon, pLog->latitudes, pLog->longitudes, pLog->count, inside);
+        PLY_destroyPolygon(polygon);
+
+        double latitudeMeters;
+        double longitudeMeters;
+        LOC_metersPerDegree(pFence->polygonLatitudes[0], &latitudeMeters, &longitudeMeters);
+        for (size_t i = 0; i < pLog->count; ++i) {
+            for (size_t v = 0; !pKeep[i] && v < pFence->polygonCount; ++v) {
+                size_t w = (v + 1) % pFence->polygonCount;
+                pKeep[i] = __segmentDistance(pLog->latitudes[i], pLog->longitudes[i], pFence->polygonLatitudes[v],
+                                             pFence->polygonLongitudes[v], pFence->polygonLatitudes[w],
+                                             pFence->polygonLongitudes[w], latitudeMeters,
+                                             longitudeMeters) <= pBoundaryMeters;
+            }
+        }
+    } else {
+        struct LocationInfo locationInfo;
+        for (size_t i = 0; i < pLog->count; ++i) {
+            LOC_calculateLocationInfo(&locationInfo, pFence->latitude, pFence->longitude, pLog->latitudes[i],
+                                      pLog->longitudes[i]);
+            inside[i] = locationInfo.distanceMeters <= pFence->radius;
+            if (fabs(locationInfo.distanceMeters - pFence->radius) <= pBoundaryMeters) {
+                pKeep[i] = 1;
+            }
+        }
+    }
+
+    for (size_t i = 1; i < pLog->count; ++i) {
+        if (inside[i] != inside[i - 1]) {
+            pKeep[i - 1] = 1;
+            pKeep[i] = 1;
+        }
+    }
+    free(inside);
+}
+
+bool _pause(int64_t pMillis) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pMillis / 1000;
+    deadline.tv_nsec += (pMillis % 1000) * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+
+    pthread_mutex_lock(&__lock);
+    while (!__stopping && ETIMEDOUT != pthread_cond_timedwait(&__wake, &__lock, &deadline)) {
+    }
+    bool retVal = !__stopping;
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+bool _waitForIdle(void) {
+    int64_t deferred = 0;
+    while (NULL != __busy && deferred < __config.maxDeferMillis && __busy(__busyContext)) {
+        if (!_pause(__config.pauseMillis)) {
+            return false;
+        }
+        deferred += MAX(__config.pauseMillis, 1);
+    }
+    return _pause(0);
+}
+
+void _expirePartition(char const *pPartition, int64_t pEndedBefore, mongoc_client_t *pClient,
+                      struct CMP_Totals *pTotals) {
+    int64_t expired = CMP_EXPIRE_BATCH_SIZE;
+    while (expired == CMP_EXPIRE_BATCH_SIZE && _waitForIdle()) {
+        expired = DB_expireGpsLogs(pPartition, pEndedBefore, CMP_EXPIRE_BATCH_SIZE, pClient);
+        pTotals->expired += MAX(expired, 0);
+        _pause(__config.pauseMillis);
+    }
+}
+
+void _compactPartition(char const *pPartition, int64_t pEndedBefore, mongoc_client_t *pClient,
+                       struct CMP_Totals *pTotals) {
+    bson_oid_t after;
+    bson_oid_init_from_string(&after, "000000000000000000000000");
+    bool more = true;
+    while (more && _waitForIdle()) {
+        bson_oid_t previous;
+        bson_oid_copy(&after, &previous);
+        size_t logCount;
+        struct DB_GpsLog **logs = DB_getGpsLogsToCompact(pPartition, pEndedBefore, &after, CMP_COMPACT_BATCH_SIZE,
+                                                         pClient, &logCount);
+        bool stopped = false;
+        for (size_t i = 0; i < logCount; ++i) {
+            struct DB_GpsLog *log = logs[i];
+            if (stopped || !_waitForIdle()) {
+                stopped = true;
+                DB_freeGpsLog(log);
+                continue;
+            }
+
+            /*
+             * Only the fences whose entry_time the log spans can have it as their corresponding log
+             */
+            size_t fenceCount;
+            struct DB_Fence **fences = DB_getFencesInWindow(log->deviceId, log->startTime, log->endTime, pClient,
+                                                            &fenceCount);
+            size_t keptCount;
+            size_t *kept = CMP_keptIndices(log, fences, fenceCount, __config.toleranceMeters,
+                                           __config.boundaryMeters, &keptCount);
+            if (DB_compactGpsLog(log, kept, keptCount, __config.toleranceMeters, pClient)) {
+                ++pTotals->compacted;
+                pTotals->pointsBefore += log->count;
+                pTotals->pointsAfter += keptCount;
+            }
+
+            free(kept);
+            for (size_t f = 0; f < fenceCount; ++f) {
+                DB_freeFence(fences[f]);
+            }
+            free(fences);
+            DB_freeGpsLog(log);
+            _pause(__config.pauseMillis);
+        }
+        free(logs);
+
+        /*
+         * A batch that read nothing ends the pass, logs left alone are retried by the next pass. Keep the lease while
+         * a long pass goes on.
+         */
+        more = !stopped && !bson_oid_equal(&previous, &after) &&
+               DB_acquireLease(CMP_LEASE_NAME, __owner, __config.intervalSeconds * 3, pClient);
+    }
+}
+
+void _runPass(mongoc_client_t *pClient) {
+    if (!_waitForIdle() || !DB_acquireLease(CMP_LEASE_NAME, __owner, __config.intervalSeconds * 3, pClient)) {
+        return;
+    }
+
+    struct CMP_Totals totals = {0, 0, 0, 0};
+    int64_t now = time(NULL);
+    size_t partitionCount;
+    char **partitions = DB_getGpsLogPartitions(pClient, &partitionCount);
+    for (size_t i = 0; i < partitionCount; ++i) {
+        if (__config.retentionSeconds > 0) {
+            _expirePartition(partitions[i], now - __config.retentionSeconds, pClient, &totals);
+        }
+        if (__config.compactAgeSeconds > 0) {
+            _compactPartition(partitions[i], now - __config.compactAgeSeconds, pClient, &totals);
+        }
+        bson_free(partitions[i]);
+    }
+    free(partitions);
+
+    char detail[160];
+    snprintf(detail, sizeof detail, "%zu logs compacted from %zu to %zu points, %lld logs expired", totals.compacted,
+             totals.pointsBefore, totals.pointsAfter, (long long) totals.expired);
+    LOG_log(LOG_LEVEL_INFO, "gps log compaction pass", detail);
+}
+
+void *_compactor(void *pArg) {
+    mongoc_client_t *client = mongoc_client_new(__uri);
+    while (_pause(__config.intervalSeconds * 1000LL)) {
+        _runPass(client);
+    }
+    mongoc_client_destroy(client);
+    return NULL;
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t *CMP_keptIndices(struct DB_GpsLog const *pLog, struct DB_Fence *const *pFences, size_t pFenceCount,
+                        double pToleranceMeters, double pBoundaryMeters, size_t *pKeptCount) {
+    size_t simplifiedCount;
+    size_t *simplified = SIM_simplify(pLog->latitudes, pLog->longitudes, pLog->count, pToleranceMeters,
+                                      &simplifiedCount);
+    uint8_t *keep = calloc(MAX(pLog->count, 1), sizeof(uint8_t));
+    for (size_t i = 0; i < simplifiedCount; ++i) {
+        keep[simplified[i]] = 1;
+    }
+    free(simplified);
+    for (size_t f = 0; f < pFenceCount; ++f) {
+        _markBoundary(pLog, pFences[f], pBoundaryMeters, keep);
+    }
+
+    size_t *retVal = malloc(MAX(pLog->count, 1) * sizeof(size_t));
+    *pKeptCount = 0;
+    for (size_t i = 0; i < pLog->count; ++i) {
+        if (keep[i]) {
+            retVal[(*pKeptCount)++] = i;
+        }
+    }
+    free(keep);
+    return retVal;
+}
+
+void CMP_start(struct CMP_Config const *pConfig, char const *pUri, CMP_busyFunction fBusy, void *pContext) {
+    pthread_mutex_lock(&__lock);
+    if (!__running) {
+        __config = *pConfig;
+        __config.intervalSeconds = MAX(__config.intervalSeconds, 1);
+        __uri = bson_strdup(pUri);
+        __busy = fBusy;
+        __busyContext = pContext;
+        __stopping = false;
+
+        char host[256] = "localhost";
+        gethostname(host, sizeof host - 1);
+        snprintf(__owner, sizeof __owner, "%s:%d", host, (int) getpid());
+        __running = 0 == pthread_create(&__compactorThread, NULL, &_compactor, NULL);
+    }
+    pthread_mutex_unlock(&__lock);
+}
+
+void CMP_stop(void) {
+    pthread_mutex_lock(&__lock);
+    bool running = __running;
+    __stopping = true;
+    pthread_cond_broadcast(&__wake);
+    pthread_mutex_unlock(&__lock);
+    if (running) {
+        pthread_join(__compactorThread, NULL);
+    }
+
+    pthread_mutex_lock(&__lock);
+    __running = false;
+    bson_free(__uri);
+    __uri = NULL;
+    pthread_mutex_unlock(&__lock);
+}
+
+//endregion
@@ -0,0 +1,76 @@
+//
+// Created by William Kamp on 8/29/16.
+//
+
+#ifndef GEOFENCEBEC_COMPACT_H
+#define GEOFENCEBEC_COMPACT_H
+
+#include <libmongoc-1.0/mongoc.h>
+#include "database.h"
+
+/*
+ * Logs read per batch when compacting, they come with all their points
+ */
+#define CMP_COMPACT_BATCH_SIZE 4
+
+/*
+ * Logs deleted per batch when expiring
+ */
+#define CMP_EXPIRE_BATCH_SIZE 100
+
+/*
+ * Name of the lease that lets one process of the deployment compact at a time
+ */
+#define CMP_LEASE_NAME "compaction"
+
+/*
+ * Defines a function telling the compactor that foreground requests need the database, it waits until it returns
+ * false or it has waited maxDeferMillis
+ */
+typedef bool (*CMP_busyFunction)(void *pContext);
+
+/*
+ * When and how aggressively gps logs are compacted and expired, an age of 0 turns that part off
+ */
+struct CMP_Config {
+    int64_t compactAgeSeconds;
+    int64_t retentionSeconds;
+    double toleranceMeters;
+    double boundaryMeters;
+    unsigned int intervalSeconds;
+    unsigned int pauseMillis;
+    unsigned int maxDeferMillis;
+};
+
+/**
+ * Choose the points of a gps log to keep: the SIM_simplify() points at pToleranceMeters, every point within
+ * pBoundaryMeters of the boundary of one of pFences and both points of every step that crosses a boundary, so the
+ * first point inside each fence, its actual entry, stays the same.
+ *
+ * param pFences - the fences the log may be the corresponding log of
+ * param pKeptCount - receives the number of kept points
+ *
+ * returns the ascending indices of the kept points which you must later free()
+ */
+size_t *CMP_keptIndices(struct DB_GpsLog const *pLog, struct DB_Fence *const *pFences, size_t pFenceCount,
+                        double pToleranceMeters, double pBoundaryMeters, size_t *pKeptCount);
+
+/**
+ * Start the background compactor, every pConfig->intervalSeconds it takes the CMP_LEASE_NAME lease and then deletes
+ * the gps logs that ended retentionSeconds ago and downsamples, with CMP_keptIndices(), the ones that ended
+ * compactAgeSeconds ago. It uses its own connection rather than the request pool, works a batch at a time, pauses
+ * pauseMillis between logs and waits while fBusy returns true, for up to maxDeferMillis before each operation so a
+ * server that is never idle is still compacted.
+ *
+ * param pUri - the MongoDB uri to connect to
+ * param fBusy - polled before each database operation or NULL
+ * param pContext - passed to fBusy
+ */
+void CMP_start(struct CMP_Config const *pConfig, char const *pUri, CMP_busyFunction fBusy, void *pContext);
+
+/**
+ * Stop the compactor after the operation in progress, does nothing when it was not started
+ */
+void CMP_stop(void);
+
+#endif //GEOFENCEBEC_COMPACT_H
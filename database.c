@@ -2,15 +2,55 @@
 // Created by William Kamp on 6/15/16.
 //
 
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
 #include "database.h"
+#include "log.h"
+#include "slowop.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define EARTH_RADIUS_METERS 6378137.0
+#define CANDIDATE_RADIUS_SLACK 1.01
+#define COLLECTION_NAME_SIZE 128
+#define INDEXED_DEVICE_CAPACITY 1024
+#define PARTITION_CAPACITY 16
 
 //region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * An aggregate cursor kept open across the reads of a streamed response, its pipeline is the query of its SOP_Op
+ */
+struct DB_Export {
+    mongoc_collection_t *collection;
+    mongoc_cursor_t *cursor;
+    bson_t pipeline;
+    struct SOP_Op op;
+    bool failed;
+};
+
+/*
+ * A document serialized to json straight from the cursor's reply
+ */
+struct DB_Json {
+    char *json;
+    size_t length;
+};
+
 //endregion
 
 //region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 typedef bson_t *(*_insertFunction)(char const *pJson);
 
+/*
+ * Defines a function that keeps what it needs of a document found by a query, the document points into the cursor's
+ * reply and is only valid during the call
+ */
+typedef void (*_foundFunction)(bson_t const *pDocument, void *pContext);
+
 /**
  * Insert a record into the database
  *
@@ -19,6 +59,48 @@ typedef bson_t *(*_insertFunction)(char const *pJson);
 struct DB_Record *_insertRecord(char const *pJson, mongoc_client_t *pClient, char const *pCollection,
                                 _insertFunction fPtr);
 
+/**
+ * Write the name of the collection of pCollection records that holds the partition of pDeviceId
+ */
+void _collectionName(char *pName, size_t pSize, char const *pCollection, char const *pDeviceId);
+
+/**
+ * Get the collection of pCollection records that holds the partition of pDeviceId
+ *
+ * returns the collection which you must later mongoc_collection_destroy()
+ */
+mongoc_collection_t *_getCollection(mongoc_client_t *pClient, char const *pCollection, char const *pDeviceId);
+
+/**
+ * Append { device_id: <id> } to a query, or { device_id: null } matching the records without a device_id
+ */
+void _appendDeviceQuery(bson_t *pQuery, char const *pDeviceId);
+
+/**
+ * The device_id of a validated record
+ *
+ * returns the id held by pRecord or NULL when it has none
+ */
+char const *_deviceIdOf(bson_t const *pRecord);
+
+/**
+ * Check the optional device_id of a record being validated
+ *
+ * returns false and fills pError when it is present but not a valid device id
+ */
+bool _validateDeviceId(bson_t const *pBson, bson_error_t *pError);
+
+/**
+ * Create the indexes of the collections holding the partition of pDeviceId, sharding them when partitioning is
+ * DB_PARTITION_SHARDED
+ */
+bool _ensurePartitionIndexes(mongoc_client_t *pClient, char const *pDeviceId);
+
+/**
+ * Shard a collection of DB on pKey, which one of its indexes must start with
+ */
+bool _shardCollection(mongoc_client_t *pClient, char const *pCollection, bson_t const *pKey, bson_error_t *pError);
+
 /**
  * Create a DB_Record structure that must be freed with void DB_freeRecord(struct DB_Record* pResult)
  */
@@ -31,6 +113,13 @@ struct DB_Record *_allocateRecord();
  */
 bson_t *_validateFenceRecord(char const *pJson);
 
+/**
+ * Validate the polygon array of a fence record and append its bounding_box
+ *
+ * returns false and fills pError when the polygon is not an array of at least 3 numeric vertices
+ */
+bool _validatePolygon(bson_t *pBson, bson_iter_t const *pIter, bson_error_t *pError);
+
 /**
  * Validate a json string as a valid gps_log
  *
@@ -38,6 +127,107 @@ bson_t *_validateFenceRecord(char const *pJson);
  */
 bson_t *_validateGpsLogRecord(char const *pJson);
 
+/**
+ * Append the query matching the gps log whose time_window spans pEpochTime
+ */
+void _appendTimeWindowQuery(bson_t *pQuery, int64_t pEpochTime);
+
+/**
+ * Find the gps log of a device spanning pEpochTime returning only pFields (all fields when NULL)
+ *
+ * param fFound - called with the log when there is one
+ *
+ * returns true when the log was found
+ */
+bool _findGpsLogRecord(int64_t pEpochTime, char const *pDeviceId, bson_t const *pFields, _foundFunction fFound,
+                       void *pContext, mongoc_client_t *pClient);
+
+/**
+ * Append the expression selecting the points of "$log" in pRange
+ * { $slice: [ { $filter: { input: "$log", as: "p", cond: { $and: [ { $gte: ["$$p.time", from] },
+ *                                                                   { $lte: ["$$p.time", to] } ] } } }, maxPoints ] }
+ */
+void _appendPointRangeExpression(bson_t *pBson, char const *pKey, struct DB_PointRange const *pRange);
+
+/**
+ * Find the gps log of a device spanning pEpochTime with only the points in pRange
+ *
+ * param fFound - called with the log when there is one
+ *
+ * returns true when the log was found
+ */
+bool _aggregateGpsLogRecord(int64_t pEpochTime, char const *pDeviceId, struct DB_PointRange const *pRange,
+                            _foundFunction fFound, void *pContext, mongoc_client_t *pClient);
+
+/**
+ * Create a DB_GpsLog structure with no points that must be freed with DB_freeGpsLog()
+ */
+struct DB_GpsLog *_allocateGpsLog();
+
+/**
+ * Grow the point arrays of a gps log to hold at least pCapacity points
+ */
+void _reserveGpsLogPoints(struct DB_GpsLog *pLog, size_t pCapacity);
+
+/**
+ * Read the latitude, longitude and time of a log point document in one pass over its fields
+ *
+ * returns false when a field is missing or not a number
+ */
+bool _decodeGpsPoint(bson_iter_t const *pPointIter, double *pLatitude, double *pLongitude, int32_t *pTime);
+
+/**
+ * Decode the vertices of a fence polygon array into pFence
+ *
+ * returns false when the polygon has fewer than 3 well formed vertices
+ */
+bool _decodePolygon(bson_iter_t const *pPolygonIter, struct DB_Fence *pFence);
+
+/**
+ * Append a GeoJSON point { type: "Point", coordinates: [lng, lat] }
+ */
+void _appendGeoJsonPoint(bson_t *pBson, char const *pKey, double pLatitude, double pLongitude);
+
+/**
+ * Store each point of a validated gps log as its own GeoJSON document in the gps_points of its device
+ */
+bool _insertGpsPoints(bson_t const *pLog, bson_value_t const *pLogId, char const *pDeviceId, int32_t pFirstIndex,
+                      mongoc_client_t *pClient, bson_error_t *pError);
+
+/**
+ * Give a gps log stored before point_count was kept the length of its log, counted server side
+ */
+bool _backfillPointCount(bson_oid_t const *pLogId, char const *pDeviceId, mongoc_client_t *pClient,
+                         bson_error_t *pError);
+
+/**
+ * Copy the value at a dotted path of pFrom into pBson keyed by the path itself, as $min and $max expect
+ */
+void _appendDescendant(bson_t *pBson, bson_t const *pFrom, char const *pPath);
+
+/**
+ * Add the points of a validated log to the gps log with pLogId and widen its bounding_box and time_window
+ *
+ * param pPoints - the validated { log: [...], bounding_box, time_window } to append
+ * param pPointCount - the number of points in pPoints
+ * param pReply - receives the reply which you must later bson_destroy(), its value is the updated log without its
+ * points or null when there is no such log
+ */
+bool _pushGpsPoints(bson_oid_t const *pLogId, char const *pDeviceId, bson_t const *pPoints, uint32_t pPointCount,
+                    mongoc_client_t *pClient, bson_t *pReply, bson_error_t *pError);
+
+/**
+ * Add the tile runs of appended points, shifted to follow the pFirstIndex points the log already had, to a gps log
+ * that has a tile index
+ */
+bool _pushTileRuns(bson_oid_t const *pLogId, char const *pDeviceId, bson_t const *pPoints, int32_t pFirstIndex,
+                   mongoc_client_t *pClient, bson_error_t *pError);
+
+/**
+ * Read the tiles of a gps log record, dropping them unless they cover each decoded point exactly once
+ */
+void _decodeTiles(bson_iter_t const *pTilesIter, struct DB_GpsLog *pLog);
+
 /**
  * Create a message that must be freed with free()
  */
@@ -45,30 +235,254 @@ char *_createMessage(char const *const msg);
 
 //endregion
 
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static enum DB_Partitioning __partitioning = DB_PARTITION_SHARED;
+static char const *const __partitioningNames[] = {"shared", "sharded", "collection"};
+static pthread_mutex_t __indexedDeviceLock = PTHREAD_MUTEX_INITIALIZER;
+static char *__indexedDevices[INDEXED_DEVICE_CAPACITY];
+static size_t __indexedDeviceNext = 0;
+
+/*
+ * Claim indexing the collections of a device, false when this process already has. Once the table is full the
+ * oldest device is forgotten and only indexed again, which is harmless.
+ */
+static bool __claimDeviceIndexes(char const *pDeviceId) {
+    bool retVal = true;
+    pthread_mutex_lock(&__indexedDeviceLock);
+    for (size_t i = 0; retVal && i < INDEXED_DEVICE_CAPACITY && NULL != __indexedDevices[i]; ++i) {
+        retVal = 0 != strcmp(__indexedDevices[i], pDeviceId);
+    }
+    if (retVal) {
+        size_t slot = __indexedDeviceNext++ % INDEXED_DEVICE_CAPACITY;
+        bson_free(__indexedDevices[slot]);
+        __indexedDevices[slot] = bson_strdup(pDeviceId);
+    }
+    pthread_mutex_unlock(&__indexedDeviceLock);
+    return retVal;
+}
+
+/*
+ * Append [cell, start, end] to an array of tile runs
+ */
+static void __appendTileRun(bson_t *pRuns, uint32_t *pRunCount, int64_t pCell, int32_t pStart, int32_t pEnd) {
+    char iStr[16];
+    char const *key;
+    bson_t run;
+    bson_uint32_to_string((*pRunCount)++, &key, iStr, sizeof iStr);
+    BSON_APPEND_ARRAY_BEGIN(pRuns, key, &run);
+    BSON_APPEND_INT64(&run, "0", pCell);
+    BSON_APPEND_INT32(&run, "1", pStart);
+    BSON_APPEND_INT32(&run, "2", pEnd);
+    bson_append_array_end(pRuns, &run);
+}
+
+/*
+ * _foundFunction keeping a copy of the document as the record of a struct DB_Record
+ */
+static void __copyRecord(bson_t const *pDocument, void *pContext) {
+    struct DB_Record *record = pContext;
+    record->record = bson_copy(pDocument);
+    record->message = _createMessage("ok");
+}
+
+/*
+ * _foundFunction serializing the document into a struct DB_Json
+ */
+static void __serializeRecord(bson_t const *pDocument, void *pContext) {
+    struct DB_Json *json = pContext;
+    json->json = bson_as_json(pDocument, &json->length);
+}
+
+static int __compareTileRunStart(void const *pA, void const *pB) {
+    struct DB_TileRun const *a = pA;
+    struct DB_TileRun const *b = pB;
+    return (a->start > b->start) - (a->start < b->start);
+}
+
+//endregion
+
 //region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 struct DB_Record *_insertRecord(char const *pJson, mongoc_client_t *pClient, char const *pCollection,
                                 _insertFunction fPtr) {
     struct DB_Record *retVal = _allocateRecord();
+    struct TRC_Span span;
+    int64_t startTime = MET_now();
+    TRC_begin(&span, "validate");
     bson_t *record = fPtr(pJson);
+    TRC_end(&span);
+    MET_recordStage(MET_currentRoute(), MET_STAGE_VALIDATE, MET_now() - startTime);
     if (record) {
+        /*
+         * Assign the id here rather than in the driver so the response (and a gps log's points) can reference it
+         */
+        if (!bson_has_field(record, "_id")) {
+            bson_oid_t oid;
+            bson_oid_init(&oid, NULL);
+            BSON_APPEND_OID(record, "_id", &oid);
+        }
+
+        /*
+         * A device's own collections are indexed before its first record goes in
+         */
+        char const *deviceId = _deviceIdOf(record);
+        if (__partitioning == DB_PARTITION_COLLECTION && NULL != deviceId && __claimDeviceIndexes(deviceId)) {
+            _ensurePartitionIndexes(pClient, deviceId);
+        }
+
         mongoc_collection_t *collection;
         bson_error_t bsonError;
-        collection = mongoc_client_get_collection(pClient, DB, pCollection);
-        if (!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, record, NULL, &bsonError)) {
+        startTime = MET_now();
+        TRC_begin(&span, "mongoc_collection_insert");
+        collection = _getCollection(pClient, pCollection, deviceId);
+        if (!SOP_insert("_insertRecord", collection, record, &bsonError)) {
             retVal->message = _createMessage(bsonError.message);
+            bson_destroy(record);
             retVal->record = NULL;
         } else {
             retVal->record = record;
             retVal->message = _createMessage("ok");
         }
         mongoc_collection_destroy(collection);
+        TRC_end(&span);
+        MET_recordStage(MET_currentRoute(), MET_STAGE_MONGO, MET_now() - startTime);
     } else {
         retVal->message = _createMessage("validation error");
     }
     return retVal;
 }
 
+void _collectionName(char *pName, size_t pSize, char const *pCollection, char const *pDeviceId) {
+    if (__partitioning == DB_PARTITION_COLLECTION && NULL != pDeviceId) {
+        snprintf(pName, pSize, "%s.%s", pCollection, pDeviceId);
+    } else {
+        snprintf(pName, pSize, "%s", pCollection);
+    }
+}
+
+mongoc_collection_t *_getCollection(mongoc_client_t *pClient, char const *pCollection, char const *pDeviceId) {
+    char name[COLLECTION_NAME_SIZE];
+    _collectionName(name, sizeof name, pCollection, pDeviceId);
+    return mongoc_client_get_collection(pClient, DB, name);
+}
+
+void _appendDeviceQuery(bson_t *pQuery, char const *pDeviceId) {
+    if (NULL != pDeviceId) {
+        BSON_APPEND_UTF8(pQuery, "device_id", pDeviceId);
+    } else {
+        BSON_APPEND_NULL(pQuery, "device_id");
+    }
+}
+
+char const *_deviceIdOf(bson_t const *pRecord) {
+    bson_iter_t iter;
+    if (bson_iter_init_find(&iter, pRecord, "device_id") && BSON_ITER_HOLDS_UTF8(&iter)) {
+        return bson_iter_utf8(&iter, NULL);
+    }
+    return NULL;
+}
+
+bool _validateDeviceId(bson_t const *pBson, bson_error_t *pError) {
+    bson_iter_t iter;
+    if (bson_iter_init_find(&iter, pBson, "device_id") &&
+        !(BSON_ITER_HOLDS_UTF8(&iter) && DB_isValidDeviceId(bson_iter_utf8(&iter, NULL)))) {
+        strncpy(pError->message, "device_id is not valid", sizeof(pError->message));
+        return false;
+    }
+    return true;
+}
+
+bool _ensurePartitionIndexes(mongoc_client_t *pClient, char const *pDeviceId) {
+    bson_error_t error;
+    bson_t keys;
+    bson_t shardKey;
+    bool sharded = __partitioning == DB_PARTITION_SHARDED;
+    bool result = true;
+    mongoc_collection_t *collection;
+
+    /*
+     * device_id leads each index so the queries of one device only read its own entries, and a shard key on the
+     * same prefix keeps each device's records together on one shard
+     */
+    collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
+    bson_init(&keys);
+    BSON_APPEND_INT32(&keys, "device_id", 1);
+    BSON_APPEND_INT32(&keys, "identifier", 1);
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    result = result && (!sharded || _shardCollection(pClient, COLLECTION_FENCES, &keys, &error));
+    bson_destroy(&keys);
+    bson_init(&keys);
+    BSON_APPEND_INT32(&keys, "device_id", 1);
+    BSON_APPEND_INT32(&keys, "entry_time", 1);
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    bson_destroy(&keys);
+#ifdef DB_GEOJSON_STORAGE
+    bson_init(&keys);
+    BSON_APPEND_UTF8(&keys, "center", "2dsphere");
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    bson_destroy(&keys);
+#endif
+    mongoc_collection_destroy(collection);
+
+    collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
+    bson_init(&keys);
+    BSON_APPEND_INT32(&keys, "device_id", 1);
+    BSON_APPEND_INT32(&keys, "time_window.start_time", 1);
+    BSON_APPEND_INT32(&keys, "time_window.end_time", 1);
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    bson_destroy(&keys);
+    bson_init(&keys);
+    BSON_APPEND_INT32(&keys, "time_window.end_time", 1);
+    BSON_APPEND_INT32(&keys, "compacted", 1);
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    bson_destroy(&keys);
+    bson_init(&shardKey);
+    BSON_APPEND_INT32(&shardKey, "device_id", 1);
+    BSON_APPEND_INT32(&shardKey, "time_window.start_time", 1);
+    result = result && (!sharded || _shardCollection(pClient, COLLECTION_GPS_LOGS, &shardKey, &error));
+    bson_destroy(&shardKey);
+    mongoc_collection_destroy(collection);
+
+#ifdef DB_GEOJSON_STORAGE
+    collection = _getCollection(pClient, COLLECTION_GPS_POINTS, pDeviceId);
+    bson_init(&keys);
+    BSON_APPEND_INT32(&keys, "log_id", 1);
+    BSON_APPEND_UTF8(&keys, "location", "2dsphere");
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    bson_destroy(&keys);
+    bson_init(&keys);
+    BSON_APPEND_INT32(&keys, "device_id", 1);
+    BSON_APPEND_INT32(&keys, "log_id", 1);
+    BSON_APPEND_INT32(&keys, "i", 1);
+    result = mongoc_collection_create_index(collection, &keys, NULL, &error) && result;
+    bson_destroy(&keys);
+    bson_init(&shardKey);
+    BSON_APPEND_INT32(&shardKey, "device_id", 1);
+    BSON_APPEND_INT32(&shardKey, "log_id", 1);
+    result = result && (!sharded || _shardCollection(pClient, COLLECTION_GPS_POINTS, &shardKey, &error));
+    bson_destroy(&shardKey);
+    mongoc_collection_destroy(collection);
+#endif
+
+    if (!result) {
+        LOG_log(LOG_LEVEL_ERROR, "error creating indexes", error.message);
+    }
+    return result;
+}
+
+bool _shardCollection(mongoc_client_t *pClient, char const *pCollection, bson_t const *pKey, bson_error_t *pError) {
+    char name[COLLECTION_NAME_SIZE];
+    snprintf(name, sizeof name, "%s.%s", DB, pCollection);
+    bson_t command;
+    bson_init(&command);
+    BSON_APPEND_UTF8(&command, "shardCollection", name);
+    BSON_APPEND_DOCUMENT(&command, "key", pKey);
+    bool result = mongoc_client_command_simple(pClient, "admin", &command, NULL, NULL, pError);
+    bson_destroy(&command);
+    return result;
+}
+
 bson_t *_validateGpsLogRecord(char const *pJson) {
     double minLatitude = 90.0;
     double maxLatitude = -90.0;
@@ -76,6 +490,12 @@ bson_t *_validateGpsLogRecord(char const *pJson) {
     double maxLongitude = -180.0;
     int64_t startTime = INT64_MAX;
     int64_t endTime = 0;
+    int32_t pointCount = 0;
+    int64_t runCell = -1;
+    int32_t runStart = 0;
+    uint32_t runCount = 0;
+    bson_t runs;
+    bson_init(&runs);
 
     bson_error_t error;
     bson_t *bson = NULL;
@@ -97,9 +517,12 @@ bson_t *_validateGpsLogRecord(char const *pJson) {
                 while (bson_iter_next(&logItr)) {
                     value = bson_iter_value(&logItr);
                     if (value->value_type == BSON_TYPE_DOCUMENT) {
+                        double latitude = NAN;
+                        double longitude = NAN;
                         if (bson_iter_recurse(&logItr, &logEntryItr) && bson_iter_find(&logEntryItr, "latitude")) {
                             value = bson_iter_value(&logEntryItr);
                             if (value->value_type == BSON_TYPE_DOUBLE) {
+                                latitude = value->value.v_double;
                                 minLatitude = MIN(minLatitude, value->value.v_double);
                                 maxLatitude = MAX(maxLatitude, value->value.v_double);
                             } else {
@@ -112,6 +535,7 @@ bson_t *_validateGpsLogRecord(char const *pJson) {
                         if (bson_iter_recurse(&logItr, &logEntryItr) && bson_iter_find(&logEntryItr, "longitude")) {
                             value = bson_iter_value(&logEntryItr);
                             if (value->value_type == BSON_TYPE_DOUBLE) {
+                                longitude = value->value.v_double;
                                 minLongitude = MIN(minLongitude, value->value.v_double);
                                 maxLongitude = MAX(maxLongitude, value->value.v_double);
                             } else {
@@ -134,6 +558,18 @@ bson_t *_validateGpsLogRecord(char const *pJson) {
                             }
                         }
 
+                        /*
+                         * Extend the run of points in the same tile or start a new one
+                         */
+                        int64_t cell = isnan(latitude) || isnan(longitude) ? -1 : DB_tileCell(latitude, longitude);
+                        if (pointCount == 0 || cell != runCell) {
+                            if (pointCount > 0) {
+                                __appendTileRun(&runs, &runCount, runCell, runStart, pointCount);
+                            }
+                            runCell = cell;
+                            runStart = pointCount;
+                        }
+                        ++pointCount;
                     } else {
                         strncpy(error.message, "log entry not json", sizeof(error.message));
                         result = false;
@@ -146,6 +582,7 @@ bson_t *_validateGpsLogRecord(char const *pJson) {
             result = false;
         }
 
+        result = result && _validateDeviceId(bson, &error);
         if (result) {
             bson_t box;
             bson_init(&box);
@@ -162,18 +599,74 @@ bson_t *_validateGpsLogRecord(char const *pJson) {
             bson_append_int64(&timeWindow, "end_time", -1, endTime);
             bson_append_document(bson, "time_window", -1, &timeWindow); // contents copied into heap allocated bson
             bson_destroy(&timeWindow);
+
+            /*
+             * { point_count: <n>, tiles: { degrees: DB_TILE_DEGREES, runs: [ [cell, start, end], ... ] } }
+             */
+            if (pointCount > 0) {
+                __appendTileRun(&runs, &runCount, runCell, runStart, pointCount);
+            }
+            BSON_APPEND_INT32(bson, "point_count", pointCount);
+            bson_t tiles;
+            BSON_APPEND_DOCUMENT_BEGIN(bson, "tiles", &tiles);
+            BSON_APPEND_DOUBLE(&tiles, "degrees", DB_TILE_DEGREES);
+            BSON_APPEND_ARRAY(&tiles, "runs", &runs);
+            bson_append_document_end(bson, &tiles);
         }
     }
+    bson_destroy(&runs);
 
     if (result) {
         return bson;
     } else {
-        printf("error validating gps log record %s\n", error.message);
+        LOG_log(LOG_LEVEL_WARN, "error validating gps log record", error.message);
         bson_free(bson);
         return NULL;
     }
 }
 
+enum DB_Partitioning DB_partitioningFor(char const *pName, enum DB_Partitioning pDefault) {
+    if (NULL == pName) {
+        return pDefault;
+    }
+    for (int partitioning = DB_PARTITION_SHARED; partitioning <= DB_PARTITION_COLLECTION; ++partitioning) {
+        if (0 == strcmp(pName, __partitioningNames[partitioning])) {
+            return (enum DB_Partitioning) partitioning;
+        }
+    }
+    return pDefault;
+}
+
+void DB_configurePartitioning(enum DB_Partitioning pPartitioning) {
+    __partitioning = pPartitioning;
+}
+
+bool DB_isValidDeviceId(char const *pDeviceId) {
+    size_t len = strlen(pDeviceId);
+    if (len == 0 || len > DB_DEVICE_ID_MAX) {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char) pDeviceId[i];
+        if (!isalnum(c) && c != '_' && c != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t DB_tileRow(double pLatitude) {
+    return (int64_t) floor((pLatitude + 90.0) / DB_TILE_DEGREES);
+}
+
+int64_t DB_tileColumn(double pLongitude) {
+    return (int64_t) floor((pLongitude + 180.0) / DB_TILE_DEGREES);
+}
+
+int64_t DB_tileCell(double pLatitude, double pLongitude) {
+    return DB_tileRow(pLatitude) * DB_TILE_COLUMNS + DB_tileColumn(pLongitude);
+}
+
 bool DB_bsonTypeIsNumber(bson_type_t const *pType) {
     bson_type_t type = *pType;
     return (type == BSON_TYPE_INT64 || type == BSON_TYPE_INT32 || type == BSON_TYPE_DOUBLE);
@@ -186,6 +679,8 @@ int32_t DB_bsonValueInt32(bson_value_t const *pValue) {
     switch (pValue->value_type) {
         case BSON_TYPE_INT32:
             return pValue->value.v_int32;
+        case BSON_TYPE_INT64:
+            return (int32_t) pValue->value.v_int64;
         case BSON_TYPE_DOUBLE:
             return (int32_t) pValue->value.v_double;
         case BSON_TYPE_DATE_TIME:
@@ -195,6 +690,80 @@ int32_t DB_bsonValueInt32(bson_value_t const *pValue) {
     }
 }
 
+double DB_bsonValueDouble(bson_value_t const *pValue) {
+    if (NULL == pValue) {
+        return 0;
+    }
+    switch (pValue->value_type) {
+        case BSON_TYPE_DOUBLE:
+            return pValue->value.v_double;
+        case BSON_TYPE_INT32:
+            return pValue->value.v_int32;
+        case BSON_TYPE_INT64:
+            return (double) pValue->value.v_int64;
+        default:
+            return 0;
+    }
+}
+
+bool _validatePolygon(bson_t *pBson, bson_iter_t const *pIter, bson_error_t *pError) {
+    double minLatitude = 90.0;
+    double maxLatitude = -90.0;
+    double minLongitude = 180.0;
+    double maxLongitude = -180.0;
+    uint32_t vertexCount = 0;
+
+    if (!BSON_ITER_HOLDS_ARRAY(pIter)) {
+        strncpy(pError->message, "polygon is not an array", sizeof(pError->message));
+        return false;
+    }
+
+    bson_iter_t vertexItr;
+    bson_iter_t coordinateItr;
+    bson_value_t const *value;
+    bson_iter_recurse(pIter, &vertexItr);
+    while (bson_iter_next(&vertexItr)) {
+        if (!BSON_ITER_HOLDS_DOCUMENT(&vertexItr)) {
+            strncpy(pError->message, "polygon vertex not json", sizeof(pError->message));
+            return false;
+        }
+
+        if (bson_iter_recurse(&vertexItr, &coordinateItr) && bson_iter_find(&coordinateItr, "latitude") &&
+            DB_bsonTypeIsNumber(&(value = bson_iter_value(&coordinateItr))->value_type)) {
+            minLatitude = MIN(minLatitude, DB_bsonValueDouble(value));
+            maxLatitude = MAX(maxLatitude, DB_bsonValueDouble(value));
+        } else {
+            strncpy(pError->message, "polygon vertex missing latitude", sizeof(pError->message));
+            return false;
+        }
+
+        if (bson_iter_recurse(&vertexItr, &coordinateItr) && bson_iter_find(&coordinateItr, "longitude") &&
+            DB_bsonTypeIsNumber(&(value = bson_iter_value(&coordinateItr))->value_type)) {
+            minLongitude = MIN(minLongitude, DB_bsonValueDouble(value));
+            maxLongitude = MAX(maxLongitude, DB_bsonValueDouble(value));
+        } else {
+            strncpy(pError->message, "polygon vertex missing longitude", sizeof(pError->message));
+            return false;
+        }
+        ++vertexCount;
+    }
+
+    if (vertexCount < 3) {
+        strncpy(pError->message, "polygon needs at least 3 vertices", sizeof(pError->message));
+        return false;
+    }
+
+    bson_t box;
+    bson_init(&box);
+    bson_append_double(&box, "min_latitude", -1, minLatitude);
+    bson_append_double(&box, "max_latitude", -1, maxLatitude);
+    bson_append_double(&box, "min_longitude", -1, minLongitude);
+    bson_append_double(&box, "max_longitude", -1, maxLongitude);
+    bson_append_document(pBson, "bounding_box", -1, &box); // contents copied into heap allocated bson
+    bson_destroy(&box);
+    return true;
+}
+
 bson_t *_validateFenceRecord(char const *pJson) {
     bson_error_t error;
     bson_t *bson = bson_new_from_json((uint8_t const *) pJson, strlen(pJson), &error);
@@ -211,26 +780,32 @@ bson_t *_validateFenceRecord(char const *pJson) {
     } else {
         result = false;
     }
-    if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "radius")) {
+
+    /*
+     * Polygon fences carry a polygon array in place of the circle's radius, latitude and longitude
+     */
+    if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "polygon")) {
+        result = result && _validatePolygon(bson, &iter, &error);
+    } else if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "radius")) {
         value = bson_iter_value(&iter);
         if (!DB_bsonTypeIsNumber(&value->value_type)) {
             return false;
         }
-    } else {
-        result = false;
-    }
-    if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "latitude")) {
-        value = bson_iter_value(&iter);
-        if (!DB_bsonTypeIsNumber(&value->value_type)) {
-            return false;
+        if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "latitude")) {
+            value = bson_iter_value(&iter);
+            if (!DB_bsonTypeIsNumber(&value->value_type)) {
+                return false;
+            }
+        } else {
+            result = false;
         }
-    } else {
-        result = false;
-    }
-    if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "longitude")) {
-        value = bson_iter_value(&iter);
-        if (!DB_bsonTypeIsNumber(&value->value_type)) {
-            return false;
+        if (bson_iter_init(&iter, bson) && bson_iter_find(&iter, "longitude")) {
+            value = bson_iter_value(&iter);
+            if (!DB_bsonTypeIsNumber(&value->value_type)) {
+                return false;
+            }
+        } else {
+            result = false;
         }
     } else {
         result = false;
@@ -243,57 +818,1018 @@ bson_t *_validateFenceRecord(char const *pJson) {
     } else {
         result = false;
     }
+    result = result && _validateDeviceId(bson, &error);
+
+#ifdef DB_GEOJSON_STORAGE
+    if (result && !bson_has_field(bson, "polygon")) {
+        double latitude = 0;
+        double longitude = 0;
+        if (bson_iter_init_find(&iter, bson, "latitude")) {
+            latitude = DB_bsonValueDouble(bson_iter_value(&iter));
+        }
+        if (bson_iter_init_find(&iter, bson, "longitude")) {
+            longitude = DB_bsonValueDouble(bson_iter_value(&iter));
+        }
+        _appendGeoJsonPoint(bson, "center", latitude, longitude);
+    }
+#endif
 
     if (result) {
         return bson;
     } else {
-        printf("error validating fence record %s\n", error.message);
+        LOG_log(LOG_LEVEL_WARN, "error validating fence record", error.message);
         bson_free(bson);
         return NULL;
     }
 }
 
-//endregion
-
-//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void _appendTimeWindowQuery(bson_t *pQuery, int64_t pEpochTime) {
+    bson_t queryChildEndTime;
+    bson_t queryChildStartTime;
 
-struct DB_Record *DB_insertGpsLogRecord(char const *pJson, mongoc_client_t *pClient) {
-    return _insertRecord(pJson, pClient, COLLECTION_GPS_LOGS, &_validateGpsLogRecord);
-}
+    BSON_APPEND_DOCUMENT_BEGIN(pQuery, "time_window.end_time", &queryChildEndTime);
+    BSON_APPEND_INT64(&queryChildEndTime, "$gte", pEpochTime);
+    bson_append_document_end(pQuery, &queryChildEndTime);
 
-struct DB_Record *DB_insertFenceRecord(char const *pJson, mongoc_client_t *pClient) {
-    return _insertRecord(pJson, pClient, COLLECTION_FENCES, &_validateFenceRecord);
+    BSON_APPEND_DOCUMENT_BEGIN(pQuery, "time_window.start_time", &queryChildStartTime);
+    BSON_APPEND_INT64(&queryChildStartTime, "$lte", pEpochTime);
+    bson_append_document_end(pQuery, &queryChildStartTime);
 }
 
-struct DB_Record *DB_getFenceRecord(char const *pIdentifier, mongoc_client_t *pClient) {
-    struct DB_Record *retVal = _allocateRecord();
-
-    mongoc_collection_t *collection;
+bool _findGpsLogRecord(int64_t pEpochTime, char const *pDeviceId, bson_t const *pFields, _foundFunction fFound,
+                       void *pContext, mongoc_client_t *pClient) {
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
     mongoc_cursor_t *cursor;
     bson_t const *doc;
-    bson_t *query;
 
-    collection = mongoc_client_get_collection(pClient, DB, COLLECTION_FENCES);
-    query = bson_new();
-    BSON_APPEND_UTF8(query, "identifier", pIdentifier);
-    cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 1, 0, query, NULL, NULL);
+    /*
+     * Build the query
+     */
+    bson_t query;
+    bson_init(&query);
+    _appendDeviceQuery(&query, pDeviceId);
+    _appendTimeWindowQuery(&query, pEpochTime);
 
-    if (mongoc_cursor_next(cursor, &doc)) {
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "_findGpsLogRecord", collection, 1, &query, pFields);
+
+    bool retVal = SOP_next(&op, cursor, &doc);
+    if (retVal) {
+        fFound(doc, pContext);
+    }
+
+    SOP_end(&op);
+    bson_destroy(&query);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    return retVal;
+}
+
+void _appendPointRangeExpression(bson_t *pBson, char const *pKey, struct DB_PointRange const *pRange) {
+    bson_t slice;
+    bson_t sliceOperands;
+    bson_t filterDoc;
+    bson_t filter;
+    bson_t cond;
+    bson_t and;
+    bson_t comparison;
+    bson_t operands;
+
+    bson_t *target = pBson;
+    char const *key = pKey;
+    if (pRange->maxPoints > 0) {
+        BSON_APPEND_DOCUMENT_BEGIN(pBson, pKey, &slice);
+        BSON_APPEND_ARRAY_BEGIN(&slice, "$slice", &sliceOperands);
+        target = &sliceOperands;
+        key = "0";
+    }
+
+    BSON_APPEND_DOCUMENT_BEGIN(target, key, &filterDoc);
+    BSON_APPEND_DOCUMENT_BEGIN(&filterDoc, "$filter", &filter);
+    BSON_APPEND_UTF8(&filter, "input", "$log");
+    BSON_APPEND_UTF8(&filter, "as", "p");
+    BSON_APPEND_DOCUMENT_BEGIN(&filter, "cond", &cond);
+    BSON_APPEND_ARRAY_BEGIN(&cond, "$and", &and);
+    BSON_APPEND_DOCUMENT_BEGIN(&and, "0", &comparison);
+    BSON_APPEND_ARRAY_BEGIN(&comparison, "$gte", &operands);
+    BSON_APPEND_UTF8(&operands, "0", "$$p.time");
+    BSON_APPEND_INT64(&operands, "1", pRange->from);
+    bson_append_array_end(&comparison, &operands);
+    bson_append_document_end(&and, &comparison);
+    BSON_APPEND_DOCUMENT_BEGIN(&and, "1", &comparison);
+    BSON_APPEND_ARRAY_BEGIN(&comparison, "$lte", &operands);
+    BSON_APPEND_UTF8(&operands, "0", "$$p.time");
+    BSON_APPEND_INT64(&operands, "1", pRange->to);
+    bson_append_array_end(&comparison, &operands);
+    bson_append_document_end(&and, &comparison);
+    bson_append_array_end(&cond, &and);
+    bson_append_document_end(&filter, &cond);
+    bson_append_document_end(&filterDoc, &filter);
+    bson_append_document_end(target, &filterDoc);
+
+    if (pRange->maxPoints > 0) {
+        BSON_APPEND_INT64(&sliceOperands, "1", pRange->maxPoints);
+        bson_append_array_end(&slice, &sliceOperands);
+        bson_append_document_end(pBson, &slice);
+    }
+}
+
+bool _aggregateGpsLogRecord(int64_t pEpochTime, char const *pDeviceId, struct DB_PointRange const *pRange,
+                            _foundFunction fFound, void *pContext, mongoc_client_t *pClient) {
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+
+    /*
+     * Build the pipeline, the other points never leave the server
+     * [ { $match: <device and time window> }, { $limit: 1 }, { $addFields: { log: <points in range> } },
+     *   { $project: { tiles: 0 } } ]
+     */
+    bson_t pipeline;
+    bson_t stages;
+    bson_t stage;
+    bson_t operator;
+
+    bson_init(&pipeline);
+    BSON_APPEND_ARRAY_BEGIN(&pipeline, "pipeline", &stages);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &operator);
+    _appendDeviceQuery(&operator, pDeviceId);
+    _appendTimeWindowQuery(&operator, pEpochTime);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage);
+    BSON_APPEND_INT32(&stage, "$limit", 1);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "2", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$addFields", &operator);
+    _appendPointRangeExpression(&operator, "log", pRange);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "3", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &operator);
+    BSON_APPEND_INT32(&operator, "tiles", 0);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    bson_append_array_end(&pipeline, &stages);
+
+    struct SOP_Op op;
+    cursor = SOP_aggregate(&op, "_aggregateGpsLogRecord", collection, &pipeline);
+
+    bool retVal = SOP_next(&op, cursor, &doc);
+    if (retVal) {
+        fFound(doc, pContext);
+    }
+
+    SOP_end(&op);
+    bson_destroy(&pipeline);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    return retVal;
+}
+
+struct DB_GpsLog *_allocateGpsLog() {
+    struct DB_GpsLog *retVal = malloc(sizeof(struct DB_GpsLog));
+    retVal->record = NULL;
+    retVal->points = NULL;
+    retVal->hasId = false;
+    retVal->deviceId = NULL;
+    retVal->startTime = 0;
+    retVal->endTime = 0;
+    retVal->latitudes = NULL;
+    retVal->longitudes = NULL;
+    retVal->times = NULL;
+    retVal->count = 0;
+    retVal->hasBoundingBox = false;
+    retVal->minLatitude = 0;
+    retVal->maxLatitude = 0;
+    retVal->minLongitude = 0;
+    retVal->maxLongitude = 0;
+    retVal->tiles = NULL;
+    retVal->tileCount = 0;
+    return retVal;
+}
+
+void _reserveGpsLogPoints(struct DB_GpsLog *pLog, size_t pCapacity) {
+    pCapacity = MAX(pCapacity, 1);
+    pLog->latitudes = realloc(pLog->latitudes, pCapacity * sizeof(double));
+    pLog->longitudes = realloc(pLog->longitudes, pCapacity * sizeof(double));
+    pLog->times = realloc(pLog->times, pCapacity * sizeof(int32_t));
+}
+
+bool _decodeGpsPoint(bson_iter_t const *pPointIter, double *pLatitude, double *pLongitude, int32_t *pTime) {
+    bson_iter_t fieldItr;
+    bson_value_t const *value;
+    bool hasLatitude = false;
+    bool hasLongitude = false;
+    bool hasTime = false;
+
+    if (!BSON_ITER_HOLDS_DOCUMENT(pPointIter) || !bson_iter_recurse(pPointIter, &fieldItr)) {
+        return false;
+    }
+    while (bson_iter_next(&fieldItr)) {
+        char const *key = bson_iter_key(&fieldItr);
+        value = bson_iter_value(&fieldItr);
+        if (!DB_bsonTypeIsNumber(&value->value_type)) {
+            continue;
+        }
+        if (0 == strcmp(key, "latitude")) {
+            *pLatitude = DB_bsonValueDouble(value);
+            hasLatitude = true;
+        } else if (0 == strcmp(key, "longitude")) {
+            *pLongitude = DB_bsonValueDouble(value);
+            hasLongitude = true;
+        } else if (0 == strcmp(key, "time")) {
+            *pTime = DB_bsonValueInt32(value);
+            hasTime = true;
+        }
+    }
+    return hasLatitude && hasLongitude && hasTime;
+}
+
+bool _decodePolygon(bson_iter_t const *pPolygonIter, struct DB_Fence *pFence) {
+    bson_iter_t vertexItr;
+    bson_iter_t coordinateItr;
+    uint32_t len;
+    uint8_t const *data;
+    bson_t array;
+
+    bson_iter_array(pPolygonIter, &len, &data);
+    if (!bson_init_static(&array, data, len)) {
+        return false;
+    }
+    size_t capacity = MAX(bson_count_keys(&array), 1);
+    pFence->polygonLatitudes = malloc(capacity * sizeof(double));
+    pFence->polygonLongitudes = malloc(capacity * sizeof(double));
+    pFence->polygonCount = 0;
+
+    bson_iter_recurse(pPolygonIter, &vertexItr);
+    while (pFence->polygonCount < capacity && bson_iter_next(&vertexItr)) {
+        bool hasLatitude = false;
+        bool hasLongitude = false;
+        if (!BSON_ITER_HOLDS_DOCUMENT(&vertexItr) || !bson_iter_recurse(&vertexItr, &coordinateItr)) {
+            return false;
+        }
+        while (bson_iter_next(&coordinateItr)) {
+            bson_value_t const *value = bson_iter_value(&coordinateItr);
+            if (!DB_bsonTypeIsNumber(&value->value_type)) {
+                continue;
+            }
+            if (0 == strcmp(bson_iter_key(&coordinateItr), "latitude")) {
+                pFence->polygonLatitudes[pFence->polygonCount] = DB_bsonValueDouble(value);
+                hasLatitude = true;
+            } else if (0 == strcmp(bson_iter_key(&coordinateItr), "longitude")) {
+                pFence->polygonLongitudes[pFence->polygonCount] = DB_bsonValueDouble(value);
+                hasLongitude = true;
+            }
+        }
+        if (!hasLatitude || !hasLongitude) {
+            return false;
+        }
+        ++pFence->polygonCount;
+    }
+    return pFence->polygonCount >= 3;
+}
+
+void _appendGeoJsonPoint(bson_t *pBson, char const *pKey, double pLatitude, double pLongitude) {
+    bson_t point;
+    bson_t coordinates;
+    BSON_APPEND_DOCUMENT_BEGIN(pBson, pKey, &point);
+    BSON_APPEND_UTF8(&point, "type", "Point");
+    BSON_APPEND_ARRAY_BEGIN(&point, "coordinates", &coordinates);
+    BSON_APPEND_DOUBLE(&coordinates, "0", pLongitude);
+    BSON_APPEND_DOUBLE(&coordinates, "1", pLatitude);
+    bson_append_array_end(&point, &coordinates);
+    bson_append_document_end(pBson, &point);
+}
+
+bool _insertGpsPoints(bson_t const *pLog, bson_value_t const *pLogId, char const *pDeviceId, int32_t pFirstIndex,
+                      mongoc_client_t *pClient, bson_error_t *pError) {
+    bson_iter_t iter;
+    bson_iter_t logItr;
+    bson_iter_t itemItr;
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_POINTS, pDeviceId);
+    mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation(collection, false, NULL);
+    bool result = true;
+
+    /*
+     * { log_id: <id>, device_id: <device>, i: <index in log>, time: <time>,
+     *   location: { type: "Point", coordinates: [lng, lat] } }
+     */
+    if (bson_iter_init_find(&logItr, pLog, "log") && bson_iter_recurse(&logItr, &iter)) {
+        int32_t i = pFirstIndex;
+        while (bson_iter_next(&iter)) {
+            double lat = 0;
+            double lng = 0;
+            int64_t time = 0;
+            if (bson_iter_recurse(&iter, &itemItr) && bson_iter_find(&itemItr, "latitude")) {
+                lat = DB_bsonValueDouble(bson_iter_value(&itemItr));
+            }
+            if (bson_iter_recurse(&iter, &itemItr) && bson_iter_find(&itemItr, "longitude")) {
+                lng = DB_bsonValueDouble(bson_iter_value(&itemItr));
+            }
+            if (bson_iter_recurse(&iter, &itemItr) && bson_iter_find(&itemItr, "time")) {
+                time = DB_bsonValueInt32(bson_iter_value(&itemItr));
+            }
+
+            bson_t point;
+            bson_init(&point);
+            BSON_APPEND_VALUE(&point, "log_id", pLogId);
+            if (NULL != pDeviceId) {
+                BSON_APPEND_UTF8(&point, "device_id", pDeviceId);
+            }
+            BSON_APPEND_INT32(&point, "i", i++);
+            BSON_APPEND_INT64(&point, "time", time);
+            _appendGeoJsonPoint(&point, "location", lat, lng);
+            mongoc_bulk_operation_insert(bulk, &point);
+            bson_destroy(&point);
+        }
+        uint32_t count = (uint32_t) (i - pFirstIndex);
+        result = count == 0 || SOP_executeBulk("_insertGpsPoints", collection, bulk, count, pError);
+    }
+
+    mongoc_bulk_operation_destroy(bulk);
+    mongoc_collection_destroy(collection);
+    return result;
+}
+
+bool _backfillPointCount(bson_oid_t const *pLogId, char const *pDeviceId, mongoc_client_t *pClient,
+                         bson_error_t *pError) {
+    /*
+     * [ { $match: { _id: <id>, device_id: <device> } }, { $project: { n: { $size: "$log" } } } ]
+     */
+    bson_t pipeline;
+    bson_t stages;
+    bson_t stage;
+    bson_t operator;
+    bson_t size;
+    bson_init(&pipeline);
+    BSON_APPEND_ARRAY_BEGIN(&pipeline, "pipeline", &stages);
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &operator);
+    BSON_APPEND_OID(&operator, "_id", pLogId);
+    _appendDeviceQuery(&operator, pDeviceId);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &operator);
+    BSON_APPEND_DOCUMENT_BEGIN(&operator, "n", &size);
+    BSON_APPEND_UTF8(&size, "$size", "$log");
+    bson_append_document_end(&operator, &size);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+    bson_append_array_end(&pipeline, &stages);
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
+    struct SOP_Op op;
+    bson_t const *doc;
+    bson_iter_t iter;
+    int32_t count = -1;
+    mongoc_cursor_t *cursor = SOP_aggregate(&op, "_backfillPointCount", collection, &pipeline);
+    if (SOP_next(&op, cursor, &doc) && bson_iter_init_find(&iter, doc, "n")) {
+        count = DB_bsonValueInt32(bson_iter_value(&iter));
+    }
+    bool result = !mongoc_cursor_error(cursor, pError);
+    SOP_end(&op);
+    mongoc_cursor_destroy(cursor);
+    bson_destroy(&pipeline);
+
+    /*
+     * Only a log still without a count is touched so a concurrent backfill and append are not undone
+     */
+    if (result && count >= 0) {
+        bson_t selector;
+        bson_t update;
+        bson_t set;
+        bson_t exists;
+        bson_init(&selector);
+        BSON_APPEND_OID(&selector, "_id", pLogId);
+        _appendDeviceQuery(&selector, pDeviceId);
+        BSON_APPEND_DOCUMENT_BEGIN(&selector, "point_count", &exists);
+        BSON_APPEND_BOOL(&exists, "$exists", false);
+        bson_append_document_end(&selector, &exists);
+        bson_init(&update);
+        BSON_APPEND_DOCUMENT_BEGIN(&update, "$set", &set);
+        BSON_APPEND_INT32(&set, "point_count", count);
+        bson_append_document_end(&update, &set);
+        result = SOP_update("_backfillPointCount", collection, &selector, &update, pError);
+        bson_destroy(&update);
+        bson_destroy(&selector);
+    }
+    mongoc_collection_destroy(collection);
+    return result;
+}
+
+void _appendDescendant(bson_t *pBson, bson_t const *pFrom, char const *pPath) {
+    bson_iter_t iter;
+    bson_iter_t descendant;
+    if (bson_iter_init(&iter, pFrom) && bson_iter_find_descendant(&iter, pPath, &descendant)) {
+        BSON_APPEND_VALUE(pBson, pPath, bson_iter_value(&descendant));
+    }
+}
+
+bool _pushGpsPoints(bson_oid_t const *pLogId, char const *pDeviceId, bson_t const *pPoints, uint32_t pPointCount,
+                    mongoc_client_t *pClient, bson_t *pReply, bson_error_t *pError) {
+    bson_iter_t iter;
+    bson_t selector;
+    bson_t update;
+    bson_t fields;
+    bson_t operator;
+    bson_t each;
+
+    bson_init(&selector);
+    BSON_APPEND_OID(&selector, "_id", pLogId);
+    _appendDeviceQuery(&selector, pDeviceId);
+    BSON_APPEND_DOCUMENT_BEGIN(&selector, "point_count", &operator);
+    BSON_APPEND_BOOL(&operator, "$exists", true);
+    bson_append_document_end(&selector, &operator);
+
+    /*
+     * { $push: { log: { $each: [...] } }, $min: { <lower bounds> }, $max: { <upper bounds> } }, the stored points are
+     * neither read nor validated again
+     */
+    bson_init(&update);
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$push", &operator);
+    BSON_APPEND_DOCUMENT_BEGIN(&operator, "log", &each);
+    if (bson_iter_init_find(&iter, pPoints, "log")) {
+        BSON_APPEND_VALUE(&each, "$each", bson_iter_value(&iter));
+    }
+    bson_append_document_end(&operator, &each);
+    bson_append_document_end(&update, &operator);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$min", &operator);
+    _appendDescendant(&operator, pPoints, "bounding_box.min_latitude");
+    _appendDescendant(&operator, pPoints, "bounding_box.min_longitude");
+    _appendDescendant(&operator, pPoints, "time_window.start_time");
+    bson_append_document_end(&update, &operator);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$max", &operator);
+    _appendDescendant(&operator, pPoints, "bounding_box.max_latitude");
+    _appendDescendant(&operator, pPoints, "bounding_box.max_longitude");
+    _appendDescendant(&operator, pPoints, "time_window.end_time");
+    bson_append_document_end(&update, &operator);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$inc", &operator);
+    BSON_APPEND_INT32(&operator, "point_count", (int32_t) pPointCount);
+    bson_append_document_end(&update, &operator);
+
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "log", 0);
+    BSON_APPEND_INT32(&fields, "tiles", 0);
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
+    bool result = SOP_findAndModify("_pushGpsPoints", collection, &selector, &update, &fields, true, pReply, pError);
+    mongoc_collection_destroy(collection);
+    bson_destroy(&fields);
+    bson_destroy(&update);
+    bson_destroy(&selector);
+    return result;
+}
+
+bool _pushTileRuns(bson_oid_t const *pLogId, char const *pDeviceId, bson_t const *pPoints, int32_t pFirstIndex,
+                   mongoc_client_t *pClient, bson_error_t *pError) {
+    bson_iter_t iter;
+    bson_iter_t runsItr;
+    bson_iter_t runItr;
+    bson_t selector;
+    bson_t update;
+    bson_t push;
+    bson_t each;
+    bson_t runs;
+    uint32_t runCount = 0;
+
+    /*
+     * { $push: { "tiles.runs": { $each: [ [cell, start + first, end + first], ... ] } } }, a log stored before tiles
+     * were kept has none to extend
+     */
+    bson_init(&selector);
+    BSON_APPEND_OID(&selector, "_id", pLogId);
+    _appendDeviceQuery(&selector, pDeviceId);
+    BSON_APPEND_DOUBLE(&selector, "tiles.degrees", DB_TILE_DEGREES);
+    bson_init(&update);
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$push", &push);
+    BSON_APPEND_DOCUMENT_BEGIN(&push, "tiles.runs", &each);
+    BSON_APPEND_ARRAY_BEGIN(&each, "$each", &runs);
+    if (bson_iter_init(&iter, pPoints) && bson_iter_find_descendant(&iter, "tiles.runs", &runsItr) &&
+        bson_iter_recurse(&runsItr, &iter)) {
+        while (bson_iter_next(&iter)) {
+            int64_t values[3] = {0, 0, 0};
+            if (bson_iter_recurse(&iter, &runItr)) {
+                for (int i = 0; i < 3 && bson_iter_next(&runItr); ++i) {
+                    values[i] = bson_iter_as_int64(&runItr);
+                }
+            }
+            __appendTileRun(&runs, &runCount, values[0], (int32_t) values[1] + pFirstIndex,
+                            (int32_t) values[2] + pFirstIndex);
+        }
+    }
+    bson_append_array_end(&each, &runs);
+    bson_append_document_end(&push, &each);
+    bson_append_document_end(&update, &push);
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
+    bool result = SOP_update("_pushTileRuns", collection, &selector, &update, pError);
+    mongoc_collection_destroy(collection);
+    bson_destroy(&update);
+    bson_destroy(&selector);
+    return result;
+}
+
+void _decodeTiles(bson_iter_t const *pTilesIter, struct DB_GpsLog *pLog) {
+    bson_iter_t iter;
+    bson_iter_t runsItr;
+    bson_iter_t runItr;
+    bool valid = bson_iter_recurse(pTilesIter, &iter) && bson_iter_find(&iter, "degrees") &&
+                 DB_bsonValueDouble(bson_iter_value(&iter)) == DB_TILE_DEGREES &&
+                 bson_iter_recurse(pTilesIter, &iter) && bson_iter_find(&iter, "runs") &&
+                 BSON_ITER_HOLDS_ARRAY(&iter) && bson_iter_recurse(&iter, &runsItr);
+
+    size_t capacity = 0;
+    while (valid && bson_iter_next(&runsItr)) {
+        int64_t values[3];
+        int fieldCount = 0;
+        if (BSON_ITER_HOLDS_ARRAY(&runsItr) && bson_iter_recurse(&runsItr, &runItr)) {
+            while (fieldCount < 3 && bson_iter_next(&runItr)) {
+                values[fieldCount++] = bson_iter_as_int64(&runItr);
+            }
+        }
+        valid = fieldCount == 3;
+        if (valid) {
+            if (pLog->tileCount == capacity) {
+                capacity = MAX(capacity * 2, 16);
+                pLog->tiles = realloc(pLog->tiles, capacity * sizeof(struct DB_TileRun));
+            }
+            struct DB_TileRun *run = &pLog->tiles[pLog->tileCount++];
+            run->cell = values[0];
+            run->start = (int32_t) values[1];
+            run->end = (int32_t) values[2];
+        }
+    }
+
+    /*
+     * Runs pushed by concurrent appends may arrive out of order, sorted they must tile [0, count) without gaps
+     */
+    if (valid) {
+        qsort(pLog->tiles, pLog->tileCount, sizeof(struct DB_TileRun), &__compareTileRunStart);
+        size_t next = 0;
+        for (size_t i = 0; valid && i < pLog->tileCount; ++i) {
+            valid = pLog->tiles[i].start == (int32_t) next && pLog->tiles[i].end > pLog->tiles[i].start;
+            next = (size_t) pLog->tiles[i].end;
+        }
+        valid = valid && next == pLog->count;
+    }
+    if (!valid) {
+        free(pLog->tiles);
+        pLog->tiles = NULL;
+        pLog->tileCount = 0;
+    }
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct DB_Record *DB_insertGpsLogRecord(char const *pJson, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_insertGpsLogRecord");
+    struct DB_Record *retVal = _insertRecord(pJson, pClient, COLLECTION_GPS_LOGS, &_validateGpsLogRecord);
+#ifdef DB_GEOJSON_STORAGE
+    bson_error_t bsonError;
+    bson_iter_t iter;
+    int64_t startTime = MET_now();
+    if (retVal->record && bson_iter_init_find(&iter, retVal->record, "_id") &&
+        !_insertGpsPoints(retVal->record, bson_iter_value(&iter), _deviceIdOf(retVal->record), 0, pClient,
+                          &bsonError)) {
+        free(retVal->message);
+        retVal->message = _createMessage(bsonError.message);
+    }
+    MET_recordStage(MET_currentRoute(), MET_STAGE_MONGO, MET_now() - startTime);
+#endif
+    TRC_end(&span);
+    return retVal;
+}
+
+struct DB_Record *DB_appendGpsLogPoints(char const *pIdentifier, char const *pDeviceId, char const *pJson,
+                                        mongoc_client_t *pClient, bool *pFound, struct DB_GpsLog **pPoints) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_appendGpsLogPoints");
+    struct DB_Record *retVal = _allocateRecord();
+    *pFound = true;
+    if (NULL != pPoints) {
+        *pPoints = NULL;
+    }
+
+    /*
+     * Only the new points are validated, their own bounding_box and time_window widen the stored ones
+     */
+    int64_t startTime = MET_now();
+    bson_t *points = _validateGpsLogRecord(pJson);
+    uint32_t count = 0;
+    bson_iter_t iter;
+    if (points && bson_iter_init_find(&iter, points, "point_count")) {
+        count = (uint32_t) DB_bsonValueInt32(bson_iter_value(&iter));
+    }
+    MET_recordStage(MET_currentRoute(), MET_STAGE_VALIDATE, MET_now() - startTime);
+    if (count == 0) {
+        retVal->message = _createMessage("validation error");
+        if (points) {
+            bson_destroy(points);
+        }
+        TRC_end(&span);
+        return retVal;
+    }
+
+    bson_oid_t oid;
+    bson_oid_init_from_string(&oid, pIdentifier);
+    bson_t reply;
+    bson_error_t error;
+    startTime = MET_now();
+    bool result = _pushGpsPoints(&oid, pDeviceId, points, count, pClient, &reply, &error);
+    if (result && !(bson_iter_init_find(&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT(&iter))) {
+        /*
+         * Either there is no such log or it predates point_count
+         */
+        bson_destroy(&reply);
+        result = _backfillPointCount(&oid, pDeviceId, pClient, &error);
+        if (result) {
+            result = _pushGpsPoints(&oid, pDeviceId, points, count, pClient, &reply, &error);
+        } else {
+            bson_init(&reply);
+        }
+    }
+
+    if (result && bson_iter_init_find(&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+        uint32_t len;
+        uint8_t const *data;
+        bson_iter_document(&iter, &len, &data);
+        retVal->record = bson_new_from_data(data, len);
+        retVal->message = _createMessage("ok");
+    } else if (result) {
+        retVal->message = _createMessage("record not found");
+        *pFound = false;
+    } else {
+        LOG_log(LOG_LEVEL_ERROR, "error appending to gps log record", error.message);
+        retVal->message = _createMessage(error.message);
+    }
+
+    /*
+     * The points take the indexes following the ones the log already had, in its tile runs and gps_points
+     */
+    bson_iter_t countIter;
+    if (retVal->record && bson_iter_init_find(&countIter, retVal->record, "point_count")) {
+        int32_t firstIndex = DB_bsonValueInt32(bson_iter_value(&countIter)) - (int32_t) count;
+        bool indexed = _pushTileRuns(&oid, pDeviceId, points, firstIndex, pClient, &error);
+#ifdef DB_GEOJSON_STORAGE
+        bson_value_t logId;
+        logId.value_type = BSON_TYPE_OID;
+        bson_oid_copy(&oid, &logId.value.v_oid);
+        indexed = indexed && _insertGpsPoints(points, &logId, pDeviceId, firstIndex, pClient, &error);
+#endif
+        if (!indexed) {
+            LOG_log(LOG_LEVEL_ERROR, "error indexing appended gps log points", error.message);
+            free(retVal->message);
+            retVal->message = _createMessage(error.message);
+        }
+    }
+    MET_recordStage(MET_currentRoute(), MET_STAGE_MONGO, MET_now() - startTime);
+    if (NULL != pPoints && NULL != retVal->record) {
+        *pPoints = DB_decodeGpsLog(points);
+    }
+
+    bson_destroy(&reply);
+    bson_destroy(points);
+    TRC_end(&span);
+    return retVal;
+}
+
+struct DB_Record *DB_insertFenceRecord(char const *pJson, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_insertFenceRecord");
+    struct DB_Record *retVal = _insertRecord(pJson, pClient, COLLECTION_FENCES, &_validateFenceRecord);
+    TRC_end(&span);
+    return retVal;
+}
+
+struct DB_Record *DB_getFenceRecord(char const *pIdentifier, char const *pDeviceId, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getFenceRecord");
+    struct DB_Record *retVal = _allocateRecord();
+
+    mongoc_collection_t *collection;
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+    bson_t *query;
+
+    collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
+    query = bson_new();
+    _appendDeviceQuery(query, pDeviceId);
+    BSON_APPEND_UTF8(query, "identifier", pIdentifier);
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_getFenceRecord", collection, 1, query, NULL);
+
+    if (SOP_next(&op, cursor, &doc)) {
         retVal->record = bson_copy(doc);
         retVal->message = _createMessage("ok");
     }
 
+    SOP_end(&op);
     bson_destroy(query);
     mongoc_cursor_destroy(cursor);
     mongoc_collection_destroy(collection);
 
+    TRC_end(&span);
+    return retVal;
+}
+
+struct DB_Fence *DB_getFenceWithLog(char const *pIdentifier, char const *pDeviceId,
+                                    struct DB_PointRange const *pRange, mongoc_client_t *pClient,
+                                    struct DB_GpsLog **pLog) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getFenceWithLog");
+    struct DB_Fence *retVal = NULL;
+    *pLog = NULL;
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
+    char logCollection[COLLECTION_NAME_SIZE];
+    _collectionName(logCollection, sizeof logCollection, COLLECTION_GPS_LOGS, pDeviceId);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+
+    /*
+     * Build the pipeline
+     * [ { $match: { device_id: <device>, identifier: <id> } }, { $limit: 1 }, { $project: { center: 0 } },
+     *   { $lookup: { from: <device's gps_logs>, let: { t: "$entry_time" }, as: "corresponding_log", pipeline: [
+     *       { $match: { device_id: <device>, $expr: { $and: [ { $lte: ["$time_window.start_time", "$$t"] },
+     *                                                         { $gte: ["$time_window.end_time", "$$t"] } ] } } },
+     *       { $limit: 1 },
+     *       { $project: { device_id: 1, log: 1, time_window: 1, bounding_box: 1, tiles: 1 } } ] } } ]
+     *
+     * With a range the $project also selects the points in it as window, the entry is still found on the whole log
+     */
+    bson_t pipeline;
+    bson_t stages;
+    bson_t stage;
+    bson_t operator;
+    bson_t let;
+    bson_t lookupStages;
+    bson_t lookupStage;
+    bson_t lookupOperator;
+    bson_t expr;
+    bson_t and;
+    bson_t comparison;
+    bson_t operands;
+
+    bson_init(&pipeline);
+    BSON_APPEND_ARRAY_BEGIN(&pipeline, "pipeline", &stages);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &operator);
+    _appendDeviceQuery(&operator, pDeviceId);
+    BSON_APPEND_UTF8(&operator, "identifier", pIdentifier);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage);
+    BSON_APPEND_INT32(&stage, "$limit", 1);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "2", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &operator);
+    BSON_APPEND_INT32(&operator, "center", 0);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "3", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$lookup", &operator);
+    BSON_APPEND_UTF8(&operator, "from", logCollection);
+    BSON_APPEND_DOCUMENT_BEGIN(&operator, "let", &let);
+    BSON_APPEND_UTF8(&let, "t", "$entry_time");
+    bson_append_document_end(&operator, &let);
+    BSON_APPEND_UTF8(&operator, "as", "corresponding_log");
+    BSON_APPEND_ARRAY_BEGIN(&operator, "pipeline", &lookupStages);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&lookupStages, "0", &lookupStage);
+    BSON_APPEND_DOCUMENT_BEGIN(&lookupStage, "$match", &lookupOperator);
+    _appendDeviceQuery(&lookupOperator, pDeviceId);
+    BSON_APPEND_DOCUMENT_BEGIN(&lookupOperator, "$expr", &expr);
+    BSON_APPEND_ARRAY_BEGIN(&expr, "$and", &and);
+    BSON_APPEND_DOCUMENT_BEGIN(&and, "0", &comparison);
+    BSON_APPEND_ARRAY_BEGIN(&comparison, "$lte", &operands);
+    BSON_APPEND_UTF8(&operands, "0", "$time_window.start_time");
+    BSON_APPEND_UTF8(&operands, "1", "$$t");
+    bson_append_array_end(&comparison, &operands);
+    bson_append_document_end(&and, &comparison);
+    BSON_APPEND_DOCUMENT_BEGIN(&and, "1", &comparison);
+    BSON_APPEND_ARRAY_BEGIN(&comparison, "$gte", &operands);
+    BSON_APPEND_UTF8(&operands, "0", "$time_window.end_time");
+    BSON_APPEND_UTF8(&operands, "1", "$$t");
+    bson_append_array_end(&comparison, &operands);
+    bson_append_document_end(&and, &comparison);
+    bson_append_array_end(&expr, &and);
+    bson_append_document_end(&lookupOperator, &expr);
+    bson_append_document_end(&lookupStage, &lookupOperator);
+    bson_append_document_end(&lookupStages, &lookupStage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&lookupStages, "1", &lookupStage);
+    BSON_APPEND_INT32(&lookupStage, "$limit", 1);
+    bson_append_document_end(&lookupStages, &lookupStage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&lookupStages, "2", &lookupStage);
+    BSON_APPEND_DOCUMENT_BEGIN(&lookupStage, "$project", &lookupOperator);
+    BSON_APPEND_INT32(&lookupOperator, "device_id", 1);
+    BSON_APPEND_INT32(&lookupOperator, "log", 1);
+    BSON_APPEND_INT32(&lookupOperator, "time_window", 1);
+    BSON_APPEND_INT32(&lookupOperator, "bounding_box", 1);
+    BSON_APPEND_INT32(&lookupOperator, "tiles", 1);
+    if (NULL != pRange) {
+        _appendPointRangeExpression(&lookupOperator, "window", pRange);
+    }
+    bson_append_document_end(&lookupStage, &lookupOperator);
+    bson_append_document_end(&lookupStages, &lookupStage);
+
+    bson_append_array_end(&operator, &lookupStages);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    bson_append_array_end(&pipeline, &stages);
+
+    struct SOP_Op op;
+    cursor = SOP_aggregate(&op, "DB_getFenceWithLog", collection, &pipeline);
+
+    /*
+     * Split the joined document back into the fence and its log
+     */
+    if (SOP_next(&op, cursor, &doc)) {
+        struct TRC_Span decodeSpan;
+        TRC_begin(&decodeSpan, "decode fence and log");
+        bson_iter_t iter;
+        bson_iter_t logItr;
+
+        bson_t *record = bson_new(); //freed with DB_Fence
+        bson_copy_to_excluding_noinit(doc, record, "corresponding_log", NULL);
+        retVal = DB_decodeFence(record);
+        if (NULL != retVal) {
+            retVal->record = record;
+        } else {
+            bson_destroy(record);
+        }
+
+        if (NULL != retVal && bson_iter_init_find(&iter, doc, "corresponding_log") &&
+            bson_iter_recurse(&iter, &logItr) && bson_iter_next(&logItr) && BSON_ITER_HOLDS_DOCUMENT(&logItr)) {
+            uint32_t len;
+            uint8_t const *data;
+            bson_t logDoc;
+            bson_iter_document(&logItr, &len, &data);
+            if (bson_init_static(&logDoc, data, len) && NULL != (*pLog = DB_decodeGpsLog(&logDoc))) {
+                /*
+                 * The tile index is only for the search, it is left out of the response
+                 */
+                (*pLog)->record = bson_new(); //freed with DB_GpsLog
+                if (NULL != pRange && bson_iter_init_find(&iter, &logDoc, "window")) {
+                    bson_copy_to_excluding_noinit(&logDoc, (*pLog)->record, "log", "window", "tiles", NULL);
+                    BSON_APPEND_VALUE((*pLog)->record, "log", bson_iter_value(&iter));
+                } else {
+                    bson_copy_to_excluding_noinit(&logDoc, (*pLog)->record, "tiles", NULL);
+                }
+            }
+        }
+        TRC_end(&decodeSpan);
+    }
+
+    SOP_end(&op);
+    bson_destroy(&pipeline);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    TRC_end(&span);
+    return retVal;
+}
+
+struct DB_Fence **DB_getFences(char const *const *pIdentifiers, size_t pCount, char const *pDeviceId,
+                               mongoc_client_t *pClient, size_t *pFenceCount) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getFences");
+    struct DB_Fence **retVal = malloc(MAX(pCount, 1) * sizeof(struct DB_Fence *));
+    *pFenceCount = 0;
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+
+    /*
+     * Build the query { device_id: <device>, identifier: { $in: [...] } }
+     */
+    bson_t query;
+    bson_init(&query);
+    _appendDeviceQuery(&query, pDeviceId);
+    bson_t queryChildIdentifier;
+    bson_t queryChildIn;
+    char iStr[16];
+    char const *key;
+
+    BSON_APPEND_DOCUMENT_BEGIN(&query, "identifier", &queryChildIdentifier);
+    BSON_APPEND_ARRAY_BEGIN(&queryChildIdentifier, "$in", &queryChildIn);
+    for (uint32_t i = 0; i < pCount; ++i) {
+        bson_uint32_to_string(i, &key, iStr, sizeof iStr);
+        BSON_APPEND_UTF8(&queryChildIn, key, pIdentifiers[i]);
+    }
+    bson_append_array_end(&queryChildIdentifier, &queryChildIn);
+    bson_append_document_end(&query, &queryChildIdentifier);
+
+    bson_t fields;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "center", 0);
+
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_getFences", collection, 0, &query, &fields);
+
+    /*
+     * Identifiers may repeat in a request but match a single fence, so there are never more fences than identifiers
+     */
+    while (*pFenceCount < pCount && SOP_next(&op, cursor, &doc)) {
+        struct DB_Fence *fence = DB_decodeFence(doc);
+        if (NULL != fence) {
+            fence->record = bson_copy(doc); //freed with DB_Fence
+            retVal[(*pFenceCount)++] = fence;
+        }
+    }
+
+    SOP_end(&op);
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    TRC_end(&span);
+    return retVal;
+}
+
+struct DB_Fence **DB_getFencesInWindow(char const *pDeviceId, int64_t pStartTime, int64_t pEndTime,
+                                       mongoc_client_t *pClient, size_t *pFenceCount) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getFencesInWindow");
+    size_t capacity = 16;
+    struct DB_Fence **retVal = malloc(capacity * sizeof(struct DB_Fence *));
+    *pFenceCount = 0;
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+
+    /*
+     * Build the query { device_id: <device>, entry_time: { $gte: <start>, $lte: <end> } }
+     */
+    bson_t query;
+    bson_t queryChildEntryTime;
+    bson_init(&query);
+    _appendDeviceQuery(&query, pDeviceId);
+    BSON_APPEND_DOCUMENT_BEGIN(&query, "entry_time", &queryChildEntryTime);
+    BSON_APPEND_INT64(&queryChildEntryTime, "$gte", pStartTime);
+    BSON_APPEND_INT64(&queryChildEntryTime, "$lte", pEndTime);
+    bson_append_document_end(&query, &queryChildEntryTime);
+
+    bson_t fields;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "center", 0);
+
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_getFencesInWindow", collection, 0, &query, &fields);
+    while (SOP_next(&op, cursor, &doc)) {
+        struct DB_Fence *fence = DB_decodeFence(doc);
+        if (NULL == fence) {
+            continue;
+        }
+        if (*pFenceCount == capacity) {
+            capacity *= 2;
+            retVal = realloc(retVal, capacity * sizeof(struct DB_Fence *));
+        }
+        retVal[(*pFenceCount)++] = fence;
+    }
+
+    SOP_end(&op);
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    TRC_end(&span);
     return retVal;
 }
 
-struct DB_Record *DB_getGpsLogRecordList(mongoc_client_t *pClient) {
+struct DB_Record *DB_getGpsLogRecordList(char const *pDeviceId, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getGpsLogRecordList");
     struct DB_Record *retVal = _allocateRecord();
 
-    mongoc_collection_t *collection = mongoc_client_get_collection(pClient, DB, COLLECTION_GPS_LOGS);
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
     mongoc_cursor_t *cursor;
     bson_t const *doc;
 
@@ -302,12 +1838,15 @@ struct DB_Record *DB_getGpsLogRecordList(mongoc_client_t *pClient) {
      */
     bson_t *query = bson_new();
     bson_t *fields = bson_new();
+    _appendDeviceQuery(query, pDeviceId);
 
     BSON_APPEND_INT32(fields, "_id", 1);
+    BSON_APPEND_INT32(fields, "device_id", 1);
     BSON_APPEND_INT32(fields, "time_window", 1);
     BSON_APPEND_INT32(fields, "bounding_box", 1);
 
-    cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 1000, 0, query, fields, NULL);
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_getGpsLogRecordList", collection, 1000, query, fields);
 
     bson_t jsonArray;
     bson_init(&jsonArray);
@@ -315,7 +1854,7 @@ struct DB_Record *DB_getGpsLogRecordList(mongoc_client_t *pClient) {
     uint32_t i = 0;
     char iStr[16];
     char const *key;
-    while (mongoc_cursor_next(cursor, &doc)) {
+    while (SOP_next(&op, cursor, &doc)) {
         //initialize jsonArray
         if (NULL == retVal->record) {
             retVal->message = _createMessage("ok");
@@ -332,19 +1871,23 @@ struct DB_Record *DB_getGpsLogRecordList(mongoc_client_t *pClient) {
         BSON_APPEND_ARRAY(records, "records", &jsonArray);
     }
 
+    SOP_end(&op);
     bson_destroy(query);
     bson_destroy(fields);
     mongoc_cursor_destroy(cursor);
     mongoc_collection_destroy(collection);
     bson_destroy(&jsonArray);
 
+    TRC_end(&span);
     return retVal;
 }
 
-struct DB_Record *DB_getFenceRecordList(mongoc_client_t *pClient) {
+struct DB_Record *DB_getFenceRecordList(char const *pDeviceId, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getFenceRecordList");
     struct DB_Record *retVal = _allocateRecord();
 
-    mongoc_collection_t *collection = mongoc_client_get_collection(pClient, DB, COLLECTION_FENCES);
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
     mongoc_cursor_t *cursor;
     bson_t const *doc;
 
@@ -352,7 +1895,9 @@ struct DB_Record *DB_getFenceRecordList(mongoc_client_t *pClient) {
      * Build the query
      */
     bson_t *query = bson_new();
-    cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 1000, 0, query, NULL, NULL);
+    _appendDeviceQuery(query, pDeviceId);
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_getFenceRecordList", collection, 1000, query, NULL);
 
     bson_t jsonArray;
     bson_init(&jsonArray);
@@ -360,7 +1905,7 @@ struct DB_Record *DB_getFenceRecordList(mongoc_client_t *pClient) {
     uint32_t i = 0;
     char iStr[16];
     char const *key;
-    while (mongoc_cursor_next(cursor, &doc)) {
+    while (SOP_next(&op, cursor, &doc)) {
         //todo: add whether there is a corresponding gps_log
 
         //initialize jsonArray
@@ -379,85 +1924,798 @@ struct DB_Record *DB_getFenceRecordList(mongoc_client_t *pClient) {
         BSON_APPEND_ARRAY(records, "records", &jsonArray);
     }
 
+    SOP_end(&op);
     bson_destroy(query);
     bson_destroy(&jsonArray);
     mongoc_cursor_destroy(cursor);
     mongoc_collection_destroy(collection);
 
+    TRC_end(&span);
     return retVal;
 }
 
-struct DB_Record *DB_getGpsLogRecord(int64_t pEpochTime, mongoc_client_t *pClient) {
+struct DB_Record *DB_getGpsLogRecord(int64_t pEpochTime, char const *pDeviceId, struct DB_PointRange const *pRange,
+                                     mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getGpsLogRecord");
+    bson_t fields;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "tiles", 0);
     struct DB_Record *retVal = _allocateRecord();
+    if (NULL != pRange) {
+        _aggregateGpsLogRecord(pEpochTime, pDeviceId, pRange, &__copyRecord, retVal, pClient);
+    } else {
+        _findGpsLogRecord(pEpochTime, pDeviceId, &fields, &__copyRecord, retVal, pClient);
+    }
+    bson_destroy(&fields);
+    TRC_end(&span);
+    return retVal;
+}
+
+char *DB_getGpsLogRecordJson(int64_t pEpochTime, char const *pDeviceId, struct DB_PointRange const *pRange,
+                             mongoc_client_t *pClient, size_t *pLength) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getGpsLogRecordJson");
+    bson_t fields;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "tiles", 0);
+    struct DB_Json retVal = {NULL, 0};
+    if (NULL != pRange) {
+        _aggregateGpsLogRecord(pEpochTime, pDeviceId, pRange, &__serializeRecord, &retVal, pClient);
+    } else {
+        _findGpsLogRecord(pEpochTime, pDeviceId, &fields, &__serializeRecord, &retVal, pClient);
+    }
+    bson_destroy(&fields);
+    TRC_end(&span);
+    *pLength = retVal.length;
+    return retVal.json;
+}
 
-    mongoc_collection_t *collection = mongoc_client_get_collection(pClient, DB, COLLECTION_GPS_LOGS);
+struct DB_GpsLog *DB_getGpsLog(int64_t pEpochTime, char const *pDeviceId, bool pWithPoints, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getGpsLog");
+    struct DB_GpsLog *retVal = NULL;
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
     mongoc_cursor_t *cursor;
     bson_t const *doc;
 
     /*
-     * Build the query
+     * Build the query, leaving the points on the server unless wanted
      */
     bson_t query;
     bson_init(&query);
-    bson_t queryChildEndTime;
-    bson_t queryChildStartTime;
+    _appendDeviceQuery(&query, pDeviceId);
+    _appendTimeWindowQuery(&query, pEpochTime);
+
+    bson_t fields;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "_id", 1);
+    BSON_APPEND_INT32(&fields, "device_id", 1);
+    BSON_APPEND_INT32(&fields, "time_window", 1);
+    BSON_APPEND_INT32(&fields, "bounding_box", 1);
+    if (pWithPoints) {
+        BSON_APPEND_INT32(&fields, "log", 1);
+        BSON_APPEND_INT32(&fields, "tiles", 1);
+    }
 
-    BSON_APPEND_DOCUMENT_BEGIN(&query, "time_window.end_time", &queryChildEndTime);
-    BSON_APPEND_INT64(&queryChildEndTime, "$gte", pEpochTime);
-    bson_append_document_end(&query, &queryChildEndTime);
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_getGpsLog", collection, 1, &query, &fields);
 
-    BSON_APPEND_DOCUMENT_BEGIN(&query, "time_window.start_time", &queryChildStartTime);
-    BSON_APPEND_INT64(&queryChildStartTime, "$lte", pEpochTime);
-    bson_append_document_end(&query, &queryChildStartTime);
+    if (SOP_next(&op, cursor, &doc)) {
+        struct TRC_Span decodeSpan;
+        TRC_begin(&decodeSpan, "DB_decodeGpsLog");
+        retVal = DB_decodeGpsLog(doc);
+        TRC_end(&decodeSpan);
+    }
+
+    SOP_end(&op);
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    TRC_end(&span);
+    return retVal;
+}
 
-    cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 1, 0, &query, NULL, NULL);
+struct DB_GpsLog *DB_getEntryCandidates(bson_oid_t const *pLogId, char const *pDeviceId,
+                                        struct DB_Fence const *pFence, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getEntryCandidates");
+    struct DB_GpsLog *retVal = _allocateGpsLog();
+    retVal->hasId = true;
+    bson_oid_copy(pLogId, &retVal->id);
 
-    if (mongoc_cursor_next(cursor, &doc)) {
-        retVal->record = bson_copy(doc);
-        retVal->message = _createMessage("ok");
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_POINTS, pDeviceId);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+    char iStr[16];
+    char const *key;
+
+    /*
+     * Build the pipeline
+     * [ { $match: { log_id: <id>, device_id: <device>, location: { $geoWithin: <fence> } } }, { $sort: { i: 1 } },
+     *   { $project: { _id: 0, time: 1, location: 1 } } ]
+     */
+    bson_t pipeline;
+    bson_t stages;
+    bson_t stage;
+    bson_t match;
+    bson_t location;
+    bson_t within;
+    bson_init(&pipeline);
+    BSON_APPEND_ARRAY_BEGIN(&pipeline, "pipeline", &stages);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &match);
+    BSON_APPEND_OID(&match, "log_id", pLogId);
+    _appendDeviceQuery(&match, pDeviceId);
+    BSON_APPEND_DOCUMENT_BEGIN(&match, "location", &location);
+    BSON_APPEND_DOCUMENT_BEGIN(&location, "$geoWithin", &within);
+    if (pFence->polygonCount > 0) {
+        bson_t geometry;
+        bson_t rings;
+        bson_t ring;
+        bson_t coordinate;
+        BSON_APPEND_DOCUMENT_BEGIN(&within, "$geometry", &geometry);
+        BSON_APPEND_UTF8(&geometry, "type", "Polygon");
+        BSON_APPEND_ARRAY_BEGIN(&geometry, "coordinates", &rings);
+        BSON_APPEND_ARRAY_BEGIN(&rings, "0", &ring);
+        // GeoJSON rings are explicitly closed
+        for (uint32_t i = 0; i <= pFence->polygonCount; ++i) {
+            size_t vertex = i % pFence->polygonCount;
+            bson_uint32_to_string(i, &key, iStr, sizeof iStr);
+            BSON_APPEND_ARRAY_BEGIN(&ring, key, &coordinate);
+            BSON_APPEND_DOUBLE(&coordinate, "0", pFence->polygonLongitudes[vertex]);
+            BSON_APPEND_DOUBLE(&coordinate, "1", pFence->polygonLatitudes[vertex]);
+            bson_append_array_end(&ring, &coordinate);
+        }
+        bson_append_array_end(&rings, &ring);
+        bson_append_array_end(&geometry, &rings);
+        bson_append_document_end(&within, &geometry);
+    } else {
+        bson_t centerSphere;
+        bson_t center;
+        BSON_APPEND_ARRAY_BEGIN(&within, "$centerSphere", &centerSphere);
+        BSON_APPEND_ARRAY_BEGIN(&centerSphere, "0", &center);
+        BSON_APPEND_DOUBLE(&center, "0", pFence->longitude);
+        BSON_APPEND_DOUBLE(&center, "1", pFence->latitude);
+        bson_append_array_end(&centerSphere, &center);
+        // radians on a sphere, enlarged to cover the difference from the WGS-84 ellipsoid
+        BSON_APPEND_DOUBLE(&centerSphere, "1", pFence->radius * CANDIDATE_RADIUS_SLACK / EARTH_RADIUS_METERS);
+        bson_append_array_end(&within, &centerSphere);
+    }
+    bson_append_document_end(&location, &within);
+    bson_append_document_end(&match, &location);
+    bson_append_document_end(&stage, &match);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$sort", &match);
+    BSON_APPEND_INT32(&match, "i", 1);
+    bson_append_document_end(&stage, &match);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "2", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &match);
+    BSON_APPEND_INT32(&match, "_id", 0);
+    BSON_APPEND_INT32(&match, "time", 1);
+    BSON_APPEND_INT32(&match, "location", 1);
+    bson_append_document_end(&stage, &match);
+    bson_append_document_end(&stages, &stage);
+
+    bson_append_array_end(&pipeline, &stages);
+
+    struct SOP_Op op;
+    cursor = SOP_aggregate(&op, "DB_getEntryCandidates", collection, &pipeline);
+
+    /*
+     * Candidates are { time, location: { type: "Point", coordinates: [lng, lat] } }
+     */
+    size_t capacity = 0;
+    while (SOP_next(&op, cursor, &doc)) {
+        bson_iter_t iter;
+        bson_iter_t coordinateItr;
+        double lat = 0;
+        double lng = 0;
+        int32_t time = 0;
+        if (!bson_iter_init(&iter, doc) || !bson_iter_find_descendant(&iter, "location.coordinates", &coordinateItr) ||
+            !bson_iter_recurse(&coordinateItr, &iter)) {
+            continue;
+        }
+        if (bson_iter_next(&iter)) {
+            lng = DB_bsonValueDouble(bson_iter_value(&iter));
+        }
+        if (bson_iter_next(&iter)) {
+            lat = DB_bsonValueDouble(bson_iter_value(&iter));
+        }
+        if (bson_iter_init_find(&iter, doc, "time")) {
+            time = DB_bsonValueInt32(bson_iter_value(&iter));
+        }
+
+        if (retVal->count == capacity) {
+            capacity = MAX(capacity * 2, 64);
+            _reserveGpsLogPoints(retVal, capacity);
+        }
+        retVal->latitudes[retVal->count] = lat;
+        retVal->longitudes[retVal->count] = lng;
+        retVal->times[retVal->count] = time;
+        ++retVal->count;
+    }
+
+    bson_error_t error;
+    if (mongoc_cursor_error(cursor, &error)) {
+        LOG_log(LOG_LEVEL_ERROR, "error finding entry candidates", error.message);
+        DB_freeGpsLog(retVal);
+        retVal = NULL;
+    }
+
+    SOP_end(&op);
+    bson_destroy(&pipeline);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    TRC_end(&span);
+    return retVal;
+}
+
+bool DB_ensureIndexes(mongoc_client_t *pClient) {
+    bool result = true;
+    if (__partitioning == DB_PARTITION_SHARDED) {
+        bson_error_t error;
+        bson_t command;
+        bson_init(&command);
+        BSON_APPEND_UTF8(&command, "enableSharding", DB);
+        result = mongoc_client_command_simple(pClient, "admin", &command, NULL, NULL, &error);
+        bson_destroy(&command);
+        if (!result) {
+            LOG_log(LOG_LEVEL_ERROR, "error enabling sharding", error.message);
+        }
     }
+    return _ensurePartitionIndexes(pClient, NULL) && result;
+}
+
+bool DB_acquireLease(char const *pName, char const *pOwner, int64_t pSeconds, mongoc_client_t *pClient) {
+    mongoc_collection_t *collection = mongoc_client_get_collection(pClient, DB, COLLECTION_LEASES);
+    int64_t now = time(NULL);
+    bson_error_t error;
 
+    /*
+     * Renew our own lease or take over an expired one, { _id: <name>, $or: [ { owner: <owner> },
+     * { expires: { $lt: <now> } } ] }
+     */
+    bson_t query;
+    bson_t or;
+    bson_t clause;
+    bson_t expires;
+    bson_init(&query);
+    BSON_APPEND_UTF8(&query, "_id", pName);
+    BSON_APPEND_ARRAY_BEGIN(&query, "$or", &or);
+    BSON_APPEND_DOCUMENT_BEGIN(&or, "0", &clause);
+    BSON_APPEND_UTF8(&clause, "owner", pOwner);
+    bson_append_document_end(&or, &clause);
+    BSON_APPEND_DOCUMENT_BEGIN(&or, "1", &clause);
+    BSON_APPEND_DOCUMENT_BEGIN(&clause, "expires", &expires);
+    BSON_APPEND_INT64(&expires, "$lt", now);
+    bson_append_document_end(&clause, &expires);
+    bson_append_document_end(&or, &clause);
+    bson_append_array_end(&query, &or);
+
+    bson_t update;
+    bson_t set;
+    bson_init(&update);
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$set", &set);
+    BSON_APPEND_UTF8(&set, "owner", pOwner);
+    BSON_APPEND_INT64(&set, "expires", now + pSeconds);
+    bson_append_document_end(&update, &set);
+
+    bson_t reply;
+    bson_iter_t iter;
+    bool result = SOP_findAndModify("DB_acquireLease", collection, &query, &update, NULL, true, &reply, &error) &&
+                  bson_iter_init_find(&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT(&iter);
+    bson_destroy(&reply);
+
+    /*
+     * Nobody held it yet, of two processes inserting at once the other one gets a duplicate key error
+     */
+    if (!result) {
+        bson_t lease;
+        bson_init(&lease);
+        BSON_APPEND_UTF8(&lease, "_id", pName);
+        BSON_APPEND_UTF8(&lease, "owner", pOwner);
+        BSON_APPEND_INT64(&lease, "expires", now + pSeconds);
+        result = SOP_insert("DB_acquireLease", collection, &lease, &error);
+        bson_destroy(&lease);
+    }
+
+    bson_destroy(&update);
     bson_destroy(&query);
+    mongoc_collection_destroy(collection);
+    return result;
+}
+
+char **DB_getGpsLogPartitions(mongoc_client_t *pClient, size_t *pCount) {
+    size_t capacity = PARTITION_CAPACITY;
+    char **retVal = malloc(capacity * sizeof(char *));
+    retVal[0] = NULL;
+    *pCount = 1;
+    if (__partitioning != DB_PARTITION_COLLECTION) {
+        return retVal;
+    }
+
+    /*
+     * { listCollections: 1, nameOnly: true, filter: { name: { $regex: "^gps_logs\." } } }
+     */
+    bson_t command;
+    bson_t filter;
+    bson_t name;
+    bson_init(&command);
+    BSON_APPEND_INT32(&command, "listCollections", 1);
+    BSON_APPEND_BOOL(&command, "nameOnly", true);
+    BSON_APPEND_DOCUMENT_BEGIN(&command, "filter", &filter);
+    BSON_APPEND_DOCUMENT_BEGIN(&filter, "name", &name);
+    BSON_APPEND_UTF8(&name, "$regex", "^" COLLECTION_GPS_LOGS "\\.");
+    bson_append_document_end(&filter, &name);
+    bson_append_document_end(&command, &filter);
+
+    bson_t reply;
+    bson_error_t error;
+    bson_iter_t iter;
+    bson_iter_t batchIter;
+    bson_iter_t collectionIter;
+    size_t prefixLength = strlen(COLLECTION_GPS_LOGS ".");
+    if (!mongoc_client_command_simple(pClient, DB, &command, NULL, &reply, &error)) {
+        LOG_log(LOG_LEVEL_ERROR, "error listing gps log collections", error.message);
+    } else if (bson_iter_init(&iter, &reply) && bson_iter_find_descendant(&iter, "cursor.firstBatch", &batchIter) &&
+               BSON_ITER_HOLDS_ARRAY(&batchIter) && bson_iter_recurse(&batchIter, &iter)) {
+        while (bson_iter_next(&iter)) {
+            if (!BSON_ITER_HOLDS_DOCUMENT(&iter) || !bson_iter_recurse(&iter, &collectionIter) ||
+                !bson_iter_find(&collectionIter, "name") || !BSON_ITER_HOLDS_UTF8(&collectionIter)) {
+                continue;
+            }
+            char const *collectionName = bson_iter_utf8(&collectionIter, NULL);
+            if (strlen(collectionName) <= prefixLength) {
+                continue;
+            }
+            if (*pCount == capacity) {
+                capacity *= 2;
+                retVal = realloc(retVal, capacity * sizeof(char *));
+            }
+            retVal[(*pCount)++] = bson_strdup(collectionName + prefixLength);
+        }
+    }
+    bson_destroy(&reply);
+    bson_destroy(&command);
+    return retVal;
+}
+
+struct DB_GpsLog **DB_getGpsLogsToCompact(char const *pPartition, int64_t pEndedBefore, bson_oid_t *pAfter,
+                                          uint32_t pLimit, mongoc_client_t *pClient, size_t *pLogCount) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_getGpsLogsToCompact");
+    struct DB_GpsLog **retVal = malloc(MAX(pLimit, 1) * sizeof(struct DB_GpsLog *));
+    *pLogCount = 0;
+
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pPartition);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+
+    /*
+     * { pipeline: [ { $match: { _id: { $gt: <after> }, time_window.end_time: { $lt: <ended before> },
+     *   compacted: null } }, { $sort: { _id: 1 } }, { $limit: <limit> },
+     *   { $project: { device_id: 1, time_window: 1, log: 1 } } ] }, resuming after the last log read so logs that
+     * are left alone are not read again by the same pass
+     */
+    bson_t pipeline;
+    bson_t stages;
+    bson_t stage;
+    bson_t operator;
+    bson_t child;
+    bson_init(&pipeline);
+    BSON_APPEND_ARRAY_BEGIN(&pipeline, "pipeline", &stages);
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &operator);
+    BSON_APPEND_DOCUMENT_BEGIN(&operator, "_id", &child);
+    BSON_APPEND_OID(&child, "$gt", pAfter);
+    bson_append_document_end(&operator, &child);
+    BSON_APPEND_DOCUMENT_BEGIN(&operator, "time_window.end_time", &child);
+    BSON_APPEND_INT64(&child, "$lt", pEndedBefore);
+    bson_append_document_end(&operator, &child);
+    BSON_APPEND_NULL(&operator, "compacted");
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$sort", &operator);
+    BSON_APPEND_INT32(&operator, "_id", 1);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "2", &stage);
+    BSON_APPEND_INT64(&stage, "$limit", pLimit);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "3", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &operator);
+    BSON_APPEND_INT32(&operator, "device_id", 1);
+    BSON_APPEND_INT32(&operator, "time_window", 1);
+    BSON_APPEND_INT32(&operator, "log", 1);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+    bson_append_array_end(&pipeline, &stages);
+
+    struct SOP_Op op;
+    bson_iter_t iter;
+    cursor = SOP_aggregate(&op, "DB_getGpsLogsToCompact", collection, &pipeline);
+    while (*pLogCount < pLimit && SOP_next(&op, cursor, &doc)) {
+        if (bson_iter_init_find(&iter, doc, "_id") && BSON_ITER_HOLDS_OID(&iter)) {
+            bson_oid_copy(bson_iter_oid(&iter), pAfter);
+        }
+        struct DB_GpsLog *log = DB_decodeGpsLog(doc);
+        if (NULL != log && log->hasId && log->count > 0) {
+            retVal[(*pLogCount)++] = log;
+        } else {
+            DB_freeGpsLog(log);
+        }
+    }
+
+    SOP_end(&op);
+    bson_destroy(&pipeline);
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+
+    TRC_end(&span);
+    return retVal;
+}
+
+bool DB_compactGpsLog(struct DB_GpsLog const *pLog, size_t const *pKeep, size_t pKeptCount, double pToleranceMeters,
+                      mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_compactGpsLog");
+
+    /*
+     * Validate the kept points as a new log so its bounding_box, time_window, point_count and tiles are built the
+     * way an ingested log's are
+     */
+    bson_t points;
+    bson_t array;
+    uint32_t appended = 0;
+    char iStr[16];
+    char const *key;
+    bson_init(&points);
+    BSON_APPEND_ARRAY_BEGIN(&points, "log", &array);
+    for (size_t i = 0; i < pKeptCount; ++i) {
+        bson_t point;
+        bson_uint32_to_string(appended++, &key, iStr, sizeof iStr);
+        BSON_APPEND_DOCUMENT_BEGIN(&array, key, &point);
+        BSON_APPEND_DOUBLE(&point, "latitude", pLog->latitudes[pKeep[i]]);
+        BSON_APPEND_DOUBLE(&point, "longitude", pLog->longitudes[pKeep[i]]);
+        BSON_APPEND_INT32(&point, "time", pLog->times[pKeep[i]]);
+        bson_append_document_end(&array, &point);
+    }
+    bson_append_array_end(&points, &array);
+    char *json = bson_as_json(&points, NULL);
+    bson_destroy(&points);
+    bson_t *record = _validateGpsLogRecord(json);
+    bson_free(json);
+    if (NULL == record) {
+        TRC_end(&span);
+        return false;
+    }
+
+    /*
+     * { _id: <id>, log: { $size: <count read> } } so points appended meanwhile are not dropped
+     */
+    bson_t selector;
+    bson_t size;
+    bson_init(&selector);
+    BSON_APPEND_OID(&selector, "_id", &pLog->id);
+    BSON_APPEND_DOCUMENT_BEGIN(&selector, "log", &size);
+    BSON_APPEND_INT64(&size, "$size", (int64_t) pLog->count);
+    bson_append_document_end(&selector, &size);
+
+    bson_t update;
+    bson_t set;
+    bson_t compacted;
+    bson_init(&update);
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$set", &set);
+    _appendDescendant(&set, record, "log");
+    _appendDescendant(&set, record, "bounding_box");
+    _appendDescendant(&set, record, "time_window");
+    _appendDescendant(&set, record, "point_count");
+    _appendDescendant(&set, record, "tiles");
+    BSON_APPEND_DOCUMENT_BEGIN(&set, "compacted", &compacted);
+    BSON_APPEND_INT64(&compacted, "time", (int64_t) time(NULL));
+    BSON_APPEND_DOUBLE(&compacted, "tolerance_meters", pToleranceMeters);
+    BSON_APPEND_INT64(&compacted, "point_count", (int64_t) pLog->count);
+    bson_append_document_end(&set, &compacted);
+    bson_append_document_end(&update, &set);
+
+    /*
+     * An update matching nothing still succeeds, so find and modify to tell a rewritten log from one that changed
+     */
+    bson_error_t error;
+    bson_t fields;
+    bson_t reply;
+    bson_iter_t iter;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "_id", 1);
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pLog->deviceId);
+    bool failed = !SOP_findAndModify("DB_compactGpsLog", collection, &selector, &update, &fields, false, &reply,
+                                     &error);
+    bool result = !failed && bson_iter_init_find(&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT(&iter);
+    bson_destroy(&reply);
+    bson_destroy(&fields);
+    mongoc_collection_destroy(collection);
+
+#ifdef DB_GEOJSON_STORAGE
+    /*
+     * Replace the 2dsphere points of the compacted range with the kept ones,
+     * { log_id: <id>, i: { $lt: <count read> } } so the points appended past it stay
+     */
+    if (result) {
+        collection = _getCollection(pClient, COLLECTION_GPS_POINTS, pLog->deviceId);
+        bson_t pointSelector;
+        bson_t compactedRange;
+        bson_init(&pointSelector);
+        BSON_APPEND_OID(&pointSelector, "log_id", &pLog->id);
+        BSON_APPEND_DOCUMENT_BEGIN(&pointSelector, "i", &compactedRange);
+        BSON_APPEND_INT64(&compactedRange, "$lt", (int64_t) pLog->count);
+        bson_append_document_end(&pointSelector, &compactedRange);
+        result = SOP_remove("DB_compactGpsLog points", collection, MONGOC_REMOVE_NONE, &pointSelector, &error);
+        bson_destroy(&pointSelector);
+        mongoc_collection_destroy(collection);
+
+        bson_value_t logId;
+        logId.value_type = BSON_TYPE_OID;
+        bson_oid_copy(&pLog->id, &logId.value.v_oid);
+        result = result && _insertGpsPoints(record, &logId, pLog->deviceId, 0, pClient, &error);
+        failed = !result;
+    }
+#endif
+
+    if (failed) {
+        LOG_log(LOG_LEVEL_ERROR, "error compacting gps log", error.message);
+    }
+    bson_destroy(&update);
+    bson_destroy(&selector);
+    bson_destroy(record);
+    TRC_end(&span);
+    return result;
+}
+
+int64_t DB_expireGpsLogs(char const *pPartition, int64_t pEndedBefore, uint32_t pLimit, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_expireGpsLogs");
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pPartition);
+    mongoc_cursor_t *cursor;
+    bson_t const *doc;
+    bson_iter_t iter;
+    bson_error_t error;
+
+    /*
+     * Collect a bounded batch of ids, { _id: { $in: [...] } } then removes the logs and their points
+     */
+    bson_t query;
+    bson_t endTime;
+    bson_init(&query);
+    BSON_APPEND_DOCUMENT_BEGIN(&query, "time_window.end_time", &endTime);
+    BSON_APPEND_INT64(&endTime, "$lt", pEndedBefore);
+    bson_append_document_end(&query, &endTime);
+    bson_t fields;
+    bson_init(&fields);
+    BSON_APPEND_INT32(&fields, "_id", 1);
+
+    bson_t in;
+    char iStr[16];
+    char const *key;
+    uint32_t count = 0;
+    bson_init(&in);
+    struct SOP_Op op;
+    cursor = SOP_find(&op, "DB_expireGpsLogs", collection, pLimit, &query, &fields);
+    while (count < pLimit && SOP_next(&op, cursor, &doc)) {
+        if (bson_iter_init_find(&iter, doc, "_id") && BSON_ITER_HOLDS_OID(&iter)) {
+            bson_uint32_to_string(count++, &key, iStr, sizeof iStr);
+            BSON_APPEND_OID(&in, key, bson_iter_oid(&iter));
+        }
+    }
+    bool result = !mongoc_cursor_error(cursor, &error);
+    SOP_end(&op);
     mongoc_cursor_destroy(cursor);
+
+    bson_t selector;
+    bson_t ids;
+    bson_init(&selector);
+    BSON_APPEND_DOCUMENT_BEGIN(&selector, "_id", &ids);
+    BSON_APPEND_ARRAY(&ids, "$in", &in);
+    bson_append_document_end(&selector, &ids);
+    if (result && count > 0) {
+        result = SOP_remove("DB_expireGpsLogs", collection, MONGOC_REMOVE_NONE, &selector, &error);
+    }
     mongoc_collection_destroy(collection);
 
+#ifdef DB_GEOJSON_STORAGE
+    if (result && count > 0) {
+        bson_t pointSelector;
+        bson_init(&pointSelector);
+        BSON_APPEND_DOCUMENT_BEGIN(&pointSelector, "log_id", &ids);
+        BSON_APPEND_ARRAY(&ids, "$in", &in);
+        bson_append_document_end(&pointSelector, &ids);
+        collection = _getCollection(pClient, COLLECTION_GPS_POINTS, pPartition);
+        result = SOP_remove("DB_expireGpsLogs points", collection, MONGOC_REMOVE_NONE, &pointSelector, &error);
+        mongoc_collection_destroy(collection);
+        bson_destroy(&pointSelector);
+    }
+#endif
+
+    if (!result) {
+        LOG_log(LOG_LEVEL_ERROR, "error expiring gps logs", error.message);
+    }
+    bson_destroy(&selector);
+    bson_destroy(&in);
+    bson_destroy(&fields);
+    bson_destroy(&query);
+    TRC_end(&span);
+    return result ? (int64_t) count : -1;
+}
+
+struct DB_Export *DB_openExport(char const *pCollection, char const *pDeviceId, int64_t pFrom, int64_t pTo,
+                                bson_oid_t const *pAfter, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_openExport");
+    struct DB_Export *retVal = malloc(sizeof(struct DB_Export));
+    retVal->collection = _getCollection(pClient, pCollection, pDeviceId);
+    retVal->failed = false;
+
+    /*
+     * Gps logs overlap the range, everything else is timed within it
+     */
+    bool logs = 0 == strcmp(pCollection, COLLECTION_GPS_LOGS);
+    char const *fromKey = logs ? "time_window.end_time" : 0 == strcmp(pCollection, COLLECTION_FENCES) ? "entry_time"
+                                                                                                     : "time";
+    char const *toKey = "time_window.start_time";
+
+    /*
+     * { pipeline: [ { $match: { device_id: <device>, _id: { $gt: <after> }, <from key>: { $gte: <from> },
+     *   <to key>: { $lte: <to> } } }, { $sort: { _id: 1 } } ] }, the sort directly follows the match so the _id index
+     * streams the documents without a blocking sort
+     */
+    bson_t stages;
+    bson_t stage;
+    bson_t operator;
+    bson_t child;
+    bson_init(&retVal->pipeline);
+    BSON_APPEND_ARRAY_BEGIN(&retVal->pipeline, "pipeline", &stages);
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$match", &operator);
+    _appendDeviceQuery(&operator, pDeviceId);
+    if (NULL != pAfter) {
+        BSON_APPEND_DOCUMENT_BEGIN(&operator, "_id", &child);
+        BSON_APPEND_OID(&child, "$gt", pAfter);
+        bson_append_document_end(&operator, &child);
+    }
+    if (logs) {
+        if (pFrom != INT64_MIN) {
+            BSON_APPEND_DOCUMENT_BEGIN(&operator, fromKey, &child);
+            BSON_APPEND_INT64(&child, "$gte", pFrom);
+            bson_append_document_end(&operator, &child);
+        }
+        if (pTo != INT64_MAX) {
+            BSON_APPEND_DOCUMENT_BEGIN(&operator, toKey, &child);
+            BSON_APPEND_INT64(&child, "$lte", pTo);
+            bson_append_document_end(&operator, &child);
+        }
+    } else if (pFrom != INT64_MIN || pTo != INT64_MAX) {
+        BSON_APPEND_DOCUMENT_BEGIN(&operator, fromKey, &child);
+        if (pFrom != INT64_MIN) {
+            BSON_APPEND_INT64(&child, "$gte", pFrom);
+        }
+        if (pTo != INT64_MAX) {
+            BSON_APPEND_INT64(&child, "$lte", pTo);
+        }
+        bson_append_document_end(&operator, &child);
+    }
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$sort", &operator);
+    BSON_APPEND_INT32(&operator, "_id", 1);
+    bson_append_document_end(&stage, &operator);
+    bson_append_document_end(&stages, &stage);
+    bson_append_array_end(&retVal->pipeline, &stages);
+
+    retVal->cursor = SOP_aggregate(&retVal->op, "DB_openExport", retVal->collection, &retVal->pipeline);
+    TRC_end(&span);
     return retVal;
 }
 
-void DB_deleteGpsLogRecord(char const *pIdentifier, mongoc_client_t *pClient) {
-    mongoc_collection_t *collection = mongoc_client_get_collection(pClient, DB, COLLECTION_GPS_LOGS);
+bool DB_nextExport(struct DB_Export *pExport, bson_t const **pDocument) {
+    if (SOP_next(&pExport->op, pExport->cursor, pDocument)) {
+        return true;
+    }
+    bson_error_t error;
+    if (mongoc_cursor_error(pExport->cursor, &error)) {
+        pExport->failed = true;
+        LOG_log(LOG_LEVEL_ERROR, "error exporting", error.message);
+    }
+    return false;
+}
+
+bool DB_exportFailed(struct DB_Export const *pExport) {
+    return pExport->failed;
+}
+
+void DB_closeExport(struct DB_Export *pExport) {
+    SOP_end(&pExport->op);
+    mongoc_cursor_destroy(pExport->cursor);
+    mongoc_collection_destroy(pExport->collection);
+    bson_destroy(&pExport->pipeline);
+    free(pExport);
+}
+
+bool DB_deleteGpsLogRecord(char const *pIdentifier, char const *pDeviceId, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_deleteGpsLogRecord");
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_GPS_LOGS, pDeviceId);
     bson_t selector;
     bson_init(&selector);
 
     bson_oid_t oid;
     bson_oid_init_from_string(&oid, pIdentifier);
     BSON_APPEND_OID(&selector, "_id", &oid);
+    _appendDeviceQuery(&selector, pDeviceId);
     bson_error_t error;
 
-    mongoc_collection_remove(collection, MONGOC_REMOVE_SINGLE_REMOVE, &selector, NULL, &error);
-    printf("error %s\n", error.message);
+    bool result = SOP_remove("DB_deleteGpsLogRecord", collection, MONGOC_REMOVE_SINGLE_REMOVE, &selector, &error);
     bson_destroy(&selector);
     mongoc_collection_destroy(collection);
+
+#ifdef DB_GEOJSON_STORAGE
+    if (result) {
+        collection = _getCollection(pClient, COLLECTION_GPS_POINTS, pDeviceId);
+        bson_init(&selector);
+        BSON_APPEND_OID(&selector, "log_id", &oid);
+        _appendDeviceQuery(&selector, pDeviceId);
+        result = SOP_remove("DB_deleteGpsLogRecord points", collection, MONGOC_REMOVE_NONE, &selector, &error);
+        bson_destroy(&selector);
+        mongoc_collection_destroy(collection);
+    }
+#endif
+
+    if (!result) {
+        LOG_log(LOG_LEVEL_ERROR, "error deleting gps log record", error.message);
+    }
+    TRC_end(&span);
+    return result;
 }
 
-void DB_deleteFenceRecord(char const *pIdentifier, mongoc_client_t *pClient) {
-    mongoc_collection_t *collection = mongoc_client_get_collection(pClient, DB, COLLECTION_FENCES);
+bool DB_deleteFenceRecord(char const *pIdentifier, char const *pDeviceId, mongoc_client_t *pClient) {
+    struct TRC_Span span;
+    TRC_begin(&span, "DB_deleteFenceRecord");
+    mongoc_collection_t *collection = _getCollection(pClient, COLLECTION_FENCES, pDeviceId);
     bson_t selector;
     bson_init(&selector);
 
     bson_oid_t oid;
     bson_oid_init_from_string(&oid, pIdentifier);
     BSON_APPEND_OID(&selector, "_id", &oid);
+    _appendDeviceQuery(&selector, pDeviceId);
     bson_error_t error;
 
-    mongoc_collection_remove(collection, MONGOC_REMOVE_SINGLE_REMOVE, &selector, NULL, &error);
-    printf("error %s\n", error.message);
+    bool result = SOP_remove("DB_deleteFenceRecord", collection, MONGOC_REMOVE_SINGLE_REMOVE, &selector, &error);
+    if (!result) {
+        LOG_log(LOG_LEVEL_ERROR, "error deleting fence record", error.message);
+    }
     bson_destroy(&selector);
     mongoc_collection_destroy(collection);
+    TRC_end(&span);
+    return result;
 }
 
 char *_createMessage(char const *const pMsg) {
-    char *retVal = malloc(strlen(pMsg));
+    char *retVal = malloc(strlen(pMsg) + 1);
     strcpy(retVal, pMsg);
     return retVal;
 }
@@ -472,7 +2730,7 @@ struct DB_Record *_allocateRecord() {
 void DB_freeRecord(struct DB_Record *pResult) {
     if (NULL != pResult) {
         if (NULL != pResult->record) {
-            bson_free(pResult->record);
+            bson_destroy(pResult->record);
         }
         if (NULL != pResult->message) {
             free(pResult->message);
@@ -481,4 +2739,180 @@ void DB_freeRecord(struct DB_Record *pResult) {
     }
 }
 
+bson_t *DB_validateFence(char const *pJson) {
+    return _validateFenceRecord(pJson);
+}
+
+bson_t *DB_validateGpsLog(char const *pJson) {
+    return _validateGpsLogRecord(pJson);
+}
+
+struct DB_Fence *DB_decodeFence(bson_t const *pDocument) {
+    struct DB_Fence *retVal = malloc(sizeof(struct DB_Fence));
+    retVal->record = NULL;
+    retVal->identifier = NULL;
+    retVal->deviceId = NULL;
+    retVal->latitude = 0;
+    retVal->longitude = 0;
+    retVal->radius = 0;
+    retVal->polygonLatitudes = NULL;
+    retVal->polygonLongitudes = NULL;
+    retVal->polygonCount = 0;
+
+    bool hasEntryTime = false;
+    bool hasLatitude = false;
+    bool hasLongitude = false;
+    bool hasRadius = false;
+    bool valid = true;
+
+    /*
+     * One pass over the fields, numbers are accepted in any numeric bson type
+     */
+    bson_iter_t iter;
+    bson_iter_init(&iter, pDocument);
+    while (valid && bson_iter_next(&iter)) {
+        char const *key = bson_iter_key(&iter);
+        bson_value_t const *value = bson_iter_value(&iter);
+        bool isNumber = DB_bsonTypeIsNumber(&value->value_type);
+        if (0 == strcmp(key, "identifier") && BSON_ITER_HOLDS_UTF8(&iter)) {
+            retVal->identifier = bson_strdup(bson_iter_utf8(&iter, NULL));
+        } else if (0 == strcmp(key, "device_id") && BSON_ITER_HOLDS_UTF8(&iter)) {
+            retVal->deviceId = bson_strdup(bson_iter_utf8(&iter, NULL));
+        } else if (0 == strcmp(key, "entry_time") && isNumber) {
+            retVal->entryTime = DB_bsonValueInt32(value);
+            hasEntryTime = true;
+        } else if (0 == strcmp(key, "latitude") && isNumber) {
+            retVal->latitude = DB_bsonValueDouble(value);
+            hasLatitude = true;
+        } else if (0 == strcmp(key, "longitude") && isNumber) {
+            retVal->longitude = DB_bsonValueDouble(value);
+            hasLongitude = true;
+        } else if (0 == strcmp(key, "radius") && isNumber) {
+            retVal->radius = DB_bsonValueDouble(value);
+            hasRadius = true;
+        } else if (0 == strcmp(key, "polygon")) {
+            valid = BSON_ITER_HOLDS_ARRAY(&iter) && _decodePolygon(&iter, retVal);
+        }
+    }
+
+    if (!valid || !hasEntryTime || (retVal->polygonCount == 0 && !(hasLatitude && hasLongitude && hasRadius))) {
+        DB_freeFence(retVal);
+        return NULL;
+    }
+    return retVal;
+}
+
+struct DB_GpsLog *DB_decodeGpsLog(bson_t const *pDocument) {
+    struct DB_GpsLog *retVal = _allocateGpsLog();
+    bool hasTimeWindow = false;
+    bool hasTiles = false;
+    bson_iter_t tilesItr;
+
+    bson_iter_t iter;
+    bson_iter_t childItr;
+    bson_iter_init(&iter, pDocument);
+    while (bson_iter_next(&iter)) {
+        char const *key = bson_iter_key(&iter);
+        if (0 == strcmp(key, "_id") && BSON_ITER_HOLDS_OID(&iter)) {
+            bson_oid_copy(bson_iter_oid(&iter), &retVal->id);
+            retVal->hasId = true;
+        } else if (0 == strcmp(key, "device_id") && BSON_ITER_HOLDS_UTF8(&iter)) {
+            retVal->deviceId = bson_strdup(bson_iter_utf8(&iter, NULL));
+        } else if (0 == strcmp(key, "time_window") && BSON_ITER_HOLDS_DOCUMENT(&iter) &&
+                   bson_iter_recurse(&iter, &childItr)) {
+            while (bson_iter_next(&childItr)) {
+                if (0 == strcmp(bson_iter_key(&childItr), "start_time")) {
+                    retVal->startTime = bson_iter_as_int64(&childItr);
+                    hasTimeWindow = true;
+                } else if (0 == strcmp(bson_iter_key(&childItr), "end_time")) {
+                    retVal->endTime = bson_iter_as_int64(&childItr);
+                }
+            }
+        } else if (0 == strcmp(key, "bounding_box") && BSON_ITER_HOLDS_DOCUMENT(&iter) &&
+                   bson_iter_recurse(&iter, &childItr)) {
+            int fieldCount = 0;
+            while (bson_iter_next(&childItr)) {
+                char const *boxKey = bson_iter_key(&childItr);
+                double value = DB_bsonValueDouble(bson_iter_value(&childItr));
+                if (0 == strcmp(boxKey, "min_latitude")) {
+                    retVal->minLatitude = value;
+                } else if (0 == strcmp(boxKey, "max_latitude")) {
+                    retVal->maxLatitude = value;
+                } else if (0 == strcmp(boxKey, "min_longitude")) {
+                    retVal->minLongitude = value;
+                } else if (0 == strcmp(boxKey, "max_longitude")) {
+                    retVal->maxLongitude = value;
+                } else {
+                    continue;
+                }
+                ++fieldCount;
+            }
+            retVal->hasBoundingBox = fieldCount == 4;
+        } else if (0 == strcmp(key, "tiles") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+            memcpy(&tilesItr, &iter, sizeof tilesItr);
+            hasTiles = true;
+        } else if (0 == strcmp(key, "log") && BSON_ITER_HOLDS_ARRAY(&iter)) {
+            uint32_t len;
+            uint8_t const *data;
+            bson_t array;
+            bson_iter_array(&iter, &len, &data);
+            if (!bson_init_static(&array, data, len)) {
+                continue;
+            }
+            retVal->points = bson_new_from_data(data, len);
+            size_t capacity = bson_count_keys(&array);
+            _reserveGpsLogPoints(retVal, capacity);
+            bson_iter_recurse(&iter, &childItr);
+            while (retVal->count < capacity && bson_iter_next(&childItr) &&
+                   _decodeGpsPoint(&childItr, &retVal->latitudes[retVal->count],
+                                   &retVal->longitudes[retVal->count], &retVal->times[retVal->count])) {
+                ++retVal->count;
+            }
+        }
+    }
+
+    if (!hasTimeWindow) {
+        DB_freeGpsLog(retVal);
+        return NULL;
+    }
+
+    /*
+     * Checked against the points so read last, whatever the order of the fields
+     */
+    if (hasTiles) {
+        _decodeTiles(&tilesItr, retVal);
+    }
+    return retVal;
+}
+
+void DB_freeFence(struct DB_Fence *pFence) {
+    if (NULL != pFence) {
+        if (NULL != pFence->record) {
+            bson_destroy(pFence->record);
+        }
+        bson_free(pFence->identifier);
+        bson_free(pFence->deviceId);
+        free(pFence->polygonLatitudes);
+        free(pFence->polygonLongitudes);
+        free(pFence);
+    }
+}
+
+void DB_freeGpsLog(struct DB_GpsLog *pLog) {
+    if (NULL != pLog) {
+        if (NULL != pLog->record) {
+            bson_destroy(pLog->record);
+        }
+        if (NULL != pLog->points) {
+            bson_destroy(pLog->points);
+        }
+        free(pLog->latitudes);
+        free(pLog->longitudes);
+        free(pLog->times);
+        free(pLog->tiles);
+        bson_free(pLog->deviceId);
+        free(pLog);
+    }
+}
+
 //endregion
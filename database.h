@@ -11,14 +11,104 @@
 #define DB "geofence"
 #define COLLECTION_FENCES "fences"
 #define COLLECTION_GPS_LOGS "gps_logs"
+#define COLLECTION_GPS_POINTS "gps_points"
+#define COLLECTION_LEASES "leases"
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+/*
+ * Gps log points are indexed by the cell of a grid of this many degrees that they fall in, DB_TILE_COLUMNS cells
+ * around each row
+ */
+#define DB_TILE_DEGREES 0.01
+#define DB_TILE_COLUMNS 36000
+
+/*
+ * Device ids name collections when partitioning by collection so they are kept short and to [A-Za-z0-9_-]
+ */
+#define DB_DEVICE_ID_MAX 64
+
+/*
+ * Where the records of each device_id are kept, records without a device_id form one more partition of their own
+ */
+enum DB_Partitioning {
+    DB_PARTITION_SHARED,     // one collection of each kind with device_id leading its indexes
+    DB_PARTITION_SHARDED,    // the shared collections, also sharded on their device_id indexes
+    DB_PARTITION_COLLECTION  // a collection of each kind per device, named <kind>.<device_id>
+};
+
 struct DB_Record {
     bson_t *record;
     char *message;
 };
 
+/*
+ * A fence decoded once from its record. Circle fences fill latitude, longitude and radius, polygon fences fill the
+ * polygon vertex arrays instead (polygonCount is 0 for circles).
+ */
+struct DB_Fence {
+    bson_t *record;
+    char *identifier;
+    char *deviceId;
+    int32_t entryTime;
+    double latitude;
+    double longitude;
+    double radius;
+    double *polygonLatitudes;
+    double *polygonLongitudes;
+    size_t polygonCount;
+};
+
+/*
+ * A run of consecutive gps log points [start, end) that fall in one tile cell
+ */
+struct DB_TileRun {
+    int64_t cell;
+    int32_t start;
+    int32_t end;
+};
+
+/*
+ * A gps log decoded once from its record with the points held in contiguous arrays. The tile runs are only kept when
+ * they cover every decoded point exactly once. points keeps the stored log array the points were decoded from, so a
+ * point can be returned with all of its fields.
+ */
+struct DB_GpsLog {
+    bson_t *record;
+    bson_t *points;
+    bool hasId;
+    bson_oid_t id;
+    char *deviceId;
+    int64_t startTime;
+    int64_t endTime;
+    double *latitudes;
+    double *longitudes;
+    int32_t *times;
+    size_t count;
+    bool hasBoundingBox;
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude;
+    double maxLongitude;
+    struct DB_TileRun *tiles;
+    size_t tileCount;
+};
+
+/*
+ * The points of a gps log to return, times from and to are inclusive and a maxPoints of 0 returns every point in the
+ * range
+ */
+struct DB_PointRange {
+    int64_t from;
+    int64_t to;
+    uint32_t maxPoints;
+};
+
+/**
+ * Opaque cursor over the documents of a collection being exported
+ */
+struct DB_Export;
+
 /*
  * Defines a function that inserts json into the database
  */
@@ -31,6 +121,22 @@ typedef struct DB_Record* (*DB_insertFunction) (char const *pJson, mongoc_client
  */
 struct DB_Record *DB_insertGpsLogRecord(char const *pJson, mongoc_client_t *pClient);
 
+/**
+ * Appends the points of a { "log": [...] } json body to the gps log with an id, widening its bounding_box and
+ * time_window without reading back the points it already has
+ *
+ * param pIdentifier - a valid object id of the gps log
+ * param pDeviceId - the device partition of the gps log, NULL for logs without a device_id
+ * param pFound - receives false when there is no gps log with the id
+ * param pPoints - receives the appended points decoded, or NULL when nothing was appended, which you must later
+ * DB_freeGpsLog(). Pass NULL when they are not needed.
+ *
+ * returns struct DB_Record holding the updated log without its points, or no record when the points are not valid,
+ * which you must later DB_deleteRecord()
+ */
+struct DB_Record *DB_appendGpsLogPoints(char const *pIdentifier, char const *pDeviceId, char const *pJson,
+                                        mongoc_client_t *pClient, bool *pFound, struct DB_GpsLog **pPoints);
+
 /**
  * Inserts a fence record when the record is valid
  *
@@ -41,46 +147,295 @@ struct DB_Record *DB_insertFenceRecord(char const *pJson, mongoc_client_t *pClie
 /**
  * Retrieve a fence record with an identifier
  *
+ * param pDeviceId - the device partition to search, NULL for fences without a device_id
+ *
  * returns struct DB_Record which you must later DB_deleteRecord()
  */
-struct DB_Record *DB_getFenceRecord(char const *pIdentifier, mongoc_client_t *pClient);
+struct DB_Record *DB_getFenceRecord(char const *pIdentifier, char const *pDeviceId, mongoc_client_t *pClient);
+
+/**
+ * Retrieve a fence with an identifier together with the gps log that spans its entry_time, in a single aggregation
+ * round trip using $lookup. Both keep their record for responses.
+ *
+ * param pDeviceId - the device partition of both, NULL for records without a device_id
+ * param pRange - when not NULL the log record keeps only the points in the range, selected server side, while the
+ * decoded points are still the whole log
+ * param pLog - receives the covering gps log, or NULL when there is none, which you must later DB_freeGpsLog()
+ *
+ * returns struct DB_Fence which you must later DB_freeFence() or NULL when the fence does not exist
+ */
+struct DB_Fence *DB_getFenceWithLog(char const *pIdentifier, char const *pDeviceId,
+                                    struct DB_PointRange const *pRange, mongoc_client_t *pClient,
+                                    struct DB_GpsLog **pLog);
+
+/**
+ * Retrieve every fence matching any of pCount identifiers with a single $in query. Each fence keeps its record.
+ *
+ * param pDeviceId - the device partition to search, NULL for fences without a device_id
+ * param pFenceCount - receives the number of fences found
+ *
+ * returns an array of struct DB_Fence which you must later DB_freeFence() and free()
+ */
+struct DB_Fence **DB_getFences(char const *const *pIdentifiers, size_t pCount, char const *pDeviceId,
+                               mongoc_client_t *pClient, size_t *pFenceCount);
+
+/**
+ * Retrieve every fence of a device whose entry_time is within [pStartTime, pEndTime], the fences a gps log spanning
+ * that window may be the corresponding log of. The fences do not keep their records.
+ *
+ * param pDeviceId - the device partition to search, NULL for fences without a device_id
+ * param pFenceCount - receives the number of fences found
+ *
+ * returns an array of struct DB_Fence which you must later DB_freeFence() and free()
+ */
+struct DB_Fence **DB_getFencesInWindow(char const *pDeviceId, int64_t pStartTime, int64_t pEndTime,
+                                       mongoc_client_t *pClient, size_t *pFenceCount);
 
 /**
- * Retrieve a list of log record sub-sets (id, time_window, bounding_box)
+ * Retrieve a list of log record sub-sets (id, device_id, time_window, bounding_box) of one device partition
  *
  * returns struct DB_Record which you must later DB_deleteRecord()
  */
-struct DB_Record *DB_getGpsLogRecordList(mongoc_client_t *pClient);
+struct DB_Record *DB_getGpsLogRecordList(char const *pDeviceId, mongoc_client_t *pClient);
 
 /**
- * Retrieve a list of fence entry records
+ * Retrieve a list of fence entry records of one device partition
  *
  * returns struct DB_Record which you must later DB_deleteRecord()
  */
-struct DB_Record *DB_getFenceRecordList(mongoc_client_t *pClient);
+struct DB_Record *DB_getFenceRecordList(char const *pDeviceId, mongoc_client_t *pClient);
 
 /**
- * Retrieve a gps log record that spans a specified time
+ * Retrieve a gps log record of a device that spans a specified time
+ *
+ * param pDeviceId - the device partition to search, NULL for logs without a device_id
+ * param pRange - when not NULL only the points in the range are returned, selected server side
  *
  * returns struct DB_Record which you must later DB_deleteRecord()
  */
-struct DB_Record *DB_getGpsLogRecord(int64_t pEpochTime, mongoc_client_t *pClient);
+struct DB_Record *DB_getGpsLogRecord(int64_t pEpochTime, char const *pDeviceId, struct DB_PointRange const *pRange,
+                                     mongoc_client_t *pClient);
+
+/**
+ * Retrieve a gps log record like DB_getGpsLogRecord() serialized to json straight from the cursor's reply, so the
+ * record is never copied as bson
+ *
+ * param pLength - receives the length of the json
+ *
+ * returns the json which you must later bson_free() or NULL when there is no such log
+ */
+char *DB_getGpsLogRecordJson(int64_t pEpochTime, char const *pDeviceId, struct DB_PointRange const *pRange,
+                             mongoc_client_t *pClient, size_t *pLength);
+
+/**
+ * Retrieve the gps log of a device that spans a specified time, fetching only the id, device_id, time window and,
+ * when pWithPoints is set, the points. The record is not kept.
+ *
+ * param pDeviceId - the device partition to search, NULL for logs without a device_id
+ *
+ * returns struct DB_GpsLog which you must later DB_freeGpsLog() or NULL when no log spans the time
+ */
+struct DB_GpsLog *DB_getGpsLog(int64_t pEpochTime, char const *pDeviceId, bool pWithPoints, mongoc_client_t *pClient);
+
+/**
+ * Retrieve the points of a gps log that may fall within a fence, found server side with the 2dsphere index on
+ * gps_points (DB_GEOJSON_STORAGE builds only). Circles are searched with a slightly enlarged radius so the caller
+ * must confirm each candidate exactly.
+ *
+ * param pLogId - the _id of the gps log
+ * param pDeviceId - the device partition of the gps log, NULL for logs without a device_id
+ *
+ * returns struct DB_GpsLog holding only the candidate points in log order which you must later DB_freeGpsLog() or
+ * NULL when the search failed
+ */
+struct DB_GpsLog *DB_getEntryCandidates(bson_oid_t const *pLogId, char const *pDeviceId,
+                                        struct DB_Fence const *pFence, mongoc_client_t *pClient);
+
+/**
+ * Create the compound indexes, led by device_id, that the storage mode relies on and shard the collections when
+ * partitioning is DB_PARTITION_SHARDED. With DB_PARTITION_COLLECTION the collections of each device are indexed when
+ * this process first inserts into them.
+ */
+bool DB_ensureIndexes(mongoc_client_t *pClient);
+
+/**
+ * Take or renew the lease pName for pOwner, so a background job runs in only one process of the deployment
+ *
+ * param pSeconds - how long the lease is held unless renewed
+ *
+ * returns true when pOwner holds the lease
+ */
+bool DB_acquireLease(char const *pName, char const *pOwner, int64_t pSeconds, mongoc_client_t *pClient);
+
+/**
+ * List the gps log collections, those of each device with DB_PARTITION_COLLECTION. The entries are passed as
+ * pPartition to the compaction functions, which do not filter on device_id.
+ *
+ * returns an array led by NULL (the gps_logs collection) then the device ids which you must later bson_free() each of
+ * and free()
+ */
+char **DB_getGpsLogPartitions(mongoc_client_t *pClient, size_t *pCount);
+
+/**
+ * Retrieve, in _id order, the next gps logs of a partition that ended before pEndedBefore and were never compacted,
+ * with their points
+ *
+ * param pAfter - only logs with a greater _id are read, receives the _id of the last log read (even one that could
+ * not be decoded) so a pass resumes after it and ends once it no longer changes
+ * param pLogCount - receives the number of logs found
+ *
+ * returns an array of struct DB_GpsLog which you must later DB_freeGpsLog() and free()
+ */
+struct DB_GpsLog **DB_getGpsLogsToCompact(char const *pPartition, int64_t pEndedBefore, bson_oid_t *pAfter,
+                                          uint32_t pLimit, mongoc_client_t *pClient, size_t *pLogCount);
+
+/**
+ * Rewrite a gps log with only some of its points, rebuilding its bounding_box, time_window, point_count and tiles
+ * (and its gps_points with DB_GEOJSON_STORAGE), and mark it { compacted: { time, tolerance_meters, point_count } }.
+ * A log that gained points since it was read is left alone.
+ *
+ * param pLog - the log as read by DB_getGpsLogsToCompact()
+ * param pKeep - the ascending indices of the points to keep, at least one
+ *
+ * returns false when the rewrite failed or the log was left alone
+ */
+bool DB_compactGpsLog(struct DB_GpsLog const *pLog, size_t const *pKeep, size_t pKeptCount, double pToleranceMeters,
+                      mongoc_client_t *pClient);
+
+/**
+ * Delete up to pLimit of the gps logs of a partition that ended before pEndedBefore, with their gps_points
+ *
+ * returns the number of logs deleted or -1 when the delete failed
+ */
+int64_t DB_expireGpsLogs(char const *pPartition, int64_t pEndedBefore, uint32_t pLimit, mongoc_client_t *pClient);
+
+/**
+ * Open a cursor over the stored documents of a device partition in _id order, so an interrupted export resumes after
+ * the last _id it received
+ *
+ * param pCollection - COLLECTION_FENCES, COLLECTION_GPS_LOGS or COLLECTION_GPS_POINTS
+ * param pFrom - documents timed before are skipped, INT64_MIN for no bound. Gps logs are selected by the overlap of
+ * their time_window, fences by entry_time and gps points by time.
+ * param pTo - documents timed after are skipped, INT64_MAX for no bound
+ * param pAfter - only documents with a greater _id are returned, NULL to start from the first
+ *
+ * returns struct DB_Export which you must later DB_closeExport() before the client is released
+ */
+struct DB_Export *DB_openExport(char const *pCollection, char const *pDeviceId, int64_t pFrom, int64_t pTo,
+                                bson_oid_t const *pAfter, mongoc_client_t *pClient);
+
+/**
+ * Advance an export, fetching the next batch from the server when the current one is used up
+ *
+ * param pDocument - receives the document, it points into the cursor's reply and is only valid until the next call
+ *
+ * returns false once the export ended, DB_exportFailed() tells whether it was cut short by an error
+ */
+bool DB_nextExport(struct DB_Export *pExport, bson_t const **pDocument);
+
+/**
+ * returns true when the cursor of the export failed
+ */
+bool DB_exportFailed(struct DB_Export const *pExport);
+
+/**
+ * Record the export with the slow operations if it was slow and deallocate it
+ */
+void DB_closeExport(struct DB_Export *pExport);
+
+/**
+ * Delete a gps log record with an id from a device partition, NULL for logs without a device_id
+ *
+ * returns false when the delete failed
+ */
+bool DB_deleteGpsLogRecord(char const *pIdentifier, char const *pDeviceId, mongoc_client_t *pClient);
+
+/**
+ * Delete a fence record with an id from a device partition, NULL for fences without a device_id
+ *
+ * returns false when the delete failed
+ */
+bool DB_deleteFenceRecord(char const *pIdentifier, char const *pDeviceId, mongoc_client_t *pClient);
+
+/**
+ * Find the partitioning named shared, sharded or collection
+ *
+ * returns pDefault when pName is NULL or names no partitioning
+ */
+enum DB_Partitioning DB_partitioningFor(char const *pName, enum DB_Partitioning pDefault);
 
 /**
- * Delete a gps log record with an id.
+ * Choose where the records of each device are kept, before any database function is called
  */
-void DB_deleteGpsLogRecord(char const *pIdentifier, mongoc_client_t *pClient);
+void DB_configurePartitioning(enum DB_Partitioning pPartitioning);
 
 /**
- * Delete a gps log record with an id.
+ * Whether a device id is 1 to DB_DEVICE_ID_MAX characters of [A-Za-z0-9_-]
  */
-void DB_deleteFenceRecord(char const *pIdentifier, mongoc_client_t *pClient);
+bool DB_isValidDeviceId(char const *pDeviceId);
 
 /**
  * Deallocate a record that has been retrieved
  */
 void DB_freeRecord(struct DB_Record *pRecord);
 
+/**
+ * Validate a fence json string the way POST /fence_entry does, without inserting it
+ *
+ * returns the record which you must later bson_destroy() or NULL when it is not a valid fence
+ */
+bson_t *DB_validateFence(char const *pJson);
+
+/**
+ * Validate a gps log json string the way POST /gps_log does (adding its time_window, bounding_box, point_count and
+ * tiles), without inserting it
+ *
+ * returns the record which you must later bson_destroy() or NULL when it is not a valid gps log
+ */
+bson_t *DB_validateGpsLog(char const *pJson);
+
+/**
+ * Decode a fence record, checking the type of every field
+ *
+ * returns struct DB_Fence without a record which you must later DB_freeFence() or NULL when the record is not a
+ * valid fence
+ */
+struct DB_Fence *DB_decodeFence(bson_t const *pDocument);
+
+/**
+ * Decode a gps log record, checking the type of every field. Points are decoded up to the first malformed point and
+ * a record fetched without its log decodes with no points.
+ *
+ * returns struct DB_GpsLog without a record which you must later DB_freeGpsLog() or NULL when the record has no
+ * time_window
+ */
+struct DB_GpsLog *DB_decodeGpsLog(bson_t const *pDocument);
+
+/**
+ * Deallocate a decoded fence and its record
+ */
+void DB_freeFence(struct DB_Fence *pFence);
+
+/**
+ * Deallocate a decoded gps log and its record
+ */
+void DB_freeGpsLog(struct DB_GpsLog *pLog);
+
+/**
+ * The row of tile cells a latitude falls in
+ */
+int64_t DB_tileRow(double pLatitude);
+
+/**
+ * The column of tile cells a longitude falls in
+ */
+int64_t DB_tileColumn(double pLongitude);
+
+/**
+ * The tile cell a point falls in, row * DB_TILE_COLUMNS + column
+ */
+int64_t DB_tileCell(double pLatitude, double pLongitude);
+
 bool DB_bsonTypeIsNumber(bson_type_t const *pType);
 
 /**
@@ -88,4 +443,9 @@ bool DB_bsonTypeIsNumber(bson_type_t const *pType);
  */
 int32_t DB_bsonValueInt32(bson_value_t const *pValue);
 
+/**
+ * Get a numeric value as a double.
+ */
+double DB_bsonValueDouble(bson_value_t const *pValue);
+
 #endif //GEOFENCEBEC_DATABASE_H
@@ -0,0 +1,332 @@
+//
+// Created by William Kamp on 7/5/16.
+//
+
+#include <math.h>
+#include <stdatomic.h>
+#include "entry.h"
+#include "location.h"
+#include "polygon.h"
+#include "trace.h"
+
+#define CHUNKS_PER_WORKER 4
+#define CANCEL_CHECK_INTERVAL 256
+#define POLYGON_BLOCK_SIZE 256
+#define FENCE_BOX_SLACK 1.01
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * Shared state of one find-first scan
+ */
+struct ENT_Scan {
+    struct DB_Fence const *fence;
+    struct PLY_Polygon *polygon;
+    struct DB_GpsLog const *log;
+    atomic_size_t firstHit;
+    uint64_t traceRequest;
+};
+
+struct ENT_Chunk {
+    struct ENT_Scan *scan;
+    size_t start;
+    size_t end;
+};
+
+/*
+ * A latitude and longitude box in degrees
+ */
+struct ENT_Box {
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude;
+    double maxLongitude;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Search the log, in chunks spread over the worker pool when pWorkers is not NULL
+ *
+ * returns the index of the point or SIZE_MAX when the fence is never entered
+ */
+size_t _findFirst(struct ENT_Scan *pScan, struct TP_Pool *pWorkers);
+
+/**
+ * The box holding every point inside a fence, a circle's enlarged by FENCE_BOX_SLACK for the change in scale across it
+ *
+ * returns false when the box would cross a pole or the antimeridian, boxes are not used for such fences
+ */
+bool _fenceBox(struct DB_Fence const *pFence, struct ENT_Box *pBox);
+
+/**
+ * Search only the tile runs of the log whose cell intersects pBox, in log order, falling back to _findFirst() when
+ * they hold too many points to search on one thread
+ *
+ * returns the index of the point or SIZE_MAX when the fence is never entered
+ */
+size_t _findFirstInTiles(struct ENT_Scan *pScan, struct ENT_Box const *pBox, struct TP_Pool *pWorkers);
+
+/**
+ * Worker pool task searching one chunk of a scan, traced as one LOC_calculateLocationInfo batch
+ */
+void _scanChunk(void *pArg);
+
+/**
+ * Search one chunk of a scan, recording the first point inside the fence
+ */
+void _searchChunk(struct ENT_Chunk *pChunk);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Lower the scan's first hit to pIndex unless an earlier hit is already recorded
+ */
+static void __recordHit(struct ENT_Scan *pScan, size_t pIndex) {
+    size_t current = atomic_load(&pScan->firstHit);
+    while (pIndex < current && !atomic_compare_exchange_weak(&pScan->firstHit, &current, pIndex)) {
+    }
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void _scanChunk(void *pArg) {
+    struct ENT_Chunk *chunk = pArg;
+
+    /*
+     * Chunks run on pool workers, carry the request being traced over from the thread that started the scan
+     */
+    uint64_t previousRequest = TRC_currentRequest();
+    TRC_setRequest(chunk->scan->traceRequest);
+    struct TRC_Span span;
+    TRC_begin(&span, chunk->scan->polygon != NULL ? "PLY_containsPoints batch" : "LOC_calculateLocationInfo batch");
+    _searchChunk(chunk);
+    TRC_end(&span);
+    TRC_setRequest(previousRequest);
+}
+
+void _searchChunk(struct ENT_Chunk *pChunk) {
+    struct ENT_Scan *scan = pChunk->scan;
+    struct DB_Fence const *fence = scan->fence;
+    struct DB_GpsLog const *log = scan->log;
+
+    /*
+     * Polygons are tested a block of points per call
+     */
+    if (scan->polygon != NULL) {
+        uint8_t inside[POLYGON_BLOCK_SIZE];
+        for (size_t i = pChunk->start; i < pChunk->end; i += POLYGON_BLOCK_SIZE) {
+            if (atomic_load_explicit(&scan->firstHit, memory_order_relaxed) < pChunk->start) {
+                return;
+            }
+
+            size_t count = MIN(POLYGON_BLOCK_SIZE, pChunk->end - i);
+            PLY_containsPoints(scan->polygon, &log->latitudes[i], &log->longitudes[i], count, inside);
+            for (size_t j = 0; j < count; ++j) {
+                if (inside[j]) {
+                    __recordHit(scan, i + j);
+                    return;
+                }
+            }
+        }
+        return;
+    }
+
+    struct LocationInfo locationInfo;
+    for (size_t i = pChunk->start; i < pChunk->end; ++i) {
+        /*
+         * Give up once an earlier chunk has confirmed a hit, nothing in this chunk can be first any more
+         */
+        if ((i - pChunk->start) % CANCEL_CHECK_INTERVAL == 0 &&
+            atomic_load_explicit(&scan->firstHit, memory_order_relaxed) < pChunk->start) {
+            return;
+        }
+
+        LOC_calculateLocationInfo(&locationInfo, fence->latitude, fence->longitude, log->latitudes[i],
+                                  log->longitudes[i]);
+        if (locationInfo.distanceMeters <= fence->radius) {
+            __recordHit(scan, i);
+            return;
+        }
+    }
+}
+
+bool _fenceBox(struct DB_Fence const *pFence, struct ENT_Box *pBox) {
+    if (pFence->polygonCount > 0) {
+        pBox->minLatitude = pBox->maxLatitude = pFence->polygonLatitudes[0];
+        pBox->minLongitude = pBox->maxLongitude = pFence->polygonLongitudes[0];
+        for (size_t i = 1; i < pFence->polygonCount; ++i) {
+            pBox->minLatitude = MIN(pBox->minLatitude, pFence->polygonLatitudes[i]);
+            pBox->maxLatitude = MAX(pBox->maxLatitude, pFence->polygonLatitudes[i]);
+            pBox->minLongitude = MIN(pBox->minLongitude, pFence->polygonLongitudes[i]);
+            pBox->maxLongitude = MAX(pBox->maxLongitude, pFence->polygonLongitudes[i]);
+        }
+        return pBox->maxLongitude - pBox->minLongitude <= 180.0;
+    }
+
+    /*
+     * A degree of longitude is shortest at the latitude furthest from the equator
+     */
+    double latitudeMeters;
+    double longitudeMeters;
+    double radius = pFence->radius * FENCE_BOX_SLACK;
+    LOC_metersPerDegree(pFence->latitude, &latitudeMeters, &longitudeMeters);
+    pBox->minLatitude = pFence->latitude - radius / latitudeMeters;
+    pBox->maxLatitude = pFence->latitude + radius / latitudeMeters;
+    if (pBox->minLatitude <= -90.0 || pBox->maxLatitude >= 90.0) {
+        return false;
+    }
+    LOC_metersPerDegree(MAX(fabs(pBox->minLatitude), fabs(pBox->maxLatitude)), &latitudeMeters, &longitudeMeters);
+    pBox->minLongitude = pFence->longitude - radius / longitudeMeters;
+    pBox->maxLongitude = pFence->longitude + radius / longitudeMeters;
+    return pBox->minLongitude > -180.0 && pBox->maxLongitude < 180.0;
+}
+
+size_t _findFirstInTiles(struct ENT_Scan *pScan, struct ENT_Box const *pBox, struct TP_Pool *pWorkers) {
+    struct DB_GpsLog const *log = pScan->log;
+    int64_t minRow = DB_tileRow(pBox->minLatitude);
+    int64_t maxRow = DB_tileRow(pBox->maxLatitude);
+    int64_t minColumn = DB_tileColumn(pBox->minLongitude);
+    int64_t maxColumn = DB_tileColumn(pBox->maxLongitude);
+
+    /*
+     * The runs are sorted by their first point so the candidates are visited in log order
+     */
+    struct ENT_Chunk *candidates = malloc(MAX(log->tileCount, 1) * sizeof(struct ENT_Chunk));
+    size_t candidateCount = 0;
+    size_t pointCount = 0;
+    for (size_t i = 0; i < log->tileCount; ++i) {
+        struct DB_TileRun const *run = &log->tiles[i];
+        int64_t row = run->cell / DB_TILE_COLUMNS;
+        int64_t column = run->cell % DB_TILE_COLUMNS;
+        if (run->cell >= 0 && row >= minRow && row <= maxRow && column >= minColumn && column <= maxColumn) {
+            candidates[candidateCount].scan = pScan;
+            candidates[candidateCount].start = (size_t) run->start;
+            candidates[candidateCount].end = (size_t) run->end;
+            ++candidateCount;
+            pointCount += (size_t) (run->end - run->start);
+        }
+    }
+
+    if (NULL != pWorkers && pointCount >= ENT_PARALLEL_THRESHOLD) {
+        free(candidates);
+        return _findFirst(pScan, pWorkers);
+    }
+
+    struct TRC_Span span;
+    TRC_begin(&span, "tile candidates");
+    atomic_init(&pScan->firstHit, SIZE_MAX);
+    for (size_t i = 0; i < candidateCount && atomic_load(&pScan->firstHit) == SIZE_MAX; ++i) {
+        _searchChunk(&candidates[i]);
+    }
+    TRC_end(&span);
+    free(candidates);
+    return atomic_load(&pScan->firstHit);
+}
+
+size_t _findFirst(struct ENT_Scan *pScan, struct TP_Pool *pWorkers) {
+    size_t count = pScan->log->count;
+    atomic_init(&pScan->firstHit, SIZE_MAX);
+
+    if (NULL == pWorkers) {
+        struct ENT_Chunk chunk = {pScan, 0, count};
+        _scanChunk(&chunk);
+        return atomic_load(&pScan->firstHit);
+    }
+
+    size_t chunkCount = TP_threadCount(pWorkers) * CHUNKS_PER_WORKER;
+    size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+    struct ENT_Chunk *chunks = malloc(chunkCount * sizeof(struct ENT_Chunk));
+    struct TP_Group group;
+    TP_initGroup(&group);
+
+    /*
+     * Submit the last chunk first, workers pop their own deque newest first so the earliest chunks start soonest
+     */
+    for (size_t c = chunkCount; c-- > 0;) {
+        chunks[c].scan = pScan;
+        chunks[c].start = MIN(c * chunkSize, count);
+        chunks[c].end = MIN(chunks[c].start + chunkSize, count);
+        TP_submit(pWorkers, &group, &_scanChunk, &chunks[c]);
+    }
+    TP_wait(pWorkers, &group);
+    TP_destroyGroup(&group);
+
+    free(chunks);
+    return atomic_load(&pScan->firstHit);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bson_t *ENT_findEntryPoint(struct DB_Fence const *pFence, struct DB_GpsLog const *pLog, struct TP_Pool *pWorkers) {
+    size_t index = ENT_findEntryIndex(pFence, pLog, pWorkers);
+    return index != SIZE_MAX ? ENT_entryPoint(pFence, pLog, index) : NULL;
+}
+
+size_t ENT_findEntryIndex(struct DB_Fence const *pFence, struct DB_GpsLog const *pLog, struct TP_Pool *pWorkers) {
+    struct ENT_Scan scan;
+    scan.fence = pFence;
+    scan.log = pLog;
+    scan.polygon = NULL;
+    scan.traceRequest = TRC_currentRequest();
+
+    /*
+     * A log whose bounding box misses the fence cannot enter it
+     */
+    struct ENT_Box box;
+    bool hasBox = _fenceBox(pFence, &box);
+    if (hasBox && pLog->hasBoundingBox &&
+        (pLog->maxLatitude < box.minLatitude || pLog->minLatitude > box.maxLatitude ||
+         pLog->maxLongitude < box.minLongitude || pLog->minLongitude > box.maxLongitude)) {
+        return SIZE_MAX;
+    }
+
+    if (pFence->polygonCount > 0) {
+        scan.polygon = PLY_createPolygon(pFence->polygonLatitudes, pFence->polygonLongitudes, pFence->polygonCount);
+        if (NULL == scan.polygon) {
+            return SIZE_MAX;
+        }
+    }
+
+    bool parallel = NULL != pWorkers && pLog->count >= ENT_PARALLEL_THRESHOLD;
+    size_t index = hasBox && pLog->tileCount > 0 ? _findFirstInTiles(&scan, &box, parallel ? pWorkers : NULL)
+                                                 : _findFirst(&scan, parallel ? pWorkers : NULL);
+    PLY_destroyPolygon(scan.polygon);
+    return index;
+}
+
+bson_t *ENT_entryPoint(struct DB_Fence const *pFence, struct DB_GpsLog const *pLog, size_t pIndex) {
+    bson_t *actualEntryPoint = NULL;
+
+    /*
+     * Copy the stored point whole, candidates were decoded without it
+     */
+    bson_iter_t iter;
+    char iStr[16];
+    char const *key;
+    bson_uint32_to_string((uint32_t) pIndex, &key, iStr, sizeof iStr);
+    if (NULL != pLog->points && bson_iter_init_find(&iter, pLog->points, key) && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+        uint32_t len;
+        uint8_t const *data;
+        bson_iter_document(&iter, &len, &data);
+        actualEntryPoint = bson_new_from_data(data, len);
+    }
+    if (NULL == actualEntryPoint) {
+        actualEntryPoint = bson_new();
+        BSON_APPEND_DOUBLE(actualEntryPoint, "latitude", pLog->latitudes[pIndex]);
+        BSON_APPEND_DOUBLE(actualEntryPoint, "longitude", pLog->longitudes[pIndex]);
+        BSON_APPEND_INT32(actualEntryPoint, "time", pLog->times[pIndex]);
+    }
+    BSON_APPEND_INT32(actualEntryPoint, "entry_delta", pFence->entryTime - pLog->times[pIndex]);
+    return actualEntryPoint;
+}
+
+//endregion
@@ -0,0 +1,47 @@
+//
+// Created by William Kamp on 7/5/16.
+//
+
+#ifndef GEOFENCEBEC_ENTRY_H
+#define GEOFENCEBEC_ENTRY_H
+
+#include <libmongoc-1.0/mongoc.h>
+#include "database.h"
+#include "threadpool.h"
+
+/*
+ * Logs with at least this many points are searched in parallel chunks
+ */
+#define ENT_PARALLEL_THRESHOLD 50000
+
+/**
+ * Scan the points of a gps log for the first one that falls within a fence
+ *
+ * param pFence - a circle or polygon fence
+ * param pLog - the log points to search, either a whole log or the candidates from DB_getEntryCandidates()
+ * param pWorkers - pool used to search logs of at least ENT_PARALLEL_THRESHOLD points, NULL to always scan on the
+ * calling thread
+ *
+ * returns a new ENT_entryPoint() document for the first point inside the fence which you must later bson_destroy()
+ * or NULL when the log never enters the fence
+ */
+bson_t *ENT_findEntryPoint(struct DB_Fence const *pFence, struct DB_GpsLog const *pLog, struct TP_Pool *pWorkers);
+
+/**
+ * Scan the points of a gps log for the first one that falls within a fence, as ENT_findEntryPoint() does. A log whose
+ * bounding box misses the fence is not scanned and a log with a tile index only has its runs in tiles the fence
+ * touches scanned.
+ *
+ * returns the index of the point in pLog or SIZE_MAX when the log never enters the fence
+ */
+size_t ENT_findEntryIndex(struct DB_Fence const *pFence, struct DB_GpsLog const *pLog, struct TP_Pool *pWorkers);
+
+/**
+ * Describe point pIndex of pLog as the entry into pFence, the stored point with its entry_delta added
+ *
+ * returns a new copy of the stored point plus entry_delta, or { latitude, longitude, time, entry_delta } for a log
+ * decoded without its stored points, which you must later bson_destroy()
+ */
+bson_t *ENT_entryPoint(struct DB_Fence const *pFence, struct DB_GpsLog const *pLog, size_t pIndex);
+
+#endif //GEOFENCEBEC_ENTRY_H
@@ -0,0 +1,246 @@
+//
+// Created by William Kamp on 8/22/16.
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libbson-1.0/bson.h>
+#include "events.h"
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A text/event-stream waiting to be read, a waiting subscriber has been read empty and is woken by the next event
+ */
+struct EVT_Subscriber {
+    struct EVT_Subscriber *next;
+    size_t bucket;
+    char *deviceId;
+    char **identifiers;
+    size_t identifierCount;
+    bson_string_t *pending;
+    size_t readOffset;
+    bool waiting;
+    bool closed;
+    EVT_streamFunction wait;
+    EVT_streamFunction wake;
+    void *context;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Queue text to a subscriber, ending its stream instead when it has fallen too far behind, and wake it when waiting.
+ * The hub must be locked.
+ */
+void _queue(struct EVT_Subscriber *pSubscriber, char const *pText);
+
+/**
+ * returns true when pSubscriber follows the fence pIdentifier of the device
+ */
+bool _follows(struct EVT_Subscriber const *pSubscriber, char const *pDeviceId, char const *pIdentifier);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static pthread_mutex_t __lock = PTHREAD_MUTEX_INITIALIZER;
+static struct EVT_Subscriber *__buckets[EVT_BUCKET_COUNT];
+static size_t __subscriberCount = 0;
+static uint64_t __nextEventId = 1;
+static bool __closing = false;
+
+/*
+ * FNV-1a of the device id, records without one share the bucket of the empty string
+ */
+static size_t __bucketFor(char const *pDeviceId) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char const *c = NULL != pDeviceId ? pDeviceId : ""; *c != '\0'; ++c) {
+        hash = (hash ^ (uint8_t) *c) * 1099511628211ULL;
+    }
+    return (size_t) (hash % EVT_BUCKET_COUNT);
+}
+
+static bool __sameDevice(char const *pA, char const *pB) {
+    return (NULL == pA && NULL == pB) || (NULL != pA && NULL != pB && 0 == strcmp(pA, pB));
+}
+
+static int __compareIdentifiers(void const *pA, void const *pB) {
+    return strcmp(*(char const *const *) pA, *(char const *const *) pB);
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void _queue(struct EVT_Subscriber *pSubscriber, char const *pText) {
+    if (pSubscriber->closed) {
+        return;
+    }
+    if (pSubscriber->pending->len - pSubscriber->readOffset + strlen(pText) > EVT_MAX_PENDING_BYTES) {
+        bson_string_truncate(pSubscriber->pending, 0);
+        pSubscriber->readOffset = 0;
+        pSubscriber->closed = true;
+    } else {
+        bson_string_append(pSubscriber->pending, pText);
+    }
+    if (pSubscriber->waiting) {
+        pSubscriber->waiting = false;
+        pSubscriber->wake(pSubscriber->context);
+    }
+}
+
+bool _follows(struct EVT_Subscriber const *pSubscriber, char const *pDeviceId, char const *pIdentifier) {
+    if (!__sameDevice(pSubscriber->deviceId, pDeviceId)) {
+        return false;
+    }
+    return pSubscriber->identifierCount == 0 ||
+           NULL != bsearch(&pIdentifier, pSubscriber->identifiers, pSubscriber->identifierCount, sizeof(char *),
+                           &__compareIdentifiers);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct EVT_Subscriber *EVT_subscribe(char const *pDeviceId, char const *const *pIdentifiers, size_t pCount,
+                                     EVT_streamFunction fWait, EVT_streamFunction fWake, void *pContext) {
+    struct EVT_Subscriber *retVal = calloc(1, sizeof(struct EVT_Subscriber));
+    retVal->bucket = __bucketFor(pDeviceId);
+    retVal->deviceId = NULL != pDeviceId ? bson_strdup(pDeviceId) : NULL;
+    retVal->identifierCount = NULL != pIdentifiers ? pCount : 0;
+    retVal->identifiers = malloc((retVal->identifierCount > 0 ? retVal->identifierCount : 1) * sizeof(char *));
+    for (size_t i = 0; i < retVal->identifierCount; ++i) {
+        retVal->identifiers[i] = bson_strdup(pIdentifiers[i]);
+    }
+    qsort(retVal->identifiers, retVal->identifierCount, sizeof(char *), &__compareIdentifiers);
+
+    /*
+     * The retry hint is sent right away so the response headers go out without waiting for the first event
+     */
+    retVal->pending = bson_string_new("retry: 5000\n\n");
+    retVal->wait = fWait;
+    retVal->wake = fWake;
+    retVal->context = pContext;
+
+    pthread_mutex_lock(&__lock);
+    retVal->closed = __closing;
+    retVal->next = __buckets[retVal->bucket];
+    __buckets[retVal->bucket] = retVal;
+    ++__subscriberCount;
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+void EVT_unsubscribe(struct EVT_Subscriber *pSubscriber) {
+    pthread_mutex_lock(&__lock);
+    struct EVT_Subscriber **link = &__buckets[pSubscriber->bucket];
+    while (NULL != *link && *link != pSubscriber) {
+        link = &(*link)->next;
+    }
+    if (NULL != *link) {
+        *link = pSubscriber->next;
+        --__subscriberCount;
+    }
+    pthread_mutex_unlock(&__lock);
+
+    for (size_t i = 0; i < pSubscriber->identifierCount; ++i) {
+        bson_free(pSubscriber->identifiers[i]);
+    }
+    free(pSubscriber->identifiers);
+    bson_free(pSubscriber->deviceId);
+    bson_string_free(pSubscriber->pending, true);
+    free(pSubscriber);
+}
+
+size_t EVT_read(struct EVT_Subscriber *pSubscriber, char *pBuffer, size_t pMax, bool *pOpen) {
+    pthread_mutex_lock(&__lock);
+    size_t retVal = pSubscriber->pending->len - pSubscriber->readOffset;
+    retVal = retVal < pMax ? retVal : pMax;
+    memcpy(pBuffer, pSubscriber->pending->str + pSubscriber->readOffset, retVal);
+    pSubscriber->readOffset += retVal;
+    if (pSubscriber->readOffset == pSubscriber->pending->len) {
+        bson_string_truncate(pSubscriber->pending, 0);
+        pSubscriber->readOffset = 0;
+    }
+    *pOpen = retVal > 0 || !pSubscriber->closed;
+    pSubscriber->waiting = retVal == 0 && *pOpen;
+    if (pSubscriber->waiting) {
+        pSubscriber->wait(pSubscriber->context);
+    }
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+bool EVT_hasSubscribers(char const *pDeviceId) {
+    bool retVal = false;
+    pthread_mutex_lock(&__lock);
+    for (struct EVT_Subscriber *s = __buckets[__bucketFor(pDeviceId)]; !retVal && NULL != s; s = s->next) {
+        retVal = __sameDevice(s->deviceId, pDeviceId);
+    }
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+bool EVT_isSubscribed(char const *pDeviceId, char const *pIdentifier) {
+    bool retVal = false;
+    pthread_mutex_lock(&__lock);
+    for (struct EVT_Subscriber *s = __buckets[__bucketFor(pDeviceId)]; !retVal && NULL != s; s = s->next) {
+        retVal = _follows(s, pDeviceId, pIdentifier);
+    }
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+void EVT_publish(char const *pDeviceId, char const *pIdentifier, char const *pData) {
+    pthread_mutex_lock(&__lock);
+    char *text = bson_strdup_printf("id: %llu\nevent: entry\ndata: %s\n\n", (unsigned long long) __nextEventId++,
+                                    pData);
+    for (struct EVT_Subscriber *s = __buckets[__bucketFor(pDeviceId)]; NULL != s; s = s->next) {
+        if (_follows(s, pDeviceId, pIdentifier)) {
+            _queue(s, text);
+        }
+    }
+    pthread_mutex_unlock(&__lock);
+    bson_free(text);
+}
+
+void EVT_keepalive(void) {
+    pthread_mutex_lock(&__lock);
+    for (size_t i = 0; i < EVT_BUCKET_COUNT; ++i) {
+        for (struct EVT_Subscriber *s = __buckets[i]; NULL != s; s = s->next) {
+            if (s->waiting) {
+                _queue(s, ": keepalive\n\n");
+            }
+        }
+    }
+    pthread_mutex_unlock(&__lock);
+}
+
+void EVT_closeAll(void) {
+    pthread_mutex_lock(&__lock);
+    __closing = true;
+    for (size_t i = 0; i < EVT_BUCKET_COUNT; ++i) {
+        for (struct EVT_Subscriber *s = __buckets[i]; NULL != s; s = s->next) {
+            s->closed = true;
+            if (s->waiting) {
+                s->waiting = false;
+                s->wake(s->context);
+            }
+        }
+    }
+    pthread_mutex_unlock(&__lock);
+}
+
+size_t EVT_subscriberCount(void) {
+    pthread_mutex_lock(&__lock);
+    size_t retVal = __subscriberCount;
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+//endregion
@@ -0,0 +1,94 @@
+//
+// Created by William Kamp on 8/22/16.
+//
+
+#ifndef GEOFENCEBEC_EVENTS_H
+#define GEOFENCEBEC_EVENTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Subscribers are kept in buckets by the hash of their device so a publish only visits those of its device
+ */
+#define EVT_BUCKET_COUNT 1024
+
+/*
+ * Bytes a subscriber may fall behind by before its stream is ended, the client reconnects and polls what it missed
+ */
+#define EVT_MAX_PENDING_BYTES (256 * 1024)
+
+/*
+ * Defines a function that parks or wakes the stream of a subscriber, eg suspending or resuming its connection
+ */
+typedef void (*EVT_streamFunction)(void *pContext);
+
+/**
+ * Opaque subscription to the fence entries of one device
+ */
+struct EVT_Subscriber;
+
+/**
+ * Subscribe to the entries into fences of a device
+ *
+ * param pDeviceId - the device partition to follow, NULL for fences without a device_id
+ * param pIdentifiers - the fence identifiers to follow, NULL to follow every fence of the device
+ * param pCount - the number of identifiers
+ * param fWait - called, with the hub locked, when EVT_read() finds nothing pending so no event slips in before the
+ * stream is parked
+ * param fWake - called, with the hub locked, when events arrive for a subscriber that EVT_read() found empty
+ * param pContext - passed to fWait and fWake
+ *
+ * returns struct EVT_Subscriber which you must later EVT_unsubscribe()
+ */
+struct EVT_Subscriber *EVT_subscribe(char const *pDeviceId, char const *const *pIdentifiers, size_t pCount,
+                                     EVT_streamFunction fWait, EVT_streamFunction fWake, void *pContext);
+
+/**
+ * Remove a subscriber from the hub and deallocate it, fWake is not called for it afterwards
+ */
+void EVT_unsubscribe(struct EVT_Subscriber *pSubscriber);
+
+/**
+ * Copy the pending text/event-stream bytes of a subscriber. When nothing is pending the subscriber waits, its fWait
+ * is called and the next event calls its fWake.
+ *
+ * param pOpen - receives false once the stream has ended and everything pending was read
+ *
+ * returns the number of bytes copied to pBuffer, at most pMax
+ */
+size_t EVT_read(struct EVT_Subscriber *pSubscriber, char *pBuffer, size_t pMax, bool *pOpen);
+
+/**
+ * returns true when anybody follows the fences of the device, so ingest can skip looking for entries otherwise
+ */
+bool EVT_hasSubscribers(char const *pDeviceId);
+
+/**
+ * returns true when anybody follows the fence pIdentifier of the device
+ */
+bool EVT_isSubscribed(char const *pDeviceId, char const *pIdentifier);
+
+/**
+ * Queue an entry event to every subscriber following the fence
+ *
+ * param pData - the json data of the event, a single line
+ */
+void EVT_publish(char const *pDeviceId, char const *pIdentifier, char const *pData);
+
+/**
+ * Queue a comment to every waiting subscriber so idle streams are not closed by proxies and dead peers are noticed
+ */
+void EVT_keepalive(void);
+
+/**
+ * End every stream once its pending events are read, subscribers made afterwards end right away
+ */
+void EVT_closeAll(void);
+
+/**
+ * returns the number of subscribers
+ */
+size_t EVT_subscriberCount(void);
+
+#endif //GEOFENCEBEC_EVENTS_H
@@ -103,4 +103,17 @@ void LOC_calculateLocationInfo(struct LocationInfo *pResult, double lat1, double
     float finalBearing = (float) atan2(cosU1 * sinLambda, -sinU1 * cosU2 + cosU1 * sinU2 * cosLambda);
     finalBearing *= 180.0 / M_PI;
     pResult->finalBearingDegrees = finalBearing;
-}
\ No newline at end of file
+}
+
+void LOC_metersPerDegree(double pLatitude, double *pLatitudeMeters, double *pLongitudeMeters) {
+    double const a = 6378137.0;          // WGS84 major axis
+    double const eSq = 6.69437999014e-3; // WGS84 first eccentricity squared
+
+    double phi = pLatitude * M_PI / 180.0;
+    double sinPhi = sin(phi);
+    double w = sqrt(1.0 - eSq * sinPhi * sinPhi);
+    double meridional = a * (1.0 - eSq) / (w * w * w);
+    double primeVertical = a / w;
+    *pLatitudeMeters = meridional * M_PI / 180.0;
+    *pLongitudeMeters = primeVertical * cos(phi) * M_PI / 180.0;
+}
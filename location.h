@@ -19,4 +19,11 @@ struct LocationInfo {
 void LOC_calculateLocationInfo(struct LocationInfo *pInfo, double startLat, double startLng, double endLat,
                                double endLng);
 
+/**
+ * The length in meters of one degree of latitude and of longitude at a latitude on the WGS-84 ellipsoid, from its
+ * meridional and prime vertical radii of curvature. Distances scaled by these are accurate to well under a meter over
+ * the few kilometers between neighbouring gps log points.
+ */
+void LOC_metersPerDegree(double pLatitude, double *pLatitudeMeters, double *pLongitudeMeters);
+
 #endif //GEOFENCEBEC_LOCATION_H
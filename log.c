@@ -0,0 +1,386 @@
+//
+// Created by William Kamp on 7/31/16.
+//
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+/*
+ * Slots of the event rate limit, events hashing to the same slot share a budget
+ */
+#define RATE_SLOTS 64
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A record as buffered by the request thread, formatting waits for the flusher
+ */
+struct LOG_Record {
+    int64_t time;
+    uint64_t requestId;
+    char const *event;
+    enum LOG_Level level;
+    unsigned int tid;
+    char detail[LOG_DETAIL_SIZE];
+};
+
+/*
+ * Records of one thread. Single producer (the owner) and single consumer (the flusher), the owner advances head and
+ * the flusher advances tail.
+ */
+struct LOG_Ring {
+    struct LOG_Ring *next;
+    atomic_bool inUse;
+    unsigned int tid;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    struct LOG_Record records[LOG_RING_SIZE];
+};
+
+/*
+ * Budget of the events hashing to a slot for the current second
+ */
+struct LOG_RateSlot {
+    _Atomic int64_t second;
+    atomic_uint count;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * The calling thread's ring, claiming a released ring or creating a new one on first use
+ */
+struct LOG_Ring *_threadRing(void);
+
+/**
+ * returns false when the warning or error pEvent has used its budget for this second
+ */
+bool _withinRateLimit(char const *pEvent, int64_t pTime);
+
+/**
+ * Move every ring's records into the flush batch, sort them by time and write them
+ */
+void _flush(void);
+
+/**
+ * Write a record as one json line
+ */
+void _writeRecord(FILE *pFile, struct LOG_Record const *pRecord);
+
+/**
+ * Flusher thread, drains the rings every LOG_FLUSH_INTERVAL_MS until LOG_stop()
+ */
+void *_flusher(void *pArg);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static char const *const __levelNames[] = {"debug", "info", "warn", "error"};
+static struct LOG_Ring *_Atomic __rings = NULL;
+static atomic_uint __nextTid = 1;
+static _Atomic uint64_t __nextRequestId = 1;
+static atomic_int __level = LOG_LEVEL_INFO;
+static _Atomic uint64_t __suppressed = 0;
+static struct LOG_RateSlot __rateSlots[RATE_SLOTS];
+static __thread struct LOG_Ring *__ring = NULL;
+static __thread uint64_t __currentRequest = 0;
+static pthread_key_t __ringKey;
+static pthread_once_t __ringKeyOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Flusher state, only touched by whoever holds __flushLock
+ */
+static pthread_mutex_t __flushLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __flushWake = PTHREAD_COND_INITIALIZER;
+static pthread_t __flushThread;
+static bool __flushRunning = false;
+static bool __flushStopping = false;
+static struct LOG_Record *__batch = NULL;
+static size_t __batchCapacity = 0;
+static uint64_t __reportedDropped = 0;
+static uint64_t __reportedSuppressed = 0;
+
+static void __releaseRing(void *pRing) {
+    struct LOG_Ring *ring = pRing;
+    atomic_store(&ring->inUse, false);
+}
+
+static void __createRingKey(void) {
+    pthread_key_create(&__ringKey, &__releaseRing);
+}
+
+static int64_t __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int __compareRecordTime(void const *pA, void const *pB) {
+    int64_t a = ((struct LOG_Record const *) pA)->time;
+    int64_t b = ((struct LOG_Record const *) pB)->time;
+    return (a > b) - (a < b);
+}
+
+static void __writeEscaped(FILE *pFile, char const *pString) {
+    for (unsigned char const *c = (unsigned char const *) pString; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', pFile);
+            fputc(*c, pFile);
+        } else if (*c < 0x20) {
+            fprintf(pFile, "\\u%04x", *c);
+        } else {
+            fputc(*c, pFile);
+        }
+    }
+}
+
+/**
+ * A record the flusher writes about the logger itself
+ */
+static void __flusherRecord(struct LOG_Record *pRecord, enum LOG_Level pLevel, char const *pEvent, uint64_t pCount) {
+    memset(pRecord, 0, sizeof(struct LOG_Record));
+    pRecord->time = __now();
+    pRecord->event = pEvent;
+    pRecord->level = pLevel;
+    snprintf(pRecord->detail, sizeof pRecord->detail, "%llu", (unsigned long long) pCount);
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct LOG_Ring *_threadRing(void) {
+    if (NULL != __ring) {
+        return __ring;
+    }
+    pthread_once(&__ringKeyOnce, &__createRingKey);
+
+    for (struct LOG_Ring *ring = atomic_load(&__rings); NULL != ring; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->inUse, &expected, true)) {
+            __ring = ring;
+            break;
+        }
+    }
+
+    if (NULL == __ring) {
+        struct LOG_Ring *ring = calloc(1, sizeof(struct LOG_Ring));
+        atomic_init(&ring->inUse, true);
+        ring->tid = atomic_fetch_add(&__nextTid, 1);
+        ring->next = atomic_load(&__rings);
+        while (!atomic_compare_exchange_weak(&__rings, &ring->next, ring)) {
+        }
+        __ring = ring;
+    }
+    pthread_setspecific(__ringKey, __ring);
+    return __ring;
+}
+
+bool _withinRateLimit(char const *pEvent, int64_t pTime) {
+    struct LOG_RateSlot *slot = &__rateSlots[((uintptr_t) pEvent >> 4) % RATE_SLOTS];
+    int64_t second = pTime / 1000000;
+    int64_t current = atomic_load_explicit(&slot->second, memory_order_relaxed);
+    if (current != second && atomic_compare_exchange_strong(&slot->second, &current, second)) {
+        atomic_store_explicit(&slot->count, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed) < LOG_RATE_LIMIT_PER_SECOND) {
+        return true;
+    }
+    atomic_fetch_add_explicit(&__suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+void _flush(void) {
+    size_t count = 0;
+    for (struct LOG_Ring *ring = atomic_load(&__rings); NULL != ring; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+        if (count + (head - tail) + 2 > __batchCapacity) {
+            __batchCapacity = (count + (head - tail) + 2) * 2;
+            __batch = realloc(__batch, __batchCapacity * sizeof(struct LOG_Record));
+        }
+        for (uint64_t i = tail; i < head; ++i) {
+            __batch[count] = ring->records[i % LOG_RING_SIZE];
+            __batch[count].tid = ring->tid;
+            ++count;
+        }
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+    }
+
+    /*
+     * Report losses since the last flush so they show up next to the records around them
+     */
+    uint64_t dropped = LOG_droppedCount();
+    uint64_t suppressed = LOG_suppressedCount();
+    if (dropped != __reportedDropped || suppressed != __reportedSuppressed) {
+        if (count + 2 > __batchCapacity) {
+            __batchCapacity = (count + 2) * 2;
+            __batch = realloc(__batch, __batchCapacity * sizeof(struct LOG_Record));
+        }
+        if (dropped != __reportedDropped) {
+            __flusherRecord(&__batch[count++], LOG_LEVEL_WARN, "log records dropped", dropped - __reportedDropped);
+            __reportedDropped = dropped;
+        }
+        if (suppressed != __reportedSuppressed) {
+            __flusherRecord(&__batch[count++], LOG_LEVEL_WARN, "log records suppressed",
+                            suppressed - __reportedSuppressed);
+            __reportedSuppressed = suppressed;
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+    qsort(__batch, count, sizeof(struct LOG_Record), &__compareRecordTime);
+    for (size_t i = 0; i < count; ++i) {
+        _writeRecord(stdout, &__batch[i]);
+    }
+    fflush(stdout);
+}
+
+void _writeRecord(FILE *pFile, struct LOG_Record const *pRecord) {
+    time_t seconds = (time_t) (pRecord->time / 1000000);
+    struct tm utc;
+    char timestamp[32];
+    gmtime_r(&seconds, &utc);
+    strftime(timestamp, sizeof timestamp, "%Y-%m-%dT%H:%M:%S", &utc);
+    fprintf(pFile, "{\"time\":\"%s.%06lldZ\",\"level\":\"%s\",\"pid\":%d,\"thread\":%u,\"request\":%llu,"
+                   "\"event\":\"", timestamp, (long long) (pRecord->time % 1000000), __levelNames[pRecord->level],
+            (int) getpid(), pRecord->tid, (unsigned long long) pRecord->requestId);
+    __writeEscaped(pFile, pRecord->event);
+    fputs("\",\"detail\":\"", pFile);
+    __writeEscaped(pFile, pRecord->detail);
+    fputs("\"}\n", pFile);
+}
+
+void *_flusher(void *pArg) {
+    (void) pArg;
+    pthread_mutex_lock(&__flushLock);
+    while (!__flushStopping) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        wake.tv_sec += wake.tv_nsec / 1000000000L;
+        wake.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&__flushWake, &__flushLock, &wake);
+        _flush();
+    }
+    pthread_mutex_unlock(&__flushLock);
+    return NULL;
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void LOG_configure(enum LOG_Level pLevel) {
+    atomic_store(&__level, pLevel);
+}
+
+enum LOG_Level LOG_levelFor(char const *pName, enum LOG_Level pDefault) {
+    if (NULL == pName) {
+        return pDefault;
+    }
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR; ++level) {
+        if (0 == strcmp(pName, __levelNames[level])) {
+            return (enum LOG_Level) level;
+        }
+    }
+    return pDefault;
+}
+
+void LOG_start(void) {
+    pthread_mutex_lock(&__flushLock);
+    if (!__flushRunning) {
+        __flushStopping = false;
+        __flushRunning = 0 == pthread_create(&__flushThread, NULL, &_flusher, NULL);
+    }
+    pthread_mutex_unlock(&__flushLock);
+}
+
+void LOG_stop(void) {
+    pthread_mutex_lock(&__flushLock);
+    bool running = __flushRunning;
+    __flushStopping = true;
+    pthread_cond_signal(&__flushWake);
+    pthread_mutex_unlock(&__flushLock);
+    if (running) {
+        pthread_join(__flushThread, NULL);
+    }
+
+    pthread_mutex_lock(&__flushLock);
+    __flushRunning = false;
+    _flush();
+    pthread_mutex_unlock(&__flushLock);
+}
+
+uint64_t LOG_newRequestId(void) {
+    return atomic_fetch_add_explicit(&__nextRequestId, 1, memory_order_relaxed);
+}
+
+void LOG_setRequest(uint64_t pRequestId) {
+    __currentRequest = pRequestId;
+}
+
+uint64_t LOG_currentRequest(void) {
+    return __currentRequest;
+}
+
+void LOG_log(enum LOG_Level pLevel, char const *pEvent, char const *pDetail) {
+    if ((int) pLevel < atomic_load_explicit(&__level, memory_order_relaxed)) {
+        return;
+    }
+    int64_t time = __now();
+    if (pLevel >= LOG_LEVEL_WARN && !_withinRateLimit(pEvent, time)) {
+        return;
+    }
+
+    struct LOG_Ring *ring = _threadRing();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+
+    struct LOG_Record *record = &ring->records[head % LOG_RING_SIZE];
+    record->time = time;
+    record->requestId = __currentRequest;
+    record->event = pEvent;
+    record->level = pLevel;
+    if (NULL != pDetail) {
+        size_t len = strnlen(pDetail, LOG_DETAIL_SIZE - 1);
+        memcpy(record->detail, pDetail, len);
+        record->detail[len] = '\0';
+    } else {
+        record->detail[0] = '\0';
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+uint64_t LOG_droppedCount(void) {
+    uint64_t dropped = 0;
+    for (struct LOG_Ring *ring = atomic_load(&__rings); NULL != ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+uint64_t LOG_suppressedCount(void) {
+    return atomic_load_explicit(&__suppressed, memory_order_relaxed);
+}
+
+//endregion
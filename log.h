@@ -0,0 +1,90 @@
+//
+// Created by William Kamp on 7/31/16.
+//
+
+#ifndef GEOFENCEBEC_LOG_H
+#define GEOFENCEBEC_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Records buffered per thread, records logged while the ring is full are dropped and counted
+ */
+#define LOG_RING_SIZE 1024
+
+/*
+ * Bytes of a record's detail that are kept, longer details are truncated
+ */
+#define LOG_DETAIL_SIZE 128
+
+/*
+ * How often the flusher drains the rings and writes stdout
+ */
+#define LOG_FLUSH_INTERVAL_MS 100
+
+/*
+ * Warnings and errors logged per second for each event, the rest are suppressed and counted
+ */
+#define LOG_RATE_LIMIT_PER_SECOND 10
+
+enum LOG_Level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+};
+
+/**
+ * Set the lowest level that is logged, LOG_LEVEL_INFO by default
+ */
+void LOG_configure(enum LOG_Level pLevel);
+
+/**
+ * Find the level named pName (debug, info, warn or error)
+ *
+ * returns pDefault when pName is NULL or not a level
+ */
+enum LOG_Level LOG_levelFor(char const *pName, enum LOG_Level pDefault);
+
+/**
+ * Start the thread that formats buffered records as json lines on stdout
+ */
+void LOG_start(void);
+
+/**
+ * Write everything buffered and stop the flusher thread
+ */
+void LOG_stop(void);
+
+/**
+ * returns a new id for a request, unique within this process
+ */
+uint64_t LOG_newRequestId(void);
+
+/**
+ * Set the request the calling thread is working on, its records carry the id. 0 when not working on a request.
+ */
+void LOG_setRequest(uint64_t pRequestId);
+
+uint64_t LOG_currentRequest(void);
+
+/**
+ * Buffer a record on the calling thread's ring, nothing is formatted or written on the calling thread
+ *
+ * param pEvent - what happened, must be a string literal (only the pointer is kept)
+ * param pDetail - copied, may be NULL
+ */
+void LOG_log(enum LOG_Level pLevel, char const *pEvent, char const *pDetail);
+
+/**
+ * returns the records dropped because their thread's ring was full
+ */
+uint64_t LOG_droppedCount(void);
+
+/**
+ * returns the warnings and errors suppressed by the per event rate limit
+ */
+uint64_t LOG_suppressedCount(void);
+
+#endif //GEOFENCEBEC_LOG_H
@@ -1,29 +1,215 @@
 #include <microhttpd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <libmongoc-1.0/mongoc.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "compact.h"
 #include "database.h"
-#include "location.h"
+#include "entry.h"
+#include "events.h"
+#include "log.h"
+#include "metrics.h"
+#include "simplify.h"
+#include "slowop.h"
+#include "supervisor.h"
+#include "threadpool.h"
+#include "trace.h"
 
 #define PORT 8181
 //#define TEXT_HTML "text/html"
 #define APPLICATION_JSON "application/json"
+#define TEXT_PROMETHEUS "text/plain; version=0.0.4"
+#define TEXT_EVENT_STREAM "text/event-stream"
+#define APPLICATION_NDJSON "application/x-ndjson"
+#define APPLICATION_BSON "application/bson"
 #define CONTENT_TYPE "Content-type"
+#define CACHE_CONTROL "Cache-Control"
 #define METHOD_GET "GET"
 #define METHOD_POST "POST"
+#define METHOD_PATCH "PATCH"
 #define METHOD_DELETE "DELETE"
+#define ENV_TRACE_SAMPLE_RATE "GEOFENCE_TRACE_SAMPLE_RATE"
+#define ENV_TRACE_FILE "GEOFENCE_TRACE_FILE"
+#define DEFAULT_TRACE_FILE "geofence_trace.json"
+#define ENV_PORT "GEOFENCE_PORT"
+#define ENV_WORKERS "GEOFENCE_WORKERS"
+#define ENV_DRAIN_SECONDS "GEOFENCE_DRAIN_SECONDS"
+#define ENV_LOG_LEVEL "GEOFENCE_LOG_LEVEL"
+#define ENV_SLOW_OP_MS "GEOFENCE_SLOW_OP_MS"
+#define ENV_PARTITIONING "GEOFENCE_PARTITIONING"
+#define DEFAULT_DRAIN_SECONDS 30
+#define ENV_HTTP_THREADS "GEOFENCE_HTTP_THREADS"
+#define ENV_MAX_CONNECTIONS "GEOFENCE_MAX_CONNECTIONS"
+#define RESERVED_DESCRIPTORS 256 // mongo connections, log and trace files
+
+/*
+ * Event streams hold their connection for as long as they follow, so the daemon waits on more descriptors than
+ * select() can watch
+ */
+#ifdef __linux__
+#define DAEMON_EVENT_LOOP MHD_USE_EPOLL_INTERNALLY
+#else
+#define DAEMON_EVENT_LOOP MHD_USE_POLL_INTERNALLY
+#endif
+#define ENV_DB_MAX_IN_FLIGHT "GEOFENCE_DB_MAX_IN_FLIGHT"
+#define ENV_DB_ADMIT_TIMEOUT_MS "GEOFENCE_DB_ADMIT_TIMEOUT_MS"
+#define DEFAULT_DB_MAX_IN_FLIGHT 100 // mongoc's default maxPoolSize
+#define DEFAULT_DB_ADMIT_TIMEOUT_MS 250
+#define ENV_COMPACT_AGE_SECONDS "GEOFENCE_COMPACT_AGE_SECONDS"
+#define ENV_RETENTION_SECONDS "GEOFENCE_RETENTION_SECONDS"
+#define ENV_COMPACT_TOLERANCE_M "GEOFENCE_COMPACT_TOLERANCE_M"
+#define ENV_COMPACT_BOUNDARY_M "GEOFENCE_COMPACT_BOUNDARY_M"
+#define ENV_COMPACT_INTERVAL_SECONDS "GEOFENCE_COMPACT_INTERVAL_SECONDS"
+#define ENV_COMPACT_PAUSE_MS "GEOFENCE_COMPACT_PAUSE_MS"
+#define ENV_COMPACT_MAX_DEFER_MS "GEOFENCE_COMPACT_MAX_DEFER_MS"
+#define DEFAULT_COMPACT_TOLERANCE_M 5.
+#define DEFAULT_COMPACT_BOUNDARY_M 50.
+#define DEFAULT_COMPACT_INTERVAL_SECONDS 3600
+#define DEFAULT_COMPACT_PAUSE_MS 100
+#define DEFAULT_COMPACT_MAX_DEFER_MS 5000
+#define ENV_EXPORT_MAX_STREAMS "GEOFENCE_EXPORT_MAX_STREAMS"
+#define DEFAULT_EXPORT_MAX_STREAMS 2
+#define ENV_MAX_BODY_BYTES "GEOFENCE_MAX_BODY_BYTES"
+#define DEFAULT_MAX_BODY_BYTES (64 * 1024 * 1024)
+#define ENV_ADMIN_TOKEN "GEOFENCE_ADMIN_TOKEN"
+#define BEARER_PREFIX "Bearer "
+#define INFLATE_CHUNK (64 * 1024)
+#define RECORD_PREFIX "{ \"message\" : \"ok\", \"record\" : "
+#define RECORD_SUFFIX " }"
+#define RETRY_AFTER "Retry-After"
+#define RETRY_AFTER_SECONDS "1"
 
 //region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 struct MA_HandlerData {
     mongoc_client_pool_t *pool;
+    struct TP_Pool *workers;
+    atomic_int dbInFlight;
+    int maxDbInFlight;
+    int64_t admitTimeout;
+    atomic_int exports;
+    int maxExports;
+    size_t maxBody;
+    char const *adminToken;
+    bool eventsEnabled;
 };
 
 struct MA_ConnectionInfo {
     size_t sz;
     char *body;
+    size_t capacity;
+    z_stream *inflater;
+    bool tryRawDeflate;
+    bool inflated;
+    bool rejected;
+    enum MET_Route route;
+    int64_t startTime;
+    int64_t bodyStartTime;
+    unsigned int statusCode;
+    uint64_t requestId;
+    uint64_t traceRequest;
+};
+
+struct MA_Batch;
+
+/*
+ * One identifier of a POST /fence_entry/evaluate request
+ */
+struct MA_BatchItem {
+    struct MA_Batch *batch;
+    char const *identifier;
+    struct DB_Fence const *fence;
+    struct DB_GpsLog const *log;
+    struct DB_GpsLog *candidates;
+    bson_t *actualEntry;
+    bool done;
+};
+
+/*
+ * State of a POST /fence_entry/evaluate request that lives until its streamed response completes
+ */
+struct MA_Batch {
+    struct TP_Pool *workers;
+    struct MHD_Connection *connection;
+    pthread_mutex_t lock;
+    size_t running;
+    bool waiting;
+    bool released;
+    bson_t *request;
+    struct DB_Fence **fences;
+    size_t fenceCount;
+    struct DB_GpsLog **logs;
+    size_t logCount;
+    struct MA_BatchItem *items;
+    size_t count;
+    size_t next;
+    char *chunk;
+    size_t chunkLen;
+    size_t chunkOffset;
+    bool finished;
+    uint64_t traceRequest;
+};
+
+/*
+ * Newly ingested gps log points to look for fence entries in, on the worker pool rather than the request thread
+ */
+struct MA_Publish {
+    struct MA_HandlerData *data;
+    struct DB_GpsLog *log;
+    struct DB_GpsLog *points;
+};
+
+/*
+ * A GET /fence_entry/events stream, its connection is suspended while the subscriber has nothing to send
+ */
+struct MA_EventStream {
+    struct MHD_Connection *connection;
+    struct EVT_Subscriber *subscriber;
+};
+
+/*
+ * A GET /admin/export stream, it holds a pooled MongoDB client until the response is freed. The chunk is either a
+ * document still in the cursor's reply, its json or the newline after it.
+ */
+struct MA_Export {
+    struct MA_HandlerData *data;
+    mongoc_client_t *client;
+    struct DB_Export *export;
+    uint8_t const *chunk;
+    size_t chunkLen;
+    size_t chunkOffset;
+    char *json;
+    bool ndjson;
+    bool newline;
+    bool finished;
+};
+
+/*
+ * The json of a record answered between RECORD_PREFIX and RECORD_SUFFIX, read from where it was serialized rather
+ * than copied into one response body
+ */
+struct MA_RecordBody {
+    char *json;
+    size_t length;
 };
 
+/*
+ * Defines a function run on a record just inserted, while the request still holds its database client
+ */
+typedef void (*MA_insertedFunction)(struct MA_HandlerData *pData, mongoc_client_t *pClient,
+                                    struct DB_Record const *pRecord);
+
 //endregion
 
 //region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -40,6 +226,12 @@ int _answerConnection(void *pCls,
                       size_t *upload_data_size,
                       void **con_cls);
 
+/**
+ * Dispatch a request whose body has been read to the handler of its route
+ */
+int _routeRequest(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pUrl, char const *pMethod,
+                  struct MA_ConnectionInfo *pConnInfo);
+
 /**
  * Request handler for / endpoint
  *
@@ -54,10 +246,11 @@ int _handleRoot(struct MHD_Connection *pConn);
  * param pData - data to retrieve a MongoDb client from
  * param pConnInfo - connection info to retrieve the request body
  * param fPtr - function pointer to insert json record into database
+ * param fInserted - function run on the inserted record or NULL
  */
 int _handlePostWithDbInsertBodyJson(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
                                     struct MA_ConnectionInfo *pConnInfo,
-                                    DB_insertFunction fPtr);
+                                    DB_insertFunction fPtr, MA_insertedFunction fInserted);
 
 /**
  * Request handler for /fence_entry POST endpoint
@@ -69,6 +262,20 @@ int _handlePostWithDbInsertBodyJson(struct MHD_Connection *pConn, struct MA_Hand
 int _handlePostFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
                           struct MA_ConnectionInfo *pConnInfo);
 
+/**
+ * Request handler for POST /fence_entry/evaluate endpoint
+ *
+ * Fetches every requested fence with one query and every distinct covering log once, then evaluates the entries on
+ * the worker pool and streams the results back in request order.
+ *
+ * param pConn - the connection to enqueue a response to
+ * param pData - data to retrieve a MongoDb client and worker pool from
+ * param pConnInfo - connection info to retrieve the request body
+ * param pDeviceId - the device partition of the fences and logs (device_id request param) or NULL
+ */
+int _handlePostFenceEntryEvaluate(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
+                                  struct MA_ConnectionInfo *pConnInfo, char const *pDeviceId);
+
 /**
  * Request handler for POST /gps_log endpoint
  *
@@ -78,14 +285,65 @@ int _handlePostFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *p
  */
 int _handlePostGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, struct MA_ConnectionInfo *pConnInfo);
 
+/**
+ * Request handler for PATCH /gps_log endpoint, appends the points of the body to an existing gps log
+ *
+ * param pConn - the connection to enqueue a response to
+ * param pData - data to retrieve a MongoDb client from
+ * param pConnInfo - connection info to retrieve the request body
+ * param pId - the gps log id (id request param)
+ * param pDeviceId - the device partition of the gps log (device_id request param) or NULL
+ */
+int _handlePatchGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, struct MA_ConnectionInfo *pConnInfo,
+                       char const *pId, char const *pDeviceId);
+
 /**
  * Request handler for /fence_entry endpoint
  *
  * param pConn - the connection to enqueue a response to
  * param pData - data to retrieve a MongoDb client from
  * param pId - the geofence id (i request param)
+ * param pDeviceId - the device partition of the fence and its log (device_id request param) or NULL
+ * param pRange - the corresponding_log points to return (from, to and max_points request params) or NULL for all
+ * param pToleranceMeters - simplify corresponding_log to this tolerance (tolerance request param) or 0 for all points
+ */
+int _handleGetFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pId,
+                         char const *pDeviceId, struct DB_PointRange const *pRange, double pToleranceMeters);
+
+/**
+ * Request handler for GET /fence_entry/events, a text/event-stream of the entries into the followed fences found in
+ * gps logs ingested from now on. The connection is suspended between events.
+ *
+ * param pConn - the connection to enqueue a response to
+ * param pIdentifiers - comma separated fence identifiers to follow (i request param) or NULL for every fence of the
+ * device
+ * param pDeviceId - the device partition of the fences (device_id request param) or NULL
+ */
+int _handleGetFenceEntryEvents(struct MHD_Connection *pConn, char const *pIdentifiers, char const *pDeviceId);
+
+/**
+ * Push the fence entries found in newly ingested gps log points to the subscribers of the fences. Nothing is read
+ * from the database unless somebody follows the fences of the log's device.
+ *
+ * param pLog - the id, device and time window of the whole gps log
+ * param pPoints - the ingested points, pLog itself when the log was just posted. When they were appended an entry is
+ * only pushed when the whole log first enters the fence at one of them, otherwise it was pushed before.
+ */
+void _publishEntries(struct MA_HandlerData *pData, mongoc_client_t *pClient, struct DB_GpsLog const *pLog,
+                     struct DB_GpsLog const *pPoints);
+
+/**
+ * Queue _publishEntries() on the worker pool with a client of its own, so ingest does not wait for the fence queries
+ *
+ * param pLog - the whole gps log, deallocated once published
+ * param pPoints - the appended points, deallocated once published, or NULL when the log was just posted
+ */
+void _queuePublish(struct MA_HandlerData *pData, struct DB_GpsLog *pLog, struct DB_GpsLog *pPoints);
+
+/**
+ * MA_insertedFunction of POST /gps_log, _queuePublish() of the posted log
  */
-int _handleGetFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pId);
+void _publishPostedLog(struct MA_HandlerData *pData, mongoc_client_t *pClient, struct DB_Record const *pRecord);
 
 /**
  * Request handler for /gps_log endpoint
@@ -93,16 +351,21 @@ int _handleGetFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pD
  * param pConn - the connection to enqueue a response to
  * param pData - data to retrieve a MongoDb client from
  * param epoch - a time within the gps log time frame (t request param)
+ * param pDeviceId - the device partition of the gps log (device_id request param) or NULL
+ * param pRange - the points to return (from, to and max_points request params) or NULL for all
+ * param pToleranceMeters - simplify the points to this tolerance (tolerance request param) or 0 for all points
  */
-int _handleGetGpsLogEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, long epoch);
+int _handleGetGpsLogEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, long epoch,
+                          char const *pDeviceId, struct DB_PointRange const *pRange, double pToleranceMeters);
 
 /**
  * Request handler for /gps_log_list endpoint
  *
  * param pConn - the connection to enqueue a response to
  * param pData - data to retrieve a MongoDb client from
+ * param pDeviceId - the device partition to list (device_id request param) or NULL
  */
-int _handleGetGpsLogEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData);
+int _handleGetGpsLogEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pDeviceId);
 
 /**
  * Request handler for 404 - resource not found
@@ -113,23 +376,187 @@ int _handleNotFound(struct MHD_Connection *pConn);
 
 int _handleError(struct MHD_Connection *pConn);
 
-int _handleDeleteFenceEntry(struct MHD_Connection *pConnection, struct MA_HandlerData *pData, const char *pId);
+/**
+ * Request handler for 400 - bad request
+ *
+ * param pConn - the connection to enqueue a response to
+ * param pMessage - the reason the request was rejected
+ */
+int _handleBadRequest(struct MHD_Connection *pConn, char const *pMessage);
+
+/**
+ * Request handler for an error answered with just a message, eg a body that is too large
+ *
+ * param pConn - the connection to enqueue a response to
+ * param pStatusCode - the status to answer with
+ * param pMessage - the reason the request was rejected
+ */
+int _handleClientError(struct MHD_Connection *pConn, unsigned int pStatusCode, char const *pMessage);
+
+int _handleDeleteFenceEntry(struct MHD_Connection *pConnection, struct MA_HandlerData *pData, const char *pId,
+                            const char *pDeviceId);
+
+int _handleDeleteGpsLog(struct MHD_Connection *pConnection, struct MA_HandlerData *pData, const char *pId,
+                        const char *pDeviceId);
+
+int _handleGetFenceEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pDeviceId);
+
+/**
+ * Request handler for GET /metrics, the Prometheus scrape endpoint
+ *
+ * param pConn - the connection to enqueue a response to
+ */
+int _handleGetMetrics(struct MHD_Connection *pConn);
+
+/**
+ * Request handler for GET /admin/trace, the sampled spans as Chrome trace json
+ *
+ * param pConn - the connection to enqueue a response to
+ */
+int _handleGetTrace(struct MHD_Connection *pConn);
+
+/**
+ * Request handler for GET /admin/slow_ops, the recorded slow Mongo operations with their explain plans
+ *
+ * param pConn - the connection to enqueue a response to
+ */
+int _handleGetSlowOps(struct MHD_Connection *pConn);
+
+/**
+ * Request handler for GET /admin/export, streams the stored documents of a collection of the device partition as
+ * newline delimited json or concatenated bson
+ *
+ * param pConn - the connection to enqueue a response to
+ * param pData - the handler data holding the export budget
+ * param pDeviceId - the device partition to export, NULL for the records without a device_id
+ */
+int _handleGetExport(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pDeviceId);
+
+/**
+ * Whether the /admin endpoints may be answered, they are only served to loopback clients and to clients presenting
+ * GEOFENCE_ADMIN_TOKEN as an Authorization: Bearer token
+ *
+ * param pConn - the connection of the request
+ * param pData - the handler data holding the admin token
+ */
+bool _isAdminRequest(struct MHD_Connection *pConn, struct MA_HandlerData *pData);
+
+/**
+ * Request handler for 403 - an /admin endpoint asked for by a client that is not allowed to
+ *
+ * param pConn - the connection to enqueue a response to
+ */
+int _handleForbidden(struct MHD_Connection *pConn);
+
+/**
+ * Request handler for 503 - the database work budget is exhausted, tells the client when to retry
+ *
+ * param pConn - the connection to enqueue a response to
+ */
+int _handleOverloaded(struct MHD_Connection *pConn);
+
+/**
+ * Take a MongoDB client from the pool, recording how long the pool made us wait
+ *
+ * Admission control, fails fast when maxDbInFlight requests already hold or wait for a client and gives up when no
+ * client frees up within pTimeout microseconds, so a burst is answered with 503s instead of queueing without bound.
+ *
+ * returns a client which you must later _pushClient() or NULL
+ */
+mongoc_client_t *_takeClient(struct MA_HandlerData *pData, int64_t pTimeout);
+
+/**
+ * _takeClient() for the request handlers, it never waits since they run on the daemon threads and a wait would stall
+ * every other connection of the thread
+ *
+ * returns a client which you must later _pushClient() or NULL when the request should be rejected with
+ * _handleOverloaded()
+ */
+mongoc_client_t *_popClient(struct MA_HandlerData *pData);
+
+/**
+ * _takeClient() for worker pool tasks, waiting up to admitTimeout
+ *
+ * returns a client which you must later _pushClient() or NULL
+ */
+mongoc_client_t *_waitForClient(struct MA_HandlerData *pData);
+
+/**
+ * Return a client taken with _popClient() or _waitForClient()
+ */
+void _pushClient(struct MA_HandlerData *pData, mongoc_client_t *pClient);
+
+/**
+ * Queue a response, remembering its status code for the request metrics, and release our reference to it
+ */
+int _queueResponse(struct MHD_Connection *pConn, unsigned int pStatusCode, struct MHD_Response *pResponse);
+
+/**
+ * Serialize a bson document and queue it as a json response
+ */
+int _queueJsonResponse(struct MHD_Connection *pConn, unsigned int pStatusCode, bson_t const *pBson);
 
-int _handleDeleteGpsLog(struct MHD_Connection *pConnection, struct MA_HandlerData *pData, const char *pId);
+/**
+ * Open a listening socket on pPort, shared with the other workers through SO_REUSEPORT where available
+ *
+ * returns the socket or -1 on failure
+ */
+int _openListenSocket(uint16_t pPort);
 
-int _handleGetFenceEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData);
+/**
+ * Hand the connections already queued on a listening socket the daemon was quiesced from to the daemon, then close
+ * it. Closing a SO_REUSEPORT socket resets the connections queued on it, the other sockets of the port do not get
+ * them.
+ *
+ * returns the number of connections handed to the daemon
+ */
+size_t _drainListenSocket(struct MHD_Daemon *pDaemon, int pSocket);
 
 //endregion
 
 //region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-static struct MA_ConnectionInfo *__createConnectionInfo() {
+/*
+ * The request being answered on this thread
+ */
+static __thread struct MA_ConnectionInfo *__currentRequest = NULL;
+
+/*
+ * Set by SIGUSR1, the main loop writes the trace file when it wakes up
+ */
+static volatile sig_atomic_t __traceDumpRequested = 0;
+
+/*
+ * Set by SIGTERM / SIGINT, the main loop stops accepting and drains
+ */
+static volatile sig_atomic_t __shutdownRequested = 0;
+
+static struct MA_ConnectionInfo *__createConnectionInfo(enum MET_Route pRoute) {
     struct MA_ConnectionInfo *info = malloc(sizeof(struct MA_ConnectionInfo));
     info->body = NULL;
     info->sz = 0;
+    info->capacity = 0;
+    info->inflater = NULL;
+    info->tryRawDeflate = false;
+    info->inflated = false;
+    info->rejected = false;
+    info->route = pRoute;
+    info->startTime = MET_now();
+    info->bodyStartTime = 0;
+    info->statusCode = 0;
+    info->requestId = LOG_newRequestId();
+    info->traceRequest = TRC_sampleRequest();
+    MET_requestStarted();
     return info;
 }
 
+/**
+ * Record the time since pStartTime against a stage of the request being answered on this thread
+ */
+static void __recordStage(enum MET_Stage pStage, int64_t pStartTime) {
+    MET_recordStage(MET_currentRoute(), pStage, MET_now() - pStartTime);
+}
+
 static void __destroyConnectionInfo(struct MA_ConnectionInfo *pInfo) {
     if (NULL == pInfo) {
         return;
@@ -138,6 +565,10 @@ static void __destroyConnectionInfo(struct MA_ConnectionInfo *pInfo) {
     if (NULL != pInfo->body) {
         free(pInfo->body);
     }
+    if (NULL != pInfo->inflater) {
+        inflateEnd(pInfo->inflater);
+        free(pInfo->inflater);
+    }
     free(pInfo);
 }
 
@@ -151,630 +582,1729 @@ static void __requestCompleted(void *pCls, struct MHD_Connection *pConn, void **
                                enum MHD_RequestTerminationCode pTermCode) {
 
     struct MA_ConnectionInfo *info = *pConnCls;
+    if (NULL != info) {
+        MET_requestFinished(info->route, info->statusCode, MET_now() - info->startTime);
+    }
+    if (__currentRequest == info) {
+        __currentRequest = NULL;
+    }
     __destroyConnectionInfo(info);
     *pConnCls = NULL;
 }
 
 #pragma clang diagnostic pop
 
-//endregion
+static int __compareBatchItemEntryTime(void const *pA, void const *pB) {
+    struct MA_BatchItem const *a = *(struct MA_BatchItem *const *) pA;
+    struct MA_BatchItem const *b = *(struct MA_BatchItem *const *) pB;
+    int32_t aTime = a->fence->entryTime;
+    int32_t bTime = b->fence->entryTime;
+    return (aTime > bTime) - (aTime < bTime);
+}
 
-//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static bool __logCoversTime(struct DB_GpsLog const *pLog, int64_t pEpochTime) {
+    return pLog->startTime <= pEpochTime && pEpochTime <= pLog->endTime;
+}
 
-int _appendData(struct MHD_Connection *pConn, size_t *pUploadDataSize, char const *pUploadData,
-                struct MA_ConnectionInfo *connectionInfo) {
+/**
+ * Free a batch once both its response and all of its submitted items are done with it
+ */
+static void __destroyBatch(struct MA_Batch *pBatch) {
+    pthread_mutex_destroy(&pBatch->lock);
 
-    size_t len = *pUploadDataSize;
-    if (connectionInfo->body == NULL) {
-        char *body = malloc(len);
-        memcpy(body, pUploadData, len);
-        connectionInfo->body = body;
-        connectionInfo->sz = len;
-    } else {
-        size_t newSize = connectionInfo->sz + len;
-        char *temp = realloc(connectionInfo->body, newSize);
-        if (temp != NULL) {
-            memcpy(&temp[connectionInfo->sz], pUploadData, len);
-            connectionInfo->body = temp;
-            connectionInfo->sz = newSize;
-        } else {
-            return _handleError(pConn);
+    for (size_t i = 0; i < pBatch->count; ++i) {
+        if (pBatch->items[i].actualEntry != NULL) {
+            bson_destroy(pBatch->items[i].actualEntry);
         }
+        DB_freeGpsLog(pBatch->items[i].candidates);
     }
-    *pUploadDataSize = 0;
-    return MHD_YES;
+    for (size_t i = 0; i < pBatch->logCount; ++i) {
+        DB_freeGpsLog(pBatch->logs[i]);
+    }
+    for (size_t i = 0; i < pBatch->fenceCount; ++i) {
+        DB_freeFence(pBatch->fences[i]);
+    }
+    bson_destroy(pBatch->request);
+    bson_free(pBatch->chunk);
+    free(pBatch->fences);
+    free(pBatch->logs);
+    free(pBatch->items);
+    free(pBatch);
 }
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-parameter"
-
-int _answerConnection(void *pCls,
-                      struct MHD_Connection *pConn,
-                      char const *pUrl,
-                      char const *pMethod,
-                      char const *pVersion,
-                      char const *pUploadData,
-                      size_t *pUploadDataSize,
-                      void **pConnCls) {
+/**
+ * Worker pool task evaluating a single batch item, resuming the response when it was suspended waiting on it.
+ * Items still queued when the client went away are skipped, and the last one to finish frees the batch.
+ */
+static void __evaluateBatchItem(void *pArg) {
+    struct MA_BatchItem *item = pArg;
+    struct MA_Batch *batch = item->batch;
+    pthread_mutex_lock(&batch->lock);
+    bool released = batch->released;
+    pthread_mutex_unlock(&batch->lock);
+
+    bson_t *actualEntry = NULL;
+    if (!released) {
+        TRC_setRequest(batch->traceRequest);
+        struct TRC_Span span;
+        TRC_begin(&span, "evaluate batch item");
+        int64_t startTime = MET_now();
+#ifdef DB_GEOJSON_STORAGE
+        actualEntry = ENT_findEntryPoint(item->fence, item->candidates, NULL);
+#else
+        actualEntry = ENT_findEntryPoint(item->fence, item->log, batch->workers);
+#endif
+        MET_recordStage(MET_ROUTE_POST_FENCE_ENTRY_EVALUATE, MET_STAGE_COMPUTE, MET_now() - startTime);
+        TRC_end(&span);
+        TRC_setRequest(0);
+    }
 
-    /*
-     * Fetch the request body
-     */
-    struct MA_ConnectionInfo *connectionInfo = *pConnCls;
-    if (NULL == *pConnCls) {
-        connectionInfo = __createConnectionInfo();
-        *pConnCls = (void *) connectionInfo;
-        return MHD_YES;
+    pthread_mutex_lock(&batch->lock);
+    item->actualEntry = actualEntry;
+    item->done = true;
+    if (batch->waiting && !batch->released) {
+        batch->waiting = false;
+        MHD_resume_connection(batch->connection);
     }
-    if (*pUploadDataSize) {
-        return _appendData(pConn, pUploadDataSize, pUploadData, connectionInfo);
+    bool last = 0 == --batch->running && batch->released;
+    pthread_mutex_unlock(&batch->lock);
+    if (last) {
+        __destroyBatch(batch);
     }
+}
 
-    /*
-     * Answer GET requests
-     */
-    if (0 == strcmp(pMethod, METHOD_GET)) {
-        /*
-         * Answer / endpoint
-         */
-        if (0 == strcmp(pUrl, "/")) {
-            return _handleRoot(pConn);
+/**
+ * Serialize the next batch item into pBatch->chunk. While that item is still being evaluated the connection is
+ * suspended instead (under the batch lock, so its completion cannot slip by unnoticed) and the item resumes it.
+ *
+ * returns false when the connection was suspended
+ */
+static bool __nextBatchChunk(struct MA_Batch *pBatch) {
+    if (pBatch->next == pBatch->count) {
+        pBatch->chunk = bson_strdup("]}");
+        pBatch->finished = true;
+    } else {
+        struct MA_BatchItem *item = &pBatch->items[pBatch->next];
+        pthread_mutex_lock(&pBatch->lock);
+        bool ready = item->done;
+        if (!ready) {
+            pBatch->waiting = true;
+            MHD_suspend_connection(pBatch->connection);
         }
-
-        /*
-         * Answer /fence_entry endpoint
-         */
-        if (0 == strcmp(pUrl, "/fence_entry")) {
-            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "i");
-            if (val) {
-                return _handleGetFenceEntry(pConn, pCls, val);
-            }
+        pthread_mutex_unlock(&pBatch->lock);
+        if (!ready) {
+            return false;
         }
 
-        /*
-         * Answer gps_log endpoint
-         */
-        if (0 == strcmp(pUrl, "/gps_log")) {
-            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "t");
-            if (val) {
-                long time = strtol(val, NULL, 10);
-                return _handleGetGpsLogEntry(pConn, pCls, time);
-            }
+        int64_t startTime = MET_now();
+        bson_t bsonItem;
+        bson_init(&bsonItem);
+        BSON_APPEND_UTF8(&bsonItem, "identifier", item->identifier);
+        if (item->fence != NULL) {
+            BSON_APPEND_UTF8(&bsonItem, "message", "ok");
+            BSON_APPEND_DOCUMENT(&bsonItem, "record", item->fence->record);
+        } else {
+            BSON_APPEND_UTF8(&bsonItem, "message", "record not found");
+            BSON_APPEND_NULL(&bsonItem, "record");
         }
-
-        /*
-         * Answer gps_log endpoint
-         */
-        if (0 == strcmp(pUrl, "/gps_log_list")) {
-            return _handleGetGpsLogEntryList(pConn, pCls);
+        if (item->log != NULL && item->log->hasId) {
+            BSON_APPEND_OID(&bsonItem, "corresponding_log_id", &item->log->id);
+        } else {
+            BSON_APPEND_NULL(&bsonItem, "corresponding_log_id");
         }
-
-        /*
-         * Answer gps_log endpoint
-         */
-        if (0 == strcmp(pUrl, "/fence_entry_list")) {
-            return _handleGetFenceEntryList(pConn, pCls);
+        if (item->actualEntry != NULL) {
+            BSON_APPEND_DOCUMENT(&bsonItem, "actual_entry", item->actualEntry);
+        } else {
+            BSON_APPEND_NULL(&bsonItem, "actual_entry");
         }
+
+        char *json = bson_as_json(&bsonItem, NULL);
+        pBatch->chunk = bson_strdup_printf("%s%s", pBatch->next > 0 ? "," : "", json);
+        bson_free(json);
+        bson_destroy(&bsonItem);
+        MET_recordStage(MET_ROUTE_POST_FENCE_ENTRY_EVALUATE, MET_STAGE_SERIALIZE, MET_now() - startTime);
+        ++pBatch->next;
     }
+    pBatch->chunkLen = strlen(pBatch->chunk);
+    pBatch->chunkOffset = 0;
+    return true;
+}
 
-        /*
-         * Answer POST requests
-         */
-    else if (0 == strcmp(pMethod, METHOD_POST)) {
-        /*
-         * Answer /fence_entry endpoint
-         */
-        if (0 == strcmp(pUrl, "/fence_entry")) {
-            return _handlePostFenceEntry(pConn, pCls, connectionInfo);
+/**
+ * MHD_ContentReaderCallback streaming the batch results in request order
+ */
+static ssize_t __readBatch(void *pCls, uint64_t pPos, char *pBuf, size_t pMax) {
+    struct MA_Batch *batch = pCls;
+    if (batch->chunkOffset == batch->chunkLen) {
+        bson_free(batch->chunk);
+        batch->chunk = NULL;
+        if (batch->finished) {
+            return MHD_CONTENT_READER_END_OF_STREAM;
         }
-
-        /*
-         * Answer /fence_entry endpoint
-         */
-        if (0 == strcmp(pUrl, "/gps_log")) {
-            return _handlePostGpsLog(pConn, pCls, connectionInfo);
+        uint64_t previousRequest = TRC_currentRequest();
+        TRC_setRequest(batch->traceRequest);
+        struct TRC_Span span;
+        TRC_begin(&span, "__nextBatchChunk");
+        bool ready = __nextBatchChunk(batch);
+        TRC_end(&span);
+        TRC_setRequest(previousRequest);
+        if (!ready) {
+            return 0;
         }
     }
 
-        /*
-         * Answer POST requests
-         */
-    else if (0 == strcmp(pMethod, METHOD_DELETE)) {
-        /*
-         * Answer /fence_entry endpoint
-         */
-        if (0 == strcmp(pUrl, "/fence_entry")) {
-            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "id");
-            if (val) {
-                return _handleDeleteFenceEntry(pConn, pCls, val);
-            }
-        }
+    size_t len = MIN(pMax, batch->chunkLen - batch->chunkOffset);
+    memcpy(pBuf, &batch->chunk[batch->chunkOffset], len);
+    batch->chunkOffset += len;
+    return (ssize_t) len;
+}
 
-        /*
-         * Answer /fence_entry endpoint
-         */
-        if (0 == strcmp(pUrl, "/gps_log")) {
+/**
+ * MHD_ContentReaderFreeCallback releasing the batch once the response is done (or the client went away). Items
+ * still being evaluated are not waited on here, the last of them frees the batch instead.
+ */
+static void __freeBatch(void *pCls) {
+    struct MA_Batch *batch = pCls;
+    pthread_mutex_lock(&batch->lock);
+    batch->released = true;
+    bool last = 0 == batch->running;
+    pthread_mutex_unlock(&batch->lock);
+    if (last) {
+        __destroyBatch(batch);
+    }
+}
+
+/**
+ * Worker pool task of _queuePublish(), the entries are dropped when no client frees up within the admission timeout
+ */
+static void __publishTask(void *pArg) {
+    struct MA_Publish *publish = pArg;
+    mongoc_client_t *client = _waitForClient(publish->data);
+    if (NULL != client) {
+        _publishEntries(publish->data, client, publish->log, NULL != publish->points ? publish->points : publish->log);
+        _pushClient(publish->data, client);
+    } else {
+        LOG_log(LOG_LEVEL_WARN, "fence entry events dropped", "no database client");
+    }
+    DB_freeGpsLog(publish->points);
+    DB_freeGpsLog(publish->log);
+    free(publish);
+}
+
+/**
+ * EVT_streamFunction suspending the connection of an event stream while it has nothing to send, so an idle
+ * subscriber costs no polling
+ */
+static void __suspendEventStream(void *pContext) {
+    struct MA_EventStream *stream = pContext;
+    MHD_suspend_connection(stream->connection);
+}
+
+/**
+ * EVT_streamFunction resuming the connection of an event stream once it has something to send
+ */
+static void __resumeEventStream(void *pContext) {
+    struct MA_EventStream *stream = pContext;
+    MHD_resume_connection(stream->connection);
+}
+
+/**
+ * MHD_ContentReaderCallback of an event stream, EVT_read() suspends the connection when nothing is pending
+ */
+static ssize_t __readEvents(void *pCls, uint64_t pPos, char *pBuf, size_t pMax) {
+    struct MA_EventStream *stream = pCls;
+    bool open;
+    size_t len = EVT_read(stream->subscriber, pBuf, pMax, &open);
+    if (len == 0 && !open) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+    return (ssize_t) len;
+}
+
+/**
+ * MHD_ContentReaderFreeCallback unsubscribing once the stream ended (or the client went away)
+ */
+static void __freeEventStream(void *pCls) {
+    struct MA_EventStream *stream = pCls;
+    EVT_unsubscribe(stream->subscriber);
+    free(stream);
+}
+
+/**
+ * Point pExport->chunk at what comes next, the next document's bson as the cursor returned it (nothing is copied
+ * before MHD's buffer) or its json followed by a newline
+ *
+ * returns false once the export ended
+ */
+static bool __nextExportChunk(struct MA_Export *pExport) {
+    bson_free(pExport->json);
+    pExport->json = NULL;
+    if (pExport->newline) {
+        pExport->newline = false;
+        pExport->chunk = (uint8_t const *) "\n";
+        pExport->chunkLen = 1;
+    } else {
+        bson_t const *doc;
+        if (!DB_nextExport(pExport->export, &doc)) {
+            return false;
+        }
+        if (pExport->ndjson) {
+            pExport->json = bson_as_json(doc, &pExport->chunkLen);
+            pExport->chunk = (uint8_t const *) pExport->json;
+            pExport->newline = true;
+        } else {
+            pExport->chunk = bson_get_data(doc);
+            pExport->chunkLen = doc->len;
+        }
+    }
+    pExport->chunkOffset = 0;
+    return true;
+}
+
+/**
+ * MHD_ContentReaderCallback filling MHD's buffer with as many documents as fit, an export cut short by a cursor
+ * error ends without its last chunk so the client can tell it from a complete one
+ */
+static ssize_t __readExport(void *pCls, uint64_t pPos, char *pBuf, size_t pMax) {
+    struct MA_Export *export = pCls;
+    size_t retVal = 0;
+    while (retVal < pMax && !export->finished) {
+        if (export->chunkOffset == export->chunkLen) {
+            export->finished = !__nextExportChunk(export);
+            continue;
+        }
+        size_t len = MIN(pMax - retVal, export->chunkLen - export->chunkOffset);
+        memcpy(&pBuf[retVal], &export->chunk[export->chunkOffset], len);
+        export->chunkOffset += len;
+        retVal += len;
+    }
+    if (retVal > 0) {
+        return (ssize_t) retVal;
+    }
+    return DB_exportFailed(export->export) ? MHD_CONTENT_READER_END_WITH_ERROR : MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+/**
+ * MHD_ContentReaderFreeCallback closing the cursor and the client of an export
+ */
+static void __freeExport(void *pCls) {
+    struct MA_Export *export = pCls;
+    DB_closeExport(export->export);
+    _pushClient(export->data, export->client);
+    bson_free(export->json);
+    atomic_fetch_sub(&export->data->exports, 1);
+    free(export);
+}
+
+/**
+ * MHD_ContentReaderCallback of a record body, pPos walks the prefix, the record json and then the suffix
+ */
+static ssize_t __readRecordBody(void *pCls, uint64_t pPos, char *pBuf, size_t pMax) {
+    struct MA_RecordBody *body = pCls;
+    size_t prefixLength = sizeof RECORD_PREFIX - 1;
+    size_t suffixStart = prefixLength + body->length;
+    size_t position = (size_t) pPos;
+    size_t retVal = 0;
+    while (retVal < pMax && position < suffixStart + sizeof RECORD_SUFFIX - 1) {
+        char const *segment;
+        size_t remaining;
+        if (position < prefixLength) {
+            segment = &RECORD_PREFIX[position];
+            remaining = prefixLength - position;
+        } else if (position < suffixStart) {
+            segment = &body->json[position - prefixLength];
+            remaining = suffixStart - position;
+        } else {
+            segment = &RECORD_SUFFIX[position - suffixStart];
+            remaining = sizeof RECORD_SUFFIX - 1 - (position - suffixStart);
+        }
+        size_t len = MIN(pMax - retVal, remaining);
+        memcpy(&pBuf[retVal], segment, len);
+        retVal += len;
+        position += len;
+    }
+    return retVal > 0 ? (ssize_t) retVal : MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+/**
+ * MHD_ContentReaderFreeCallback releasing a record body
+ */
+static void __freeRecordBody(void *pCls) {
+    struct MA_RecordBody *body = pCls;
+    bson_free(body->json);
+    free(body);
+}
+
+/**
+ * CMP_busyFunction, the compactor defers its operations while any request holds a database client
+ */
+static bool __databaseBusy(void *pContext) {
+    struct MA_HandlerData *data = pContext;
+    return atomic_load(&data->dbInFlight) > 0;
+}
+
+/*
+ * Parse a whole request param as a base 10 integer, returns false when it is empty, has trailing characters or is out
+ * of range
+ */
+static bool __parseInt64(char const *pValue, int64_t *pResult) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(pValue, &end, 10);
+    if (end == pValue || '\0' != *end || ERANGE == errno) {
+        return false;
+    }
+    *pResult = value;
+    return true;
+}
+
+/*
+ * Read the from, to and max_points request params into pRange, *pResult is pRange or NULL when none was given.
+ * Returns false when a param is not an integer or max_points is negative or too large.
+ */
+static bool __pointRangeFor(struct MHD_Connection *pConn, struct DB_PointRange *pRange,
+                            struct DB_PointRange const **pResult) {
+    char const *from = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "from");
+    char const *to = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "to");
+    char const *maxPoints = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "max_points");
+    *pResult = NULL;
+    if (NULL == from && NULL == to && NULL == maxPoints) {
+        return true;
+    }
+    int64_t maxPointsValue = 0;
+    pRange->from = INT64_MIN;
+    pRange->to = INT64_MAX;
+    if ((NULL != from && !__parseInt64(from, &pRange->from)) || (NULL != to && !__parseInt64(to, &pRange->to)) ||
+        (NULL != maxPoints && (!__parseInt64(maxPoints, &maxPointsValue) || maxPointsValue < 0 ||
+                               maxPointsValue > UINT32_MAX))) {
+        return false;
+    }
+    pRange->maxPoints = (uint32_t) maxPointsValue;
+    *pResult = pRange;
+    return true;
+}
+
+/*
+ * Read the tolerance request param, 0 when it is missing or not a positive number of meters
+ */
+static double __toleranceFor(struct MHD_Connection *pConn) {
+    char const *tolerance = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "tolerance");
+    double retVal = tolerance ? strtod(tolerance, NULL) : 0.0;
+    return retVal > 0.0 ? retVal : 0.0;
+}
+
+/*
+ * Answer a request whose body is refused while it is still being uploaded, the rest of the upload is discarded
+ */
+static int __rejectBody(struct MHD_Connection *pConn, struct MA_ConnectionInfo *pInfo, unsigned int pStatusCode,
+                        char const *pMessage) {
+    pInfo->rejected = true;
+    return _handleClientError(pConn, pStatusCode, pMessage);
+}
+
+/*
+ * Inflate a chunk of a compressed body onto the body, growing it as needed up to pData->maxBody. inflate is also
+ * offered the byte kept for the NUL terminator, the body is only too large once it writes there at maxBody.
+ */
+static int __inflateBody(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pUploadData,
+                         size_t pLen, struct MA_ConnectionInfo *pInfo) {
+    z_stream *inflater = pInfo->inflater;
+    if (pInfo->inflated) {
+        return __rejectBody(pConn, pInfo, MHD_HTTP_BAD_REQUEST, "body continues past its compressed stream");
+    }
+    bool firstChunk = 0 == inflater->total_in;
+    inflater->next_in = (Bytef *) pUploadData;
+    inflater->avail_in = (uInt) pLen;
+    bool pending = false;
+    while ((!pInfo->inflated && (inflater->avail_in > 0 || pending)) || pInfo->sz > pInfo->capacity) {
+        if (NULL == pInfo->body || pInfo->sz > pInfo->capacity) {
+            if (pInfo->sz > pInfo->capacity && pInfo->capacity >= pData->maxBody) {
+                return __rejectBody(pConn, pInfo, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE, "body is too large");
+            }
+            size_t capacity = MIN(MAX(pInfo->capacity * 2, INFLATE_CHUNK), pData->maxBody);
+            char *temp = realloc(pInfo->body, capacity + 1);
+            if (temp == NULL) {
+                return __rejectBody(pConn, pInfo, MHD_HTTP_INTERNAL_SERVER_ERROR, "error");
+            }
+            pInfo->body = temp;
+            pInfo->capacity = capacity;
+            continue;
+        }
+        inflater->next_out = (Bytef *) &pInfo->body[pInfo->sz];
+        inflater->avail_out = (uInt) (pInfo->capacity + 1 - pInfo->sz);
+        int status = inflate(inflater, Z_NO_FLUSH);
+        pInfo->sz = pInfo->capacity + 1 - inflater->avail_out;
+        pending = 0 == inflater->avail_out;
+        if (status == Z_STREAM_END) {
+            pInfo->inflated = true;
+        } else if (status == Z_DATA_ERROR && firstChunk && pInfo->tryRawDeflate) {
+            /*
+             * Content-Encoding: deflate should be zlib wrapped but some clients send raw deflate, start over as that
+             */
+            pInfo->tryRawDeflate = false;
+            pInfo->sz = 0;
+            inflateReset2(inflater, -MAX_WBITS);
+            inflater->next_in = (Bytef *) pUploadData;
+            inflater->avail_in = (uInt) pLen;
+        } else if (status != Z_OK && status != Z_BUF_ERROR) {
+            return __rejectBody(pConn, pInfo, MHD_HTTP_BAD_REQUEST, "body is not valid gzip or deflate");
+        }
+    }
+    if (inflater->avail_in > 0) {
+        return __rejectBody(pConn, pInfo, MHD_HTTP_BAD_REQUEST, "body continues past its compressed stream");
+    }
+    pInfo->body[pInfo->sz] = '\0';
+    return MHD_YES;
+}
+
+/**
+ * Answer with a record fetched by a DB_ list or lookup function, 404 when it was not found
+ */
+static int __respondWithRecord(struct MHD_Connection *pConn, struct DB_Record *pRecord) {
+    /*
+     * Craft json response
+     */
+    bson_t bsonResponse;
+    bson_init(&bsonResponse);
+    unsigned int statusCode;
+    if (pRecord->record) {
+        BSON_APPEND_UTF8(&bsonResponse, "message", pRecord->message);
+        BSON_APPEND_DOCUMENT(&bsonResponse, "record", pRecord->record);
+        statusCode = MHD_HTTP_OK;
+    } else {
+        BSON_APPEND_UTF8(&bsonResponse, "message", "record not found");
+        BSON_APPEND_NULL(&bsonResponse, "record");
+        statusCode = MHD_HTTP_NOT_FOUND;
+    }
+    int ret = _queueJsonResponse(pConn, statusCode, &bsonResponse);
+
+    /**
+     * Cleanup
+     */
+    DB_freeRecord(pRecord);
+    bson_destroy(&bsonResponse);
+
+    return ret;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int _appendData(struct MHD_Connection *pConn, struct MA_HandlerData *pData, size_t *pUploadDataSize,
+                char const *pUploadData, struct MA_ConnectionInfo *connectionInfo) {
+    size_t len = *pUploadDataSize;
+    *pUploadDataSize = 0;
+
+    /*
+     * A gzip or deflate body is inflated as it arrives, only what it inflates to is ever buffered
+     */
+    if (connectionInfo->body == NULL && connectionInfo->inflater == NULL) {
+        connectionInfo->bodyStartTime = MET_now();
+        char const *encoding = MHD_lookup_connection_value(pConn, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_ENCODING);
+        if (NULL != encoding && 0 != strcasecmp(encoding, "identity")) {
+            if (0 != strcasecmp(encoding, "gzip") && 0 != strcasecmp(encoding, "deflate")) {
+                return __rejectBody(pConn, connectionInfo, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
+                                    "Content-Encoding must be gzip or deflate");
+            }
+            connectionInfo->inflater = calloc(1, sizeof(z_stream));
+            connectionInfo->tryRawDeflate = 0 == strcasecmp(encoding, "deflate");
+            if (Z_OK != inflateInit2(connectionInfo->inflater, MAX_WBITS + 32)) {
+                return __rejectBody(pConn, connectionInfo, MHD_HTTP_INTERNAL_SERVER_ERROR, "error");
+            }
+        }
+    }
+    if (NULL != connectionInfo->inflater) {
+        return __inflateBody(pConn, pData, pUploadData, len, connectionInfo);
+    }
+
+    /*
+     * The body is kept NUL terminated so it can be handed straight to the json parsers
+     */
+    size_t newSize = connectionInfo->sz + len;
+    if (newSize > pData->maxBody) {
+        return __rejectBody(pConn, connectionInfo, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE, "body is too large");
+    }
+    char *temp = realloc(connectionInfo->body, newSize + 1);
+    if (temp == NULL) {
+        return __rejectBody(pConn, connectionInfo, MHD_HTTP_INTERNAL_SERVER_ERROR, "error");
+    }
+    memcpy(&temp[connectionInfo->sz], pUploadData, len);
+    temp[newSize] = '\0';
+    connectionInfo->body = temp;
+    connectionInfo->sz = newSize;
+    connectionInfo->capacity = newSize;
+    return MHD_YES;
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+
+int _answerConnection(void *pCls,
+                      struct MHD_Connection *pConn,
+                      char const *pUrl,
+                      char const *pMethod,
+                      char const *pVersion,
+                      char const *pUploadData,
+                      size_t *pUploadDataSize,
+                      void **pConnCls) {
+
+    /*
+     * Fetch the request body
+     */
+    struct MA_ConnectionInfo *connectionInfo = *pConnCls;
+    if (NULL == *pConnCls) {
+        connectionInfo = __createConnectionInfo(MET_routeFor(pMethod, pUrl));
+        *pConnCls = (void *) connectionInfo;
+        return MHD_YES;
+    }
+    __currentRequest = connectionInfo;
+    MET_setCurrentRoute(connectionInfo->route);
+    LOG_setRequest(connectionInfo->requestId);
+    if (connectionInfo->rejected) {
+        *pUploadDataSize = 0;
+        return MHD_YES;
+    }
+    if (*pUploadDataSize) {
+        return _appendData(pConn, pCls, pUploadDataSize, pUploadData, connectionInfo);
+    }
+    if (NULL != connectionInfo->inflater && !connectionInfo->inflated) {
+        connectionInfo->rejected = true;
+        return _handleBadRequest(pConn, "body is not valid gzip or deflate");
+    }
+    if (connectionInfo->body != NULL) {
+        __recordStage(MET_STAGE_BODY_READ, connectionInfo->bodyStartTime);
+    }
+
+    TRC_setRequest(connectionInfo->traceRequest);
+    struct TRC_Span span;
+    TRC_begin(&span, "_answerConnection");
+    int ret = _routeRequest(pConn, pCls, pUrl, pMethod, connectionInfo);
+    TRC_end(&span);
+    TRC_setRequest(0);
+    return ret;
+}
+
+int _routeRequest(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pUrl, char const *pMethod,
+                  struct MA_ConnectionInfo *pConnInfo) {
+    /*
+     * Every database endpoint works within the partition of one device, those without a device_id when it is missing
+     */
+    char const *deviceId = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "device_id");
+    if (NULL != deviceId && !DB_isValidDeviceId(deviceId)) {
+        return _handleBadRequest(pConn, "device_id is not valid");
+    }
+
+    /*
+     * Answer GET requests
+     */
+    if (0 == strcmp(pMethod, METHOD_GET)) {
+        /*
+         * Answer / endpoint
+         */
+        if (0 == strcmp(pUrl, "/")) {
+            return _handleRoot(pConn);
+        }
+
+        /*
+         * Answer /fence_entry endpoint
+         */
+        if (0 == strcmp(pUrl, "/fence_entry")) {
+            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "i");
+            if (val) {
+                struct DB_PointRange range;
+                struct DB_PointRange const *pointRange;
+                if (!__pointRangeFor(pConn, &range, &pointRange)) {
+                    return _handleBadRequest(pConn, "from, to and max_points must be integers, max_points at least 0");
+                }
+                return _handleGetFenceEntry(pConn, pData, val, deviceId, pointRange, __toleranceFor(pConn));
+            }
+        }
+
+        /*
+         * Answer /fence_entry/events endpoint
+         */
+        if (0 == strcmp(pUrl, "/fence_entry/events")) {
+            if (!pData->eventsEnabled) {
+                return _handleClientError(pConn, MHD_HTTP_NOT_IMPLEMENTED,
+                                          "event streams are not available with more than one worker");
+            }
+            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "i");
+            return _handleGetFenceEntryEvents(pConn, val, deviceId);
+        }
+
+        /*
+         * Answer gps_log endpoint
+         */
+        if (0 == strcmp(pUrl, "/gps_log")) {
+            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "t");
+            if (val) {
+                long time = strtol(val, NULL, 10);
+                struct DB_PointRange range;
+                struct DB_PointRange const *pointRange;
+                if (!__pointRangeFor(pConn, &range, &pointRange)) {
+                    return _handleBadRequest(pConn, "from, to and max_points must be integers, max_points at least 0");
+                }
+                return _handleGetGpsLogEntry(pConn, pData, time, deviceId, pointRange, __toleranceFor(pConn));
+            }
+        }
+
+        /*
+         * Answer gps_log endpoint
+         */
+        if (0 == strcmp(pUrl, "/gps_log_list")) {
+            return _handleGetGpsLogEntryList(pConn, pData, deviceId);
+        }
+
+        /*
+         * Answer gps_log endpoint
+         */
+        if (0 == strcmp(pUrl, "/fence_entry_list")) {
+            return _handleGetFenceEntryList(pConn, pData, deviceId);
+        }
+
+        /*
+         * Answer metrics endpoint
+         */
+        if (0 == strcmp(pUrl, "/metrics")) {
+            return _handleGetMetrics(pConn);
+        }
+
+        /*
+         * Answer trace dump endpoint
+         */
+        if (0 == strcmp(pUrl, "/admin/trace")) {
+            if (!_isAdminRequest(pConn, pData)) {
+                return _handleForbidden(pConn);
+            }
+            return _handleGetTrace(pConn);
+        }
+
+        /*
+         * Answer slow operation log endpoint
+         */
+        if (0 == strcmp(pUrl, "/admin/slow_ops")) {
+            if (!_isAdminRequest(pConn, pData)) {
+                return _handleForbidden(pConn);
+            }
+            return _handleGetSlowOps(pConn);
+        }
+
+        /*
+         * Answer export endpoint
+         */
+        if (0 == strcmp(pUrl, "/admin/export")) {
+            if (!_isAdminRequest(pConn, pData)) {
+                return _handleForbidden(pConn);
+            }
+            return _handleGetExport(pConn, pData, deviceId);
+        }
+    }
+
+        /*
+         * Answer POST requests
+         */
+    else if (0 == strcmp(pMethod, METHOD_POST)) {
+        /*
+         * Answer /fence_entry endpoint
+         */
+        if (0 == strcmp(pUrl, "/fence_entry")) {
+            return _handlePostFenceEntry(pConn, pData, pConnInfo);
+        }
+
+        /*
+         * Answer /fence_entry/evaluate endpoint
+         */
+        if (0 == strcmp(pUrl, "/fence_entry/evaluate")) {
+            return _handlePostFenceEntryEvaluate(pConn, pData, pConnInfo, deviceId);
+        }
+
+        /*
+         * Answer /fence_entry endpoint
+         */
+        if (0 == strcmp(pUrl, "/gps_log")) {
+            return _handlePostGpsLog(pConn, pData, pConnInfo);
+        }
+    }
+
+        /*
+         * Answer PATCH requests
+         */
+    else if (0 == strcmp(pMethod, METHOD_PATCH)) {
+        /*
+         * Answer /gps_log endpoint
+         */
+        if (0 == strcmp(pUrl, "/gps_log")) {
+            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "id");
+            if (val) {
+                return _handlePatchGpsLog(pConn, pData, pConnInfo, val, deviceId);
+            }
+        }
+    }
+
+        /*
+         * Answer DELETE requests
+         */
+    else if (0 == strcmp(pMethod, METHOD_DELETE)) {
+        /*
+         * Answer /fence_entry endpoint
+         */
+        if (0 == strcmp(pUrl, "/fence_entry")) {
             char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "id");
             if (val) {
-                return _handleDeleteGpsLog(pConn, pCls, val);
+                return _handleDeleteFenceEntry(pConn, pData, val, deviceId);
             }
         }
+
+        /*
+         * Answer /fence_entry endpoint
+         */
+        if (0 == strcmp(pUrl, "/gps_log")) {
+            char const *val = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "id");
+            if (val) {
+                return _handleDeleteGpsLog(pConn, pData, val, deviceId);
+            }
+        }
+    }
+
+    /*
+     * Answer with 404 not found
+     */
+    return _handleNotFound(pConn);
+}
+
+int _handleDeleteGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, const char *pId,
+                        const char *pDeviceId) {
+    if (!bson_oid_is_valid(pId, strlen(pId))) {
+        return _handleBadRequest(pConn, "id is not a valid object id");
+    }
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    int64_t startTime = MET_now();
+    bool deleted = DB_deleteGpsLogRecord(pId, pDeviceId, client);
+    __recordStage(MET_STAGE_MONGO, startTime);
+    _pushClient(pData, client);
+
+    if (!deleted) {
+        return _handleError(pConn);
+    }
+
+    /*
+     * Craft json response
+     */
+    bson_t bsonResponse;
+    bson_init(&bsonResponse);
+    BSON_APPEND_UTF8(&bsonResponse, "message", "ok");
+    int ret = _queueJsonResponse(pConn, MHD_HTTP_OK, &bsonResponse);
+
+    /*
+     * Cleanup
+     */
+    bson_destroy(&bsonResponse);
+
+    return ret;
+}
+
+int _handleDeleteFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, const char *pId,
+                            const char *pDeviceId) {
+    if (!bson_oid_is_valid(pId, strlen(pId))) {
+        return _handleBadRequest(pConn, "id is not a valid object id");
     }
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    int64_t startTime = MET_now();
+    bool deleted = DB_deleteFenceRecord(pId, pDeviceId, client);
+    __recordStage(MET_STAGE_MONGO, startTime);
+    _pushClient(pData, client);
+
+    if (!deleted) {
+        return _handleError(pConn);
+    }
+
+    /*
+     * Craft json response
+     */
+    bson_t bsonResponse;
+    bson_init(&bsonResponse);
+    BSON_APPEND_UTF8(&bsonResponse, "message", "ok");
+    int ret = _queueJsonResponse(pConn, MHD_HTTP_OK, &bsonResponse);
+
+    /*
+     * Cleanup
+     */
+    bson_destroy(&bsonResponse);
+
+    return ret;
+}
+
+#pragma clang diagnostic pop
+
+int _handleRoot(struct MHD_Connection *pConn) {
+    /*
+     * Craft json response
+     */
+    bson_t *json_response = bson_new();
+    BSON_APPEND_UTF8(json_response, "message", "GeoFenceMark");
+    int ret = _queueJsonResponse(pConn, MHD_HTTP_OK, json_response);
+
+    /*
+     * Cleanup
+     */
+    bson_destroy(json_response);
+
+    return ret;
+}
 
+int _handleGetFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pId,
+                         char const *pDeviceId, struct DB_PointRange const *pRange, double pToleranceMeters) {
     /*
-     * Answer with 404 not found
+     * Fetch the record from the database
      */
-    *pUploadDataSize = 0;
-    return _handleNotFound(pConn);
-}
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    int64_t startTime = MET_now();
+    struct DB_GpsLog *log = NULL;
+    struct DB_Fence *fence = DB_getFenceWithLog(pId, pDeviceId, pRange, client, &log);
+    bson_t *actualEntryPoint = NULL;
+    __recordStage(MET_STAGE_MONGO, startTime);
+    _pushClient(pData, client);
+
+    if (log != NULL) {
+        startTime = MET_now();
+        size_t entryIndex = ENT_findEntryIndex(fence, log, pData->workers);
+        if (entryIndex != SIZE_MAX) {
+            actualEntryPoint = ENT_entryPoint(fence, log, entryIndex);
+        }
 
-int _handleDeleteGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, const char *pId) {
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    DB_deleteGpsLogRecord(pId, client);
-    mongoc_client_pool_push(pool, client);
+        /*
+         * The simplified log always keeps the entry point
+         */
+        if (pToleranceMeters > 0.0) {
+            bson_t *simplified = SIM_simplifiedRecord(log->record, log, pToleranceMeters, entryIndex, pRange);
+            bson_destroy(log->record);
+            log->record = simplified;
+        }
+        __recordStage(MET_STAGE_COMPUTE, startTime);
+    }
 
     /*
      * Craft json response
      */
-    bson_t json_response;
-    bson_init(&json_response);
-    BSON_APPEND_UTF8(&json_response, "message", "ok");
-    char *responseBody = bson_as_json(&json_response, NULL);
+    bson_t bsonResponse;
+    bson_init(&bsonResponse);
+    unsigned int statusCode;
+    if (fence != NULL) {
+        BSON_APPEND_UTF8(&bsonResponse, "message", "ok");
+        BSON_APPEND_DOCUMENT(&bsonResponse, "record", fence->record);
+        if (log != NULL) {
+            BSON_APPEND_DOCUMENT(&bsonResponse, "corresponding_log", log->record);
+            if (actualEntryPoint != NULL) {
+                BSON_APPEND_DOCUMENT(&bsonResponse, "actual_entry", actualEntryPoint);
+            } else {
+                BSON_APPEND_NULL(&bsonResponse, "actual_entry");
+            }
+        } else {
+            BSON_APPEND_NULL(&bsonResponse, "corresponding_log");
+            BSON_APPEND_NULL(&bsonResponse, "actual_entry");
+        }
+        statusCode = MHD_HTTP_OK;
+    } else {
+        BSON_APPEND_UTF8(&bsonResponse, "message", "record not found");
+        BSON_APPEND_NULL(&bsonResponse, "record");
+        statusCode = MHD_HTTP_NOT_FOUND;
+    }
+    int ret = _queueJsonResponse(pConn, statusCode, &bsonResponse);
+
+    /**
+     * Cleanup
+     */
+    DB_freeFence(fence);
+    DB_freeGpsLog(log);
+    if (actualEntryPoint != NULL) {
+        bson_destroy(actualEntryPoint);
+    }
+    bson_destroy(&bsonResponse);
 
+    return ret;
+}
+
+int _handleGetGpsLogEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pDeviceId) {
     /*
-     * Queue a json response
+     * Fetch the record from the database
      */
-    struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, MHD_HTTP_OK, response);
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    int64_t startTime = MET_now();
+    struct DB_Record *record = DB_getGpsLogRecordList(pDeviceId, client);
+    __recordStage(MET_STAGE_MONGO, startTime);
+    _pushClient(pData, client);
+
+    return __respondWithRecord(pConn, record);
+}
 
+int _handleGetFenceEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pDeviceId) {
     /*
-     * Cleanup
+     * Fetch the record from the database
      */
-    MHD_destroy_response(response);
-    bson_free(responseBody);
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    int64_t startTime = MET_now();
+    struct DB_Record *record = DB_getFenceRecordList(pDeviceId, client);
+    __recordStage(MET_STAGE_MONGO, startTime);
+    _pushClient(pData, client);
 
-    return ret;
+    return __respondWithRecord(pConn, record);
 }
 
-int _handleDeleteFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, const char *pId) {
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    DB_deleteFenceRecord(pId, client);
-    mongoc_client_pool_push(pool, client);
-
+int _handleGetGpsLogEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, long epoch,
+                          char const *pDeviceId, struct DB_PointRange const *pRange, double pToleranceMeters) {
     /*
-     * Craft json response
+     * Fetch the record from the database
      */
-    bson_t json_response;
-    bson_init(&json_response);
-    BSON_APPEND_UTF8(&json_response, "message", "ok");
-    char *responseBody = bson_as_json(&json_response, NULL);
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    int64_t startTime = MET_now();
 
     /*
-     * Queue a json response
+     * Without simplification the record is only serialized, straight from the cursor's reply into the json MHD sends
+     * from, instead of being copied as bson twice and then as json
      */
-    struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, MHD_HTTP_OK, response);
+    if (pToleranceMeters <= 0.0) {
+        struct MA_RecordBody *body = malloc(sizeof(struct MA_RecordBody));
+        body->json = DB_getGpsLogRecordJson(epoch, pDeviceId, pRange, client, &body->length);
+        __recordStage(MET_STAGE_MONGO, startTime);
+        _pushClient(pData, client);
+        if (NULL == body->json) {
+            free(body);
+            return __respondWithRecord(pConn, calloc(1, sizeof(struct DB_Record)));
+        }
+        struct MHD_Response *response;
+        response = MHD_create_response_from_callback(sizeof RECORD_PREFIX - 1 + body->length + sizeof RECORD_SUFFIX - 1,
+                                                     32 * 1024, &__readRecordBody, body, &__freeRecordBody);
+        MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
+        return _queueResponse(pConn, MHD_HTTP_OK, response);
+    }
+
+    struct DB_Record *record = DB_getGpsLogRecord(epoch, pDeviceId, pRange, client);
+    __recordStage(MET_STAGE_MONGO, startTime);
+    _pushClient(pData, client);
 
     /*
-     * Cleanup
+     * Simplify the points already narrowed to the range
      */
-    MHD_destroy_response(response);
-    bson_free(responseBody);
+    if (pToleranceMeters > 0.0 && record->record) {
+        startTime = MET_now();
+        struct DB_GpsLog *log = DB_decodeGpsLog(record->record);
+        if (log != NULL) {
+            bson_t *simplified = SIM_simplifiedRecord(record->record, log, pToleranceMeters, SIZE_MAX, NULL);
+            bson_destroy(record->record);
+            record->record = simplified;
+            DB_freeGpsLog(log);
+        }
+        __recordStage(MET_STAGE_COMPUTE, startTime);
+    }
 
-    return ret;
+    return __respondWithRecord(pConn, record);
 }
 
-#pragma clang diagnostic pop
-
-int _handleRoot(struct MHD_Connection *pConn) {
+int _handlePostWithDbInsertBodyJson(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
+                                    struct MA_ConnectionInfo *pConnInfo,
+                                    DB_insertFunction fPtr, MA_insertedFunction fInserted) {
     /*
-     * Craft json response
+     * Insert the record in the db, the database layer records its own validate and mongo stages
      */
-    bson_t *json_response = bson_new();
-    BSON_APPEND_UTF8(json_response, "message", "GeoFenceMark");
-    char *responseBody = bson_as_json(json_response, NULL);
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    struct DB_Record *record = fPtr(pConnInfo->body, client);
+    if (NULL != fInserted && record->record) {
+        fInserted(pData, client, record);
+    }
+    _pushClient(pData, client);
 
     /*
-     * Queue a json response
+     * Craft json response
      */
-    struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, MHD_HTTP_OK, response);
+    unsigned int statusCode = MHD_HTTP_BAD_REQUEST;
+    bson_t bsonResponse;
+    bson_init(&bsonResponse);
+    if (record->record) {
+        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
+        BSON_APPEND_DOCUMENT(&bsonResponse, "record", record->record);
+        statusCode = MHD_HTTP_OK;
+    } else {
+        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
+        BSON_APPEND_NULL(&bsonResponse, "record");
+    }
+    int ret = _queueJsonResponse(pConn, statusCode, &bsonResponse);
 
     /*
      * Cleanup
      */
-    MHD_destroy_response(response);
-    bson_destroy(json_response);
-    bson_free(responseBody);
+    DB_freeRecord(record);
+    bson_destroy(&bsonResponse);
 
     return ret;
 }
 
-int _handleGetFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pId) {
+int _handlePostGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, struct MA_ConnectionInfo *pConnInfo) {
+    return _handlePostWithDbInsertBodyJson(pConn, pData, pConnInfo, &DB_insertGpsLogRecord, &_publishPostedLog);
+}
+
+void _publishPostedLog(struct MA_HandlerData *pData, mongoc_client_t *pClient, struct DB_Record const *pRecord) {
     /*
-     * Fetch the record from the database
+     * Look at the device before decoding the points, most logs have nobody waiting for them
      */
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    struct DB_Record *record = DB_getFenceRecord(pId, client);
-    struct DB_Record *logRecord = NULL;
-    bson_t *actualEntryPoint = NULL;
-    bson_value_t const *value = NULL;
-    struct LocationInfo locationInfo;
-
-    double fenceLat = 0;
-    double fenceLng = 0;
-    double radius = 0;
-    int32_t entryTime = 0;
-
-    if (record->record) { // Find corresponding log entry
-        bson_iter_t iter;
-        bool proceed;
-
-        if (bson_iter_init_find(&iter, record->record, "entry_time")) {
-            value = bson_iter_value(&iter);
-            entryTime = DB_bsonValueInt32(value);
-            logRecord = DB_getGpsLogRecord(entryTime, client);
-            proceed = logRecord->record != NULL;
-        } else {
-            proceed = false;
-        }
+    bson_iter_t iter;
+    char const *deviceId = NULL;
+    if (bson_iter_init_find(&iter, pRecord->record, "device_id") && BSON_ITER_HOLDS_UTF8(&iter)) {
+        deviceId = bson_iter_utf8(&iter, NULL);
+    }
+    if (!EVT_hasSubscribers(deviceId)) {
+        return;
+    }
+    struct DB_GpsLog *log = DB_decodeGpsLog(pRecord->record);
+    if (NULL != log) {
+        _queuePublish(pData, log, NULL);
+    }
+}
 
-        if (proceed && bson_iter_init_find(&iter, record->record, "latitude")) {
-            value = bson_iter_value(&iter);
-            fenceLat = value->value.v_double;
-        } else {
-            proceed = false;
-        }
+void _queuePublish(struct MA_HandlerData *pData, struct DB_GpsLog *pLog, struct DB_GpsLog *pPoints) {
+    struct MA_Publish *publish = malloc(sizeof(struct MA_Publish));
+    publish->data = pData;
+    publish->log = pLog;
+    publish->points = pPoints;
+    TP_submit(pData->workers, NULL, &__publishTask, publish);
+}
 
-        if (proceed && bson_iter_init_find(&iter, record->record, "longitude")) {
-            value = bson_iter_value(&iter);
-            fenceLng = value->value.v_double;
-        } else {
-            proceed = false;
-        }
+void _publishEntries(struct MA_HandlerData *pData, mongoc_client_t *pClient, struct DB_GpsLog const *pLog,
+                     struct DB_GpsLog const *pPoints) {
+    if (!pLog->hasId || pPoints->count == 0 || !EVT_hasSubscribers(pLog->deviceId)) {
+        return;
+    }
 
-        if (proceed && bson_iter_init_find(&iter, record->record, "radius")) {
-            value = bson_iter_value(&iter);
-            radius = value->value.v_double;
-        } else {
-            proceed = false;
+    /*
+     * Only fences whose entry_time the log spans can have it as their corresponding log
+     */
+    size_t fenceCount;
+    struct DB_Fence **fences = DB_getFencesInWindow(pLog->deviceId, pLog->startTime, pLog->endTime, pClient,
+                                                    &fenceCount);
+    for (size_t i = 0; i < fenceCount; ++i) {
+        struct DB_Fence *fence = fences[i];
+        struct DB_GpsLog *log = NULL;
+        struct DB_GpsLog const *entryLog = pPoints;
+        size_t index = SIZE_MAX;
+        if (EVT_isSubscribed(fence->deviceId, fence->identifier)) {
+            index = ENT_findEntryIndex(fence, pPoints, pData->workers);
         }
 
-        if (proceed && bson_iter_init_find(&iter, logRecord->record, "log")) {
-            bson_iter_t logItr;
-            bson_iter_recurse(&iter, &logItr);
-
-            bson_iter_t itemItr;
+        /*
+         * The new points enter the fence, check that the log did not already enter it before them
+         */
+        if (index != SIZE_MAX && pPoints != pLog) {
+            DB_freeFence(DB_getFenceWithLog(fence->identifier, fence->deviceId, NULL, pClient, &log));
+            index = NULL != log && bson_oid_equal(&log->id, &pLog->id) ?
+                    ENT_findEntryIndex(fence, log, pData->workers) : SIZE_MAX;
+            if (index != SIZE_MAX && index + pPoints->count < log->count) {
+                index = SIZE_MAX;
+            }
+            entryLog = log;
+        }
 
-            while (bson_iter_next(&logItr)) {
-                double ptLat, ptLng;
-                int32_t ptTime;
-                if (bson_iter_recurse(&logItr, &itemItr) && bson_iter_find(&itemItr, "latitude")) {
-                    value = bson_iter_value(&itemItr);
-                    ptLat = value->value.v_double;
-                } else {
-                    break;
-                }
+        if (index != SIZE_MAX) {
+            bson_t event;
+            bson_init(&event);
+            BSON_APPEND_UTF8(&event, "identifier", fence->identifier);
+            if (NULL != fence->deviceId) {
+                BSON_APPEND_UTF8(&event, "device_id", fence->deviceId);
+            }
+            BSON_APPEND_OID(&event, "log_id", &pLog->id);
+            bson_t *actualEntry = ENT_entryPoint(fence, entryLog, index);
+            BSON_APPEND_DOCUMENT(&event, "actual_entry", actualEntry);
+            char *data = bson_as_json(&event, NULL);
+            EVT_publish(fence->deviceId, fence->identifier, data);
+            bson_free(data);
+            bson_destroy(actualEntry);
+            bson_destroy(&event);
+        }
+        DB_freeGpsLog(log);
+        DB_freeFence(fence);
+    }
+    free(fences);
+}
 
-                if (bson_iter_recurse(&logItr, &itemItr) && bson_iter_find(&itemItr, "longitude")) {
-                    value = bson_iter_value(&itemItr);
-                    ptLng = value->value.v_double;
-                } else {
-                    break;
-                }
+int _handlePatchGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, struct MA_ConnectionInfo *pConnInfo,
+                       char const *pId, char const *pDeviceId) {
+    if (NULL == pConnInfo->body) {
+        return _handleBadRequest(pConn, "body is required");
+    }
+    if (!bson_oid_is_valid(pId, strlen(pId))) {
+        return _handleBadRequest(pConn, "id is not a valid object id");
+    }
 
-                if (bson_iter_recurse(&logItr, &itemItr) && bson_iter_find(&itemItr, "time")) {
-                    value = bson_iter_value(&itemItr);
-                    ptTime = DB_bsonValueInt32(value);
-                } else {
-                    break;
-                }
+    /*
+     * Append the points, the database layer records its own validate and mongo stages
+     */
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        return _handleOverloaded(pConn);
+    }
+    bool found;
+    struct DB_GpsLog *points = NULL;
+    struct DB_Record *record = DB_appendGpsLogPoints(pId, pDeviceId, pConnInfo->body, client, &found,
+                                                     EVT_hasSubscribers(pDeviceId) ? &points : NULL);
 
-                LOC_calculateLocationInfo(&locationInfo, fenceLat, fenceLng, ptLat, ptLng);
-                if (locationInfo.distanceMeters <= radius) {
-                    int32_t entryTimeDelta = entryTime - ptTime;
-                    bson_value_t const *logItemValue = bson_iter_value(&logItr);
-                    actualEntryPoint = bson_new_from_data(logItemValue->value.v_doc.data,
-                                                          logItemValue->value.v_doc.data_len);
-                    BSON_APPEND_INT32(actualEntryPoint, "entry_delta", entryTimeDelta);
-                    break;
-                }
-            }
+    /*
+     * The record is the log without its points, the appended ones were decoded by the append
+     */
+    if (NULL != points) {
+        struct DB_GpsLog *log = DB_decodeGpsLog(record->record);
+        if (NULL != log) {
+            _queuePublish(pData, log, points);
+        } else {
+            DB_freeGpsLog(points);
         }
     }
-    mongoc_client_pool_push(pool, client);
+    _pushClient(pData, client);
 
     /*
      * Craft json response
      */
+    unsigned int statusCode = found ? MHD_HTTP_BAD_REQUEST : MHD_HTTP_NOT_FOUND;
     bson_t bsonResponse;
     bson_init(&bsonResponse);
-    unsigned int statusCode;
+    BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
     if (record->record) {
-        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
         BSON_APPEND_DOCUMENT(&bsonResponse, "record", record->record);
-        if (logRecord != NULL && logRecord->record != NULL) {
-            BSON_APPEND_DOCUMENT(&bsonResponse, "corresponding_log", logRecord->record);
-            if (actualEntryPoint != NULL) {
-                BSON_APPEND_DOCUMENT(&bsonResponse, "actual_entry", actualEntryPoint);
+        statusCode = MHD_HTTP_OK;
+    } else {
+        BSON_APPEND_NULL(&bsonResponse, "record");
+    }
+    int ret = _queueJsonResponse(pConn, statusCode, &bsonResponse);
+
+    /*
+     * Cleanup
+     */
+    DB_freeRecord(record);
+    bson_destroy(&bsonResponse);
+
+    return ret;
+}
+
+int _handlePostFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
+                          struct MA_ConnectionInfo *pConnInfo) {
+    return _handlePostWithDbInsertBodyJson(pConn, pData, pConnInfo, &DB_insertFenceRecord, NULL);
+}
+
+int _handlePostFenceEntryEvaluate(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
+                                  struct MA_ConnectionInfo *pConnInfo, char const *pDeviceId) {
+    /*
+     * Parse the requested identifiers { "identifiers": ["abc123", ...] }
+     */
+    if (NULL == pConnInfo->body) {
+        return _handleBadRequest(pConn, "body is required");
+    }
+    int64_t startTime = MET_now();
+    bson_error_t error;
+    bson_t *request = bson_new_from_json((uint8_t const *) pConnInfo->body, (ssize_t) pConnInfo->sz, &error);
+    bson_iter_t iter;
+    bson_iter_t idItr;
+    if (NULL == request || !bson_iter_init_find(&iter, request, "identifiers") || !BSON_ITER_HOLDS_ARRAY(&iter)) {
+        if (NULL != request) {
+            bson_destroy(request);
+        }
+        return _handleBadRequest(pConn, "identifiers array is required");
+    }
+
+    size_t count = 0;
+    bson_iter_recurse(&iter, &idItr);
+    while (bson_iter_next(&idItr)) {
+        if (!BSON_ITER_HOLDS_UTF8(&idItr)) {
+            bson_destroy(request);
+            return _handleBadRequest(pConn, "identifiers must be strings");
+        }
+        ++count;
+    }
+    __recordStage(MET_STAGE_VALIDATE, startTime);
+
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        bson_destroy(request);
+        return _handleOverloaded(pConn);
+    }
+
+    struct MA_Batch *batch = malloc(sizeof(struct MA_Batch));
+    batch->workers = pData->workers;
+    batch->connection = pConn;
+    pthread_mutex_init(&batch->lock, NULL);
+    batch->running = 0;
+    batch->waiting = false;
+    batch->released = false;
+    batch->request = request;
+    batch->fences = NULL;
+    batch->fenceCount = 0;
+    batch->logs = NULL;
+    batch->logCount = 0;
+    batch->items = calloc(count > 0 ? count : 1, sizeof(struct MA_BatchItem));
+    batch->count = count;
+    batch->next = 0;
+    batch->finished = false;
+    batch->traceRequest = pConnInfo->traceRequest;
+
+    char const **identifiers = malloc((count > 0 ? count : 1) * sizeof(char const *));
+    struct MA_BatchItem **byEntryTime = malloc((count > 0 ? count : 1) * sizeof(struct MA_BatchItem *));
+    size_t i = 0;
+    bson_iter_recurse(&iter, &idItr);
+    while (bson_iter_next(&idItr)) {
+        struct MA_BatchItem *item = &batch->items[i];
+        item->batch = batch;
+        item->identifier = bson_iter_utf8(&idItr, NULL);
+        identifiers[i] = item->identifier;
+        ++i;
+    }
+
+    /*
+     * Fetch all fences in one round trip then each distinct covering log once, visiting fences in entry time order so
+     * that consecutive fences covered by the same log reuse it
+     */
+    startTime = MET_now();
+    batch->fences = DB_getFences(identifiers, count, pDeviceId, client, &batch->fenceCount);
+
+    size_t fenceCount = 0;
+    for (size_t f = 0; f < batch->fenceCount; ++f) {
+        struct DB_Fence const *fence = batch->fences[f];
+        for (i = 0; i < count; ++i) {
+            struct MA_BatchItem *item = &batch->items[i];
+            if (item->fence == NULL && fence->identifier != NULL && 0 == strcmp(fence->identifier, item->identifier)) {
+                item->fence = fence;
+                byEntryTime[fenceCount++] = item;
+            }
+        }
+    }
+
+    qsort(byEntryTime, fenceCount, sizeof(struct MA_BatchItem *), &__compareBatchItemEntryTime);
+    batch->logs = malloc((fenceCount > 0 ? fenceCount : 1) * sizeof(struct DB_GpsLog *));
+    struct DB_GpsLog const *currentLog = NULL;
+    for (i = 0; i < fenceCount; ++i) {
+        struct MA_BatchItem *item = byEntryTime[i];
+        if (currentLog == NULL || !__logCoversTime(currentLog, item->fence->entryTime)) {
+#ifdef DB_GEOJSON_STORAGE
+            struct DB_GpsLog *log = DB_getGpsLog(item->fence->entryTime, pDeviceId, false, client);
+#else
+            struct DB_GpsLog *log = DB_getGpsLog(item->fence->entryTime, pDeviceId, true, client);
+#endif
+            if (log != NULL) {
+                batch->logs[batch->logCount++] = log;
+                currentLog = log;
             } else {
-                BSON_APPEND_NULL(&bsonResponse, "actual_entry");
+                continue;
             }
+        }
+        item->log = currentLog;
+    }
+
+#ifdef DB_GEOJSON_STORAGE
+    /*
+     * Let the 2dsphere index pick the candidate points so only those cross the wire instead of whole logs
+     */
+    for (i = 0; i < fenceCount; ++i) {
+        struct MA_BatchItem *item = byEntryTime[i];
+        if (item->log != NULL && item->log->hasId) {
+            item->candidates = DB_getEntryCandidates(&item->log->id, pDeviceId, item->fence, client);
+        }
+        if (NULL == item->candidates) {
+            item->log = NULL;
+        }
+    }
+#endif
+    _pushClient(pData, client);
+    __recordStage(MET_STAGE_MONGO, startTime);
+
+    /*
+     * Spread the distance scans across the worker pool
+     */
+    for (i = 0; i < count; ++i) {
+        struct MA_BatchItem *item = &batch->items[i];
+        if (item->fence != NULL && item->log != NULL) {
+            ++batch->running;
         } else {
-            BSON_APPEND_NULL(&bsonResponse, "corresponding_log");
-            BSON_APPEND_NULL(&bsonResponse, "actual_entry");
+            item->done = true;
         }
-        statusCode = MHD_HTTP_OK;
-    } else {
-        BSON_APPEND_UTF8(&bsonResponse, "message", "record not found");
-        BSON_APPEND_NULL(&bsonResponse, "record");
-        statusCode = MHD_HTTP_NOT_FOUND;
     }
-    char *responseBody = bson_as_json(&bsonResponse, NULL);
+    for (i = 0; i < count; ++i) {
+        struct MA_BatchItem *item = &batch->items[i];
+        if (!item->done) {
+            TP_submit(batch->workers, NULL, &__evaluateBatchItem, item);
+        }
+    }
+    free(identifiers);
+    free(byEntryTime);
 
     /*
-     * Queue a json response
+     * Queue a streamed json response, results are written in request order as they complete
      */
+    batch->chunk = bson_strdup("{\"message\": \"ok\", \"results\": [");
+    batch->chunkLen = strlen(batch->chunk);
+    batch->chunkOffset = 0;
+
     struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024, &__readBatch, batch, &__freeBatch);
     MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, statusCode, response);
+    return _queueResponse(pConn, MHD_HTTP_OK, response);
+}
 
-    /**
-     * Cleanup
+int _handleGetFenceEntryEvents(struct MHD_Connection *pConn, char const *pIdentifiers, char const *pDeviceId) {
+    /*
+     * Split the identifiers, the subscriber keeps its own copies
      */
-    MHD_destroy_response(response);
-    DB_freeRecord(record);
-    DB_freeRecord(logRecord);
-    bson_destroy(&bsonResponse);
-    bson_free(responseBody);
+    char *identifiers = NULL != pIdentifiers ? bson_strdup(pIdentifiers) : NULL;
+    size_t count = 0;
+    size_t capacity = 8;
+    char const **list = malloc(capacity * sizeof(char const *));
+    char *save = NULL;
+    for (char *id = NULL != identifiers ? strtok_r(identifiers, ",", &save) : NULL; NULL != id;
+         id = strtok_r(NULL, ",", &save)) {
+        if (count == capacity) {
+            capacity *= 2;
+            list = realloc(list, capacity * sizeof(char const *));
+        }
+        list[count++] = id;
+    }
+    if (NULL != identifiers && count == 0) {
+        bson_free(identifiers);
+        free(list);
+        return _handleBadRequest(pConn, "i must list at least one identifier");
+    }
 
-    return ret;
+    struct MA_EventStream *stream = malloc(sizeof(struct MA_EventStream));
+    stream->connection = pConn;
+    stream->subscriber = EVT_subscribe(pDeviceId, NULL != identifiers ? list : NULL, count, &__suspendEventStream,
+                                       &__resumeEventStream, stream);
+    bson_free(identifiers);
+    free(list);
+
+    /*
+     * Queue a streamed response that lasts until the client goes away or the daemon drains
+     */
+    struct MHD_Response *response;
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4 * 1024, &__readEvents, stream,
+                                                 &__freeEventStream);
+    MHD_add_response_header(response, CONTENT_TYPE, TEXT_EVENT_STREAM);
+    MHD_add_response_header(response, CACHE_CONTROL, "no-cache");
+    return _queueResponse(pConn, MHD_HTTP_OK, response);
 }
 
-int _handleGetGpsLogEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData) {
+int _handleGetExport(struct MHD_Connection *pConn, struct MA_HandlerData *pData, char const *pDeviceId) {
+    char const *collection = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "collection");
+    char const *format = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "format");
+    char const *from = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "from");
+    char const *to = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "to");
+    char const *after = MHD_lookup_connection_value(pConn, MHD_GET_ARGUMENT_KIND, "after");
+    if (NULL == collection || (0 != strcmp(collection, COLLECTION_FENCES) &&
+                               0 != strcmp(collection, COLLECTION_GPS_LOGS) &&
+                               0 != strcmp(collection, COLLECTION_GPS_POINTS))) {
+        return _handleBadRequest(pConn, "collection must be fences, gps_logs or gps_points");
+    }
+    bool ndjson = NULL == format || 0 == strcmp(format, "ndjson");
+    if (!ndjson && 0 != strcmp(format, "bson")) {
+        return _handleBadRequest(pConn, "format must be ndjson or bson");
+    }
+    int64_t fromTime = INT64_MIN;
+    int64_t toTime = INT64_MAX;
+    if ((NULL != from && !__parseInt64(from, &fromTime)) || (NULL != to && !__parseInt64(to, &toTime))) {
+        return _handleBadRequest(pConn, "from and to must be epoch seconds");
+    }
+    bson_oid_t afterId;
+    if (NULL != after) {
+        if (!bson_oid_is_valid(after, strlen(after))) {
+            return _handleBadRequest(pConn, "after must be an ObjectId");
+        }
+        bson_oid_init_from_string(&afterId, after);
+    }
+
     /*
-     * Fetch the record from the database
+     * Each export holds a pooled client for as long as the client reads, so only a few run at once
      */
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    struct DB_Record *record = DB_getGpsLogRecordList(client);
-    mongoc_client_pool_push(pool, client);
+    if (atomic_fetch_add(&pData->exports, 1) >= pData->maxExports) {
+        atomic_fetch_sub(&pData->exports, 1);
+        return _handleOverloaded(pConn);
+    }
+    mongoc_client_t *client = _popClient(pData);
+    if (NULL == client) {
+        atomic_fetch_sub(&pData->exports, 1);
+        return _handleOverloaded(pConn);
+    }
+    struct MA_Export *export = calloc(1, sizeof(struct MA_Export));
+    export->data = pData;
+    export->ndjson = ndjson;
+    export->client = client;
+
+    /*
+     * Read the first document before answering so a failing query is still answered 500
+     */
+    int64_t startTime = MET_now();
+    export->export = DB_openExport(collection, pDeviceId, fromTime, toTime, NULL != after ? &afterId : NULL,
+                                   export->client);
+    export->finished = !__nextExportChunk(export);
+    __recordStage(MET_STAGE_MONGO, startTime);
+    if (export->finished && DB_exportFailed(export->export)) {
+        __freeExport(export);
+        return _handleError(pConn);
+    }
+
+    /*
+     * Queue a streamed response, sent chunked, that is read straight off the cursor as the client takes it
+     */
+    struct MHD_Response *response;
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 64 * 1024, &__readExport, export, &__freeExport);
+    MHD_add_response_header(response, CONTENT_TYPE, ndjson ? APPLICATION_NDJSON : APPLICATION_BSON);
+    return _queueResponse(pConn, MHD_HTTP_OK, response);
+}
+
+int _handleGetMetrics(struct MHD_Connection *pConn) {
+    char *responseBody = MET_render();
 
     /*
-     * Craft json response
+     * Queue a text response, microhttpd takes ownership of the body
      */
-    bson_t bsonResponse;
-    bson_init(&bsonResponse);
-    unsigned int statusCode;
-    if (record->record) {
-        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
-        BSON_APPEND_DOCUMENT(&bsonResponse, "record", record->record);
-        statusCode = MHD_HTTP_OK;
-    } else {
-        BSON_APPEND_UTF8(&bsonResponse, "message", "record not found");
-        BSON_APPEND_NULL(&bsonResponse, "record");
-        statusCode = MHD_HTTP_NOT_FOUND;
-    }
-    char *responseBody = bson_as_json(&bsonResponse, NULL);
+    struct MHD_Response *response;
+    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(response, CONTENT_TYPE, TEXT_PROMETHEUS);
+    return _queueResponse(pConn, MHD_HTTP_OK, response);
+}
+
+int _handleGetTrace(struct MHD_Connection *pConn) {
+    char *responseBody = TRC_renderChromeTrace();
 
     /*
-     * Queue a json response
+     * Queue a json response, the body is copied since it was allocated by libbson
      */
     struct MHD_Response *response;
     response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
     MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, statusCode, response);
+    int ret = _queueResponse(pConn, MHD_HTTP_OK, response);
 
-    /**
+    /*
      * Cleanup
      */
-    MHD_destroy_response(response);
-    DB_freeRecord(record);
-    bson_destroy(&bsonResponse);
     bson_free(responseBody);
 
     return ret;
 }
 
+int _handleGetSlowOps(struct MHD_Connection *pConn) {
+    char *responseBody = SOP_renderJson();
 
-int _handleGetFenceEntryList(struct MHD_Connection *pConn, struct MA_HandlerData *pData) {
     /*
-     * Fetch the record from the database
+     * Queue a json response, the body is copied since it was allocated by libbson
      */
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    struct DB_Record *record = DB_getFenceRecordList(client);
-    mongoc_client_pool_push(pool, client);
+    struct MHD_Response *response;
+    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
+    int ret = _queueResponse(pConn, MHD_HTTP_OK, response);
+
+    /*
+     * Cleanup
+     */
+    bson_free(responseBody);
+
+    return ret;
+}
 
+int _handleError(struct MHD_Connection *pConn) {
     /*
      * Craft json response
      */
     bson_t bsonResponse;
     bson_init(&bsonResponse);
-    unsigned int statusCode;
-    if (record->record) {
-        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
-        BSON_APPEND_DOCUMENT(&bsonResponse, "record", record->record);
-        statusCode = MHD_HTTP_OK;
-    } else {
-        BSON_APPEND_UTF8(&bsonResponse, "message", "record not found");
-        BSON_APPEND_NULL(&bsonResponse, "record");
-        statusCode = MHD_HTTP_NOT_FOUND;
-    }
-    char *responseBody = bson_as_json(&bsonResponse, NULL);
+    BSON_APPEND_UTF8(&bsonResponse, "message", "error");
+    int ret = _queueJsonResponse(pConn, MHD_HTTP_INTERNAL_SERVER_ERROR, &bsonResponse);
 
     /*
-     * Queue a json response
-     */
-    struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, statusCode, response);
-
-    /**
      * Cleanup
      */
-    MHD_destroy_response(response);
-    DB_freeRecord(record);
     bson_destroy(&bsonResponse);
-    bson_free(responseBody);
 
     return ret;
 }
 
-int _handleGetGpsLogEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData, long epoch) {
-    /*
-     * Fetch the record from the database
-     */
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    struct DB_Record *record = DB_getGpsLogRecord(epoch, client);
-    mongoc_client_pool_push(pool, client);
+int _handleBadRequest(struct MHD_Connection *pConn, char const *pMessage) {
+    return _handleClientError(pConn, MHD_HTTP_BAD_REQUEST, pMessage);
+}
 
+int _handleClientError(struct MHD_Connection *pConn, unsigned int pStatusCode, char const *pMessage) {
     /*
      * Craft json response
      */
     bson_t bsonResponse;
     bson_init(&bsonResponse);
-    unsigned int statusCode;
-    if (record->record) {
-        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
-        BSON_APPEND_DOCUMENT(&bsonResponse, "record", record->record);
-        statusCode = MHD_HTTP_OK;
-    } else {
-        BSON_APPEND_UTF8(&bsonResponse, "message", "record not found");
-        BSON_APPEND_NULL(&bsonResponse, "record");
-        statusCode = MHD_HTTP_NOT_FOUND;
-    }
-    char *responseBody = bson_as_json(&bsonResponse, NULL);
+    BSON_APPEND_UTF8(&bsonResponse, "message", pMessage);
+    int ret = _queueJsonResponse(pConn, pStatusCode, &bsonResponse);
 
     /*
-     * Queue a json response
-     */
-    struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, statusCode, response);
-
-    /**
      * Cleanup
      */
-    MHD_destroy_response(response);
-    DB_freeRecord(record);
     bson_destroy(&bsonResponse);
-    bson_free(responseBody);
 
     return ret;
 }
 
-int _handlePostWithDbInsertBodyJson(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
-                                    struct MA_ConnectionInfo *pConnInfo,
-                                    DB_insertFunction fPtr) {
-    /*
-     * Insert the record in the db
-     */
-    mongoc_client_pool_t *pool = pData->pool;
-    mongoc_client_t *client;
-    client = mongoc_client_pool_pop(pool);
-    struct DB_Record *record = fPtr(pConnInfo->body, client);
-    mongoc_client_pool_push(pool, client);
-
+int _handleNotFound(struct MHD_Connection *pConn) {
     /*
      * Craft json response
      */
-    unsigned int statusCode = MHD_HTTP_BAD_REQUEST;
     bson_t bsonResponse;
     bson_init(&bsonResponse);
-    if (record->record) {
-        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
-        BSON_APPEND_DOCUMENT(&bsonResponse, "record", record->record);
-        statusCode = MHD_HTTP_OK;
-    } else {
-        BSON_APPEND_UTF8(&bsonResponse, "message", record->message);
-        BSON_APPEND_NULL(&bsonResponse, "record");
-    }
-    char *responseBody = bson_as_json(&bsonResponse, NULL);
-
-    /*
-     * Queue a json response
-     */
-    struct MHD_Response *response;
-    response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, statusCode, response);
+    BSON_APPEND_UTF8(&bsonResponse, "message", "not found");
+    int ret = _queueJsonResponse(pConn, MHD_HTTP_NOT_FOUND, &bsonResponse);
 
     /*
      * Cleanup
      */
-    MHD_destroy_response(response);
-    DB_freeRecord(record);
     bson_destroy(&bsonResponse);
-    bson_free(responseBody);
 
     return ret;
 }
 
-int _handlePostGpsLog(struct MHD_Connection *pConn, struct MA_HandlerData *pData, struct MA_ConnectionInfo *pConnInfo) {
-    return _handlePostWithDbInsertBodyJson(pConn, pData, pConnInfo, &DB_insertGpsLogRecord);
+bool _isAdminRequest(struct MHD_Connection *pConn, struct MA_HandlerData *pData) {
+    union MHD_ConnectionInfo const *info = MHD_get_connection_info(pConn, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    if (NULL != info && NULL != info->client_addr) {
+        struct sockaddr const *address = info->client_addr;
+        if (AF_INET == address->sa_family) {
+            struct sockaddr_in const *ipv4 = (struct sockaddr_in const *) address;
+            if (127 == (ntohl(ipv4->sin_addr.s_addr) >> 24)) {
+                return true;
+            }
+        } else if (AF_INET6 == address->sa_family) {
+            struct sockaddr_in6 const *ipv6 = (struct sockaddr_in6 const *) address;
+            if (IN6_IS_ADDR_LOOPBACK(&ipv6->sin6_addr) ||
+                (IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr) && 127 == ipv6->sin6_addr.s6_addr[12])) {
+                return true;
+            }
+        }
+    }
+
+    /*
+     * Compare the whole token whatever the first mismatch so the comparison does not time how much of it was right
+     */
+    char const *authorization = MHD_lookup_connection_value(pConn, MHD_HEADER_KIND, MHD_HTTP_HEADER_AUTHORIZATION);
+    if (NULL == pData->adminToken || '\0' == pData->adminToken[0] || NULL == authorization ||
+        0 != strncmp(authorization, BEARER_PREFIX, strlen(BEARER_PREFIX))) {
+        return false;
+    }
+    char const *token = &authorization[strlen(BEARER_PREFIX)];
+    size_t length = strlen(pData->adminToken);
+    if (strlen(token) != length) {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (size_t i = 0; i < length; ++i) {
+        difference |= (unsigned char) (token[i] ^ pData->adminToken[i]);
+    }
+    return 0 == difference;
 }
 
-int _handlePostFenceEntry(struct MHD_Connection *pConn, struct MA_HandlerData *pData,
-                          struct MA_ConnectionInfo *pConnInfo) {
-    return _handlePostWithDbInsertBodyJson(pConn, pData, pConnInfo, &DB_insertFenceRecord);
+int _handleForbidden(struct MHD_Connection *pConn) {
+    return _handleClientError(pConn, MHD_HTTP_FORBIDDEN, "forbidden");
 }
 
-int _handleError(struct MHD_Connection *pConn) {
+int _handleOverloaded(struct MHD_Connection *pConn) {
+    MET_recordRejection(MET_currentRoute());
+
     /*
      * Craft json response
      */
     bson_t bsonResponse;
     bson_init(&bsonResponse);
-    BSON_APPEND_UTF8(&bsonResponse, "message", "error");
+    BSON_APPEND_UTF8(&bsonResponse, "message", "service overloaded, retry later");
     char *responseBody = bson_as_json(&bsonResponse, NULL);
-
-    /*
-     * Queue a json response
-     */
     struct MHD_Response *response;
     response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
     MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
+    MHD_add_response_header(response, RETRY_AFTER, RETRY_AFTER_SECONDS);
+    int ret = _queueResponse(pConn, MHD_HTTP_SERVICE_UNAVAILABLE, response);
 
     /*
      * Cleanup
      */
-    MHD_destroy_response(response);
-    bson_destroy(&bsonResponse);
     bson_free(responseBody);
+    bson_destroy(&bsonResponse);
 
     return ret;
 }
 
+mongoc_client_t *_takeClient(struct MA_HandlerData *pData, int64_t pTimeout) {
+    if (atomic_fetch_add(&pData->dbInFlight, 1) >= pData->maxDbInFlight) {
+        atomic_fetch_sub(&pData->dbInFlight, 1);
+        return NULL;
+    }
+
+    struct TRC_Span span;
+    TRC_begin(&span, "mongoc_client_pool_pop");
+    int64_t startTime = MET_now();
+    int64_t deadline = startTime + pTimeout;
+    mongoc_client_t *client = mongoc_client_pool_try_pop(pData->pool);
 
-int _handleNotFound(struct MHD_Connection *pConn) {
     /*
-     * Craft json response
+     * mongoc can only wait for a client without limit, so poll with a growing pause until the deadline
      */
-    bson_t bsonResponse;
-    bson_init(&bsonResponse);
-    BSON_APPEND_UTF8(&bsonResponse, "message", "not found");
-    char *responseBody = bson_as_json(&bsonResponse, NULL);
+    struct timespec pause = {0, 100 * 1000};
+    while (NULL == client && MET_now() < deadline) {
+        nanosleep(&pause, NULL);
+        pause.tv_nsec = pause.tv_nsec < 5 * 1000 * 1000 ? pause.tv_nsec * 2 : pause.tv_nsec;
+        client = mongoc_client_pool_try_pop(pData->pool);
+    }
+    MET_recordPoolWait(MET_now() - startTime);
+    TRC_end(&span);
+
+    if (NULL == client) {
+        atomic_fetch_sub(&pData->dbInFlight, 1);
+    }
+    return client;
+}
+
+mongoc_client_t *_popClient(struct MA_HandlerData *pData) {
+    return _takeClient(pData, 0);
+}
+
+mongoc_client_t *_waitForClient(struct MA_HandlerData *pData) {
+    return _takeClient(pData, pData->admitTimeout);
+}
+
+void _pushClient(struct MA_HandlerData *pData, mongoc_client_t *pClient) {
+    mongoc_client_pool_push(pData->pool, pClient);
+    atomic_fetch_sub(&pData->dbInFlight, 1);
+}
+
+int _queueResponse(struct MHD_Connection *pConn, unsigned int pStatusCode, struct MHD_Response *pResponse) {
+    if (NULL != __currentRequest) {
+        __currentRequest->statusCode = pStatusCode;
+    }
+    int ret = MHD_queue_response(pConn, pStatusCode, pResponse);
+    MHD_destroy_response(pResponse);
+    return ret;
+}
+
+int _queueJsonResponse(struct MHD_Connection *pConn, unsigned int pStatusCode, bson_t const *pBson) {
+    struct TRC_Span span;
+    TRC_begin(&span, "bson_as_json");
+    int64_t startTime = MET_now();
+    char *responseBody = bson_as_json(pBson, NULL);
+    __recordStage(MET_STAGE_SERIALIZE, startTime);
+    TRC_end(&span);
 
     /*
      * Queue a json response
@@ -782,18 +2312,73 @@ int _handleNotFound(struct MHD_Connection *pConn) {
     struct MHD_Response *response;
     response = MHD_create_response_from_buffer(strlen(responseBody), (void *) responseBody, MHD_RESPMEM_MUST_COPY);
     MHD_add_response_header(response, CONTENT_TYPE, APPLICATION_JSON);
-    int ret = MHD_queue_response(pConn, MHD_HTTP_NOT_FOUND, response);
+    int ret = _queueResponse(pConn, pStatusCode, response);
 
     /*
      * Cleanup
      */
-    MHD_destroy_response(response);
-    bson_destroy(&bsonResponse);
     bson_free(responseBody);
 
     return ret;
 }
 
+int _openListenSocket(uint16_t pPort) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+#ifdef SO_REUSEPORT
+    /*
+     * Every worker binds the port and the kernel spreads new connections between them
+     */
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on)) {
+        LOG_log(LOG_LEVEL_WARN, "SO_REUSEPORT unavailable, workers will not share the port", NULL);
+    }
+#endif
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(pPort);
+    if (0 != bind(fd, (struct sockaddr *) &address, sizeof address) || 0 != listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+size_t _drainListenSocket(struct MHD_Daemon *pDaemon, int pSocket) {
+    fcntl(pSocket, F_SETFL, fcntl(pSocket, F_GETFL) | O_NONBLOCK);
+    size_t handed = 0;
+    for (;;) {
+        struct sockaddr_storage address;
+        socklen_t addressLen = sizeof address;
+        int fd = accept(pSocket, (struct sockaddr *) &address, &addressLen);
+        if (fd < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        /*
+         * The daemon closes the connection when it cannot take it
+         */
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        handed += MHD_YES == MHD_add_connection(pDaemon, fd, (struct sockaddr *) &address, addressLen);
+    }
+    close(pSocket);
+
+    if (handed > 0) {
+        char detail[64];
+        snprintf(detail, sizeof detail, "%zu connections", handed);
+        LOG_log(LOG_LEVEL_INFO, "queued connections handed to the draining daemon", detail);
+    }
+    return handed;
+}
+
 //endregion
 
 //region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -804,6 +2389,18 @@ void handleSigalrm(int signal) {
     }
 }
 
+void handleSigusr1(int signal) {
+    if (signal == SIGUSR1) {
+        __traceDumpRequested = 1;
+    }
+}
+
+void handleSigterm(int signal) {
+    if (signal == SIGTERM || signal == SIGINT) {
+        __shutdownRequested = 1;
+    }
+}
+
 void doSleep(unsigned int seconds) {
     struct sigaction sa;
     sigset_t mask;
@@ -816,15 +2413,102 @@ void doSleep(unsigned int seconds) {
     // Get the current signal mask
     sigprocmask(0, NULL, &mask);
 
-    // Unblock SIGALRM
+    // Unblock SIGALRM, SIGUSR1 (trace dump requests) and SIGTERM / SIGINT (shutdown)
     sigdelset(&mask, SIGALRM);
+    sigdelset(&mask, SIGUSR1);
+    sigdelset(&mask, SIGTERM);
+    sigdelset(&mask, SIGINT);
 
     // Wait with this mask
     alarm(seconds);
     sigsuspend(&mask);
 }
 
-int main() {
+int main(int argc, char **argv) {
+    (void) argc;
+
+    /*
+     * With GEOFENCE_WORKERS set this process only supervises, each worker is this binary exec'd again
+     */
+    char const *workers = getenv(ENV_WORKERS);
+    long workerCount = NULL != workers ? strtol(workers, NULL, 10) : 0;
+    LOG_configure(LOG_levelFor(getenv(ENV_LOG_LEVEL), LOG_LEVEL_INFO));
+    if (workerCount > 0 && !SV_isWorker()) {
+        return SV_supervise((unsigned int) workerCount, argv);
+    }
+
+    char const *port = getenv(ENV_PORT);
+    long portNumber = NULL != port ? strtol(port, NULL, 10) : PORT;
+    char const *drain = getenv(ENV_DRAIN_SECONDS);
+    long drainSeconds = NULL != drain ? strtol(drain, NULL, 10) : DEFAULT_DRAIN_SECONDS;
+    char const *httpThreads = getenv(ENV_HTTP_THREADS);
+    long httpThreadCount = NULL != httpThreads ? strtol(httpThreads, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    httpThreadCount = MAX(httpThreadCount, 1);
+
+    /*
+     * Allow as many connections as the descriptor limit leaves room for, raised to its hard limit first
+     */
+    struct rlimit files;
+    long connectionLimit = 1024;
+    if (0 == getrlimit(RLIMIT_NOFILE, &files)) {
+        if (files.rlim_cur < files.rlim_max) {
+            files.rlim_cur = files.rlim_max;
+            if (0 != setrlimit(RLIMIT_NOFILE, &files)) {
+                getrlimit(RLIMIT_NOFILE, &files);
+            }
+        }
+        connectionLimit = (long) MIN(files.rlim_cur, (rlim_t) INT_MAX) - RESERVED_DESCRIPTORS;
+    }
+    char const *maxConnections = getenv(ENV_MAX_CONNECTIONS);
+    connectionLimit = NULL != maxConnections ? strtol(maxConnections, NULL, 10) : connectionLimit;
+    connectionLimit = MAX(connectionLimit, 64);
+
+    /*
+     * Request threads only buffer log records, the flusher thread writes them to stdout as json lines
+     */
+    LOG_start();
+
+    /*
+     * Record Mongo operations slower than GEOFENCE_SLOW_OP_MS for GET /admin/slow_ops
+     */
+    char const *slowOpMs = getenv(ENV_SLOW_OP_MS);
+    SOP_configure((NULL != slowOpMs ? strtoll(slowOpMs, NULL, 10) : SOP_DEFAULT_THRESHOLD_MS) * 1000);
+    char detail[LOG_DETAIL_SIZE];
+
+    /*
+     * Sample a fraction of requests into the tracer, SIGUSR1 writes the spans to the trace file. Workers share a
+     * working directory so each writes its own file.
+     */
+    char const *sampleRate = getenv(ENV_TRACE_SAMPLE_RATE);
+    TRC_configure(NULL != sampleRate ? strtod(sampleRate, NULL) : TRC_DEFAULT_SAMPLE_RATE);
+    char const *traceFileEnv = getenv(ENV_TRACE_FILE);
+    char traceFile[PATH_MAX];
+    if (SV_isWorker()) {
+        snprintf(traceFile, sizeof traceFile, "%s.%d", NULL != traceFileEnv ? traceFileEnv : DEFAULT_TRACE_FILE,
+                 (int) getpid());
+    } else {
+        snprintf(traceFile, sizeof traceFile, "%s", NULL != traceFileEnv ? traceFileEnv : DEFAULT_TRACE_FILE);
+    }
+
+    /*
+     * Only the main thread takes SIGUSR1 and SIGTERM / SIGINT (while it sleeps), the daemon threads inherit the
+     * blocked mask
+     */
+    struct sigaction sa;
+    sa.sa_handler = &handleSigusr1;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = &handleSigterm;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR1);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+
     /**
      * Initialize mongo-c
      */
@@ -838,6 +2522,15 @@ int main() {
     uri = mongoc_uri_new(DB_URL);
     pool = mongoc_client_pool_new(uri);
 
+    /*
+     * Make sure the indexes the storage mode relies on exist, led by device_id and sharded on it when
+     * GEOFENCE_PARTITIONING is sharded
+     */
+    DB_configurePartitioning(DB_partitioningFor(getenv(ENV_PARTITIONING), DB_PARTITION_SHARED));
+    mongoc_client_t *client = mongoc_client_pool_pop(pool);
+    DB_ensureIndexes(client);
+    mongoc_client_pool_push(pool, client);
+
     /*
      * Setup the handler data to have access to the mongo-c client pool.
      */
@@ -845,26 +2538,148 @@ int main() {
     data->pool = pool;
 
     /*
-     * Start http daemon
+     * Bound the requests holding or waiting for a database client, the rest are answered 503
+     */
+    char const *maxDbInFlight = getenv(ENV_DB_MAX_IN_FLIGHT);
+    char const *admitTimeout = getenv(ENV_DB_ADMIT_TIMEOUT_MS);
+    atomic_init(&data->dbInFlight, 0);
+    data->maxDbInFlight = NULL != maxDbInFlight ? atoi(maxDbInFlight) : DEFAULT_DB_MAX_IN_FLIGHT;
+    data->admitTimeout = (NULL != admitTimeout ? strtoll(admitTimeout, NULL, 10) : DEFAULT_DB_ADMIT_TIMEOUT_MS) * 1000;
+
+    /*
+     * Exports hold a pooled client while they stream, bound how many stream at once
+     */
+    char const *maxExports = getenv(ENV_EXPORT_MAX_STREAMS);
+    atomic_init(&data->exports, 0);
+    data->maxExports = NULL != maxExports ? atoi(maxExports) : DEFAULT_EXPORT_MAX_STREAMS;
+    data->adminToken = getenv(ENV_ADMIN_TOKEN);
+
+    /*
+     * A worker only sees the logs it ingested itself, so with several of them a stream would silently miss most
+     * entries, refuse the streams instead
+     */
+    data->eventsEnabled = workerCount <= 1;
+
+    /*
+     * Bound request bodies, compressed ones by what they inflate to
+     */
+    char const *maxBody = getenv(ENV_MAX_BODY_BYTES);
+    data->maxBody = NULL != maxBody ? (size_t) strtoull(maxBody, NULL, 10) : DEFAULT_MAX_BODY_BYTES;
+
+    /*
+     * Start one evaluation worker per cpu
+     */
+    data->workers = TP_createPool(0);
+
+    /*
+     * Compact and expire aging gps logs in the background when GEOFENCE_COMPACT_AGE_SECONDS or
+     * GEOFENCE_RETENTION_SECONDS is set, one process of the deployment at a time
+     */
+    char const *compactAge = getenv(ENV_COMPACT_AGE_SECONDS);
+    char const *retention = getenv(ENV_RETENTION_SECONDS);
+    char const *compactTolerance = getenv(ENV_COMPACT_TOLERANCE_M);
+    char const *compactBoundary = getenv(ENV_COMPACT_BOUNDARY_M);
+    char const *compactInterval = getenv(ENV_COMPACT_INTERVAL_SECONDS);
+    char const *compactPause = getenv(ENV_COMPACT_PAUSE_MS);
+    char const *compactMaxDefer = getenv(ENV_COMPACT_MAX_DEFER_MS);
+    struct CMP_Config compaction;
+    compaction.compactAgeSeconds = NULL != compactAge ? strtoll(compactAge, NULL, 10) : 0;
+    compaction.retentionSeconds = NULL != retention ? strtoll(retention, NULL, 10) : 0;
+    compaction.toleranceMeters = NULL != compactTolerance ? strtod(compactTolerance, NULL)
+                                                          : DEFAULT_COMPACT_TOLERANCE_M;
+    compaction.boundaryMeters = NULL != compactBoundary ? strtod(compactBoundary, NULL) : DEFAULT_COMPACT_BOUNDARY_M;
+    compaction.intervalSeconds = (unsigned int) (NULL != compactInterval ? strtoul(compactInterval, NULL, 10)
+                                                                        : DEFAULT_COMPACT_INTERVAL_SECONDS);
+    compaction.pauseMillis = (unsigned int) (NULL != compactPause ? strtoul(compactPause, NULL, 10)
+                                                                  : DEFAULT_COMPACT_PAUSE_MS);
+    compaction.maxDeferMillis = (unsigned int) (NULL != compactMaxDefer ? strtoul(compactMaxDefer, NULL, 10)
+                                                                        : DEFAULT_COMPACT_MAX_DEFER_MS);
+    if (compaction.compactAgeSeconds > 0 || compaction.retentionSeconds > 0) {
+        CMP_start(&compaction, DB_URL, &__databaseBusy, data);
+    }
+    SOP_start(DB_URL, DB);
+
+    /*
+     * Start http daemon on our own socket so workers can share the port
      */
-    struct MHD_Daemon *daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, PORT, NULL, NULL,
-                                                 &_answerConnection, data,
-                                                 MHD_OPTION_NOTIFY_COMPLETED, __requestCompleted,
-                                                 NULL, MHD_OPTION_END);
+    struct MHD_Daemon *daemon = NULL;
+    int listenSocket = _openListenSocket((uint16_t) portNumber);
+    if (listenSocket < 0) {
+        snprintf(detail, sizeof detail, "port %ld", portNumber);
+        LOG_log(LOG_LEVEL_ERROR, "could not listen", detail);
+    } else {
+        daemon = MHD_start_daemon(DAEMON_EVENT_LOOP | MHD_USE_PIPE_FOR_SHUTDOWN | MHD_USE_SUSPEND_RESUME,
+                                  (uint16_t) portNumber,
+                                  NULL, NULL, &_answerConnection, data,
+                                  MHD_OPTION_LISTEN_SOCKET, listenSocket,
+                                  MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) httpThreadCount,
+                                  MHD_OPTION_CONNECTION_LIMIT, (unsigned int) connectionLimit,
+                                  MHD_OPTION_NOTIFY_COMPLETED, __requestCompleted,
+                                  NULL, MHD_OPTION_END);
+    }
 
     /*
-     * Wait for the 'q' key if the daemon was started
+     * Serve until SIGTERM / SIGINT, or until our supervisor is gone
      */
     if (NULL != daemon) {
-        printf("GeoFence Http daemon running\n");
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wmissing-noreturn"
-        for (; ;) {
+        snprintf(detail, sizeof detail, "port %ld", portNumber);
+        LOG_log(LOG_LEVEL_INFO, "GeoFence Http daemon running", detail);
+        SV_notifyReady();
+        while (!__shutdownRequested && !SV_supervisorGone()) {
             doSleep(10);
+            EVT_keepalive();
+            if (__traceDumpRequested) {
+                __traceDumpRequested = 0;
+                if (TRC_writeChromeTrace(traceFile)) {
+                    LOG_log(LOG_LEVEL_INFO, "trace written", traceFile);
+                } else {
+                    LOG_log(LOG_LEVEL_ERROR, "could not write trace", traceFile);
+                }
+            }
         }
-#pragma clang diagnostic pop
+
+        /*
+         * Stop accepting, the other workers (or a replacement) keep the port, then let the connections already queued
+         * on our socket and in-flight requests finish
+         */
+        LOG_log(LOG_LEVEL_INFO, "GeoFence Http daemon draining", NULL);
+        int quiesced = MHD_quiesce_daemon(daemon);
+        size_t handed = quiesced >= 0 ? _drainListenSocket(daemon, quiesced) : 0;
+        EVT_closeAll();
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += drainSeconds;
+        struct timespec pause = {0, 50 * 1000 * 1000};
+        struct timespec now;
+
+        /*
+         * Connections handed over get one pause to start their requests before in-flight requests are counted
+         */
+        bool settling = handed > 0;
+        while (settling || MET_requestsInFlight() > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+                snprintf(detail, sizeof detail, "%lld requests in flight", (long long) MET_requestsInFlight());
+                LOG_log(LOG_LEVEL_WARN, "drain timed out", detail);
+                break;
+            }
+            nanosleep(&pause, NULL);
+            settling = false;
+        }
+
+        /**
+         * Stop http daemon
+         */
+        MHD_stop_daemon(daemon);
+    } else if (listenSocket >= 0) {
+        close(listenSocket);
     }
 
+    CMP_stop();
+    SOP_stop();
+    TP_destroyPool(data->workers);
+    free(data);
 
     /**
      * Cleanup mongo-c
@@ -872,14 +2687,8 @@ int main() {
     mongoc_client_pool_destroy(pool);
     mongoc_uri_destroy(uri);
     mongoc_cleanup();
-
-    free(data);
-
-    /**
-     * Stop http daemon
-     */
-    MHD_stop_daemon(daemon);
-    return 0;
+    LOG_stop();
+    return daemon != NULL ? 0 : 1;
 }
 
-//endregion
\ No newline at end of file
+//endregion
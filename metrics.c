@@ -0,0 +1,413 @@
+//
+// Created by William Kamp on 7/26/16.
+//
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "events.h"
+#include "log.h"
+#include "metrics.h"
+
+#define BUCKET_COUNT 16
+#define STATUS_OTHER 8
+#define STATUS_COUNT (STATUS_OTHER + 1)
+#define RENDER_INITIAL_CAPACITY 16384
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct MET_RouteName {
+    char const *method;
+    char const *path;
+};
+
+/*
+ * Latency histogram with non cumulative buckets, the last bucket is +Inf
+ */
+struct MET_Histogram {
+    _Atomic uint64_t buckets[BUCKET_COUNT];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sumMicros;
+};
+
+/*
+ * Counters owned by a single thread. Only the owner writes them so increments are plain relaxed loads and stores,
+ * the scraper reads them relaxed and sums the shards.
+ */
+struct MET_Shard {
+    struct MET_Shard *next;
+    atomic_bool inUse;
+    _Atomic int64_t inFlight;
+    _Atomic uint64_t requests[MET_ROUTE_COUNT][STATUS_COUNT];
+    struct MET_Histogram latency[MET_ROUTE_COUNT];
+    struct MET_Histogram stages[MET_ROUTE_COUNT][MET_STAGE_COUNT];
+    struct MET_Histogram poolWait;
+    _Atomic uint64_t rejected[MET_ROUTE_COUNT];
+};
+
+/*
+ * Growable text buffer for rendering
+ */
+struct MET_Buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * The calling thread's shard, claiming a released shard or creating a new one on first use
+ */
+struct MET_Shard *_threadShard(void);
+
+/**
+ * Sum a histogram over every shard into pTotal
+ */
+void _sumHistogram(size_t pOffset, struct MET_Histogram *pTotal);
+
+/**
+ * Append a histogram in the exposition format
+ *
+ * param pLabels - label pairs without braces shared by every series of the histogram
+ */
+void _renderHistogram(struct MET_Buffer *pBuffer, char const *pName, char const *pLabels,
+                      struct MET_Histogram const *pHistogram);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static struct MET_RouteName const __routeNames[MET_ROUTE_COUNT] = {
+        [MET_ROUTE_ROOT] = {"GET", "/"},
+        [MET_ROUTE_GET_FENCE_ENTRY] = {"GET", "/fence_entry"},
+        [MET_ROUTE_GET_FENCE_ENTRY_LIST] = {"GET", "/fence_entry_list"},
+        [MET_ROUTE_GET_FENCE_ENTRY_EVENTS] = {"GET", "/fence_entry/events"},
+        [MET_ROUTE_GET_GPS_LOG] = {"GET", "/gps_log"},
+        [MET_ROUTE_GET_GPS_LOG_LIST] = {"GET", "/gps_log_list"},
+        [MET_ROUTE_GET_METRICS] = {"GET", "/metrics"},
+        [MET_ROUTE_GET_ADMIN_TRACE] = {"GET", "/admin/trace"},
+        [MET_ROUTE_GET_ADMIN_SLOW_OPS] = {"GET", "/admin/slow_ops"},
+        [MET_ROUTE_GET_ADMIN_EXPORT] = {"GET", "/admin/export"},
+        [MET_ROUTE_POST_FENCE_ENTRY] = {"POST", "/fence_entry"},
+        [MET_ROUTE_POST_FENCE_ENTRY_EVALUATE] = {"POST", "/fence_entry/evaluate"},
+        [MET_ROUTE_POST_GPS_LOG] = {"POST", "/gps_log"},
+        [MET_ROUTE_PATCH_GPS_LOG] = {"PATCH", "/gps_log"},
+        [MET_ROUTE_DELETE_FENCE_ENTRY] = {"DELETE", "/fence_entry"},
+        [MET_ROUTE_DELETE_GPS_LOG] = {"DELETE", "/gps_log"},
+        [MET_ROUTE_OTHER] = {"other", "other"},
+};
+
+static char const *const __stageNames[MET_STAGE_COUNT] = {
+        [MET_STAGE_BODY_READ] = "body_read",
+        [MET_STAGE_VALIDATE] = "validate",
+        [MET_STAGE_MONGO] = "mongo",
+        [MET_STAGE_COMPUTE] = "compute",
+        [MET_STAGE_SERIALIZE] = "serialize",
+};
+
+/*
+ * Status codes counted individually, anything else is counted as "other"
+ */
+static unsigned int const __statusCodes[STATUS_OTHER] = {200, 400, 403, 404, 413, 415, 500, 503};
+
+/*
+ * Upper bounds of the finite buckets in microseconds
+ */
+static int64_t const __bucketBounds[BUCKET_COUNT - 1] = {
+        100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+static struct MET_Shard *_Atomic __shards = NULL;
+static __thread struct MET_Shard *__shard = NULL;
+static __thread enum MET_Route __currentRoute = MET_ROUTE_OTHER;
+static pthread_key_t __shardKey;
+static pthread_once_t __shardKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Thread exit destructor handing the shard, counters intact, to the next thread that needs one
+ */
+static void __releaseShard(void *pShard) {
+    struct MET_Shard *shard = pShard;
+    atomic_store(&shard->inUse, false);
+}
+
+static void __createShardKey(void) {
+    pthread_key_create(&__shardKey, &__releaseShard);
+}
+
+static inline void __add(_Atomic uint64_t *pCounter, uint64_t pValue) {
+    atomic_store_explicit(pCounter, atomic_load_explicit(pCounter, memory_order_relaxed) + pValue,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t __read(_Atomic uint64_t const *pCounter) {
+    return atomic_load_explicit((_Atomic uint64_t *) pCounter, memory_order_relaxed);
+}
+
+static void __observe(struct MET_Histogram *pHistogram, int64_t pMicros) {
+    if (pMicros < 0) {
+        pMicros = 0;
+    }
+    size_t bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && pMicros > __bucketBounds[bucket]) {
+        ++bucket;
+    }
+    __add(&pHistogram->buckets[bucket], 1);
+    __add(&pHistogram->count, 1);
+    __add(&pHistogram->sumMicros, (uint64_t) pMicros);
+}
+
+static size_t __statusIndex(unsigned int pStatusCode) {
+    for (size_t i = 0; i < STATUS_OTHER; ++i) {
+        if (__statusCodes[i] == pStatusCode) {
+            return i;
+        }
+    }
+    return STATUS_OTHER;
+}
+
+static void __appendf(struct MET_Buffer *pBuffer, char const *pFormat, ...) {
+    va_list args;
+    for (; ;) {
+        size_t available = pBuffer->capacity - pBuffer->len;
+        va_start(args, pFormat);
+        int written = vsnprintf(&pBuffer->data[pBuffer->len], available, pFormat, args);
+        va_end(args);
+        if (written < 0) {
+            return;
+        }
+        if ((size_t) written < available) {
+            pBuffer->len += (size_t) written;
+            return;
+        }
+        pBuffer->capacity = pBuffer->capacity * 2 + (size_t) written;
+        pBuffer->data = realloc(pBuffer->data, pBuffer->capacity);
+    }
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct MET_Shard *_threadShard(void) {
+    if (NULL != __shard) {
+        return __shard;
+    }
+    pthread_once(&__shardKeyOnce, &__createShardKey);
+
+    for (struct MET_Shard *shard = atomic_load(&__shards); NULL != shard; shard = shard->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&shard->inUse, &expected, true)) {
+            __shard = shard;
+            break;
+        }
+    }
+
+    if (NULL == __shard) {
+        struct MET_Shard *shard = calloc(1, sizeof(struct MET_Shard));
+        atomic_init(&shard->inUse, true);
+        shard->next = atomic_load(&__shards);
+        while (!atomic_compare_exchange_weak(&__shards, &shard->next, shard)) {
+        }
+        __shard = shard;
+    }
+    pthread_setspecific(__shardKey, __shard);
+    return __shard;
+}
+
+void _sumHistogram(size_t pOffset, struct MET_Histogram *pTotal) {
+    memset(pTotal, 0, sizeof(struct MET_Histogram));
+    for (struct MET_Shard *shard = atomic_load(&__shards); NULL != shard; shard = shard->next) {
+        struct MET_Histogram const *histogram = (struct MET_Histogram const *) ((char const *) shard + pOffset);
+        for (size_t b = 0; b < BUCKET_COUNT; ++b) {
+            __add(&pTotal->buckets[b], __read(&histogram->buckets[b]));
+        }
+        __add(&pTotal->count, __read(&histogram->count));
+        __add(&pTotal->sumMicros, __read(&histogram->sumMicros));
+    }
+}
+
+void _renderHistogram(struct MET_Buffer *pBuffer, char const *pName, char const *pLabels,
+                      struct MET_Histogram const *pHistogram) {
+    char const *separator = pLabels[0] != '\0' ? "," : "";
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < BUCKET_COUNT - 1; ++b) {
+        cumulative += __read(&pHistogram->buckets[b]);
+        __appendf(pBuffer, "%s_bucket{%s%sle=\"%g\"} %llu\n", pName, pLabels, separator,
+                  (double) __bucketBounds[b] / 1e6, (unsigned long long) cumulative);
+    }
+    __appendf(pBuffer, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", pName, pLabels, separator,
+              (unsigned long long) __read(&pHistogram->count));
+    char const *open = pLabels[0] != '\0' ? "{" : "";
+    char const *close = pLabels[0] != '\0' ? "}" : "";
+    __appendf(pBuffer, "%s_sum%s%s%s %.6f\n", pName, open, pLabels, close,
+              (double) __read(&pHistogram->sumMicros) / 1e6);
+    __appendf(pBuffer, "%s_count%s%s%s %llu\n", pName, open, pLabels, close,
+              (unsigned long long) __read(&pHistogram->count));
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int64_t MET_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+enum MET_Route MET_routeFor(char const *pMethod, char const *pUrl) {
+    for (int route = 0; route < MET_ROUTE_OTHER; ++route) {
+        if (0 == strcmp(pMethod, __routeNames[route].method) && 0 == strcmp(pUrl, __routeNames[route].path)) {
+            return (enum MET_Route) route;
+        }
+    }
+    return MET_ROUTE_OTHER;
+}
+
+void MET_setCurrentRoute(enum MET_Route pRoute) {
+    __currentRoute = pRoute;
+}
+
+enum MET_Route MET_currentRoute(void) {
+    return __currentRoute;
+}
+
+void MET_requestStarted(void) {
+    struct MET_Shard *shard = _threadShard();
+    atomic_store_explicit(&shard->inFlight, atomic_load_explicit(&shard->inFlight, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+int64_t MET_requestsInFlight(void) {
+    /*
+     * Requests may finish on a different thread than they started on so a shard's gauge can go negative on its own
+     */
+    int64_t inFlight = 0;
+    for (struct MET_Shard *shard = atomic_load(&__shards); NULL != shard; shard = shard->next) {
+        inFlight += atomic_load_explicit(&shard->inFlight, memory_order_relaxed);
+    }
+    return inFlight > 0 ? inFlight : 0;
+}
+
+void MET_requestFinished(enum MET_Route pRoute, unsigned int pStatusCode, int64_t pMicros) {
+    struct MET_Shard *shard = _threadShard();
+    atomic_store_explicit(&shard->inFlight, atomic_load_explicit(&shard->inFlight, memory_order_relaxed) - 1,
+                          memory_order_relaxed);
+    __add(&shard->requests[pRoute][__statusIndex(pStatusCode)], 1);
+    __observe(&shard->latency[pRoute], pMicros);
+}
+
+void MET_recordStage(enum MET_Route pRoute, enum MET_Stage pStage, int64_t pMicros) {
+    __observe(&_threadShard()->stages[pRoute][pStage], pMicros);
+}
+
+void MET_recordPoolWait(int64_t pMicros) {
+    __observe(&_threadShard()->poolWait, pMicros);
+}
+
+void MET_recordRejection(enum MET_Route pRoute) {
+    __add(&_threadShard()->rejected[pRoute], 1);
+}
+
+char *MET_render(void) {
+    struct MET_Buffer buffer = {malloc(RENDER_INITIAL_CAPACITY), 0, RENDER_INITIAL_CAPACITY};
+    struct MET_Histogram histogram;
+    char labels[160];
+    buffer.data[0] = '\0';
+
+    __appendf(&buffer, "# HELP geofence_http_requests_in_flight Requests received and not yet answered.\n"
+            "# TYPE geofence_http_requests_in_flight gauge\n"
+            "geofence_http_requests_in_flight %lld\n", (long long) MET_requestsInFlight());
+
+    __appendf(&buffer, "# HELP geofence_event_subscribers Open GET /fence_entry/events streams.\n"
+            "# TYPE geofence_event_subscribers gauge\n"
+            "geofence_event_subscribers %zu\n", EVT_subscriberCount());
+
+    __appendf(&buffer, "# HELP geofence_http_requests_total Requests answered by route and status code.\n"
+            "# TYPE geofence_http_requests_total counter\n");
+    for (int route = 0; route < MET_ROUTE_COUNT; ++route) {
+        for (size_t status = 0; status < STATUS_COUNT; ++status) {
+            uint64_t total = 0;
+            for (struct MET_Shard *shard = atomic_load(&__shards); NULL != shard; shard = shard->next) {
+                total += __read(&shard->requests[route][status]);
+            }
+            if (total == 0) {
+                continue;
+            }
+            char code[16];
+            if (status == STATUS_OTHER) {
+                snprintf(code, sizeof code, "other");
+            } else {
+                snprintf(code, sizeof code, "%u", __statusCodes[status]);
+            }
+            __appendf(&buffer, "geofence_http_requests_total{method=\"%s\",route=\"%s\",code=\"%s\"} %llu\n",
+                      __routeNames[route].method, __routeNames[route].path, code, (unsigned long long) total);
+        }
+    }
+
+    __appendf(&buffer, "# HELP geofence_http_request_duration_seconds Time from receiving a request to finishing "
+            "its response.\n"
+            "# TYPE geofence_http_request_duration_seconds histogram\n");
+    for (int route = 0; route < MET_ROUTE_COUNT; ++route) {
+        _sumHistogram(offsetof(struct MET_Shard, latency[route]), &histogram);
+        if (__read(&histogram.count) > 0) {
+            snprintf(labels, sizeof labels, "method=\"%s\",route=\"%s\"", __routeNames[route].method,
+                     __routeNames[route].path);
+            _renderHistogram(&buffer, "geofence_http_request_duration_seconds", labels, &histogram);
+        }
+    }
+
+    __appendf(&buffer, "# HELP geofence_stage_duration_seconds Time spent in each stage of a request.\n"
+            "# TYPE geofence_stage_duration_seconds histogram\n");
+    for (int route = 0; route < MET_ROUTE_COUNT; ++route) {
+        for (int stage = 0; stage < MET_STAGE_COUNT; ++stage) {
+            _sumHistogram(offsetof(struct MET_Shard, stages[route][stage]), &histogram);
+            if (__read(&histogram.count) > 0) {
+                snprintf(labels, sizeof labels, "method=\"%s\",route=\"%s\",stage=\"%s\"",
+                         __routeNames[route].method, __routeNames[route].path, __stageNames[stage]);
+                _renderHistogram(&buffer, "geofence_stage_duration_seconds", labels, &histogram);
+            }
+        }
+    }
+
+    __appendf(&buffer, "# HELP geofence_mongo_pool_wait_seconds Time spent waiting for a MongoDB client.\n"
+            "# TYPE geofence_mongo_pool_wait_seconds histogram\n");
+    _sumHistogram(offsetof(struct MET_Shard, poolWait), &histogram);
+    _renderHistogram(&buffer, "geofence_mongo_pool_wait_seconds", "", &histogram);
+
+    __appendf(&buffer, "# HELP geofence_admission_rejected_total Requests answered 503 because the database work "
+            "budget was exhausted.\n"
+            "# TYPE geofence_admission_rejected_total counter\n");
+    for (int route = 0; route < MET_ROUTE_COUNT; ++route) {
+        uint64_t total = 0;
+        for (struct MET_Shard *shard = atomic_load(&__shards); NULL != shard; shard = shard->next) {
+            total += __read(&shard->rejected[route]);
+        }
+        if (total > 0) {
+            __appendf(&buffer, "geofence_admission_rejected_total{method=\"%s\",route=\"%s\"} %llu\n",
+                      __routeNames[route].method, __routeNames[route].path, (unsigned long long) total);
+        }
+    }
+
+    __appendf(&buffer, "# HELP geofence_log_dropped_total Log records dropped because their thread's buffer was "
+            "full.\n"
+            "# TYPE geofence_log_dropped_total counter\n"
+            "geofence_log_dropped_total %llu\n", (unsigned long long) LOG_droppedCount());
+    __appendf(&buffer, "# HELP geofence_log_suppressed_total Warnings and errors suppressed by the log rate limit.\n"
+            "# TYPE geofence_log_suppressed_total counter\n"
+            "geofence_log_suppressed_total %llu\n", (unsigned long long) LOG_suppressedCount());
+
+    return buffer.data;
+}
+
+//endregion
@@ -0,0 +1,101 @@
+//
+// Created by William Kamp on 7/26/16.
+//
+
+#ifndef GEOFENCEBEC_METRICS_H
+#define GEOFENCEBEC_METRICS_H
+
+#include <stdint.h>
+
+/*
+ * The routes the service answers, requests that match none are counted as MET_ROUTE_OTHER
+ */
+enum MET_Route {
+    MET_ROUTE_ROOT,
+    MET_ROUTE_GET_FENCE_ENTRY,
+    MET_ROUTE_GET_FENCE_ENTRY_LIST,
+    MET_ROUTE_GET_FENCE_ENTRY_EVENTS,
+    MET_ROUTE_GET_GPS_LOG,
+    MET_ROUTE_GET_GPS_LOG_LIST,
+    MET_ROUTE_GET_METRICS,
+    MET_ROUTE_GET_ADMIN_TRACE,
+    MET_ROUTE_GET_ADMIN_SLOW_OPS,
+    MET_ROUTE_GET_ADMIN_EXPORT,
+    MET_ROUTE_POST_FENCE_ENTRY,
+    MET_ROUTE_POST_FENCE_ENTRY_EVALUATE,
+    MET_ROUTE_POST_GPS_LOG,
+    MET_ROUTE_PATCH_GPS_LOG,
+    MET_ROUTE_DELETE_FENCE_ENTRY,
+    MET_ROUTE_DELETE_GPS_LOG,
+    MET_ROUTE_OTHER,
+    MET_ROUTE_COUNT
+};
+
+/*
+ * The stages a request spends its time in
+ */
+enum MET_Stage {
+    MET_STAGE_BODY_READ,
+    MET_STAGE_VALIDATE,
+    MET_STAGE_MONGO,
+    MET_STAGE_COMPUTE,
+    MET_STAGE_SERIALIZE,
+    MET_STAGE_COUNT
+};
+
+/**
+ * Monotonic clock in microseconds
+ */
+int64_t MET_now(void);
+
+/**
+ * Find the route of a request
+ */
+enum MET_Route MET_routeFor(char const *pMethod, char const *pUrl);
+
+/**
+ * Set the route the calling thread is working on so that code without access to the request (the database layer)
+ * can attribute its stages with MET_currentRoute()
+ */
+void MET_setCurrentRoute(enum MET_Route pRoute);
+
+enum MET_Route MET_currentRoute(void);
+
+/**
+ * Count a request that has started and not yet finished
+ */
+void MET_requestStarted(void);
+
+/**
+ * Requests started and not yet finished across all threads
+ */
+int64_t MET_requestsInFlight(void);
+
+/**
+ * Count a finished request with its status code and total latency
+ */
+void MET_requestFinished(enum MET_Route pRoute, unsigned int pStatusCode, int64_t pMicros);
+
+/**
+ * Add time spent in a stage of a request on pRoute
+ */
+void MET_recordStage(enum MET_Route pRoute, enum MET_Stage pStage, int64_t pMicros);
+
+/**
+ * Add time spent waiting for a MongoDB client from the pool
+ */
+void MET_recordPoolWait(int64_t pMicros);
+
+/**
+ * Count a request on pRoute turned away because the database work budget was exhausted
+ */
+void MET_recordRejection(enum MET_Route pRoute);
+
+/**
+ * Aggregate every thread's counters into the Prometheus text exposition format
+ *
+ * returns a NUL terminated string which you must later free()
+ */
+char *MET_render(void);
+
+#endif //GEOFENCEBEC_METRICS_H
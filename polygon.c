@@ -0,0 +1,194 @@
+//
+// Created by William Kamp on 7/12/16.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "polygon.h"
+
+#define LANES 4
+#define MAX_BANDS 256
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * Four lane double vector, lowered to whatever SIMD the target supports (SSE2 pairs, AVX, NEON)
+ */
+typedef double PLY_vec __attribute__((vector_size(LANES * sizeof(double))));
+typedef int64_t PLY_mask __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+/*
+ * The edges overlapping one latitude band stored as structure of arrays, padded to a multiple of LANES with NaN
+ * edges that never cross
+ */
+struct PLY_Band {
+    double *startLatitudes;
+    double *endLatitudes;
+    double *startLongitudes;
+    double *slopes;
+    size_t count;
+};
+
+struct PLY_Polygon {
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude;
+    double maxLongitude;
+    double bandsPerDegree;
+    size_t bandCount;
+    struct PLY_Band *bands;
+};
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static size_t __bandIndex(struct PLY_Polygon const *pPolygon, double pLatitude) {
+    double band = (pLatitude - pPolygon->minLatitude) * pPolygon->bandsPerDegree;
+    if (band <= 0) {
+        return 0;
+    }
+    size_t index = (size_t) band;
+    return index < pPolygon->bandCount ? index : pPolygon->bandCount - 1;
+}
+
+static double *__allocateLanes(size_t pCount) {
+    double *lanes = aligned_alloc(sizeof(PLY_vec), pCount * sizeof(double));
+    for (size_t i = 0; i < pCount; ++i) {
+        lanes[i] = NAN;
+    }
+    return lanes;
+}
+
+/**
+ * Even-odd test of a single point against the edges of its band
+ */
+static uint8_t __bandContains(struct PLY_Band const *pBand, double pLatitude, double pLongitude) {
+    PLY_vec lat = {pLatitude, pLatitude, pLatitude, pLatitude};
+    PLY_vec lng = {pLongitude, pLongitude, pLongitude, pLongitude};
+    PLY_mask crossings = {0, 0, 0, 0};
+
+    for (size_t e = 0; e < pBand->count; e += LANES) {
+        PLY_vec startLat = *(PLY_vec const *) &pBand->startLatitudes[e];
+        PLY_vec endLat = *(PLY_vec const *) &pBand->endLatitudes[e];
+        PLY_vec startLng = *(PLY_vec const *) &pBand->startLongitudes[e];
+        PLY_vec slope = *(PLY_vec const *) &pBand->slopes[e];
+
+        PLY_mask straddles = (startLat > lat) ^ (endLat > lat);
+        PLY_vec crossingLng = startLng + (lat - startLat) * slope;
+        crossings ^= straddles & (lng < crossingLng);
+    }
+
+    int64_t parity = crossings[0] ^ crossings[1] ^ crossings[2] ^ crossings[3];
+    return (uint8_t) (parity & 1);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct PLY_Polygon *PLY_createPolygon(double const *pLatitudes, double const *pLongitudes, size_t pCount) {
+    if (pCount < 3) {
+        return NULL;
+    }
+
+    struct PLY_Polygon *polygon = malloc(sizeof(struct PLY_Polygon));
+    polygon->minLatitude = 90.0;
+    polygon->maxLatitude = -90.0;
+    polygon->minLongitude = 180.0;
+    polygon->maxLongitude = -180.0;
+    for (size_t i = 0; i < pCount; ++i) {
+        polygon->minLatitude = fmin(polygon->minLatitude, pLatitudes[i]);
+        polygon->maxLatitude = fmax(polygon->maxLatitude, pLatitudes[i]);
+        polygon->minLongitude = fmin(polygon->minLongitude, pLongitudes[i]);
+        polygon->maxLongitude = fmax(polygon->maxLongitude, pLongitudes[i]);
+    }
+
+    /*
+     * Roughly two edges per band keeps the per point edge count small without an oversized grid
+     */
+    size_t bandCount = pCount / 2;
+    bandCount = bandCount < 1 ? 1 : (bandCount > MAX_BANDS ? MAX_BANDS : bandCount);
+    double height = polygon->maxLatitude - polygon->minLatitude;
+    polygon->bandCount = bandCount;
+    polygon->bandsPerDegree = height > 0 ? (double) bandCount / height : 0;
+    polygon->bands = calloc(bandCount, sizeof(struct PLY_Band));
+
+    /*
+     * First pass counts the edges per band, second pass fills them in
+     */
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            for (size_t b = 0; b < bandCount; ++b) {
+                struct PLY_Band *band = &polygon->bands[b];
+                size_t padded = (band->count + LANES - 1) / LANES * LANES;
+                padded = padded > 0 ? padded : LANES;
+                band->startLatitudes = __allocateLanes(padded);
+                band->endLatitudes = __allocateLanes(padded);
+                band->startLongitudes = __allocateLanes(padded);
+                band->slopes = __allocateLanes(padded);
+                band->count = 0;
+            }
+        }
+
+        for (size_t i = 0; i < pCount; ++i) {
+            size_t j = (i + 1) % pCount;
+            double startLat = pLatitudes[i];
+            double endLat = pLatitudes[j];
+            size_t first = __bandIndex(polygon, fmin(startLat, endLat));
+            size_t last = __bandIndex(polygon, fmax(startLat, endLat));
+            for (size_t b = first; b <= last; ++b) {
+                struct PLY_Band *band = &polygon->bands[b];
+                if (pass == 1) {
+                    band->startLatitudes[band->count] = startLat;
+                    band->endLatitudes[band->count] = endLat;
+                    band->startLongitudes[band->count] = pLongitudes[i];
+                    band->slopes[band->count] = endLat != startLat ?
+                                                (pLongitudes[j] - pLongitudes[i]) / (endLat - startLat) : 0.0;
+                }
+                ++band->count;
+            }
+        }
+    }
+
+    /*
+     * Round the edge counts up so the padding lanes are visited too
+     */
+    for (size_t b = 0; b < bandCount; ++b) {
+        struct PLY_Band *band = &polygon->bands[b];
+        band->count = (band->count + LANES - 1) / LANES * LANES;
+    }
+
+    return polygon;
+}
+
+void PLY_destroyPolygon(struct PLY_Polygon *pPolygon) {
+    if (NULL == pPolygon) {
+        return;
+    }
+    for (size_t b = 0; b < pPolygon->bandCount; ++b) {
+        free(pPolygon->bands[b].startLatitudes);
+        free(pPolygon->bands[b].endLatitudes);
+        free(pPolygon->bands[b].startLongitudes);
+        free(pPolygon->bands[b].slopes);
+    }
+    free(pPolygon->bands);
+    free(pPolygon);
+}
+
+void PLY_containsPoints(struct PLY_Polygon const *pPolygon, double const *pLatitudes, double const *pLongitudes,
+                        size_t pCount, uint8_t *pInside) {
+    for (size_t i = 0; i < pCount; ++i) {
+        double lat = pLatitudes[i];
+        double lng = pLongitudes[i];
+        if (lat < pPolygon->minLatitude || lat > pPolygon->maxLatitude ||
+            lng < pPolygon->minLongitude || lng > pPolygon->maxLongitude) {
+            pInside[i] = 0;
+        } else {
+            pInside[i] = __bandContains(&pPolygon->bands[__bandIndex(pPolygon, lat)], lat, lng);
+        }
+    }
+}
+
+//endregion
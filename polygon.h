@@ -0,0 +1,38 @@
+//
+// Created by William Kamp on 7/12/16.
+//
+
+#ifndef GEOFENCEBEC_POLYGON_H
+#define GEOFENCEBEC_POLYGON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A polygon prepared for fast point-in-polygon tests. Vertices are treated as planar latitude / longitude
+ * coordinates, which is accurate for footprint sized polygons that do not cross the antimeridian.
+ *
+ * Points are first rejected against the bounding box, then tested only against the edges of the latitude band
+ * (grid row) they fall in using the even-odd crossing rule, several edges per instruction.
+ */
+struct PLY_Polygon;
+
+/**
+ * Prepare a polygon from its vertices, the closing edge from the last vertex back to the first is implied
+ *
+ * returns struct PLY_Polygon which you must later PLY_destroyPolygon() or NULL when there are fewer than 3 vertices
+ */
+struct PLY_Polygon *PLY_createPolygon(double const *pLatitudes, double const *pLongitudes, size_t pCount);
+
+/**
+ * Deallocate a polygon
+ */
+void PLY_destroyPolygon(struct PLY_Polygon *pPolygon);
+
+/**
+ * Test many points at once, pInside[i] is set to 1 when point i is inside the polygon and 0 otherwise
+ */
+void PLY_containsPoints(struct PLY_Polygon const *pPolygon, double const *pLatitudes, double const *pLongitudes,
+                        size_t pCount, uint8_t *pInside);
+
+#endif //GEOFENCEBEC_POLYGON_H
@@ -0,0 +1,303 @@
+//
+// Created by William Kamp on 8/8/16.
+//
+
+#include <pthread.h>
+#include "location.h"
+#include "simplify.h"
+#include "trace.h"
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A cached simplification, the count and the first and last times tell a log that changed since apart
+ */
+struct SIM_Entry {
+    bool used;
+    bson_oid_t id;
+    double tolerance;
+    size_t count;
+    int32_t firstTime;
+    int32_t lastTime;
+    size_t *indices;
+    size_t keptCount;
+    uint64_t lastUsed;
+};
+
+/*
+ * A span of points still to be simplified
+ */
+struct SIM_Span {
+    size_t start;
+    size_t end;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Find the cached simplification of pLog
+ *
+ * returns a copy of its indices which you must later free() or NULL when it is not cached
+ */
+size_t *_cacheFind(struct DB_GpsLog const *pLog, double pToleranceMeters, size_t *pKeptCount);
+
+/**
+ * Keep a copy of the simplification of pLog, replacing the least recently used one when the cache is full
+ */
+void _cacheStore(struct DB_GpsLog const *pLog, double pToleranceMeters, size_t const *pIndices, size_t pKeptCount);
+
+/**
+ * Append { latitude, longitude, time } of point pIndex of pLog to pArray unless it is outside pRange
+ *
+ * returns false once pRange holds no more points
+ */
+bool _appendPoint(bson_t *pArray, uint32_t *pAppended, struct DB_GpsLog const *pLog, size_t pIndex,
+                  struct DB_PointRange const *pRange);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static pthread_mutex_t __lock = PTHREAD_MUTEX_INITIALIZER;
+static struct SIM_Entry __entries[SIM_CACHE_CAPACITY];
+static uint64_t __clock = 0;
+
+/*
+ * Longitude difference in degrees taking the short way across the antimeridian
+ */
+static inline double __longitudeDelta(double pFrom, double pTo) {
+    double delta = pTo - pFrom;
+    if (delta > 180.0) {
+        delta -= 360.0;
+    } else if (delta < -180.0) {
+        delta += 360.0;
+    }
+    return delta;
+}
+
+static bool __entryMatches(struct SIM_Entry const *pEntry, struct DB_GpsLog const *pLog, double pToleranceMeters) {
+    return pEntry->used && pEntry->tolerance == pToleranceMeters && pEntry->count == pLog->count &&
+           pEntry->firstTime == pLog->times[0] && pEntry->lastTime == pLog->times[pLog->count - 1] &&
+           bson_oid_equal(&pEntry->id, &pLog->id);
+}
+
+static size_t *__copyIndices(size_t const *pIndices, size_t pCount) {
+    size_t *retVal = malloc(MAX(pCount, 1) * sizeof(size_t));
+    memcpy(retVal, pIndices, pCount * sizeof(size_t));
+    return retVal;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t *_cacheFind(struct DB_GpsLog const *pLog, double pToleranceMeters, size_t *pKeptCount) {
+    size_t *retVal = NULL;
+    pthread_mutex_lock(&__lock);
+    for (size_t i = 0; i < SIM_CACHE_CAPACITY; ++i) {
+        struct SIM_Entry *entry = &__entries[i];
+        if (__entryMatches(entry, pLog, pToleranceMeters)) {
+            entry->lastUsed = ++__clock;
+            retVal = __copyIndices(entry->indices, entry->keptCount);
+            *pKeptCount = entry->keptCount;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&__lock);
+    return retVal;
+}
+
+void _cacheStore(struct DB_GpsLog const *pLog, double pToleranceMeters, size_t const *pIndices, size_t pKeptCount) {
+    size_t *indices = __copyIndices(pIndices, pKeptCount);
+    pthread_mutex_lock(&__lock);
+    struct SIM_Entry *victim = &__entries[0];
+    for (size_t i = 0; i < SIM_CACHE_CAPACITY; ++i) {
+        struct SIM_Entry *entry = &__entries[i];
+        if (!entry->used || __entryMatches(entry, pLog, pToleranceMeters)) {
+            victim = entry;
+            break;
+        }
+        if (entry->lastUsed < victim->lastUsed) {
+            victim = entry;
+        }
+    }
+    free(victim->indices);
+    victim->used = true;
+    bson_oid_copy(&pLog->id, &victim->id);
+    victim->tolerance = pToleranceMeters;
+    victim->count = pLog->count;
+    victim->firstTime = pLog->times[0];
+    victim->lastTime = pLog->times[pLog->count - 1];
+    victim->indices = indices;
+    victim->keptCount = pKeptCount;
+    victim->lastUsed = ++__clock;
+    pthread_mutex_unlock(&__lock);
+}
+
+bool _appendPoint(bson_t *pArray, uint32_t *pAppended, struct DB_GpsLog const *pLog, size_t pIndex,
+                  struct DB_PointRange const *pRange) {
+    if (NULL != pRange) {
+        if (pRange->maxPoints > 0 && *pAppended >= pRange->maxPoints) {
+            return false;
+        }
+        if (pLog->times[pIndex] < pRange->from || pLog->times[pIndex] > pRange->to) {
+            return true;
+        }
+    }
+
+    char iStr[16];
+    char const *key;
+    bson_t point;
+    bson_uint32_to_string((*pAppended)++, &key, iStr, sizeof iStr);
+    BSON_APPEND_DOCUMENT_BEGIN(pArray, key, &point);
+    BSON_APPEND_DOUBLE(&point, "latitude", pLog->latitudes[pIndex]);
+    BSON_APPEND_DOUBLE(&point, "longitude", pLog->longitudes[pIndex]);
+    BSON_APPEND_INT32(&point, "time", pLog->times[pIndex]);
+    bson_append_document_end(pArray, &point);
+    return true;
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t *SIM_simplify(double const *pLatitudes, double const *pLongitudes, size_t pCount, double pToleranceMeters,
+                     size_t *pKeptCount) {
+    *pKeptCount = 0;
+    if (pCount <= 2) {
+        size_t *retVal = malloc(2 * sizeof(size_t));
+        for (size_t i = 0; i < pCount; ++i) {
+            retVal[(*pKeptCount)++] = i;
+        }
+        return retVal;
+    }
+
+    uint8_t *keep = calloc(pCount, sizeof(uint8_t));
+    size_t kept = 0;
+
+    /*
+     * Iterative, a spiral or back and forth track would overflow the call stack when recursing. The track starts as
+     * runs of SIM_MAX_SPAN_POINTS, a span is searched in time linear to its length and one that only ever splits off a
+     * single point would otherwise be searched n times.
+     */
+    size_t stackCapacity = 64 + pCount / (SIM_MAX_SPAN_POINTS - 1);
+    size_t stackSize = 0;
+    struct SIM_Span *stack = malloc(stackCapacity * sizeof(struct SIM_Span));
+    for (size_t start = 0; start < pCount - 1; start += SIM_MAX_SPAN_POINTS - 1) {
+        size_t end = MIN(start + SIM_MAX_SPAN_POINTS - 1, pCount - 1);
+        kept += !keep[start] + !keep[end];
+        keep[start] = 1;
+        keep[end] = 1;
+        stack[stackSize++] = (struct SIM_Span) {start, end};
+    }
+    double toleranceSq = pToleranceMeters * pToleranceMeters;
+
+    while (stackSize > 0) {
+        struct SIM_Span span = stack[--stackSize];
+        if (span.end <= span.start + 1) {
+            continue;
+        }
+
+        /*
+         * Project the span onto a plane in meters around the middle of its segment and find the point furthest from
+         * the segment
+         */
+        double latitudeMeters;
+        double longitudeMeters;
+        double startLat = pLatitudes[span.start];
+        double startLng = pLongitudes[span.start];
+        LOC_metersPerDegree((startLat + pLatitudes[span.end]) / 2.0, &latitudeMeters, &longitudeMeters);
+        double segmentX = __longitudeDelta(startLng, pLongitudes[span.end]) * longitudeMeters;
+        double segmentY = (pLatitudes[span.end] - startLat) * latitudeMeters;
+        double segmentLengthSq = segmentX * segmentX + segmentY * segmentY;
+
+        double furthestSq = -1.0;
+        size_t furthest = span.start;
+        for (size_t i = span.start + 1; i < span.end; ++i) {
+            double x = __longitudeDelta(startLng, pLongitudes[i]) * longitudeMeters;
+            double y = (pLatitudes[i] - startLat) * latitudeMeters;
+            double t = segmentLengthSq > 0.0 ? (x * segmentX + y * segmentY) / segmentLengthSq : 0.0;
+            t = MAX(0.0, MIN(1.0, t));
+            double dx = x - t * segmentX;
+            double dy = y - t * segmentY;
+            double distanceSq = dx * dx + dy * dy;
+            if (distanceSq > furthestSq) {
+                furthestSq = distanceSq;
+                furthest = i;
+            }
+        }
+
+        if (furthestSq > toleranceSq) {
+            keep[furthest] = 1;
+            ++kept;
+            if (stackSize + 2 > stackCapacity) {
+                stackCapacity *= 2;
+                stack = realloc(stack, stackCapacity * sizeof(struct SIM_Span));
+            }
+            stack[stackSize++] = (struct SIM_Span) {span.start, furthest};
+            stack[stackSize++] = (struct SIM_Span) {furthest, span.end};
+        }
+    }
+
+    size_t *retVal = malloc(kept * sizeof(size_t));
+    for (size_t i = 0; i < pCount; ++i) {
+        if (keep[i]) {
+            retVal[(*pKeptCount)++] = i;
+        }
+    }
+    free(stack);
+    free(keep);
+    return retVal;
+}
+
+size_t *SIM_simplifyLog(struct DB_GpsLog const *pLog, double pToleranceMeters, size_t *pKeptCount) {
+    bool cacheable = pLog->hasId && pLog->count > 0;
+    size_t *retVal = cacheable ? _cacheFind(pLog, pToleranceMeters, pKeptCount) : NULL;
+    if (NULL == retVal) {
+        struct TRC_Span span;
+        TRC_begin(&span, "SIM_simplify");
+        retVal = SIM_simplify(pLog->latitudes, pLog->longitudes, pLog->count, pToleranceMeters, pKeptCount);
+        TRC_end(&span);
+        if (cacheable) {
+            _cacheStore(pLog, pToleranceMeters, retVal, *pKeptCount);
+        }
+    }
+    return retVal;
+}
+
+bson_t *SIM_simplifiedRecord(bson_t const *pRecord, struct DB_GpsLog const *pLog, double pToleranceMeters,
+                             size_t pKeepIndex, struct DB_PointRange const *pRange) {
+    size_t keptCount;
+    size_t *indices = SIM_simplifyLog(pLog, pToleranceMeters, &keptCount);
+
+    bson_t *retVal = bson_new();
+    bson_copy_to_excluding_noinit(pRecord, retVal, "log", "simplified", NULL);
+
+    /*
+     * Merge the kept point into the ascending indices
+     */
+    bson_t array;
+    uint32_t appended = 0;
+    bool more = true;
+    BSON_APPEND_ARRAY_BEGIN(retVal, "log", &array);
+    for (size_t i = 0; more && i < keptCount; ++i) {
+        if (pKeepIndex < indices[i] && (i == 0 || pKeepIndex > indices[i - 1])) {
+            more = _appendPoint(&array, &appended, pLog, pKeepIndex, pRange);
+        }
+        more = more && _appendPoint(&array, &appended, pLog, indices[i], pRange);
+    }
+    bson_append_array_end(retVal, &array);
+
+    bson_t simplified;
+    BSON_APPEND_DOCUMENT_BEGIN(retVal, "simplified", &simplified);
+    BSON_APPEND_DOUBLE(&simplified, "tolerance_meters", pToleranceMeters);
+    BSON_APPEND_INT64(&simplified, "point_count", (int64_t) pLog->count);
+    bson_append_document_end(retVal, &simplified);
+
+    free(indices);
+    return retVal;
+}
+
+//endregion
@@ -0,0 +1,56 @@
+//
+// Created by William Kamp on 8/8/16.
+//
+
+#ifndef GEOFENCEBEC_SIMPLIFY_H
+#define GEOFENCEBEC_SIMPLIFY_H
+
+#include <libmongoc-1.0/mongoc.h>
+#include "database.h"
+
+/*
+ * Simplified logs kept, the least recently used is replaced
+ */
+#define SIM_CACHE_CAPACITY 64
+
+/*
+ * Points one Douglas-Peucker run searches at most, a longer track is simplified as runs of this many points whose
+ * ends are always kept, so the worst case is linear in the length of the track rather than quadratic
+ */
+#define SIM_MAX_SPAN_POINTS 1024
+
+/**
+ * Douglas-Peucker simplification of a track, keeping its first and last points and every point needed so that no
+ * dropped point is further than pToleranceMeters from the kept track. Distances are measured on the WGS-84 ellipsoid
+ * scaled locally around each segment with LOC_metersPerDegree(). Every SIM_MAX_SPAN_POINTS - 1th point is kept too.
+ *
+ * param pKeptCount - receives the number of kept points
+ *
+ * returns the ascending indices of the kept points which you must later free()
+ */
+size_t *SIM_simplify(double const *pLatitudes, double const *pLongitudes, size_t pCount, double pToleranceMeters,
+                     size_t *pKeptCount);
+
+/**
+ * SIM_simplify() the points of a decoded gps log, answered from a cache keyed by the log id, the tolerance and the
+ * span of the points so an appended or sliced log is simplified again
+ *
+ * param pKeptCount - receives the number of kept points
+ *
+ * returns the ascending indices of the kept points which you must later free()
+ */
+size_t *SIM_simplifyLog(struct DB_GpsLog const *pLog, double pToleranceMeters, size_t *pKeptCount);
+
+/**
+ * Copy a gps log record replacing its log with the simplified points of pLog, adding
+ * simplified: { tolerance_meters, point_count } with the number of points before simplification
+ *
+ * param pKeepIndex - a point of pLog kept regardless of the tolerance, such as the fence entry, or SIZE_MAX
+ * param pRange - the kept points to return or NULL for all
+ *
+ * returns a record which you must later bson_destroy()
+ */
+bson_t *SIM_simplifiedRecord(bson_t const *pRecord, struct DB_GpsLog const *pLog, double pToleranceMeters,
+                             size_t pKeepIndex, struct DB_PointRange const *pRange);
+
+#endif //GEOFENCEBEC_SIMPLIFY_H
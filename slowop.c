@@ -0,0 +1,394 @@
+//
+// Created by William Kamp on 8/1/16.
+//
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "slowop.h"
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A recorded slow operation, query and explain are json
+ */
+struct SOP_Entry {
+    int64_t time;
+    char const *name;
+    enum SOP_Kind kind;
+    char collection[64];
+    int64_t micros;
+    uint32_t documents;
+    size_t bytes;
+    char *query;
+    char *explain;
+};
+
+/*
+ * An explain waiting for the explainer thread, its command is built when the operation is recorded since the query
+ * does not outlive the operation
+ */
+struct SOP_Explain {
+    uint64_t sequence;
+    bson_t *command;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * The command asking the server how it plans pOp, unless another explain was queued within SOP_EXPLAIN_INTERVAL_MS
+ *
+ * returns a command which you must later bson_destroy() or NULL
+ */
+bson_t *_explainCommand(struct SOP_Op const *pOp);
+
+/**
+ * Explainer thread, runs the queued explain on its own connection and attaches the plan to the entry it was queued
+ * for unless that entry has been overwritten since
+ */
+void *_explainer(void *pArg);
+
+/**
+ * Keep pOp if it took at least the threshold
+ */
+void _record(struct SOP_Op const *pOp);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static char const *const __kindNames[] = {"find", "aggregate", "insert", "bulk_insert", "remove", "find_and_modify",
+                                          "update"};
+static _Atomic int64_t __threshold = SOP_DEFAULT_THRESHOLD_MS * 1000;
+static _Atomic int64_t __lastExplain = 0;
+static pthread_mutex_t __lock = PTHREAD_MUTEX_INITIALIZER;
+static struct SOP_Entry __entries[SOP_CAPACITY];
+static uint64_t __recorded = 0;
+static pthread_cond_t __wake = PTHREAD_COND_INITIALIZER;
+static pthread_t __explainerThread;
+static bool __running = false;
+static bool __stopping = false;
+static char *__uri = NULL;
+static char *__database = NULL;
+static struct SOP_Explain __pending = {0, NULL};
+
+static int64_t __monotonicNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t __wallNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void __beginOp(struct SOP_Op *pOp, char const *pName, enum SOP_Kind pKind, mongoc_collection_t *pCollection,
+                      bson_t const *pQuery) {
+    pOp->name = pName;
+    pOp->kind = pKind;
+    pOp->collection = pCollection;
+    pOp->query = pQuery;
+    pOp->micros = 0;
+    pOp->documents = 0;
+    pOp->bytes = 0;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bson_t *_explainCommand(struct SOP_Op const *pOp) {
+    if (NULL == pOp->query || pOp->kind == SOP_INSERT || pOp->kind == SOP_BULK_INSERT) {
+        return NULL;
+    }
+    int64_t now = __monotonicNow();
+    int64_t last = atomic_load(&__lastExplain);
+    if (now - last < SOP_EXPLAIN_INTERVAL_MS * 1000 || !atomic_compare_exchange_strong(&__lastExplain, &last, now)) {
+        return NULL;
+    }
+
+    /*
+     * queryPlanner verbosity only plans the query, it does not run it again
+     */
+    char const *collection = mongoc_collection_get_name(pOp->collection);
+    bson_t *command = bson_new();
+    bson_t explained;
+    if (pOp->kind == SOP_AGGREGATE) {
+        bson_iter_t iter;
+        BSON_APPEND_UTF8(command, "aggregate", collection);
+        if (bson_iter_init_find(&iter, pOp->query, "pipeline")) {
+            BSON_APPEND_VALUE(command, "pipeline", bson_iter_value(&iter));
+        }
+        BSON_APPEND_BOOL(command, "explain", true);
+    } else if (pOp->kind == SOP_FIND || pOp->kind == SOP_FIND_AND_MODIFY || pOp->kind == SOP_UPDATE) {
+        /*
+         * A find and modify or update is planned like a find of its query
+         */
+        BSON_APPEND_DOCUMENT_BEGIN(command, "explain", &explained);
+        BSON_APPEND_UTF8(&explained, "find", collection);
+        BSON_APPEND_DOCUMENT(&explained, "filter", pOp->query);
+        bson_append_document_end(command, &explained);
+        BSON_APPEND_UTF8(command, "verbosity", "queryPlanner");
+    } else {
+        bson_t deletes;
+        bson_t statement;
+        BSON_APPEND_DOCUMENT_BEGIN(command, "explain", &explained);
+        BSON_APPEND_UTF8(&explained, "delete", collection);
+        BSON_APPEND_ARRAY_BEGIN(&explained, "deletes", &deletes);
+        BSON_APPEND_DOCUMENT_BEGIN(&deletes, "0", &statement);
+        BSON_APPEND_DOCUMENT(&statement, "q", pOp->query);
+        BSON_APPEND_INT32(&statement, "limit", 0);
+        bson_append_document_end(&deletes, &statement);
+        bson_append_array_end(&explained, &deletes);
+        bson_append_document_end(command, &explained);
+        BSON_APPEND_UTF8(command, "verbosity", "queryPlanner");
+    }
+    return command;
+}
+
+void _record(struct SOP_Op const *pOp) {
+    if (pOp->micros < atomic_load_explicit(&__threshold, memory_order_relaxed)) {
+        return;
+    }
+
+    /*
+     * Slow path, the query and explain command are captured before taking the lock, the explain itself runs on the
+     * explainer thread
+     */
+    char detail[LOG_DETAIL_SIZE];
+    snprintf(detail, sizeof detail, "%s %lldms", pOp->name, (long long) (pOp->micros / 1000));
+    LOG_log(LOG_LEVEL_WARN, "slow mongo operation", detail);
+    char *query = NULL != pOp->query ? bson_as_json(pOp->query, NULL) : NULL;
+    bson_t *command = _explainCommand(pOp);
+
+    pthread_mutex_lock(&__lock);
+    if (NULL != command && __running && NULL == __pending.command) {
+        __pending.sequence = __recorded;
+        __pending.command = command;
+        command = NULL;
+        pthread_cond_signal(&__wake);
+    }
+    struct SOP_Entry *entry = &__entries[__recorded++ % SOP_CAPACITY];
+    bson_free(entry->query);
+    bson_free(entry->explain);
+    entry->time = __wallNow();
+    entry->name = pOp->name;
+    entry->kind = pOp->kind;
+    snprintf(entry->collection, sizeof entry->collection, "%s", mongoc_collection_get_name(pOp->collection));
+    entry->micros = pOp->micros;
+    entry->documents = pOp->documents;
+    entry->bytes = pOp->bytes;
+    entry->query = query;
+    entry->explain = NULL;
+    pthread_mutex_unlock(&__lock);
+    if (NULL != command) {
+        bson_destroy(command);
+    }
+}
+
+void *_explainer(void *pArg) {
+    mongoc_client_t *client = mongoc_client_new(__uri);
+    pthread_mutex_lock(&__lock);
+    while (!__stopping) {
+        if (NULL == __pending.command) {
+            pthread_cond_wait(&__wake, &__lock);
+            continue;
+        }
+        struct SOP_Explain explain = __pending;
+        __pending.command = NULL;
+        pthread_mutex_unlock(&__lock);
+
+        /*
+         * Not timed through _record(), an explain is never recorded as a slow operation itself
+         */
+        bson_t reply;
+        bson_error_t error;
+        char *plan = NULL;
+        if (mongoc_client_command_simple(client, __database, explain.command, NULL, &reply, &error)) {
+            plan = bson_as_json(&reply, NULL);
+        } else {
+            LOG_log(LOG_LEVEL_WARN, "explain failed", error.message);
+        }
+        bson_destroy(&reply);
+        bson_destroy(explain.command);
+
+        pthread_mutex_lock(&__lock);
+        if (__recorded <= explain.sequence + SOP_CAPACITY) {
+            struct SOP_Entry *entry = &__entries[explain.sequence % SOP_CAPACITY];
+            bson_free(entry->explain);
+            entry->explain = plan;
+        } else {
+            bson_free(plan);
+        }
+    }
+    pthread_mutex_unlock(&__lock);
+    mongoc_client_destroy(client);
+    return NULL;
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void SOP_configure(int64_t pThresholdMicros) {
+    atomic_store(&__threshold, pThresholdMicros);
+}
+
+void SOP_start(char const *pUri, char const *pDatabase) {
+    pthread_mutex_lock(&__lock);
+    if (!__running) {
+        __uri = bson_strdup(pUri);
+        __database = bson_strdup(pDatabase);
+        __stopping = false;
+        __running = 0 == pthread_create(&__explainerThread, NULL, &_explainer, NULL);
+    }
+    pthread_mutex_unlock(&__lock);
+}
+
+void SOP_stop(void) {
+    pthread_mutex_lock(&__lock);
+    bool running = __running;
+    __stopping = true;
+    pthread_cond_broadcast(&__wake);
+    pthread_mutex_unlock(&__lock);
+    if (running) {
+        pthread_join(__explainerThread, NULL);
+    }
+
+    pthread_mutex_lock(&__lock);
+    __running = false;
+    if (NULL != __pending.command) {
+        bson_destroy(__pending.command);
+        __pending.command = NULL;
+    }
+    bson_free(__uri);
+    __uri = NULL;
+    bson_free(__database);
+    __database = NULL;
+    pthread_mutex_unlock(&__lock);
+}
+
+mongoc_cursor_t *SOP_find(struct SOP_Op *pOp, char const *pName, mongoc_collection_t *pCollection, uint32_t pLimit,
+                          bson_t const *pQuery, bson_t const *pFields) {
+    __beginOp(pOp, pName, SOP_FIND, pCollection, pQuery);
+    int64_t startTime = __monotonicNow();
+    mongoc_cursor_t *cursor = mongoc_collection_find(pCollection, MONGOC_QUERY_NONE, 0, pLimit, 0, pQuery, pFields,
+                                                     NULL);
+    pOp->micros += __monotonicNow() - startTime;
+    return cursor;
+}
+
+mongoc_cursor_t *SOP_aggregate(struct SOP_Op *pOp, char const *pName, mongoc_collection_t *pCollection,
+                               bson_t const *pPipeline) {
+    __beginOp(pOp, pName, SOP_AGGREGATE, pCollection, pPipeline);
+    int64_t startTime = __monotonicNow();
+    mongoc_cursor_t *cursor = mongoc_collection_aggregate(pCollection, MONGOC_QUERY_NONE, pPipeline, NULL, NULL);
+    pOp->micros += __monotonicNow() - startTime;
+    return cursor;
+}
+
+bool SOP_next(struct SOP_Op *pOp, mongoc_cursor_t *pCursor, bson_t const **pDocument) {
+    int64_t startTime = __monotonicNow();
+    bool retVal = mongoc_cursor_next(pCursor, pDocument);
+    pOp->micros += __monotonicNow() - startTime;
+    if (retVal) {
+        ++pOp->documents;
+        pOp->bytes += (*pDocument)->len;
+    }
+    return retVal;
+}
+
+void SOP_end(struct SOP_Op *pOp) {
+    _record(pOp);
+}
+
+bool SOP_insert(char const *pName, mongoc_collection_t *pCollection, bson_t const *pDocument, bson_error_t *pError) {
+    struct SOP_Op op;
+    __beginOp(&op, pName, SOP_INSERT, pCollection, NULL);
+    int64_t startTime = __monotonicNow();
+    bool retVal = mongoc_collection_insert(pCollection, MONGOC_INSERT_NONE, pDocument, NULL, pError);
+    op.micros = __monotonicNow() - startTime;
+    op.documents = 1;
+    op.bytes = pDocument->len;
+    _record(&op);
+    return retVal;
+}
+
+bool SOP_executeBulk(char const *pName, mongoc_collection_t *pCollection, mongoc_bulk_operation_t *pBulk,
+                     uint32_t pCount, bson_error_t *pError) {
+    struct SOP_Op op;
+    __beginOp(&op, pName, SOP_BULK_INSERT, pCollection, NULL);
+    int64_t startTime = __monotonicNow();
+    bool retVal = mongoc_bulk_operation_execute(pBulk, NULL, pError) != 0;
+    op.micros = __monotonicNow() - startTime;
+    op.documents = pCount;
+    _record(&op);
+    return retVal;
+}
+
+bool SOP_remove(char const *pName, mongoc_collection_t *pCollection, mongoc_remove_flags_t pFlags,
+                bson_t const *pSelector, bson_error_t *pError) {
+    struct SOP_Op op;
+    __beginOp(&op, pName, SOP_REMOVE, pCollection, pSelector);
+    int64_t startTime = __monotonicNow();
+    bool retVal = mongoc_collection_remove(pCollection, pFlags, pSelector, NULL, pError);
+    op.micros = __monotonicNow() - startTime;
+    _record(&op);
+    return retVal;
+}
+
+bool SOP_findAndModify(char const *pName, mongoc_collection_t *pCollection, bson_t const *pQuery,
+                       bson_t const *pUpdate, bson_t const *pFields, bool pNew, bson_t *pReply, bson_error_t *pError) {
+    struct SOP_Op op;
+    __beginOp(&op, pName, SOP_FIND_AND_MODIFY, pCollection, pQuery);
+    int64_t startTime = __monotonicNow();
+    bool retVal = mongoc_collection_find_and_modify(pCollection, pQuery, NULL, pUpdate, pFields, false, false, pNew,
+                                                    pReply, pError);
+    op.micros = __monotonicNow() - startTime;
+    op.documents = 1;
+    op.bytes = pUpdate->len;
+    _record(&op);
+    return retVal;
+}
+
+bool SOP_update(char const *pName, mongoc_collection_t *pCollection, bson_t const *pSelector, bson_t const *pUpdate,
+                bson_error_t *pError) {
+    struct SOP_Op op;
+    __beginOp(&op, pName, SOP_UPDATE, pCollection, pSelector);
+    int64_t startTime = __monotonicNow();
+    bool retVal = mongoc_collection_update(pCollection, MONGOC_UPDATE_NONE, pSelector, pUpdate, NULL, pError);
+    op.micros = __monotonicNow() - startTime;
+    op.documents = 1;
+    op.bytes = pUpdate->len;
+    _record(&op);
+    return retVal;
+}
+
+char *SOP_renderJson(void) {
+    bson_string_t *json = bson_string_new(NULL);
+    bson_string_append_printf(json, "{\"threshold_ms\":%lld,\"operations\":[",
+                              (long long) (atomic_load(&__threshold) / 1000));
+    pthread_mutex_lock(&__lock);
+    uint64_t count = __recorded < SOP_CAPACITY ? __recorded : SOP_CAPACITY;
+    for (uint64_t i = 0; i < count; ++i) {
+        struct SOP_Entry const *entry = &__entries[(__recorded - 1 - i) % SOP_CAPACITY];
+        bson_string_append_printf(json, "%s{\"time\":%lld,\"operation\":\"%s\",\"kind\":\"%s\",\"collection\":\"%s\","
+                                          "\"ms\":%.3f,\"documents\":%u,\"bytes\":%zu,\"query\":%s,\"explain\":%s}",
+                                  i > 0 ? "," : "", (long long) (entry->time / 1000), entry->name,
+                                  __kindNames[entry->kind], entry->collection, entry->micros / 1000.0,
+                                  entry->documents, entry->bytes, NULL != entry->query ? entry->query : "null",
+                                  NULL != entry->explain ? entry->explain : "null");
+    }
+    pthread_mutex_unlock(&__lock);
+    bson_string_append(json, "]}");
+    return bson_string_free(json, false);
+}
+
+//endregion
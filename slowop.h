@@ -0,0 +1,136 @@
+//
+// Created by William Kamp on 8/1/16.
+//
+
+#ifndef GEOFENCEBEC_SLOWOP_H
+#define GEOFENCEBEC_SLOWOP_H
+
+#include <libmongoc-1.0/mongoc.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Mongo operations taking longer than this are recorded when GEOFENCE_SLOW_OP_MS is not set
+ */
+#define SOP_DEFAULT_THRESHOLD_MS 100
+
+/*
+ * Slow operations kept, older ones are overwritten
+ */
+#define SOP_CAPACITY 128
+
+/*
+ * At most one explain is queued per interval so a slow database is not asked to plan every slow query
+ */
+#define SOP_EXPLAIN_INTERVAL_MS 1000
+
+enum SOP_Kind {
+    SOP_FIND,
+    SOP_AGGREGATE,
+    SOP_INSERT,
+    SOP_BULK_INSERT,
+    SOP_REMOVE,
+    SOP_FIND_AND_MODIFY,
+    SOP_UPDATE,
+};
+
+/**
+ * A cursor operation being timed on the stack, only the time spent in the driver is counted
+ */
+struct SOP_Op {
+    char const *name;
+    enum SOP_Kind kind;
+    mongoc_collection_t *collection;
+    bson_t const *query;
+    int64_t micros;
+    uint32_t documents;
+    size_t bytes;
+};
+
+/**
+ * Set the duration from which operations are recorded, 0 records every operation
+ */
+void SOP_configure(int64_t pThresholdMicros);
+
+/**
+ * Start the thread running explains of slow operations on its own connection rather than on the thread that recorded
+ * them, operations recorded before it is started carry no explain
+ *
+ * param pUri - the MongoDB uri to connect to
+ * param pDatabase - the database the recorded operations run against
+ */
+void SOP_start(char const *pUri, char const *pDatabase);
+
+/**
+ * Stop the explain thread after the explain in progress, does nothing when it was not started
+ */
+void SOP_stop(void);
+
+/**
+ * Timed mongoc_collection_find() without flags, skip or batch size
+ *
+ * param pOp - pass to SOP_next() and SOP_end()
+ * param pName - the operation, must be a string literal (only the pointer is kept)
+ *
+ * returns a cursor which you must later mongoc_cursor_destroy() after SOP_end()
+ */
+mongoc_cursor_t *SOP_find(struct SOP_Op *pOp, char const *pName, mongoc_collection_t *pCollection, uint32_t pLimit,
+                          bson_t const *pQuery, bson_t const *pFields);
+
+/**
+ * Timed mongoc_collection_aggregate() of a { pipeline: [...] } document
+ *
+ * returns a cursor which you must later mongoc_cursor_destroy() after SOP_end()
+ */
+mongoc_cursor_t *SOP_aggregate(struct SOP_Op *pOp, char const *pName, mongoc_collection_t *pCollection,
+                               bson_t const *pPipeline);
+
+/**
+ * Timed mongoc_cursor_next() counting the documents returned and their size
+ */
+bool SOP_next(struct SOP_Op *pOp, mongoc_cursor_t *pCursor, bson_t const **pDocument);
+
+/**
+ * Record the operation if it was slow, its collection and query must still be alive
+ */
+void SOP_end(struct SOP_Op *pOp);
+
+/**
+ * Timed mongoc_collection_insert(), recorded if slow
+ */
+bool SOP_insert(char const *pName, mongoc_collection_t *pCollection, bson_t const *pDocument, bson_error_t *pError);
+
+/**
+ * Timed mongoc_bulk_operation_execute() of pCount inserts, recorded if slow
+ */
+bool SOP_executeBulk(char const *pName, mongoc_collection_t *pCollection, mongoc_bulk_operation_t *pBulk,
+                     uint32_t pCount, bson_error_t *pError);
+
+/**
+ * Timed mongoc_collection_remove(), recorded if slow
+ */
+bool SOP_remove(char const *pName, mongoc_collection_t *pCollection, mongoc_remove_flags_t pFlags,
+                bson_t const *pSelector, bson_error_t *pError);
+
+/**
+ * Timed mongoc_collection_find_and_modify() of a single document without sort or upsert, recorded if slow
+ *
+ * param pReply - receives the reply which you must later bson_destroy(), its value is null when nothing matched
+ */
+bool SOP_findAndModify(char const *pName, mongoc_collection_t *pCollection, bson_t const *pQuery,
+                       bson_t const *pUpdate, bson_t const *pFields, bool pNew, bson_t *pReply, bson_error_t *pError);
+
+/**
+ * Timed mongoc_collection_update() of a single document, recorded if slow
+ */
+bool SOP_update(char const *pName, mongoc_collection_t *pCollection, bson_t const *pSelector, bson_t const *pUpdate,
+                bson_error_t *pError);
+
+/**
+ * The recorded slow operations, newest first, with their query and explain plan
+ *
+ * returns a json string which you must later bson_free()
+ */
+char *SOP_renderJson(void);
+
+#endif //GEOFENCEBEC_SLOWOP_H
@@ -0,0 +1,424 @@
+//
+// Created by William Kamp on 7/30/16.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "supervisor.h"
+
+#define ENV_READY_FD "GEOFENCE_SUPERVISOR_READY_FD"
+#define ENV_SUPERVISOR_PID "GEOFENCE_SUPERVISOR_PID"
+#define EXIT_EXEC_FAILED 127
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A worker process. Workers being replaced by a restart stay in the table, no longer current, until they exit. A
+ * worker waiting to be respawned has no pid and the time it is due.
+ */
+struct SV_Worker {
+    pid_t pid;
+    time_t started;
+    time_t respawnAt;
+    bool current;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Fork and exec a worker and wait for it to report that it is accepting connections
+ *
+ * param pReady - set to whether the worker became ready within SV_READY_TIMEOUT_SECONDS
+ *
+ * returns the pid of the worker or -1 when it could not be started
+ */
+pid_t _spawn(bool *pReady);
+
+/**
+ * Reap exited workers, respawning current ones unless shutting down. Workers that died soon after starting are only
+ * scheduled for _respawnDue().
+ */
+void _reap(void);
+
+/**
+ * Respawn the workers whose respawn is due, or drop them when shutting down, and set an alarm for the next one
+ */
+void _respawnDue(void);
+
+/**
+ * Replace every current worker one at a time
+ */
+void _rollingRestart(void);
+
+/**
+ * Send pSignal to every live worker
+ */
+void _signalWorkers(int pSignal);
+
+/**
+ * An unused slot of the worker table, growing it as needed
+ */
+struct SV_Worker *_freeSlot(void);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static volatile sig_atomic_t __terminateRequested = 0;
+static volatile sig_atomic_t __restartRequested = 0;
+static volatile sig_atomic_t __childExited = 0;
+static volatile sig_atomic_t __traceRequested = 0;
+static volatile sig_atomic_t __respawnDue = 0;
+static bool __shuttingDown = false;
+static char __executable[PATH_MAX];
+static char **__argv = NULL;
+static struct SV_Worker *__workers = NULL;
+static size_t __workerCapacity = 0;
+
+static void __handleSignal(int pSignal) {
+    switch (pSignal) {
+        case SIGTERM:
+        case SIGINT:
+            __terminateRequested = 1;
+            break;
+        case SIGHUP:
+            __restartRequested = 1;
+            break;
+        case SIGCHLD:
+            __childExited = 1;
+            break;
+        case SIGUSR1:
+            __traceRequested = 1;
+            break;
+        case SIGALRM:
+            __respawnDue = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+static void __describeExit(pid_t pPid, int pStatus) {
+    char detail[PATH_MAX + 64];
+    if (WIFEXITED(pStatus) && EXIT_EXEC_FAILED == WEXITSTATUS(pStatus)) {
+        snprintf(detail, sizeof detail, "worker %d, %s", (int) pPid, __executable);
+        LOG_log(LOG_LEVEL_ERROR, "worker could not exec", detail);
+    } else if (WIFEXITED(pStatus)) {
+        snprintf(detail, sizeof detail, "worker %d, status %d", (int) pPid, WEXITSTATUS(pStatus));
+        LOG_log(0 == WEXITSTATUS(pStatus) ? LOG_LEVEL_INFO : LOG_LEVEL_WARN, "worker exited", detail);
+    } else if (WIFSIGNALED(pStatus)) {
+        snprintf(detail, sizeof detail, "worker %d, signal %d", (int) pPid, WTERMSIG(pStatus));
+        LOG_log(LOG_LEVEL_WARN, "worker killed", detail);
+    }
+}
+
+static size_t __liveCount(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < __workerCapacity; ++i) {
+        count += __workers[i].pid > 0;
+    }
+    return count;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+pid_t _spawn(bool *pReady) {
+    *pReady = false;
+    int ready[2];
+    if (0 != pipe(ready)) {
+        return -1;
+    }
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        /*
+         * Worker, hand over the write end of the ready pipe and restore the signal mask the supervisor blocked
+         */
+        char value[32];
+        close(ready[0]);
+        snprintf(value, sizeof value, "%d", ready[1]);
+        setenv(ENV_READY_FD, value, 1);
+        snprintf(value, sizeof value, "%d", (int) supervisor);
+        setenv(ENV_SUPERVISOR_PID, value, 1);
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        execv(__executable, __argv);
+
+        /*
+         * The log flusher is not running in the forked child, the supervisor logs the exit status instead
+         */
+        _exit(EXIT_EXEC_FAILED);
+    }
+    close(ready[1]);
+    if (pid < 0) {
+        close(ready[0]);
+        return -1;
+    }
+
+    /*
+     * The worker writes a byte once it is listening, the pipe closes without one if it dies first
+     */
+    struct pollfd poller = {ready[0], POLLIN, 0};
+    char byte;
+    int polled;
+    while ((polled = poll(&poller, 1, SV_READY_TIMEOUT_SECONDS * 1000)) < 0 && errno == EINTR) {
+    }
+    *pReady = polled > 0 && read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+    return pid;
+}
+
+struct SV_Worker *_freeSlot(void) {
+    for (size_t i = 0; i < __workerCapacity; ++i) {
+        if (__workers[i].pid <= 0 && 0 == __workers[i].respawnAt) {
+            return &__workers[i];
+        }
+    }
+    size_t capacity = __workerCapacity * 2;
+    __workers = realloc(__workers, capacity * sizeof(struct SV_Worker));
+    memset(&__workers[__workerCapacity], 0, (capacity - __workerCapacity) * sizeof(struct SV_Worker));
+    __workerCapacity = capacity;
+    return &__workers[capacity / 2];
+}
+
+void _reap(void) {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        __describeExit(pid, status);
+        for (size_t i = 0; i < __workerCapacity; ++i) {
+            struct SV_Worker *worker = &__workers[i];
+            if (worker->pid != pid) {
+                continue;
+            }
+            worker->pid = 0;
+            if (worker->current && !__shuttingDown) {
+                time_t now = time(NULL);
+                worker->respawnAt = now - worker->started < SV_RESPAWN_DELAY_SECONDS ? now + SV_RESPAWN_DELAY_SECONDS
+                                                                                    : now;
+                __respawnDue = 1;
+            }
+            break;
+        }
+    }
+}
+
+void _respawnDue(void) {
+    time_t now = time(NULL);
+    time_t next = 0;
+    for (size_t i = 0; i < __workerCapacity; ++i) {
+        struct SV_Worker *worker = &__workers[i];
+        if (0 == worker->respawnAt) {
+            continue;
+        }
+        if (__shuttingDown) {
+            worker->respawnAt = 0;
+        } else if (worker->respawnAt <= now) {
+            bool ready;
+            worker->respawnAt = 0;
+            worker->pid = _spawn(&ready);
+            worker->started = time(NULL);
+            char detail[32];
+            snprintf(detail, sizeof detail, "worker %d", (int) worker->pid);
+            LOG_log(LOG_LEVEL_INFO, "respawned worker", detail);
+        } else if (0 == next || worker->respawnAt < next) {
+            next = worker->respawnAt;
+        }
+    }
+
+    /*
+     * sigsuspend() wakes on the alarm, signals are still taken while the respawn waits
+     */
+    alarm(0 != next ? (unsigned int) (next - now) : 0);
+}
+
+void _rollingRestart(void) {
+    /*
+     * Only the workers current now are replaced, not the replacements added to the table as we go
+     */
+    size_t count = 0;
+    pid_t *replace = malloc(__workerCapacity * sizeof(pid_t));
+    for (size_t i = 0; i < __workerCapacity; ++i) {
+        if (__workers[i].pid > 0 && __workers[i].current) {
+            replace[count++] = __workers[i].pid;
+        }
+    }
+
+    for (size_t r = 0; r < count && !__terminateRequested; ++r) {
+        bool ready;
+        pid_t pid = _spawn(&ready);
+        if (pid < 0 || !ready) {
+            LOG_log(LOG_LEVEL_ERROR, "restart stopped, replacement worker did not become ready", NULL);
+            if (pid > 0) {
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+            }
+            break;
+        }
+
+        /*
+         * The replacement shares the port now, the old worker stops accepting and drains
+         */
+        struct SV_Worker *replacement = _freeSlot();
+        replacement->pid = pid;
+        replacement->started = time(NULL);
+        replacement->current = true;
+        for (size_t i = 0; i < __workerCapacity; ++i) {
+            if (__workers[i].pid == replace[r]) {
+                __workers[i].current = false;
+                kill(replace[r], SIGTERM);
+                char detail[64];
+                snprintf(detail, sizeof detail, "worker %d with %d", (int) replace[r], (int) pid);
+                LOG_log(LOG_LEVEL_INFO, "replaced worker", detail);
+            }
+        }
+    }
+    free(replace);
+}
+
+void _signalWorkers(int pSignal) {
+    for (size_t i = 0; i < __workerCapacity; ++i) {
+        if (__workers[i].pid > 0) {
+            kill(__workers[i].pid, pSignal);
+        }
+    }
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int SV_supervise(unsigned int pWorkerCount, char **argv) {
+    /*
+     * Remember the binary's path now, a deploy may replace the file later and restarts should exec the new one
+     */
+    ssize_t len = readlink("/proc/self/exe", __executable, sizeof __executable - 1);
+    if (len > 0) {
+        __executable[len] = '\0';
+    } else {
+        strncpy(__executable, argv[0], sizeof __executable - 1);
+    }
+    __argv = argv;
+
+    /*
+     * Signals are only taken while waiting in sigsuspend()
+     */
+    sigset_t handled;
+    sigset_t waitMask;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGHUP);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGALRM);
+    sigprocmask(SIG_BLOCK, &handled, &waitMask);
+    struct sigaction sa;
+    sa.sa_handler = &__handleSignal;
+    sa.sa_flags = 0;
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+
+    /*
+     * Started with the signals blocked so the flusher thread never takes them
+     */
+    LOG_start();
+
+    char detail[64];
+    __workerCapacity = pWorkerCount * 2;
+    __workers = calloc(__workerCapacity, sizeof(struct SV_Worker));
+    for (unsigned int i = 0; i < pWorkerCount; ++i) {
+        bool ready;
+        __workers[i].pid = _spawn(&ready);
+        __workers[i].started = time(NULL);
+        __workers[i].current = true;
+        if (__workers[i].pid < 0 || !ready) {
+            snprintf(detail, sizeof detail, "worker %u", i);
+            LOG_log(LOG_LEVEL_ERROR, "worker did not start", detail);
+        }
+    }
+    snprintf(detail, sizeof detail, "pid %d, %u workers", (int) getpid(), pWorkerCount);
+    LOG_log(LOG_LEVEL_INFO, "GeoFence supervisor running", detail);
+
+    for (;;) {
+        if (__childExited) {
+            __childExited = 0;
+            _reap();
+        }
+        if (__terminateRequested && !__shuttingDown) {
+            __shuttingDown = true;
+            __respawnDue = 1;
+            _signalWorkers(SIGTERM);
+        }
+        if (__respawnDue) {
+            __respawnDue = 0;
+            _respawnDue();
+        }
+        if (__shuttingDown && __liveCount() == 0) {
+            break;
+        }
+        if (__restartRequested) {
+            __restartRequested = 0;
+            if (!__shuttingDown) {
+                _rollingRestart();
+            }
+        }
+        if (__traceRequested) {
+            __traceRequested = 0;
+            _signalWorkers(SIGUSR1);
+        }
+        sigsuspend(&waitMask);
+    }
+
+    free(__workers);
+    LOG_log(LOG_LEVEL_INFO, "GeoFence supervisor stopped", NULL);
+    LOG_stop();
+    return 0;
+}
+
+bool SV_isWorker(void) {
+    return NULL != getenv(ENV_SUPERVISOR_PID);
+}
+
+void SV_notifyReady(void) {
+    char const *value = getenv(ENV_READY_FD);
+    if (NULL == value) {
+        return;
+    }
+    int fd = atoi(value);
+    if (write(fd, "1", 1) != 1) {
+        LOG_log(LOG_LEVEL_ERROR, "could not notify the supervisor", strerror(errno));
+    }
+    close(fd);
+    unsetenv(ENV_READY_FD);
+}
+
+bool SV_supervisorGone(void) {
+    char const *value = getenv(ENV_SUPERVISOR_PID);
+    return NULL != value && getppid() != (pid_t) atoi(value);
+}
+
+//endregion
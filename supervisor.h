@@ -0,0 +1,52 @@
+//
+// Created by William Kamp on 7/30/16.
+//
+
+#ifndef GEOFENCEBEC_SUPERVISOR_H
+#define GEOFENCEBEC_SUPERVISOR_H
+
+#include <stdbool.h>
+
+/*
+ * Seconds a new worker has to start accepting connections before a restart gives up on it
+ */
+#define SV_READY_TIMEOUT_SECONDS 30
+
+/*
+ * Workers that die sooner than this after starting are respawned after a pause instead of immediately
+ */
+#define SV_RESPAWN_DELAY_SECONDS 1
+
+/**
+ * Run as the supervisor of pWorkerCount worker processes and return when they have all exited
+ *
+ * Each worker is a fresh exec of this binary (so a restart picks up a replaced binary) that binds its own
+ * SO_REUSEPORT listening socket and Mongo pool. Workers that die are respawned.
+ *
+ * SIGTERM / SIGINT - forwarded to every worker, which drain their in-flight requests and exit
+ * SIGHUP - rolling restart, each worker is replaced by a new one that is accepting connections before the old one is
+ *          told to drain, so the port is never left without a listener
+ * SIGUSR1 - forwarded to every worker (trace dump)
+ *
+ * param argv - the arguments main() was started with, workers are exec'd with them
+ *
+ * returns the exit status for main()
+ */
+int SV_supervise(unsigned int pWorkerCount, char **argv);
+
+/**
+ * returns true when this process is a worker started by SV_supervise()
+ */
+bool SV_isWorker(void);
+
+/**
+ * Tell the supervisor this worker is accepting connections, does nothing when not supervised
+ */
+void SV_notifyReady(void);
+
+/**
+ * returns true when this process is a worker whose supervisor has exited
+ */
+bool SV_supervisorGone(void);
+
+#endif //GEOFENCEBEC_SUPERVISOR_H
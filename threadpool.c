@@ -0,0 +1,320 @@
+//
+// Created by William Kamp on 7/5/16.
+//
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+#define INITIAL_DEQUE_CAPACITY 64
+#define WAIT_RECHECK_NANOS 1000000L
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct TP_Task {
+    TP_taskFunction function;
+    void *arg;
+    struct TP_Group *group;
+};
+
+/*
+ * Ring buffer of tasks. The owning worker takes from the bottom, thieves take from the top.
+ */
+struct TP_Deque {
+    pthread_mutex_t lock;
+    struct TP_Task *tasks;
+    size_t capacity;
+    size_t top;
+    size_t count;
+};
+
+struct TP_Worker {
+    struct TP_Pool *pool;
+    unsigned int index;
+    pthread_t thread;
+};
+
+struct TP_Pool {
+    unsigned int threadCount;
+    struct TP_Deque *deques;
+    struct TP_Worker *workers;
+    pthread_mutex_t sleepLock;
+    pthread_cond_t wake;
+    atomic_size_t queued;
+    atomic_uint nextDeque;
+    bool shutdown;
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * Worker thread entry point
+ */
+void *_workerMain(void *pArg);
+
+/**
+ * Take a task from the caller's own deque or steal one from another deque
+ *
+ * returns true when pTask was filled
+ */
+bool _takeTask(struct TP_Pool *pPool, int pOwnIndex, struct TP_Task *pTask);
+
+/**
+ * Execute a task and mark it complete in its group
+ */
+void _runTask(struct TP_Task *pTask);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * Index of the pool worker running on this thread and the pool it belongs to, -1 for non-pool threads
+ */
+static __thread int __workerIndex = -1;
+static __thread struct TP_Pool *__workerPool = NULL;
+
+static void __pushBottom(struct TP_Deque *pDeque, struct TP_Task const *pTask) {
+    pthread_mutex_lock(&pDeque->lock);
+    if (pDeque->count == pDeque->capacity) {
+        size_t newCapacity = pDeque->capacity * 2;
+        struct TP_Task *tasks = malloc(newCapacity * sizeof(struct TP_Task));
+        for (size_t i = 0; i < pDeque->count; ++i) {
+            tasks[i] = pDeque->tasks[(pDeque->top + i) % pDeque->capacity];
+        }
+        free(pDeque->tasks);
+        pDeque->tasks = tasks;
+        pDeque->capacity = newCapacity;
+        pDeque->top = 0;
+    }
+    pDeque->tasks[(pDeque->top + pDeque->count) % pDeque->capacity] = *pTask;
+    ++pDeque->count;
+    pthread_mutex_unlock(&pDeque->lock);
+}
+
+static bool __popBottom(struct TP_Deque *pDeque, struct TP_Task *pTask) {
+    bool found = false;
+    pthread_mutex_lock(&pDeque->lock);
+    if (pDeque->count > 0) {
+        --pDeque->count;
+        *pTask = pDeque->tasks[(pDeque->top + pDeque->count) % pDeque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&pDeque->lock);
+    return found;
+}
+
+static bool __stealTop(struct TP_Deque *pDeque, struct TP_Task *pTask) {
+    bool found = false;
+    pthread_mutex_lock(&pDeque->lock);
+    if (pDeque->count > 0) {
+        *pTask = pDeque->tasks[pDeque->top];
+        pDeque->top = (pDeque->top + 1) % pDeque->capacity;
+        --pDeque->count;
+        found = true;
+    }
+    pthread_mutex_unlock(&pDeque->lock);
+    return found;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool _takeTask(struct TP_Pool *pPool, int pOwnIndex, struct TP_Task *pTask) {
+    if (atomic_load(&pPool->queued) == 0) {
+        return false;
+    }
+
+    bool found = pOwnIndex >= 0 && __popBottom(&pPool->deques[pOwnIndex], pTask);
+
+    /*
+     * Steal from the other deques starting after our own so thieves spread out
+     */
+    unsigned int start = pOwnIndex >= 0 ? (unsigned int) pOwnIndex + 1 : 0;
+    for (unsigned int i = 0; !found && i < pPool->threadCount; ++i) {
+        unsigned int victim = (start + i) % pPool->threadCount;
+        if ((int) victim != pOwnIndex) {
+            found = __stealTop(&pPool->deques[victim], pTask);
+        }
+    }
+
+    if (found) {
+        atomic_fetch_sub(&pPool->queued, 1);
+    }
+    return found;
+}
+
+void _runTask(struct TP_Task *pTask) {
+    pTask->function(pTask->arg);
+
+    struct TP_Group *group = pTask->group;
+    if (NULL != group) {
+        pthread_mutex_lock(&group->lock);
+        if (0 == --group->pending) {
+            pthread_cond_broadcast(&group->done);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+void *_workerMain(void *pArg) {
+    struct TP_Worker *worker = pArg;
+    struct TP_Pool *pool = worker->pool;
+    __workerIndex = (int) worker->index;
+    __workerPool = pool;
+
+    struct TP_Task task;
+    for (; ;) {
+        if (_takeTask(pool, __workerIndex, &task)) {
+            _runTask(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->sleepLock);
+        while (0 == atomic_load(&pool->queued) && !pool->shutdown) {
+            pthread_cond_wait(&pool->wake, &pool->sleepLock);
+        }
+        bool exit = pool->shutdown && 0 == atomic_load(&pool->queued);
+        pthread_mutex_unlock(&pool->sleepLock);
+        if (exit) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct TP_Pool *TP_createPool(unsigned int pThreadCount) {
+    if (0 == pThreadCount) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pThreadCount = cpus > 0 ? (unsigned int) cpus : 1;
+    }
+
+    struct TP_Pool *pool = malloc(sizeof(struct TP_Pool));
+    pool->threadCount = pThreadCount;
+    pool->shutdown = false;
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->nextDeque, 0);
+    pthread_mutex_init(&pool->sleepLock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    pool->deques = malloc(pThreadCount * sizeof(struct TP_Deque));
+    pool->workers = malloc(pThreadCount * sizeof(struct TP_Worker));
+    for (unsigned int i = 0; i < pThreadCount; ++i) {
+        struct TP_Deque *deque = &pool->deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->tasks = malloc(INITIAL_DEQUE_CAPACITY * sizeof(struct TP_Task));
+        deque->capacity = INITIAL_DEQUE_CAPACITY;
+        deque->top = 0;
+        deque->count = 0;
+    }
+    for (unsigned int i = 0; i < pThreadCount; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_create(&pool->workers[i].thread, NULL, &_workerMain, &pool->workers[i]);
+    }
+    return pool;
+}
+
+void TP_destroyPool(struct TP_Pool *pPool) {
+    if (NULL == pPool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pPool->sleepLock);
+    pPool->shutdown = true;
+    pthread_cond_broadcast(&pPool->wake);
+    pthread_mutex_unlock(&pPool->sleepLock);
+
+    for (unsigned int i = 0; i < pPool->threadCount; ++i) {
+        pthread_join(pPool->workers[i].thread, NULL);
+    }
+    for (unsigned int i = 0; i < pPool->threadCount; ++i) {
+        pthread_mutex_destroy(&pPool->deques[i].lock);
+        free(pPool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pPool->sleepLock);
+    pthread_cond_destroy(&pPool->wake);
+    free(pPool->deques);
+    free(pPool->workers);
+    free(pPool);
+}
+
+unsigned int TP_threadCount(struct TP_Pool const *pPool) {
+    return pPool->threadCount;
+}
+
+void TP_initGroup(struct TP_Group *pGroup) {
+    pthread_mutex_init(&pGroup->lock, NULL);
+    pthread_cond_init(&pGroup->done, NULL);
+    pGroup->pending = 0;
+}
+
+void TP_destroyGroup(struct TP_Group *pGroup) {
+    pthread_mutex_destroy(&pGroup->lock);
+    pthread_cond_destroy(&pGroup->done);
+}
+
+void TP_submit(struct TP_Pool *pPool, struct TP_Group *pGroup, TP_taskFunction fPtr, void *pArg) {
+    struct TP_Task task = {fPtr, pArg, pGroup};
+    if (NULL != pGroup) {
+        pthread_mutex_lock(&pGroup->lock);
+        ++pGroup->pending;
+        pthread_mutex_unlock(&pGroup->lock);
+    }
+
+    unsigned int index;
+    if (__workerPool == pPool) {
+        index = (unsigned int) __workerIndex;
+    } else {
+        index = atomic_fetch_add(&pPool->nextDeque, 1) % pPool->threadCount;
+    }
+    atomic_fetch_add(&pPool->queued, 1);
+    __pushBottom(&pPool->deques[index], &task);
+
+    pthread_mutex_lock(&pPool->sleepLock);
+    pthread_cond_signal(&pPool->wake);
+    pthread_mutex_unlock(&pPool->sleepLock);
+}
+
+void TP_wait(struct TP_Pool *pPool, struct TP_Group *pGroup) {
+    int ownIndex = __workerPool == pPool ? __workerIndex : -1;
+    struct TP_Task task;
+
+    pthread_mutex_lock(&pGroup->lock);
+    while (pGroup->pending > 0) {
+        pthread_mutex_unlock(&pGroup->lock);
+
+        /*
+         * Help out rather than block a thread that could be doing the work we are waiting on
+         */
+        if (_takeTask(pPool, ownIndex, &task)) {
+            _runTask(&task);
+            pthread_mutex_lock(&pGroup->lock);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAIT_RECHECK_NANOS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&pGroup->lock);
+        if (pGroup->pending > 0) {
+            pthread_cond_timedwait(&pGroup->done, &pGroup->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&pGroup->lock);
+}
+
+//endregion
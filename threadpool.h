@@ -0,0 +1,64 @@
+//
+// Created by William Kamp on 7/5/16.
+//
+
+#ifndef GEOFENCEBEC_THREADPOOL_H
+#define GEOFENCEBEC_THREADPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Defines a unit of work executed by a pool worker
+ */
+typedef void (*TP_taskFunction)(void *pArg);
+
+/**
+ * Opaque work-stealing thread pool. Each worker owns a deque, pops its own work LIFO and steals from the other
+ * workers FIFO when it runs dry.
+ */
+struct TP_Pool;
+
+/**
+ * Tracks completion of a set of submitted tasks. Initialize with TP_initGroup() and release with TP_destroyGroup().
+ */
+struct TP_Group {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    size_t pending;
+};
+
+/**
+ * Create a pool with pThreadCount workers (0 means one per online cpu)
+ *
+ * returns struct TP_Pool which you must later TP_destroyPool()
+ */
+struct TP_Pool *TP_createPool(unsigned int pThreadCount);
+
+/**
+ * Stop all workers once their queued work is finished and deallocate the pool
+ */
+void TP_destroyPool(struct TP_Pool *pPool);
+
+/**
+ * The number of worker threads in the pool
+ */
+unsigned int TP_threadCount(struct TP_Pool const *pPool);
+
+void TP_initGroup(struct TP_Group *pGroup);
+
+void TP_destroyGroup(struct TP_Group *pGroup);
+
+/**
+ * Queue a task. When called from a pool worker the task is pushed onto that worker's own deque.
+ */
+void TP_submit(struct TP_Pool *pPool, struct TP_Group *pGroup, TP_taskFunction fPtr, void *pArg);
+
+/**
+ * Block until every task submitted with pGroup has run. The calling thread executes queued tasks while it waits so
+ * that workers may safely wait on nested groups.
+ */
+void TP_wait(struct TP_Pool *pPool, struct TP_Group *pGroup);
+
+#endif //GEOFENCEBEC_THREADPOOL_H
@@ -0,0 +1,233 @@
+//
+// Created by William Kamp on 7/27/16.
+//
+
+#include <libbson-1.0/bson.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+//region STRUCTURES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * A finished span. Fields are relaxed atomics so the dumper may read a slot while its owner overwrites it, torn
+ * slots are discarded using the ring head.
+ */
+struct TRC_Event {
+    _Atomic(char const *) name;
+    _Atomic int64_t start;
+    _Atomic int64_t duration;
+    _Atomic uint64_t requestId;
+};
+
+/*
+ * Spans of one thread. Only the owner writes, head counts every span ever written.
+ */
+struct TRC_Ring {
+    struct TRC_Ring *next;
+    atomic_bool inUse;
+    unsigned int tid;
+    _Atomic uint64_t head;
+    struct TRC_Event events[TRC_RING_SIZE];
+};
+
+//endregion
+
+//region PRIVATE INTERFACE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/**
+ * The calling thread's ring, claiming a released ring or creating a new one on first use
+ */
+struct TRC_Ring *_threadRing(void);
+
+/**
+ * Append the spans of one ring that were not overwritten while being read
+ */
+void _renderRing(bson_string_t *pJson, struct TRC_Ring *pRing, bool *pFirst);
+
+//endregion
+
+//region STATIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static struct TRC_Ring *_Atomic __rings = NULL;
+static atomic_uint __nextTid = 1;
+static _Atomic uint64_t __nextRequestId = 1;
+static _Atomic uint32_t __sampleThreshold = (uint32_t) (TRC_DEFAULT_SAMPLE_RATE * UINT32_MAX);
+static __thread struct TRC_Ring *__ring = NULL;
+static __thread uint64_t __currentRequest = 0;
+static __thread uint32_t __random = 0;
+static pthread_key_t __ringKey;
+static pthread_once_t __ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static void __releaseRing(void *pRing) {
+    struct TRC_Ring *ring = pRing;
+    atomic_store(&ring->inUse, false);
+}
+
+static void __createRingKey(void) {
+    pthread_key_create(&__ringKey, &__releaseRing);
+}
+
+static int64_t __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Per thread xorshift generator, sampling does not need anything better
+ */
+static uint32_t __nextRandom(void) {
+    if (__random == 0) {
+        __random = (uint32_t) (uintptr_t) &__random ^ (uint32_t) __now() ^ 0x9e3779b9u;
+        if (__random == 0) {
+            __random = 1;
+        }
+    }
+    __random ^= __random << 13;
+    __random ^= __random >> 17;
+    __random ^= __random << 5;
+    return __random;
+}
+
+//endregion
+
+//region PRIVATE FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+struct TRC_Ring *_threadRing(void) {
+    if (NULL != __ring) {
+        return __ring;
+    }
+    pthread_once(&__ringKeyOnce, &__createRingKey);
+
+    for (struct TRC_Ring *ring = atomic_load(&__rings); NULL != ring; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->inUse, &expected, true)) {
+            __ring = ring;
+            break;
+        }
+    }
+
+    if (NULL == __ring) {
+        struct TRC_Ring *ring = calloc(1, sizeof(struct TRC_Ring));
+        atomic_init(&ring->inUse, true);
+        ring->tid = atomic_fetch_add(&__nextTid, 1);
+        ring->next = atomic_load(&__rings);
+        while (!atomic_compare_exchange_weak(&__rings, &ring->next, ring)) {
+        }
+        __ring = ring;
+    }
+    pthread_setspecific(__ringKey, __ring);
+    return __ring;
+}
+
+void _renderRing(bson_string_t *pJson, struct TRC_Ring *pRing, bool *pFirst) {
+    uint64_t head = atomic_load_explicit(&pRing->head, memory_order_acquire);
+    uint64_t first = head > TRC_RING_SIZE ? head - TRC_RING_SIZE : 0;
+    uint64_t count = head - first;
+    struct TRC_Event *copy = malloc((count > 0 ? count : 1) * sizeof(struct TRC_Event));
+    for (uint64_t i = first; i < head; ++i) {
+        struct TRC_Event *event = &pRing->events[i % TRC_RING_SIZE];
+        struct TRC_Event *slot = &copy[i - first];
+        atomic_init(&slot->name, atomic_load_explicit(&event->name, memory_order_relaxed));
+        atomic_init(&slot->start, atomic_load_explicit(&event->start, memory_order_relaxed));
+        atomic_init(&slot->duration, atomic_load_explicit(&event->duration, memory_order_relaxed));
+        atomic_init(&slot->requestId, atomic_load_explicit(&event->requestId, memory_order_relaxed));
+    }
+
+    /*
+     * The owner kept writing while we copied, anything it may have reached (including the slot it is filling now) is
+     * torn
+     */
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&pRing->head, memory_order_relaxed);
+    uint64_t valid = after + 1 > TRC_RING_SIZE ? after + 1 - TRC_RING_SIZE : 0;
+
+    pid_t pid = getpid();
+    for (uint64_t i = first > valid ? first : valid; i < head; ++i) {
+        struct TRC_Event *slot = &copy[i - first];
+        bson_string_append_printf(pJson, "%s{\"name\":\"%s\",\"cat\":\"geofence\",\"ph\":\"X\",\"ts\":%lld,"
+                                          "\"dur\":%lld,\"pid\":%d,\"tid\":%u,\"args\":{\"request\":%llu}}",
+                                  *pFirst ? "" : ",\n", atomic_load(&slot->name),
+                                  (long long) atomic_load(&slot->start), (long long) atomic_load(&slot->duration),
+                                  (int) pid, pRing->tid, (unsigned long long) atomic_load(&slot->requestId));
+        *pFirst = false;
+    }
+    free(copy);
+}
+
+//endregion
+
+//region PUBLIC FUNCTIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void TRC_configure(double pSampleRate) {
+    pSampleRate = pSampleRate < 0 ? 0 : pSampleRate > 1 ? 1 : pSampleRate;
+    atomic_store(&__sampleThreshold, (uint32_t) (pSampleRate * UINT32_MAX));
+}
+
+uint64_t TRC_sampleRequest(void) {
+    uint32_t threshold = atomic_load_explicit(&__sampleThreshold, memory_order_relaxed);
+    if (threshold == 0 || (threshold != UINT32_MAX && __nextRandom() >= threshold)) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&__nextRequestId, 1, memory_order_relaxed);
+}
+
+void TRC_setRequest(uint64_t pRequestId) {
+    __currentRequest = pRequestId;
+}
+
+uint64_t TRC_currentRequest(void) {
+    return __currentRequest;
+}
+
+void TRC_begin(struct TRC_Span *pSpan, char const *pName) {
+    pSpan->requestId = __currentRequest;
+    if (pSpan->requestId != 0) {
+        pSpan->name = pName;
+        pSpan->start = __now();
+    }
+}
+
+void TRC_end(struct TRC_Span *pSpan) {
+    if (pSpan->requestId == 0) {
+        return;
+    }
+
+    struct TRC_Ring *ring = _threadRing();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct TRC_Event *event = &ring->events[head % TRC_RING_SIZE];
+    atomic_store_explicit(&event->name, pSpan->name, memory_order_relaxed);
+    atomic_store_explicit(&event->start, pSpan->start, memory_order_relaxed);
+    atomic_store_explicit(&event->duration, __now() - pSpan->start, memory_order_relaxed);
+    atomic_store_explicit(&event->requestId, pSpan->requestId, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+char *TRC_renderChromeTrace(void) {
+    bson_string_t *json = bson_string_new("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (struct TRC_Ring *ring = atomic_load(&__rings); NULL != ring; ring = ring->next) {
+        _renderRing(json, ring, &first);
+    }
+    bson_string_append(json, "\n]}\n");
+    return bson_string_free(json, false);
+}
+
+bool TRC_writeChromeTrace(char const *pPath) {
+    FILE *file = fopen(pPath, "w");
+    if (NULL == file) {
+        return false;
+    }
+    char *json = TRC_renderChromeTrace();
+    bool result = fputs(json, file) >= 0;
+    result = 0 == fclose(file) && result;
+    bson_free(json);
+    return result;
+}
+
+//endregion
@@ -0,0 +1,77 @@
+//
+// Created by William Kamp on 7/27/16.
+//
+
+#ifndef GEOFENCEBEC_TRACE_H
+#define GEOFENCEBEC_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Fraction of requests traced when GEOFENCE_TRACE_SAMPLE_RATE is not set
+ */
+#define TRC_DEFAULT_SAMPLE_RATE 0.01
+
+/*
+ * Spans kept per thread, older spans are overwritten
+ */
+#define TRC_RING_SIZE 4096
+
+/**
+ * A span being timed on the stack. Spans opened while the thread is not working on a sampled request cost one
+ * thread local read.
+ */
+struct TRC_Span {
+    char const *name;
+    int64_t start;
+    uint64_t requestId;
+};
+
+/**
+ * Set the fraction of requests (0 to 1) that TRC_sampleRequest() picks
+ */
+void TRC_configure(double pSampleRate);
+
+/**
+ * Decide whether to trace a new request
+ *
+ * returns a request id to pass to TRC_setRequest() or 0 when the request is not sampled
+ */
+uint64_t TRC_sampleRequest(void);
+
+/**
+ * Set the sampled request the calling thread is working on, 0 for none. Work handed to another thread must set the
+ * request there too.
+ */
+void TRC_setRequest(uint64_t pRequestId);
+
+uint64_t TRC_currentRequest(void);
+
+/**
+ * Start timing a span of the current request
+ *
+ * param pName - a string that outlives the trace, usually a literal
+ */
+void TRC_begin(struct TRC_Span *pSpan, char const *pName);
+
+/**
+ * Finish a span and record it in the calling thread's ring buffer
+ */
+void TRC_end(struct TRC_Span *pSpan);
+
+/**
+ * Render every thread's recorded spans as Chrome trace event JSON, loadable in chrome://tracing and Perfetto
+ *
+ * returns a NUL terminated string which you must later bson_free()
+ */
+char *TRC_renderChromeTrace(void);
+
+/**
+ * Write TRC_renderChromeTrace() to a file
+ *
+ * returns false when the file could not be written
+ */
+bool TRC_writeChromeTrace(char const *pPath);
+
+#endif //GEOFENCEBEC_TRACE_H